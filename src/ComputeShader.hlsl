@@ -1,5 +1,6 @@
 #define blocksize 128
 
+// mirrored by the gravity namespace in simulation.hpp for the CPU engines
 static float softening_squared = 0.0012500000f * 0.0012500000f;
 static float scale_factor = 10000.0f;
 static float G = 6.67300e-11f * scale_factor;
@@ -7,6 +8,30 @@ static float particle_mass = scale_factor * scale_factor;
 
 groupshared float4 updated_positions[blocksize];
 
+// DETERMINISTIC is defined by render_system when deterministic_ is set:
+// precise keeps the compiler from fusing or reordering the accumulation, so
+// every thread sums its tiles in the order written below on any driver
+#ifdef DETERMINISTIC
+#define accumulator precise float3
+#else
+#define accumulator float3
+#endif
+
+// COMPACT_STORAGE is defined when render_system::compact_storage_ is set: the
+// particles live in the packed layout of compact_storage.hpp and are unpacked
+// here. Padding slots of the last tile then carry zero mass instead of
+// generating false gravity at the origin.
+#ifdef COMPACT_STORAGE
+#include "compact_storage.hlsli"
+
+groupshared float3 block_min[blocksize];
+groupshared float3 block_max[blocksize];
+
+#define tile_mass(p) (p.w)
+#else
+#define tile_mass(p) (mass)
+#endif
+
 void calculate_acceleration(inout float3 a_i, float4 p_j, float4 p_i, float mass, int particles = 1)
 {
     float3 r = p_j.xyz - p_i.xyz;
@@ -30,15 +55,27 @@ struct particle_t
     float4 velocity;
 };
 
+#ifdef COMPACT_STORAGE
+ByteAddressBuffer particle_data : register(t0); // SRV
+RWByteAddressBuffer updated_particle_data : register(u0); // UAV
+#else
 StructuredBuffer<particle_t> particle_data : register(t0); // SRV
 RWStructuredBuffer<particle_t> updated_particle_data : register(u0); // UAV
+#endif
 
 [numthreads(blocksize, 1, 1)]
 void main(uint3 g_id : SV_GroupID, uint3 DT_id : SV_DispatchThreadID, uint3 GT_id : SV_GroupThreadID, uint GI : SV_GroupIndex)
 {
+#ifdef COMPACT_STORAGE
+    uint blocks = param.y;
+    uint self = min(DT_id.x, param.x - 1);
+    float4 current_position = float4(load_position(particle_data, self, blocks, load_block_header(particle_data, self / blocksize)), 0.0f);
+    float4 current_velocity = float4(load_velocity(particle_data, self, blocks), 0.0f);
+#else
     float4 current_position = particle_data[DT_id.x].position;
     float4 current_velocity = particle_data[DT_id.x].velocity;
-    float3 a = 0;
+#endif
+    accumulator a = 0;
     float mass = particle_mass;
     
     uint neighbors = param.y;
@@ -46,21 +83,28 @@ void main(uint3 g_id : SV_GroupID, uint3 DT_id : SV_DispatchThreadID, uint3 GT_i
     [loop]
     for (uint i = 0; i < neighbors; ++i)
     {
+#ifdef COMPACT_STORAGE
+        // a tile is exactly one storage block, so it shares a single header
+        uint j = i * blocksize + GI;
+        float4 header = load_block_header(particle_data, i);
+        updated_positions[GI] = float4(load_position(particle_data, min(j, param.x - 1), blocks, header), j < param.x ? mass : 0.0f);
+#else
         updated_positions[GI] = particle_data[i * blocksize + GI].position;
+#endif
         
         GroupMemoryBarrierWithGroupSync();
         
         [unroll]
         for (uint counter = 0; counter < blocksize; counter += 8) 
         {
-            calculate_acceleration(a, updated_positions[counter + 0], current_position, mass);
-            calculate_acceleration(a, updated_positions[counter + 1], current_position, mass);
-            calculate_acceleration(a, updated_positions[counter + 2], current_position, mass);
-            calculate_acceleration(a, updated_positions[counter + 3], current_position, mass);
-            calculate_acceleration(a, updated_positions[counter + 4], current_position, mass);
-            calculate_acceleration(a, updated_positions[counter + 5], current_position, mass);
-            calculate_acceleration(a, updated_positions[counter + 6], current_position, mass);
-            calculate_acceleration(a, updated_positions[counter + 7], current_position, mass);
+            calculate_acceleration(a, updated_positions[counter + 0], current_position, tile_mass(updated_positions[counter + 0]));
+            calculate_acceleration(a, updated_positions[counter + 1], current_position, tile_mass(updated_positions[counter + 1]));
+            calculate_acceleration(a, updated_positions[counter + 2], current_position, tile_mass(updated_positions[counter + 2]));
+            calculate_acceleration(a, updated_positions[counter + 3], current_position, tile_mass(updated_positions[counter + 3]));
+            calculate_acceleration(a, updated_positions[counter + 4], current_position, tile_mass(updated_positions[counter + 4]));
+            calculate_acceleration(a, updated_positions[counter + 5], current_position, tile_mass(updated_positions[counter + 5]));
+            calculate_acceleration(a, updated_positions[counter + 6], current_position, tile_mass(updated_positions[counter + 6]));
+            calculate_acceleration(a, updated_positions[counter + 7], current_position, tile_mass(updated_positions[counter + 7]));
         }
         GroupMemoryBarrierWithGroupSync();
     }
@@ -79,9 +123,41 @@ void main(uint3 g_id : SV_GroupID, uint3 DT_id : SV_DispatchThreadID, uint3 GT_i
     
     current_position.xyz += current_velocity.xyz * paramf.x;
     
+#ifdef COMPACT_STORAGE
+    // the group's particles form one output block: reduce their bounds into
+    // the block header, then pack every particle against it
+    bool valid = DT_id.x < param.x;
+    block_min[GI] = valid ? current_position.xyz : 3.0e38f;
+    block_max[GI] = valid ? current_position.xyz : -3.0e38f;
+    GroupMemoryBarrierWithGroupSync();
+
+    [unroll]
+    for (uint stride = blocksize / 2; stride > 0; stride >>= 1)
+    {
+        if (GI < stride)
+        {
+            block_min[GI] = min(block_min[GI], block_min[GI + stride]);
+            block_max[GI] = max(block_max[GI], block_max[GI + stride]);
+        }
+        GroupMemoryBarrierWithGroupSync();
+    }
+
+    float3 extent = block_max[0] - block_min[0];
+    float4 block_header = float4(block_min[0], max(max(max(extent.x, extent.y), extent.z) / 65535.0f, 1e-6f));
+
+    if (GI == 0)
+        updated_particle_data.Store4(g_id.x * compact_header_size, asuint(block_header));
+
+    if (valid)
+    {
+        store_particle(updated_particle_data, DT_id.x, blocks, block_header, current_position.xyz, current_velocity.xyz);
+        updated_particle_data.Store(compact_cold_address(DT_id.x, param.x, blocks), asuint(length(a)));
+    }
+#else
     if (DT_id.x < param.x)
     {
         updated_particle_data[DT_id.x].position = current_position;
         updated_particle_data[DT_id.x].velocity = float4(current_velocity.xyz, length(a));
     }
+#endif
 }
\ No newline at end of file
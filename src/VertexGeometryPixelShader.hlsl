@@ -29,12 +29,19 @@ struct particle_t
     float4 velocity;
 };
 
+#ifdef COMPACT_STORAGE
+#include "compact_storage.hlsli"
+
+ByteAddressBuffer particle_data;
+#else
 StructuredBuffer<particle_t> particle_data;
+#endif
 
 cbuffer cb0
 {
     row_major matrix mvp;
     row_major matrix inv_view;
+    uint4 particle_params; // x - particles amount, y - storage blocks
 };
 
 cbuffer cb1
@@ -67,9 +74,16 @@ VertexOutput VS_main(VertexInput IN)
 {
     VertexOutput OUT;
     
+#ifdef COMPACT_STORAGE
+    uint blocks = particle_params.y;
+    OUT.pos = load_position(particle_data, IN.id, blocks, load_block_header(particle_data, IN.id / compact_block_size));
+    
+    float magnitude = asfloat(particle_data.Load(compact_cold_address(IN.id, particle_params.x, blocks))) / 9.0f;
+#else
     OUT.pos = particle_data[IN.id].position.xyz;
     
     float magnitude = particle_data[IN.id].velocity.w / 9.0f;
+#endif
     float4 red = float4(1.0f, 0.1f, 0.1f, 1.0f);
     float4 cyan_blue = float4(0.0f, 1.0f, 1.0f, 1.0f);
     
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+
+// How the engines sum the per-interaction accelerations of a particle.
+// The accumulator is a template parameter of the force loops, so the plain
+// float path compiles to exactly the code it had before. real is the type
+// calculate_acceleration evaluates a single interaction in.
+//
+// Note that the compensated sum only survives compilers that keep IEEE
+// semantics - no -ffast-math or /fp:fast for the engines.
+
+// sums in float, the result depends on the order the terms arrive in
+struct float_accumulator {
+    using real = float;
+    static constexpr const char* name = "float";
+
+    float x = 0.0f, y = 0.0f, z = 0.0f;
+
+    void add(float ax, float ay, float az) {
+        x += ax;
+        y += ay;
+        z += az;
+    }
+
+    float get_x() const { return x; }
+    float get_y() const { return y; }
+    float get_z() const { return z; }
+};
+
+// float terms, Kahan-compensated float sum: the rounding error of every
+// addition is carried into the next one
+struct kahan_accumulator {
+    using real = float;
+    static constexpr const char* name = "kahan";
+
+    float x = 0.0f, y = 0.0f, z = 0.0f;
+    float cx = 0.0f, cy = 0.0f, cz = 0.0f;
+
+    void add(float ax, float ay, float az) {
+        compensated_add(x, cx, ax);
+        compensated_add(y, cy, ay);
+        compensated_add(z, cz, az);
+    }
+
+    float get_x() const { return x; }
+    float get_y() const { return y; }
+    float get_z() const { return z; }
+
+private:
+    static void compensated_add(float& sum, float& compensation, float term) {
+        float corrected = term - compensation;
+        float next = sum + corrected;
+        compensation = (next - sum) - corrected;
+        sum = next;
+    }
+};
+
+// float terms summed in double, stored back as float
+struct double_accumulator {
+    using real = float;
+    static constexpr const char* name = "double";
+
+    double x = 0.0, y = 0.0, z = 0.0;
+
+    void add(float ax, float ay, float az) {
+        x += ax;
+        y += ay;
+        z += az;
+    }
+
+    float get_x() const { return static_cast<float>(x); }
+    float get_y() const { return static_cast<float>(y); }
+    float get_z() const { return static_cast<float>(z); }
+};
+
+// every interaction evaluated and summed in double, only storage is float
+struct full_double_accumulator {
+    using real = double;
+    static constexpr const char* name = "fp64";
+
+    double x = 0.0, y = 0.0, z = 0.0;
+
+    void add(double ax, double ay, double az) {
+        x += ax;
+        y += ay;
+        z += az;
+    }
+
+    float get_x() const { return static_cast<float>(x); }
+    float get_y() const { return static_cast<float>(y); }
+    float get_z() const { return static_cast<float>(z); }
+};
+
+// Sums in 32.32 fixed point. Every term is truncated once on the way in and
+// integer addition is associative, so the sum is bit-identical whatever order
+// the terms are added in - the fixed precision of the engines.
+//
+// A term is clamped to (-2^30, 2^30) before the conversion (the softened
+// force of a single particle stays below ~2^24, a heavy tree node in a dense
+// core may not), a NaN term counts as 0, and the sum saturates at about
+// +-2^31 instead of overflowing. Within those ranges the result is exact and
+// order-independent; a sum that saturated is defined but no longer either.
+struct fixed_point_accumulator {
+    using real = float;
+    static constexpr const char* name = "fixed";
+    static constexpr float scale = 4294967296.0f;       // 2^32
+    static constexpr float term_limit = 1073741824.0f;  // 2^30
+
+    int64_t x = 0, y = 0, z = 0;
+
+    void add(float ax, float ay, float az) {
+        saturating_add(x, to_fixed(ax));
+        saturating_add(y, to_fixed(ay));
+        saturating_add(z, to_fixed(az));
+    }
+
+    float get_x() const { return static_cast<float>(x / double(scale)); }
+    float get_y() const { return static_cast<float>(y / double(scale)); }
+    float get_z() const { return static_cast<float>(z / double(scale)); }
+
+private:
+    static int64_t to_fixed(float term) {
+        const int64_t limit = int64_t(1) << 62;     // term_limit * scale
+        if (term >= term_limit)
+            return limit;
+        if (term <= -term_limit)
+            return -limit;
+        if (term != term)
+            return 0;
+        return static_cast<int64_t>(term * scale);
+    }
+
+    static void saturating_add(int64_t& sum, int64_t term) {
+        if (term > 0 && sum > INT64_MAX - term)
+            sum = INT64_MAX;
+        else if (term < 0 && sum < INT64_MIN - term)
+            sum = INT64_MIN;
+        else
+            sum += term;
+    }
+};
@@ -0,0 +1,516 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Benchmark results as nbody-bench suite writes them and nbody-bench compare
+// reads them
+//
+// A case is one engine, precision, particle count and thread count, timed
+// for a number of repetitions of one step each after some warmup steps. The
+// report keeps the raw samples next to their summary so that two reports
+// can be compared with a test on the samples rather than on the means:
+// compare_samples() runs a one-sided Mann-Whitney U test each way.
+
+// the usual count for one body-body interaction: 3 subtractions, 3
+// multiplications and 3 additions for the squared distance and softening,
+// the square root and division, and 3 multiply-adds into the acceleration
+// (Nyland, Harris and Prins, GPU Gems 3, ch. 31)
+constexpr double flops_per_interaction = 20.0;
+
+struct sample_summary {
+    size_t count = 0;
+    double mean = 0.0;
+    double median = 0.0;
+    double stddev = 0.0;
+    double min = 0.0;
+    double max = 0.0;
+    double ci_low = 0.0;        // 95% confidence interval of the mean
+    double ci_high = 0.0;
+};
+
+// two-sided 95% quantile of Student's t distribution
+inline double student_t95(size_t degrees_of_freedom) {
+    static const double table[] = {
+        0.0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+    if (degrees_of_freedom < sizeof(table) / sizeof(table[0]))
+        return table[degrees_of_freedom];
+    return degrees_of_freedom < 60 ? 2.000 : degrees_of_freedom < 120 ? 1.980 : 1.960;
+}
+
+inline sample_summary summarize(std::vector<double> samples) {
+    sample_summary s;
+    s.count = samples.size();
+    if (s.count == 0)
+        return s;
+
+    std::sort(samples.begin(), samples.end());
+    s.min = samples.front();
+    s.max = samples.back();
+    s.median = s.count % 2 ? samples[s.count / 2] : 0.5 * (samples[s.count / 2 - 1] + samples[s.count / 2]);
+
+    double sum = 0.0;
+    for (double x : samples)
+        sum += x;
+    s.mean = sum / s.count;
+
+    double squares = 0.0;
+    for (double x : samples)
+        squares += (x - s.mean) * (x - s.mean);
+    s.stddev = s.count > 1 ? std::sqrt(squares / (s.count - 1)) : 0.0;
+
+    const double half_width = s.count > 1 ? student_t95(s.count - 1) * s.stddev / std::sqrt(double(s.count)) : 0.0;
+    s.ci_low = s.mean - half_width;
+    s.ci_high = s.mean + half_width;
+    return s;
+}
+
+// hardware counters of one engine phase per step, summed over the threads;
+// see perf_counters.hpp
+struct phase_counters {
+    std::string phase;
+    double      seconds = 0.0;              // thread time in the phase
+    double      cycles = 0.0;
+    double      instructions = 0.0;
+    double      cache_references = 0.0;
+    double      cache_misses = 0.0;
+    double      flops = 0.0;                // from the interaction count, the force kernel only
+};
+
+struct bench_case {
+    std::string         engine;
+    std::string         precision;
+    uint32_t            particles = 0;
+    unsigned            threads = 0;
+    double              interactions = 0.0;         // per step, averaged over the repetitions
+    std::vector<double> seconds;                    // one step per repetition
+    double              scaling_efficiency = 0.0;   // speedup over one thread divided by threads, 0 - no one-thread case
+    std::vector<phase_counters> counters;           // empty - not counted
+
+    // identifies the case across reports
+    std::string name() const {
+        return engine + "/" + precision + "/n=" + std::to_string(particles) + "/threads=" + std::to_string(threads);
+    }
+};
+
+struct bench_report {
+    std::string             profile;
+    std::string             isa;            // what the build targets, see build_isa()
+    std::string             compiler;
+    unsigned                hardware_threads = 0;
+    uint32_t                warmup = 0;
+    uint32_t                repetitions = 0;
+    std::vector<bench_case> cases;
+};
+
+// the widest SIMD extension the compiler may use; the engines have no
+// hand-written vector paths, so ISAs are compared across builds
+inline const char* build_isa() {
+#if defined(__AVX512F__)
+    return "avx512f";
+#elif defined(__AVX2__)
+    return "avx2";
+#elif defined(__AVX__)
+    return "avx";
+#elif defined(__SSE4_2__)
+    return "sse4.2";
+#elif defined(__SSE2__) || defined(_M_X64)
+    return "sse2";
+#elif defined(__ARM_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+inline const char* build_compiler() {
+#if defined(__clang__)
+    return "clang " __clang_version__;
+#elif defined(__GNUC__)
+    return "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+    return "msvc";
+#else
+    return "unknown";
+#endif
+}
+
+inline void write_bench_report(const std::string& path, const bench_report& report) {
+    FILE* file = std::fopen(path.c_str(), "w");
+    if (!file)
+        throw std::runtime_error("cannot write " + path);
+
+    std::fprintf(file, "{\n");
+    std::fprintf(file, "  \"schema\": \"nbody-bench-suite/1\",\n");
+    std::fprintf(file, "  \"profile\": \"%s\",\n", report.profile.c_str());
+    std::fprintf(file, "  \"isa\": \"%s\",\n", report.isa.c_str());
+    std::fprintf(file, "  \"compiler\": \"%s\",\n", report.compiler.c_str());
+    std::fprintf(file, "  \"hardware_threads\": %u,\n", report.hardware_threads);
+    std::fprintf(file, "  \"warmup\": %u,\n", report.warmup);
+    std::fprintf(file, "  \"repetitions\": %u,\n", report.repetitions);
+    std::fprintf(file, "  \"cases\": [");
+
+    for (size_t c = 0; c < report.cases.size(); ++c) {
+        const bench_case& bc = report.cases[c];
+        const sample_summary s = summarize(bc.seconds);
+
+        std::fprintf(file, "%s\n    {\n", c ? "," : "");
+        std::fprintf(file, "      \"name\": \"%s\",\n", bc.name().c_str());
+        std::fprintf(file, "      \"engine\": \"%s\",\n", bc.engine.c_str());
+        std::fprintf(file, "      \"precision\": \"%s\",\n", bc.precision.c_str());
+        std::fprintf(file, "      \"layout\": \"soa\",\n");
+        std::fprintf(file, "      \"particles\": %u,\n", bc.particles);
+        std::fprintf(file, "      \"threads\": %u,\n", bc.threads);
+        std::fprintf(file, "      \"interactions_per_step\": %.17g,\n", bc.interactions);
+        std::fprintf(file, "      \"seconds\": [");
+        for (size_t i = 0; i < bc.seconds.size(); ++i)
+            std::fprintf(file, "%s%.9g", i ? ", " : "", bc.seconds[i]);
+        std::fprintf(file, "],\n");
+        std::fprintf(file, "      \"seconds_mean\": %.9g,\n", s.mean);
+        std::fprintf(file, "      \"seconds_median\": %.9g,\n", s.median);
+        std::fprintf(file, "      \"seconds_stddev\": %.9g,\n", s.stddev);
+        std::fprintf(file, "      \"seconds_ci95\": [%.9g, %.9g],\n", s.ci_low, s.ci_high);
+        std::fprintf(file, "      \"interactions_per_second\": %.9g,\n", bc.interactions / s.mean);
+        std::fprintf(file, "      \"gflops\": %.9g,\n", bc.interactions * flops_per_interaction / s.mean * 1e-9);
+        std::fprintf(file, "      \"ns_per_particle_step\": %.9g,\n", s.mean / bc.particles * 1e9);
+        std::fprintf(file, "      \"scaling_efficiency\": %.9g%s\n", bc.scaling_efficiency, bc.counters.empty() ? "" : ",");
+        if (!bc.counters.empty()) {
+            std::fprintf(file, "      \"counters\": {");
+            for (size_t p = 0; p < bc.counters.size(); ++p) {
+                const phase_counters& pc = bc.counters[p];
+                std::fprintf(file, "%s\n        \"%s\": { \"seconds\": %.9g, \"cycles\": %.17g, \"instructions\": %.17g, \"cache_references\": %.17g, \"cache_misses\": %.17g, \"flops\": %.17g }",
+                    p ? "," : "", pc.phase.c_str(), pc.seconds, pc.cycles, pc.instructions, pc.cache_references, pc.cache_misses, pc.flops);
+            }
+            std::fprintf(file, "\n      }\n");
+        }
+        std::fprintf(file, "    }");
+    }
+
+    std::fprintf(file, "\n  ]\n}\n");
+    if (std::fclose(file) != 0)
+        throw std::runtime_error("cannot write " + path);
+}
+
+// just enough JSON for the reports: no \u escapes beyond ASCII
+struct json_value {
+    enum kind_t { null, boolean, number, string, array, object };
+
+    kind_t                                          kind = null;
+    double                                          value = 0.0;    // number, boolean
+    std::string                                     text;           // string
+    std::vector<json_value>                         items;          // array
+    std::vector<std::pair<std::string, json_value>> members;        // object
+
+    const json_value* find(const std::string& key) const {
+        for (const auto& member : members)
+            if (member.first == key)
+                return &member.second;
+        return nullptr;
+    }
+};
+
+class json_parser {
+public:
+    json_parser(const char* begin, const char* end) : p_(begin), end_(end) {}
+
+    json_value parse() {
+        json_value value = parse_value();
+        skip_space();
+        if (p_ != end_)
+            fail("trailing characters");
+        return value;
+    }
+
+private:
+    [[noreturn]] void fail(const char* what) const {
+        throw std::runtime_error(std::string("json: ") + what);
+    }
+
+    void skip_space() {
+        while (p_ != end_ && std::isspace(static_cast<unsigned char>(*p_)))
+            ++p_;
+    }
+
+    bool consume(char c) {
+        skip_space();
+        if (p_ == end_ || *p_ != c)
+            return false;
+        ++p_;
+        return true;
+    }
+
+    void expect(char c) {
+        if (!consume(c))
+            fail("unexpected character");
+    }
+
+    bool consume_word(const char* word) {
+        const size_t length = std::char_traits<char>::length(word);
+        if (size_t(end_ - p_) < length || std::char_traits<char>::compare(p_, word, length) != 0)
+            return false;
+        p_ += length;
+        return true;
+    }
+
+    std::string parse_string() {
+        expect('"');
+        std::string text;
+        while (p_ != end_ && *p_ != '"') {
+            char c = *p_++;
+            if (c == '\\') {
+                if (p_ == end_)
+                    break;
+                c = *p_++;
+                switch (c) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'u': {
+                    if (end_ - p_ < 4)
+                        fail("bad escape");
+                    const unsigned code = static_cast<unsigned>(std::strtoul(std::string(p_, p_ + 4).c_str(), nullptr, 16));
+                    p_ += 4;
+                    c = code < 0x80 ? static_cast<char>(code) : '?';
+                    break;
+                }
+                default: break;     // \" \\ \/
+                }
+            }
+            text += c;
+        }
+        if (p_ == end_)
+            fail("unterminated string");
+        ++p_;
+        return text;
+    }
+
+    json_value parse_value() {
+        skip_space();
+        if (p_ == end_)
+            fail("unexpected end");
+
+        json_value value;
+        if (*p_ == '{') {
+            ++p_;
+            value.kind = json_value::object;
+            if (consume('}'))
+                return value;
+            do {
+                skip_space();
+                std::string key = parse_string();
+                expect(':');
+                value.members.emplace_back(std::move(key), parse_value());
+            } while (consume(','));
+            expect('}');
+        }
+        else if (*p_ == '[') {
+            ++p_;
+            value.kind = json_value::array;
+            if (consume(']'))
+                return value;
+            do {
+                value.items.push_back(parse_value());
+            } while (consume(','));
+            expect(']');
+        }
+        else if (*p_ == '"') {
+            value.kind = json_value::string;
+            value.text = parse_string();
+        }
+        else if (consume_word("true")) {
+            value.kind = json_value::boolean;
+            value.value = 1.0;
+        }
+        else if (consume_word("false")) {
+            value.kind = json_value::boolean;
+        }
+        else if (consume_word("null")) {
+            value.kind = json_value::null;
+        }
+        else {
+            // strtod stops at the end of the number; the file is held in a
+            // std::string, so it is terminated
+            char* number_end = nullptr;
+            value.kind = json_value::number;
+            value.value = std::strtod(p_, &number_end);
+            if (number_end == p_)
+                fail("unexpected character");
+            p_ = number_end;
+        }
+        return value;
+    }
+
+private:
+    const char* p_;
+    const char* end_;
+};
+
+inline bench_report read_bench_report(const std::string& path) {
+    FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file)
+        throw std::runtime_error("cannot open " + path);
+    std::string text;
+    char buffer[1 << 16];
+    size_t read;
+    while ((read = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+        text.append(buffer, read);
+    std::fclose(file);
+
+    const json_value root = json_parser(text.data(), text.data() + text.size()).parse();
+    const json_value* schema = root.find("schema");
+    const json_value* cases = root.find("cases");
+    if (!schema || schema->text != "nbody-bench-suite/1" || !cases || cases->kind != json_value::array)
+        throw std::runtime_error("bench report: " + path + " is not an nbody-bench suite report");
+
+    auto text_of = [](const json_value& object, const char* key) {
+        const json_value* value = object.find(key);
+        return value ? value->text : std::string();
+    };
+    auto number_of = [](const json_value& object, const char* key) {
+        const json_value* value = object.find(key);
+        return value ? value->value : 0.0;
+    };
+
+    bench_report report;
+    report.profile = text_of(root, "profile");
+    report.isa = text_of(root, "isa");
+    report.compiler = text_of(root, "compiler");
+    report.hardware_threads = static_cast<unsigned>(number_of(root, "hardware_threads"));
+    report.warmup = static_cast<uint32_t>(number_of(root, "warmup"));
+    report.repetitions = static_cast<uint32_t>(number_of(root, "repetitions"));
+
+    for (const json_value& item : cases->items) {
+        bench_case bc;
+        bc.engine = text_of(item, "engine");
+        bc.precision = text_of(item, "precision");
+        bc.particles = static_cast<uint32_t>(number_of(item, "particles"));
+        bc.threads = static_cast<unsigned>(number_of(item, "threads"));
+        bc.interactions = number_of(item, "interactions_per_step");
+        bc.scaling_efficiency = number_of(item, "scaling_efficiency");
+        if (const json_value* seconds = item.find("seconds"))
+            for (const json_value& sample : seconds->items)
+                bc.seconds.push_back(sample.value);
+        if (const json_value* counters = item.find("counters")) {
+            for (const auto& member : counters->members) {
+                phase_counters pc;
+                pc.phase = member.first;
+                pc.seconds = number_of(member.second, "seconds");
+                pc.cycles = number_of(member.second, "cycles");
+                pc.instructions = number_of(member.second, "instructions");
+                pc.cache_references = number_of(member.second, "cache_references");
+                pc.cache_misses = number_of(member.second, "cache_misses");
+                pc.flops = number_of(member.second, "flops");
+                bc.counters.push_back(pc);
+            }
+        }
+        report.cases.push_back(bc);
+    }
+    return report;
+}
+
+// Mann-Whitney U test
+//
+// U counts the pairs (x from the current sample, y from the baseline) with
+// x > y, ties counting half. Without ties and with up to 400 pairs the
+// p-values come from the exact distribution of U, otherwise from the normal
+// approximation with the tie correction.
+
+struct sample_comparison {
+    double baseline_median = 0.0;
+    double current_median = 0.0;
+    double change = 0.0;        // current / baseline - 1 of the medians
+    double u = 0.0;
+    double p_slower = 1.0;      // one-sided p-value of current > baseline
+    double p_faster = 1.0;      // and of current < baseline
+};
+
+// frequencies of U = 0..n1 n2 for samples of n1 and n2 under the null
+// hypothesis: the coefficients of the Gaussian binomial [n1 + n2, n1], from
+// the recurrence on whether the largest value is in the first sample
+inline std::vector<double> mann_whitney_distribution(size_t n1, size_t n2) {
+    std::vector<std::vector<double>> row(n2 + 1, std::vector<double>(1, 1.0));
+    for (size_t i = 1; i <= n1; ++i) {
+        std::vector<std::vector<double>> next(n2 + 1);
+        next[0].assign(1, 1.0);
+        for (size_t j = 1; j <= n2; ++j) {
+            std::vector<double> counts(i * j + 1, 0.0);
+            for (size_t u = 0; u < row[j].size(); ++u)
+                counts[u + j] += row[j][u];
+            for (size_t u = 0; u < next[j - 1].size(); ++u)
+                counts[u] += next[j - 1][u];
+            next[j] = std::move(counts);
+        }
+        row.swap(next);
+    }
+    return row[n2];
+}
+
+inline sample_comparison compare_samples(const std::vector<double>& baseline, const std::vector<double>& current) {
+    sample_comparison c;
+    const size_t n1 = current.size(), n2 = baseline.size();
+    if (n1 == 0 || n2 == 0)
+        return c;
+
+    c.baseline_median = summarize(baseline).median;
+    c.current_median = summarize(current).median;
+    c.change = c.current_median / c.baseline_median - 1.0;
+
+    bool ties = false;
+    for (double x : current) {
+        for (double y : baseline) {
+            c.u += x > y ? 1.0 : x == y ? 0.5 : 0.0;
+            ties = ties || x == y;
+        }
+    }
+
+    if (!ties && n1 * n2 <= 400) {
+        const std::vector<double> counts = mann_whitney_distribution(n1, n2);
+        double total = 0.0, above = 0.0, below = 0.0;
+        for (size_t u = 0; u < counts.size(); ++u) {
+            total += counts[u];
+            above += double(u) >= c.u ? counts[u] : 0.0;
+            below += double(u) <= c.u ? counts[u] : 0.0;
+        }
+        c.p_slower = above / total;
+        c.p_faster = below / total;
+        return c;
+    }
+
+    // the tie correction needs the sizes of the groups of equal values
+    std::vector<double> pooled(current);
+    pooled.insert(pooled.end(), baseline.begin(), baseline.end());
+    std::sort(pooled.begin(), pooled.end());
+    double tie_term = 0.0;
+    for (size_t i = 0; i < pooled.size();) {
+        size_t j = i;
+        while (j < pooled.size() && pooled[j] == pooled[i])
+            ++j;
+        const double t = double(j - i);
+        tie_term += t * t * t - t;
+        i = j;
+    }
+
+    const double n = double(n1 + n2);
+    const double mean = 0.5 * n1 * n2;
+    const double variance = n1 * n2 / 12.0 * ((n + 1.0) - tie_term / (n * (n - 1.0)));
+    if (variance <= 0.0)
+        return c;
+
+    const double sd = std::sqrt(variance);
+    c.p_slower = 0.5 * std::erfc((c.u - mean - 0.5) / sd / std::sqrt(2.0));
+    c.p_faster = 0.5 * std::erfc((mean - c.u - 0.5) / sd / std::sqrt(2.0));
+    return c;
+}
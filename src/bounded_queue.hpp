@@ -0,0 +1,93 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+// A blocking FIFO of at most capacity items between a producer and a
+// background thread; push() waits while the queue is full, which keeps a slow
+// consumer from piling up memory.
+template<class T>
+class bounded_queue {
+public:
+    explicit bounded_queue(size_t capacity) :
+        capacity_(capacity > 0 ? capacity : 1)
+    {
+    }
+
+    // false if the queue was closed
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+        if (closed_)
+            return false;
+
+        items_.push_back(std::move(item));
+        lock.unlock();
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // false once the queue is closed and drained
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        if (items_.empty())
+            return false;
+
+        item = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // false if nothing is queued right now
+    bool try_pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (items_.empty())
+            return false;
+
+        item = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // discards the queued items
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        items_.clear();
+        not_full_.notify_all();
+    }
+
+    // wakes everyone; pushes fail from now on, pops drain what is left
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return items_.size();
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+private:
+    const size_t            capacity_;
+    std::deque<T>           items_;
+    bool                    closed_ = false;
+    mutable std::mutex      mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+};
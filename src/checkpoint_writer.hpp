@@ -0,0 +1,380 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "delta_checkpoint.hpp"
+#include "snapshot.hpp"
+#include "trace.hpp"
+
+// Asynchronous checkpointing
+//
+// submit() is called by the simulation thread at a step boundary. It copies
+// the state into one of two staging buffers as a complete snapshot image and
+// returns; a dedicated I/O thread writes the image while the simulation goes
+// on. The simulation only waits when both staging buffers are still being
+// written, i.e. when checkpoints come faster than the disk takes them. That
+// wait plus the copy is the stall, reported per checkpoint in stats().
+//
+// Images are written with large sector-aligned writes, bypassing the page
+// cache where the platform allows it (O_DIRECT, F_NOCACHE,
+// FILE_FLAG_NO_BUFFERING), to a temporary file that is renamed into place
+// once complete, so a crash never leaves a torn checkpoint behind.
+//
+// With full_every > 1 only every full_every-th checkpoint is a full snapshot;
+// the ones between are delta checkpoints against the checkpoint before them
+// (see delta_checkpoint.hpp). The I/O thread codes them, so they cost the
+// simulation no more than a full one; it keeps the last state as the base.
+
+constexpr uint64_t checkpoint_alignment = 4096;             // sector and page size for unbuffered I/O
+constexpr uint64_t checkpoint_write_size = 8ull << 20;      // bytes per write call
+
+// a heap allocation aligned for unbuffered I/O
+class aligned_buffer {
+public:
+    aligned_buffer() = default;
+
+    aligned_buffer(const aligned_buffer&) = delete;
+    aligned_buffer& operator=(const aligned_buffer&) = delete;
+
+    ~aligned_buffer() {
+        release();
+    }
+
+    // keeps the contents only if capacity suffices
+    void reserve(uint64_t size) {
+        size = (size + checkpoint_alignment - 1) / checkpoint_alignment * checkpoint_alignment;
+        if (size <= capacity_)
+            return;
+
+        release();
+#ifdef _WIN32
+        data_ = static_cast<uint8_t*>(_aligned_malloc(static_cast<size_t>(size), checkpoint_alignment));
+#else
+        void* data = nullptr;
+        if (posix_memalign(&data, checkpoint_alignment, static_cast<size_t>(size)) != 0)
+            data = nullptr;
+        data_ = static_cast<uint8_t*>(data);
+#endif
+        if (!data_)
+            throw std::bad_alloc();
+        capacity_ = size;
+    }
+
+    uint8_t* data() const { return data_; }
+    uint64_t capacity() const { return capacity_; }
+
+private:
+    void release() {
+#ifdef _WIN32
+        _aligned_free(data_);
+#else
+        std::free(data_);
+#endif
+        data_ = nullptr;
+        capacity_ = 0;
+    }
+
+private:
+    uint8_t*    data_ = nullptr;
+    uint64_t    capacity_ = 0;
+};
+
+// writes size bytes of image to path; image must be aligned and hold size
+// rounded up to checkpoint_alignment, the tail beyond size is overwritten with zeros
+inline void write_checkpoint_image(const std::string& path, uint8_t* image, uint64_t size, bool direct_io) {
+    const uint64_t padded = (size + checkpoint_alignment - 1) / checkpoint_alignment * checkpoint_alignment;
+    std::memset(image + size, 0, static_cast<size_t>(padded - size));
+
+    const std::string temporary = path + ".tmp";
+
+#ifdef _WIN32
+    auto widen = [](const std::string& s) {
+        std::wstring w(MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, nullptr, 0), L'\0');
+        MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, &w[0], static_cast<int>(w.size()));
+        w.resize(w.size() - 1);
+        return w;
+    };
+
+    CREATEFILE2_EXTENDED_PARAMETERS parameters = { sizeof(parameters) };
+    parameters.dwFileAttributes = FILE_ATTRIBUTE_NORMAL;
+    parameters.dwFileFlags = direct_io ? FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH : 0;
+
+    HANDLE file = CreateFile2(widen(temporary).c_str(), GENERIC_WRITE, 0, CREATE_ALWAYS, &parameters);
+    if (file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("cannot write " + temporary);
+
+    bool ok = true;
+    for (uint64_t offset = 0; ok && offset < padded; offset += checkpoint_write_size) {
+        DWORD bytes = static_cast<DWORD>((std::min)(checkpoint_write_size, padded - offset));
+        DWORD written = 0;
+        ok = WriteFile(file, image + offset, bytes, &written, nullptr) && written == bytes;
+    }
+
+    // drop the padding of the last sector
+    FILE_END_OF_FILE_INFO end = {};
+    end.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+    ok = ok && SetFileInformationByHandle(file, FileEndOfFileInfo, &end, sizeof(end));
+    ok = CloseHandle(file) && ok;
+    ok = ok && MoveFileExW(widen(temporary).c_str(), widen(path).c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int fd = -1;
+#ifdef O_DIRECT
+    if (direct_io)
+        fd = ::open(temporary.c_str(), flags | O_DIRECT, 0644);
+#endif
+    // not every file system takes O_DIRECT, fall back to buffered writes
+    if (fd < 0)
+        fd = ::open(temporary.c_str(), flags, 0644);
+    if (fd < 0)
+        throw std::runtime_error("cannot write " + temporary);
+
+#ifdef F_NOCACHE
+    if (direct_io)
+        ::fcntl(fd, F_NOCACHE, 1);
+#endif
+
+    bool ok = true;
+    for (uint64_t offset = 0; ok && offset < padded;) {
+        const size_t bytes = static_cast<size_t>((std::min)(checkpoint_write_size, padded - offset));
+        const ssize_t written = ::write(fd, image + offset, bytes);
+        ok = written > 0;
+        offset += ok ? static_cast<uint64_t>(written) : 0;
+    }
+
+    // drop the padding of the last sector
+    ok = ok && ::ftruncate(fd, static_cast<off_t>(size)) == 0;
+    ok = ::close(fd) == 0 && ok;
+    ok = ok && std::rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+
+    if (!ok)
+        throw std::runtime_error("cannot write " + path);
+}
+
+struct checkpoint_stats {
+    uint64_t count = 0;             // checkpoints submitted
+    uint64_t written = 0;           // checkpoints on disk
+    uint64_t deltas = 0;            // of those, delta checkpoints
+    uint64_t bytes = 0;             // bytes on disk
+    double   last_stall = 0.0;      // seconds the simulation thread spent in the last submit()
+    double   max_stall = 0.0;
+    double   total_stall = 0.0;
+    double   last_write = 0.0;      // seconds the I/O thread spent on the last image
+    double   total_write = 0.0;
+};
+
+class checkpoint_writer {
+public:
+    explicit checkpoint_writer(const std::string& directory, bool direct_io = true, uint32_t full_every = 1) :
+        directory_(directory),
+        direct_io_(direct_io),
+        full_every_((std::max)(full_every, 1u)),
+        io_thread_([this] { io_thread_proc(); })
+    {
+    }
+
+    checkpoint_writer(const checkpoint_writer&) = delete;
+    checkpoint_writer& operator=(const checkpoint_writer&) = delete;
+
+    ~checkpoint_writer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            terminating_ = true;
+        }
+        changed_.notify_all();
+        io_thread_.join();
+    }
+
+    // checkpoint_<step>.snap in the writer's directory
+    std::string path(uint64_t step) const {
+        return file_path(step, "snap");
+    }
+
+    // checkpoint_<step>.delta
+    std::string delta_path(uint64_t step) const {
+        return file_path(step, "delta");
+    }
+
+    // copies the state into a free staging buffer and queues it; blocks only
+    // while both buffers are in flight. Rethrows the error of a failed write.
+    void submit(const particle_set& particles, const snapshot_info& info) {
+        NBODY_TRACE_SCOPE("checkpoint submit");
+        const auto start = std::chrono::steady_clock::now();
+        const snapshot_header header = make_snapshot_header(particles, info);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this] { return error_ || !slots_[0].pending || !slots_[1].pending; });
+        rethrow_error();
+
+        slot_t& slot = slots_[slots_[0].pending ? 1 : 0];
+        slot.delta = stats_.count % full_every_ != 0;
+        lock.unlock();
+
+        // the staging copy runs outside the lock so the I/O thread can go on with the other slot
+        slot.image.reserve(header.file_size);
+        serialize_snapshot(particles, header, slot.image.data());
+        slot.size = header.file_size;
+        slot.step = info.step;
+        slot.sequence = ++sequence_;
+
+        const double stall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        lock.lock();
+        slot.pending = true;
+        stats_.count++;
+        stats_.last_stall = stall;
+        stats_.max_stall = (std::max)(stats_.max_stall, stall);
+        stats_.total_stall += stall;
+        lock.unlock();
+        changed_.notify_all();
+    }
+
+    // waits until every submitted checkpoint is on disk
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this] { return error_ || (!slots_[0].pending && !slots_[1].pending); });
+        rethrow_error();
+    }
+
+    checkpoint_stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    struct slot_t {
+        aligned_buffer  image;
+        uint64_t        size = 0;
+        uint64_t        sequence = 0;
+        uint64_t        step = 0;
+        bool            delta = false;
+        bool            pending = false;    // owned by the I/O thread until written
+    };
+
+    std::string file_path(uint64_t step, const char* extension) const {
+        const std::string name = checkpoint_file_name(step, extension);
+        return directory_.empty() ? name : directory_ + "/" + name;
+    }
+
+    // I/O thread: writes the slot as a delta against base_ if it asks for
+    // one and can be, otherwise as a full snapshot; returns the bytes written
+    uint64_t write_slot(slot_t& slot, bool& delta) {
+        delta = false;
+        if (full_every_ == 1) {
+            write_checkpoint_image(path(slot.step), slot.image.data(), slot.size, direct_io_);
+            return slot.size;
+        }
+
+        // the state becomes the next base either way
+        const snapshot_view view(slot.image.data(), static_cast<size_t>(slot.size));
+        load_snapshot(view, next_base_.particles);
+        next_base_.assign(slot.step);
+
+        uint64_t size = slot.size;
+        if (slot.delta && encode_checkpoint_delta(view, next_base_.checksum, base_, delta_bytes_)) {
+            size = delta_bytes_.size();
+            delta_image_.reserve(size);
+            std::memcpy(delta_image_.data(), delta_bytes_.data(), static_cast<size_t>(size));
+            write_checkpoint_image(delta_path(slot.step), delta_image_.data(), size, direct_io_);
+            delta = true;
+        }
+        else
+            write_checkpoint_image(path(slot.step), slot.image.data(), slot.size, direct_io_);
+
+        std::swap(base_, next_base_);
+        return size;
+    }
+
+    void rethrow_error() {
+        if (error_) {
+            std::exception_ptr error = error_;
+            error_ = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+    void io_thread_proc() {
+        NBODY_TRACE_THREAD("checkpoint io");
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        for (;;) {
+            changed_.wait(lock, [this] { return terminating_ || slots_[0].pending || slots_[1].pending; });
+
+            if (!slots_[0].pending && !slots_[1].pending)
+                return; // terminating with nothing left to write
+
+            // oldest first
+            slot_t* slot = &slots_[0];
+            if (!slot->pending || (slots_[1].pending && slots_[1].sequence < slot->sequence))
+                slot = &slots_[1];
+
+            lock.unlock();
+
+            const auto start = std::chrono::steady_clock::now();
+            std::exception_ptr error;
+            uint64_t bytes = 0;
+            bool delta = false;
+            try {
+                NBODY_TRACE_SCOPE("checkpoint write");
+                bytes = write_slot(*slot, delta);
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            lock.lock();
+            slot->pending = false;
+            if (error)
+                error_ = error;
+            else {
+                stats_.written++;
+                stats_.deltas += delta ? 1 : 0;
+                stats_.bytes += bytes;
+            }
+            stats_.last_write = seconds;
+            stats_.total_write += seconds;
+            changed_.notify_all();
+        }
+    }
+
+private:
+    std::string                 directory_;
+    bool                        direct_io_;
+    uint32_t                    full_every_;
+    slot_t                      slots_[2];
+    uint64_t                    sequence_ = 0;
+    checkpoint_stats            stats_;
+    std::exception_ptr          error_;
+    bool                        terminating_ = false;
+
+    // I/O thread only
+    delta_base                  base_;          // the last checkpoint written
+    delta_base                  next_base_;
+    std::vector<uint8_t>        delta_bytes_;
+    aligned_buffer              delta_image_;
+
+    mutable std::mutex          mutex_;
+    std::condition_variable     changed_;
+    std::thread                 io_thread_;     // last, starts once everything else is constructed
+};
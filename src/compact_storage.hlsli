@@ -0,0 +1,85 @@
+// Unpacking of the compact particle storage (COMPACT_STORAGE), the layout is
+// described in compact_storage.hpp:
+//
+//   block headers   blocks x float4(origin, cell size)
+//   records         COMPACT_POSITION_FIXED16 ? 12 : 20 bytes per particle
+//   cold column     count x float |a|
+
+#define compact_block_size 128
+#define compact_header_size 16
+
+#ifdef COMPACT_POSITION_FIXED16
+#define compact_record_size 12
+#else
+#define compact_record_size 20
+#endif
+
+uint compact_record_address(uint index, uint blocks)
+{
+    return blocks * compact_header_size + index * compact_record_size;
+}
+
+uint compact_cold_address(uint index, uint count, uint blocks)
+{
+    return blocks * compact_header_size + count * compact_record_size + index * 4;
+}
+
+float decode_velocity(uint bits)
+{
+#ifdef COMPACT_VELOCITY_BF16
+    return asfloat((bits & 0xffff) << 16);
+#else
+    return f16tof32(bits);
+#endif
+}
+
+uint encode_velocity(float value)
+{
+#ifdef COMPACT_VELOCITY_BF16
+    uint bits = asuint(value);
+    return (bits + 0x7fff + ((bits >> 16) & 1)) >> 16;
+#else
+    return f32tof16(value);
+#endif
+}
+
+float4 load_block_header(ByteAddressBuffer buffer, uint block)
+{
+    return asfloat(buffer.Load4(block * compact_header_size));
+}
+
+float3 load_position(ByteAddressBuffer buffer, uint index, uint blocks, float4 header)
+{
+    uint address = compact_record_address(index, blocks);
+#ifdef COMPACT_POSITION_FIXED16
+    uint2 bits = buffer.Load2(address);
+    return header.xyz + float3(bits.x & 0xffff, bits.x >> 16, bits.y & 0xffff) * header.w;
+#else
+    return header.xyz + asfloat(buffer.Load3(address));
+#endif
+}
+
+float3 load_velocity(ByteAddressBuffer buffer, uint index, uint blocks)
+{
+    uint address = compact_record_address(index, blocks);
+#ifdef COMPACT_POSITION_FIXED16
+    uint2 bits = buffer.Load2(address + 4);
+    return float3(decode_velocity(bits.x >> 16), decode_velocity(bits.y), decode_velocity(bits.y >> 16));
+#else
+    uint2 bits = buffer.Load2(address + 12);
+    return float3(decode_velocity(bits.x), decode_velocity(bits.x >> 16), decode_velocity(bits.y));
+#endif
+}
+
+void store_particle(RWByteAddressBuffer buffer, uint index, uint blocks, float4 header, float3 position, float3 velocity)
+{
+    uint address = compact_record_address(index, blocks);
+    uint3 v = uint3(encode_velocity(velocity.x), encode_velocity(velocity.y), encode_velocity(velocity.z));
+#ifdef COMPACT_POSITION_FIXED16
+    uint3 q = (uint3)clamp(round((position - header.xyz) / header.w), 0.0f, 65535.0f);
+    buffer.Store3(address, uint3(q.x | (q.y << 16), q.z | (v.x << 16), v.y | (v.z << 16)));
+#else
+    buffer.Store3(address, asuint(position - header.xyz));
+    buffer.Store2(address + 12, uint2(v.x | (v.y << 16), v.z));
+#endif
+}
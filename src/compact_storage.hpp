@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "simulation.hpp"
+
+// Compact particle storage
+//
+// particle_t spends 32 bytes per particle, and velocity.w only carries |a| for
+// coloring. The compact layout stores particles in blocks of 128 - the tile
+// size of ComputeShader.hlsl - with positions relative to a per-block origin
+// and 16-bit velocities, and moves |a| into a separate cold column that only
+// the vertex shader reads. One buffer holds, in order:
+//
+//   block headers   blocks x 16 bytes: float3 origin, float cell size
+//   records         count x record size, see below
+//   cold column     count x float |a|
+//
+// Records are either
+//   float_relative  20 bytes: float3 position - origin, 3 x 16-bit velocity (+ 16 unused bits)
+//   fixed16         12 bytes: 3 x uint16 (position - origin) / cell, 3 x 16-bit velocity
+// and velocities are IEEE half or bfloat16.
+//
+// fixed16 + half is 16 bytes per particle instead of 32. Its resolution is
+// the block's extent / 65535, so it is only as good as the blocks are
+// compact - fine for Morton-sorted particles, coarse for the unsorted GPU path.
+// Masses are not stored; like the shader, the layout assumes
+// gravity::particle_mass for every particle, and unpack_compact() sets it:
+// other masses are lost. Ids, costs and fixed-point positions are not stored
+// either. nbody-bench storage checks a round trip against the bounds below.
+//
+// compact_storage.hlsli unpacks the same layout inside the kernels; keep them
+// in sync.
+
+enum class position_encoding : uint32_t {
+    float_relative,
+    fixed16,
+};
+
+enum class velocity_encoding : uint32_t {
+    half,
+    bfloat16,
+};
+
+struct compact_format {
+    position_encoding position = position_encoding::float_relative;
+    velocity_encoding velocity = velocity_encoding::half;
+};
+
+constexpr uint32_t compact_block_size = 128;
+constexpr uint32_t compact_header_size = 16;
+
+inline uint32_t compact_record_size(position_encoding encoding) {
+    return encoding == position_encoding::fixed16 ? 12 : 20;
+}
+
+struct compact_layout {
+    uint32_t count;
+    uint32_t blocks;
+    uint32_t record_size;
+    uint64_t records_offset;
+    uint64_t cold_offset;
+    uint64_t size;
+};
+
+inline compact_layout make_compact_layout(uint32_t count, const compact_format& format) {
+    compact_layout layout = {};
+    layout.count = count;
+    layout.blocks = (count + compact_block_size - 1) / compact_block_size;
+    layout.record_size = compact_record_size(format.position);
+    layout.records_offset = uint64_t(layout.blocks) * compact_header_size;
+    layout.cold_offset = layout.records_offset + uint64_t(count) * layout.record_size;
+    layout.size = layout.cold_offset + uint64_t(count) * sizeof(float);
+    return layout;
+}
+
+// IEEE binary16, round to nearest even
+inline uint16_t float_to_half(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+
+    const uint32_t sign = (bits >> 16) & 0x8000;
+    const uint32_t exponent = (bits >> 23) & 0xff;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if (exponent == 0xff)
+        return static_cast<uint16_t>(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+
+    int32_t half_exponent = int32_t(exponent) - 127 + 15;
+    if (half_exponent >= 0x1f)
+        return static_cast<uint16_t>(sign | 0x7c00);
+
+    if (half_exponent <= 0) {
+        if (half_exponent < -10)
+            return static_cast<uint16_t>(sign);
+
+        // subnormal: shift the implicit bit in and round
+        mantissa |= 0x800000;
+        const uint32_t shift = uint32_t(14 - half_exponent);
+        uint32_t half_mantissa = mantissa >> shift;
+        const uint32_t remainder = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half_mantissa & 1)))
+            ++half_mantissa;
+        return static_cast<uint16_t>(sign | half_mantissa);
+    }
+
+    uint32_t half = sign | (uint32_t(half_exponent) << 10) | (mantissa >> 13);
+    const uint32_t remainder = mantissa & 0x1fff;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+        ++half; // may carry into the exponent, which is the correct rounding
+
+    return static_cast<uint16_t>(half);
+}
+
+inline float half_to_float(uint16_t half) {
+    const uint32_t sign = uint32_t(half & 0x8000) << 16;
+    const uint32_t exponent = (half >> 10) & 0x1f;
+    const uint32_t mantissa = half & 0x3ff;
+
+    uint32_t bits;
+    if (exponent == 0) {
+        float value = std::ldexp(static_cast<float>(mantissa), -24);
+        return sign ? -value : value;
+    }
+    if (exponent == 0x1f)
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    else
+        bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// the upper half of a float, round to nearest even
+inline uint16_t float_to_bfloat16(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+
+    if ((bits & 0x7fffffff) > 0x7f800000)
+        return static_cast<uint16_t>((bits >> 16) | 0x40); // keep NaN a NaN
+
+    return static_cast<uint16_t>((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+}
+
+inline float bfloat16_to_float(uint16_t value) {
+    uint32_t bits = uint32_t(value) << 16;
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+inline uint16_t encode_velocity(float value, velocity_encoding encoding) {
+    return encoding == velocity_encoding::bfloat16 ? float_to_bfloat16(value) : float_to_half(value);
+}
+
+inline float decode_velocity(uint16_t value, velocity_encoding encoding) {
+    return encoding == velocity_encoding::bfloat16 ? bfloat16_to_float(value) : half_to_float(value);
+}
+
+// the block header the kernel computes as well: origin at the block's minimum corner,
+// cell size spanning the largest extent with 65535 steps
+inline void compact_block_header(const particle_set& particles, uint32_t begin, uint32_t end, float header[4]) {
+    float lo[3] = { particles.px[begin], particles.py[begin], particles.pz[begin] };
+    float hi[3] = { lo[0], lo[1], lo[2] };
+
+    for (uint32_t i = begin + 1; i < end; ++i) {
+        lo[0] = (std::min)(lo[0], particles.px[i]); hi[0] = (std::max)(hi[0], particles.px[i]);
+        lo[1] = (std::min)(lo[1], particles.py[i]); hi[1] = (std::max)(hi[1], particles.py[i]);
+        lo[2] = (std::min)(lo[2], particles.pz[i]); hi[2] = (std::max)(hi[2], particles.pz[i]);
+    }
+
+    float extent = (std::max)({ hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2] });
+
+    header[0] = lo[0];
+    header[1] = lo[1];
+    header[2] = lo[2];
+    header[3] = (std::max)(extent / 65535.0f, 1e-6f);
+}
+
+// the largest error a round trip may leave in a position coordinate x of a
+// block with origin and cell size: half a cell for fixed16, plus the float
+// rounding of the offset and of its reconstruction
+inline float compact_position_bound(float x, float origin, float cell, position_encoding encoding) {
+    const float rounding = std::numeric_limits<float>::epsilon() * (std::fabs(x) + std::fabs(origin) + std::fabs(x - origin));
+    return encoding == position_encoding::fixed16 ? 0.5f * cell + rounding : rounding;
+}
+
+// and in a velocity component v within the range of the encoding: half a
+// unit in the last place, or for half half its smallest subnormal
+inline float compact_velocity_bound(float v, velocity_encoding encoding) {
+    if (encoding == velocity_encoding::bfloat16)
+        return std::ldexp(std::fabs(v), -8);
+    return std::ldexp(std::fabs(v), -11) + std::ldexp(1.0f, -25);
+}
+
+inline void pack_compact(const particle_set& particles, const compact_format& format, std::vector<uint8_t>& buffer) {
+    const compact_layout layout = make_compact_layout(static_cast<uint32_t>(particles.size()), format);
+    buffer.assign(layout.size, 0);
+
+    for (uint32_t block = 0; block < layout.blocks; ++block) {
+        const uint32_t begin = block * compact_block_size;
+        const uint32_t end = (std::min)(begin + compact_block_size, layout.count);
+
+        float header[4];
+        compact_block_header(particles, begin, end, header);
+        std::memcpy(&buffer[uint64_t(block) * compact_header_size], header, sizeof(header));
+
+        for (uint32_t i = begin; i < end; ++i) {
+            uint8_t* record = &buffer[layout.records_offset + uint64_t(i) * layout.record_size];
+
+            const uint16_t v[3] = {
+                encode_velocity(particles.vx[i], format.velocity),
+                encode_velocity(particles.vy[i], format.velocity),
+                encode_velocity(particles.vz[i], format.velocity),
+            };
+
+            if (format.position == position_encoding::fixed16) {
+                const float p[3] = { particles.px[i], particles.py[i], particles.pz[i] };
+                uint16_t q[3];
+                for (int axis = 0; axis < 3; ++axis) {
+                    float cell = std::nearbyint((p[axis] - header[axis]) / header[3]);
+                    q[axis] = static_cast<uint16_t>((std::min)((std::max)(cell, 0.0f), 65535.0f));
+                }
+
+                const uint16_t words[6] = { q[0], q[1], q[2], v[0], v[1], v[2] };
+                std::memcpy(record, words, sizeof(words));
+            }
+            else {
+                const float p[3] = { particles.px[i] - header[0], particles.py[i] - header[1], particles.pz[i] - header[2] };
+                std::memcpy(record, p, sizeof(p));
+                std::memcpy(record + sizeof(p), v, sizeof(v));
+            }
+        }
+    }
+
+    std::memcpy(&buffer[layout.cold_offset], particles.acceleration.data(), uint64_t(layout.count) * sizeof(float));
+}
+
+// masses come back as gravity::particle_mass, ids are left as they are
+inline void unpack_compact(const uint8_t* buffer, uint32_t count, const compact_format& format, particle_set& particles) {
+    const compact_layout layout = make_compact_layout(count, format);
+    particles.resize(count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        float header[4];
+        std::memcpy(header, buffer + uint64_t(i / compact_block_size) * compact_header_size, sizeof(header));
+
+        const uint8_t* record = buffer + layout.records_offset + uint64_t(i) * layout.record_size;
+        uint16_t v[3];
+
+        if (format.position == position_encoding::fixed16) {
+            uint16_t words[6];
+            std::memcpy(words, record, sizeof(words));
+
+            particles.px[i] = header[0] + words[0] * header[3];
+            particles.py[i] = header[1] + words[1] * header[3];
+            particles.pz[i] = header[2] + words[2] * header[3];
+            std::memcpy(v, words + 3, sizeof(v));
+        }
+        else {
+            float p[3];
+            std::memcpy(p, record, sizeof(p));
+            std::memcpy(v, record + sizeof(p), sizeof(v));
+
+            particles.px[i] = header[0] + p[0];
+            particles.py[i] = header[1] + p[1];
+            particles.pz[i] = header[2] + p[2];
+        }
+
+        particles.vx[i] = decode_velocity(v[0], format.velocity);
+        particles.vy[i] = decode_velocity(v[1], format.velocity);
+        particles.vz[i] = decode_velocity(v[2], format.velocity);
+        particles.mass[i] = gravity::particle_mass;
+    }
+
+    std::memcpy(particles.acceleration.data(), buffer + layout.cold_offset, uint64_t(count) * sizeof(float));
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Splits [0, cost.size()) into zone_count contiguous ranges of roughly equal
+// summed cost. The engines record how many interactions every particle needed
+// during the previous step, and particles are kept in Morton order, so equal
+// cost ranges give every worker a compact region of space and the same amount
+// of work - a dense cluster core ends up in a short range, the halo in a long one.
+//
+// Returns zone_count + 1 boundaries, zone k being [bounds[k], bounds[k + 1]).
+inline std::vector<uint32_t> cost_zones(const std::vector<uint32_t>& cost, uint32_t zone_count) {
+    const uint32_t count = static_cast<uint32_t>(cost.size());
+    zone_count = (std::max)(zone_count, 1u);
+
+    std::vector<uint64_t> prefix(count + 1);
+    prefix[0] = 0;
+    for (uint32_t i = 0; i < count; ++i)
+        prefix[i + 1] = prefix[i] + (std::max)(cost[i], 1u);
+
+    const uint64_t total = prefix[count];
+
+    std::vector<uint32_t> bounds(zone_count + 1);
+    bounds[0] = 0;
+    for (uint32_t zone = 1; zone < zone_count; ++zone) {
+        uint64_t target = total * zone / zone_count;
+        auto it = std::lower_bound(prefix.begin() + bounds[zone - 1], prefix.begin() + count, target);
+        bounds[zone] = static_cast<uint32_t>(it - prefix.begin());
+    }
+    bounds[zone_count] = count;
+
+    return bounds;
+}
+
+// the static split the engines fall back to: the same particle count per zone
+inline std::vector<uint32_t> even_zones(uint32_t count, uint32_t zone_count) {
+    zone_count = (std::max)(zone_count, 1u);
+
+    std::vector<uint32_t> bounds(zone_count + 1);
+    for (uint32_t zone = 0; zone <= zone_count; ++zone)
+        bounds[zone] = static_cast<uint32_t>(uint64_t(count) * zone / zone_count);
+
+    return bounds;
+}
@@ -0,0 +1,687 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "accumulators.hpp"
+#include "cost_zones.hpp"
+#include "fixed_position.hpp"
+#include "morton.hpp"
+#include "perf_counters.hpp"
+#include "simulation.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+
+// CPU counterparts of ComputeShader.hlsl. Every engine advances a particle_set
+// by one step using the same force law and integrator as the shader, and
+// records the number of interactions each particle needed in particle_set::cost
+// so that the next step can be split across the workers by cost.
+//
+// The engines are templates over an accumulator from accumulators.hpp, which
+// picks the precision of the force sums at compile time.
+
+// the update that follows the force evaluation
+enum class integrator_kind {
+    euler_damped,   // the shader's: v = (v + a dt) * damping, then x += v dt
+    leapfrog,       // kick-drift-kick, second order and time-reversible; damping on the closing kick
+};
+
+inline const char* integrator_name(integrator_kind integrator) {
+    return integrator == integrator_kind::leapfrog ? "leapfrog" : "euler-damped";
+}
+
+// "euler-damped" (or "euler") or "leapfrog"; false for an unknown name
+inline bool parse_integrator(const std::string& name, integrator_kind& integrator) {
+    if (name == "euler-damped" || name == "euler")
+        integrator = integrator_kind::euler_damped;
+    else if (name == "leapfrog")
+        integrator = integrator_kind::leapfrog;
+    else
+        return false;
+    return true;
+}
+
+struct engine_config {
+    unsigned thread_count  = 0;     // 0 - one per hardware thread
+    bool     balance_costs = true;  // split work by last step's interaction counts instead of particle counts
+    float    theta         = 0.5f;  // Barnes-Hut opening angle
+    uint32_t leaf_size     = 16;    // particles per tree leaf
+    bool     fixed_positions = false; // integrate 64-bit fixed-point positions, see fixed_position.hpp
+    integrator_kind integrator = integrator_kind::euler_damped; // the update after the force evaluation
+};
+
+// Determinism
+//
+// Each particle's acceleration is summed by a single worker in a fixed order
+// (index order for the direct engine, Morton order of the tree for the tree
+// engine), the tree is built serially from a sort with a total order, and
+// the cost zones only decide who computes a particle, never how. That alone
+// gives bit-identical particle states on 1, 8 or 64 threads, in every
+// precision. The fixed precision (fixed_point_accumulator) also makes each
+// sum independent of the order of its terms, which only a kernel that
+// reorders them would need, at 3 to 4 times the tree engine's time and 7 to
+// 8 times the direct engine's. nbody-bench determinism checks both.
+
+template<class accumulator, class real>
+inline void add_acceleration(accumulator& a, real rx, real ry, real rz, float mass) {
+    real dist = std::sqrt(rx * rx + ry * ry + rz * rz + real(gravity::softening_squared));
+
+    real F = real(gravity::G) * real(mass) / (dist * dist * dist);
+    a.add(rx * F, ry * F, rz * F);
+}
+
+template<class accumulator>
+inline void calculate_acceleration(accumulator& a, float pjx, float pjy, float pjz, float pix, float piy, float piz, float mass) {
+    using real = typename accumulator::real;
+    add_acceleration(a, real(pjx) - real(pix), real(pjy) - real(piy), real(pjz) - real(piz), mass);
+}
+
+// the same on an offset pj - pi computed beforehand, e.g. from fixed-point positions
+template<class accumulator>
+inline void calculate_acceleration(accumulator& a, float rx, float ry, float rz, float mass) {
+    using real = typename accumulator::real;
+    add_acceleration(a, real(rx), real(ry), real(rz), mass);
+}
+
+// the potential of the same softened force law, in double
+inline double softened_potential(double rx, double ry, double rz, double mass) {
+    return -double(gravity::G) * mass / std::sqrt(rx * rx + ry * ry + rz * rz + double(gravity::softening_squared));
+}
+
+// the potential at particle i of the particles [begin, end), without itself
+inline double softened_potential(const particle_set& particles, uint32_t i, uint32_t begin, uint32_t end) {
+    const double pix = particles.px[i], piy = particles.py[i], piz = particles.pz[i];
+    double phi = 0.0;
+    for (uint32_t j = begin; j < end; ++j) {
+        if (j != i)
+            phi += softened_potential(particles.px[j] - pix, particles.py[j] - piy, particles.pz[j] - piz, particles.mass[j]);
+    }
+    return phi;
+}
+
+class cpu_engine {
+public:
+    explicit cpu_engine(const engine_config& config) :
+        config_(config),
+        pool_(config.thread_count)
+    {
+    }
+
+    virtual ~cpu_engine() = default;
+
+    virtual const char* name() const = 0;
+    virtual const char* precision() const = 0;
+
+    // fills the accelerations without moving the particles; the tree engine
+    // leaves them sorted in Morton order
+    virtual void compute_accelerations(particle_set& particles) = 0;
+
+    // the potential energy, 1/2 sum of m_i phi_i, with the engine's own
+    // approximation of phi and in double; the particles keep their order.
+    // For the conservation diagnostics, see diagnostics.hpp
+    virtual double potential_energy(const particle_set& particles) = 0;
+
+    void step(particle_set& particles, const compute_data& params) {
+        if (config_.integrator == integrator_kind::leapfrog) {
+            leapfrog_step(particles, params);
+            return;
+        }
+        compute_accelerations(particles);
+        integrate(particles, params);
+    }
+
+    unsigned thread_count() const {
+        return pool_.size();
+    }
+
+    // the workers, for reductions over the particles between steps
+    thread_pool& pool() {
+        return pool_;
+    }
+
+    // accelerations of the last step, in the order the particles are stored
+    const std::vector<float>& ax() const { return ax_; }
+    const std::vector<float>& ay() const { return ay_; }
+    const std::vector<float>& az() const { return az_; }
+
+    // the ranges the workers were given during the last step
+    const std::vector<uint32_t>& last_zones() const {
+        return zones_;
+    }
+
+protected:
+    // with fixed_positions, seeds the fixed-point columns from px/py/pz the
+    // first time a particle set is seen; afterwards they are the master copy,
+    // except where px/py/pz were written outside the engine in between
+    void prepare_positions(particle_set& particles) {
+        if (!config_.fixed_positions)
+            return;
+        if (particles.fx.size() != particles.size())
+            load_fixed_positions(particles);
+        else
+            sync_fixed_positions(particles);
+    }
+
+    void split_work(const particle_set& particles) {
+        zones_ = config_.balance_costs
+            ? cost_zones(particles.cost, pool_.size())
+            : even_zones(static_cast<uint32_t>(particles.size()), pool_.size());
+    }
+
+    // same update tail as the compute shader
+    void integrate(particle_set& particles, const compute_data& params) {
+        NBODY_TRACE_SCOPE("integrate");
+        const float delta_time = params.paramf[0];
+        const float damping = params.paramf[1];
+        const std::vector<uint32_t> zones = even_zones(static_cast<uint32_t>(particles.size()), pool_.size());
+
+        pool_.run(pool_.size(), [&](uint32_t zone) {
+            NBODY_PERF_SCOPE(perf_phase::integrate);
+            for (uint32_t i = zones[zone]; i < zones[zone + 1]; ++i) {
+                kick(particles, i, delta_time, damping);
+                drift(particles, i, delta_time);
+                particles.acceleration[i] = std::sqrt(ax_[i] * ax_[i] + ay_[i] * ay_[i] + az_[i] * az_[i]);
+            }
+        });
+    }
+
+    // The opening kick reuses the accelerations of the previous step, so a
+    // step costs one force evaluation like the shader's update; they are
+    // computed first when the engine has not seen the particles yet. Stepping
+    // a different particle set of the same size in between is not noticed.
+    void leapfrog_step(particle_set& particles, const compute_data& params) {
+        const float delta_time = params.paramf[0];
+        const float damping = params.paramf[1];
+
+        if (ax_.size() != particles.size())
+            compute_accelerations(particles);
+
+        const uint32_t count = static_cast<uint32_t>(particles.size());
+        std::vector<uint32_t> zones = even_zones(count, pool_.size());
+        pool_.run(pool_.size(), [&](uint32_t zone) {
+            NBODY_TRACE_SCOPE("kick drift");
+            NBODY_PERF_SCOPE(perf_phase::integrate);
+            for (uint32_t i = zones[zone]; i < zones[zone + 1]; ++i) {
+                kick(particles, i, 0.5f * delta_time, 1.0f);
+                drift(particles, i, delta_time);
+            }
+        });
+
+        // the tree engine reorders the particles here, the zones are redone
+        compute_accelerations(particles);
+
+        zones = even_zones(count, pool_.size());
+        pool_.run(pool_.size(), [&](uint32_t zone) {
+            NBODY_TRACE_SCOPE("kick");
+            NBODY_PERF_SCOPE(perf_phase::integrate);
+            for (uint32_t i = zones[zone]; i < zones[zone + 1]; ++i) {
+                kick(particles, i, 0.5f * delta_time, damping);
+                particles.acceleration[i] = std::sqrt(ax_[i] * ax_[i] + ay_[i] * ay_[i] + az_[i] * az_[i]);
+            }
+        });
+    }
+
+    void kick(particle_set& particles, uint32_t i, float delta_time, float damping) {
+        particles.vx[i] = (particles.vx[i] + ax_[i] * delta_time) * damping;
+        particles.vy[i] = (particles.vy[i] + ay_[i] * delta_time) * damping;
+        particles.vz[i] = (particles.vz[i] + az_[i] * delta_time) * damping;
+    }
+
+    void drift(particle_set& particles, uint32_t i, float delta_time) {
+        if (config_.fixed_positions) {
+            particles.fx[i] += to_fixed_position(double(particles.vx[i]) * delta_time);
+            particles.fy[i] += to_fixed_position(double(particles.vy[i]) * delta_time);
+            particles.fz[i] += to_fixed_position(double(particles.vz[i]) * delta_time);
+            store_float_positions(particles, i, i + 1);
+        }
+        else {
+            particles.px[i] += particles.vx[i] * delta_time;
+            particles.py[i] += particles.vy[i] * delta_time;
+            particles.pz[i] += particles.vz[i] * delta_time;
+        }
+    }
+
+    // 1/2 sum of m_i phi(i, stack) per zone, then over the zones in order
+    template<class potential>
+    double sum_potential(const particle_set& particles, potential phi) {
+        const std::vector<uint32_t> zones = even_zones(static_cast<uint32_t>(particles.size()), pool_.size());
+        std::vector<double> sums(pool_.size(), 0.0);
+
+        pool_.run(pool_.size(), [&](uint32_t zone) {
+            std::vector<uint32_t> stack;
+            double sum = 0.0;
+            for (uint32_t i = zones[zone]; i < zones[zone + 1]; ++i)
+                sum += double(particles.mass[i]) * phi(i, stack);
+            sums[zone] = sum;
+        });
+
+        double energy = 0.0;
+        for (double sum : sums)
+            energy += sum;
+        return 0.5 * energy;
+    }
+
+    void reset_accelerations(size_t count) {
+        ax_.assign(count, 0.0f);
+        ay_.assign(count, 0.0f);
+        az_.assign(count, 0.0f);
+    }
+
+protected:
+    engine_config           config_;
+    thread_pool             pool_;
+    std::vector<uint32_t>   zones_;
+    std::vector<float>      ax_, ay_, az_;
+};
+
+// O(N^2) summation, the reference the shader implements
+template<class precision_policy>
+class basic_direct_engine : public cpu_engine {
+public:
+    using cpu_engine::cpu_engine;
+
+    const char* name() const override {
+        return "direct";
+    }
+
+    const char* precision() const override {
+        return precision_policy::name;
+    }
+
+    void compute_accelerations(particle_set& particles) override {
+        const uint32_t count = static_cast<uint32_t>(particles.size());
+        reset_accelerations(count);
+        prepare_positions(particles);
+        split_work(particles);
+
+        NBODY_TRACE_SCOPE("force");
+        dispatch<precision_policy>(particles);
+    }
+
+    // every pair
+    double potential_energy(const particle_set& particles) override {
+        const uint32_t count = static_cast<uint32_t>(particles.size());
+        return sum_potential(particles, [&](uint32_t i, std::vector<uint32_t>&) {
+            return softened_potential(particles, i, 0, count);
+        });
+    }
+
+private:
+    template<class accumulator>
+    void dispatch(particle_set& particles) {
+        if (config_.fixed_positions)
+            accelerate<accumulator, true>(particles);
+        else
+            accelerate<accumulator, false>(particles);
+    }
+
+    template<class accumulator, bool fixed>
+    void accelerate(particle_set& particles) {
+        const uint32_t count = static_cast<uint32_t>(particles.size());
+
+        pool_.run(pool_.size(), [&](uint32_t zone) {
+            NBODY_TRACE_SCOPE("force zone");
+            NBODY_PERF_SCOPE(perf_phase::walk);
+            for (uint32_t i = zones_[zone]; i < zones_[zone + 1]; ++i) {
+                accumulator a;
+
+                if (fixed) {
+                    const int64_t fix = particles.fx[i], fiy = particles.fy[i], fiz = particles.fz[i];
+                    for (uint32_t j = 0; j < count; ++j)
+                        calculate_acceleration(a, fixed_offset(particles.fx[j], fix), fixed_offset(particles.fy[j], fiy), fixed_offset(particles.fz[j], fiz), particles.mass[j]);
+                }
+                else {
+                    const float pix = particles.px[i], piy = particles.py[i], piz = particles.pz[i];
+                    for (uint32_t j = 0; j < count; ++j)
+                        calculate_acceleration(a, particles.px[j], particles.py[j], particles.pz[j], pix, piy, piz, particles.mass[j]);
+                }
+
+                ax_[i] = a.get_x(); ay_[i] = a.get_y(); az_[i] = a.get_z();
+                particles.cost[i] = count;
+            }
+        });
+    }
+};
+
+// Barnes-Hut over a linear octree built from the Morton-sorted particles.
+// Particles stay in Morton order between steps, so a cost zone is also a
+// compact region of space. With fixed_positions the keys come from the integer
+// positions and every node keeps a fixed-point center of mass next to the
+// float one, so the walk works on exact offsets.
+template<class precision_policy>
+class basic_tree_engine : public cpu_engine {
+public:
+    struct node_t {
+        float    com_x, com_y, com_z;
+        float    mass;
+        float    size;          // edge length of the node's cube
+        uint32_t begin, end;    // particle range in Morton order
+        uint32_t first_child;   // children are stored next to each other
+        uint32_t child_count;   // 0 for leaves
+    };
+
+    using cpu_engine::cpu_engine;
+
+    const char* name() const override {
+        return "tree";
+    }
+
+    const char* precision() const override {
+        return precision_policy::name;
+    }
+
+    void compute_accelerations(particle_set& particles) override {
+        const uint32_t count = static_cast<uint32_t>(particles.size());
+        reset_accelerations(count);
+        if (count == 0)
+            return;
+
+        prepare_positions(particles);
+        {
+            NBODY_TRACE_SCOPE("tree build");
+            NBODY_PERF_SCOPE(perf_phase::build);
+            build(particles);
+        }
+        split_work(particles);
+
+        NBODY_TRACE_SCOPE("force");
+        dispatch<precision_policy>(particles);
+    }
+
+    // a Barnes-Hut walk with the engine's opening angle over a tree of a
+    // copy of the particles, which replaces the tree of the last step
+    double potential_energy(const particle_set& particles) override {
+        if (particles.size() == 0)
+            return 0.0;
+
+        particle_set sorted = particles;
+        build(sorted);
+        return sum_potential(sorted, [&](uint32_t i, std::vector<uint32_t>& stack) {
+            return walk_potential(sorted, i, stack);
+        });
+    }
+
+    const std::vector<node_t>& nodes() const {
+        return nodes_;
+    }
+
+protected:
+    struct fixed_com_t {
+        int64_t x, y, z;
+    };
+
+    void build(particle_set& particles) {
+        float size;
+        if (config_.fixed_positions) {
+            const fixed_bounding_cube box = compute_fixed_bounds(particles);
+            morton_sort(particles, box, keys_);
+            box_ = { from_fixed_position(box.min_x), from_fixed_position(box.min_y), from_fixed_position(box.min_z), 0.0f };
+            size = static_cast<float>(std::ldexp(double(morton_cells), int(box.shift)) / fixed_position_scale);
+            box_.size = size;
+        }
+        else {
+            box_ = compute_bounds(particles);
+            morton_sort(particles, box_, keys_);
+            size = box_.size;
+        }
+
+        nodes_.clear();
+        nodes_.push_back({});
+        fixed_com_.clear();
+        if (config_.fixed_positions)
+            fixed_com_.push_back({});
+        build_node(particles, 0, 0, static_cast<uint32_t>(particles.size()), 0, size);
+    }
+
+    void build_node(const particle_set& particles, uint32_t index, uint32_t begin, uint32_t end, uint32_t level, float size) {
+        nodes_[index].begin = begin;
+        nodes_[index].end = end;
+        nodes_[index].size = size;
+        nodes_[index].first_child = 0;
+        nodes_[index].child_count = 0;
+
+        if (end - begin <= config_.leaf_size || level == morton_bits) {
+            if (config_.fixed_positions) {
+                const fixed_com_t origin = { particles.fx[begin], particles.fy[begin], particles.fz[begin] };
+                double m = 0.0, x = 0.0, y = 0.0, z = 0.0;
+                for (uint32_t i = begin; i < end; ++i) {
+                    m += particles.mass[i];
+                    x += double(particles.mass[i]) * double(particles.fx[i] - origin.x);
+                    y += double(particles.mass[i]) * double(particles.fy[i] - origin.y);
+                    z += double(particles.mass[i]) * double(particles.fz[i] - origin.z);
+                }
+                set_fixed_center_of_mass(index, origin, m, x, y, z);
+                return;
+            }
+
+            double m = 0.0, x = 0.0, y = 0.0, z = 0.0;
+            for (uint32_t i = begin; i < end; ++i) {
+                m += particles.mass[i];
+                x += double(particles.mass[i]) * particles.px[i];
+                y += double(particles.mass[i]) * particles.py[i];
+                z += double(particles.mass[i]) * particles.pz[i];
+            }
+            set_center_of_mass(nodes_[index], m, x, y, z);
+            return;
+        }
+
+        // the particles are sorted, so each octant is a contiguous sub-range
+        uint32_t bounds[9];
+        bounds[0] = begin;
+        for (uint32_t octant = 0; octant < 8; ++octant) {
+            uint32_t i = bounds[octant];
+            while (i < end && morton_octant(keys_[i], level) == octant)
+                ++i;
+            bounds[octant + 1] = i;
+        }
+
+        const uint32_t first_child = static_cast<uint32_t>(nodes_.size());
+        uint32_t child_count = 0;
+        for (uint32_t octant = 0; octant < 8; ++octant) {
+            if (bounds[octant] != bounds[octant + 1])
+                ++child_count;
+        }
+
+        nodes_.resize(nodes_.size() + child_count);
+        if (config_.fixed_positions)
+            fixed_com_.resize(nodes_.size());
+        nodes_[index].first_child = first_child;
+        nodes_[index].child_count = child_count;
+
+        uint32_t child = first_child;
+        for (uint32_t octant = 0; octant < 8; ++octant) {
+            if (bounds[octant] != bounds[octant + 1])
+                build_node(particles, child++, bounds[octant], bounds[octant + 1], level + 1, size * 0.5f);
+        }
+
+        if (config_.fixed_positions) {
+            const fixed_com_t origin = fixed_com_[first_child];
+            double m = 0.0, x = 0.0, y = 0.0, z = 0.0;
+            for (uint32_t c = first_child; c < first_child + child_count; ++c) {
+                const double mass = nodes_[c].mass;
+                m += mass;
+                x += mass * double(fixed_com_[c].x - origin.x);
+                y += mass * double(fixed_com_[c].y - origin.y);
+                z += mass * double(fixed_com_[c].z - origin.z);
+            }
+            set_fixed_center_of_mass(index, origin, m, x, y, z);
+            return;
+        }
+
+        double m = 0.0, x = 0.0, y = 0.0, z = 0.0;
+        for (uint32_t c = first_child; c < first_child + child_count; ++c) {
+            const node_t& n = nodes_[c];
+            m += n.mass;
+            x += double(n.mass) * n.com_x;
+            y += double(n.mass) * n.com_y;
+            z += double(n.mass) * n.com_z;
+        }
+        set_center_of_mass(nodes_[index], m, x, y, z);
+    }
+
+    static void set_center_of_mass(node_t& node, double m, double x, double y, double z) {
+        node.mass = static_cast<float>(m);
+        node.com_x = m > 0.0 ? static_cast<float>(x / m) : 0.0f;
+        node.com_y = m > 0.0 ? static_cast<float>(y / m) : 0.0f;
+        node.com_z = m > 0.0 ? static_cast<float>(z / m) : 0.0f;
+    }
+
+    // x, y, z are mass-weighted sums of offsets from origin
+    void set_fixed_center_of_mass(uint32_t index, const fixed_com_t& origin, double m, double x, double y, double z) {
+        fixed_com_t& com = fixed_com_[index];
+        com.x = origin.x + (m > 0.0 ? std::llround(x / m) : 0);
+        com.y = origin.y + (m > 0.0 ? std::llround(y / m) : 0);
+        com.z = origin.z + (m > 0.0 ? std::llround(z / m) : 0);
+
+        node_t& node = nodes_[index];
+        node.mass = static_cast<float>(m);
+        node.com_x = from_fixed_position(com.x);
+        node.com_y = from_fixed_position(com.y);
+        node.com_z = from_fixed_position(com.z);
+    }
+
+    template<class accumulator>
+    void dispatch(particle_set& particles) {
+        if (config_.fixed_positions)
+            accelerate<accumulator, true>(particles);
+        else
+            accelerate<accumulator, false>(particles);
+    }
+
+    template<class accumulator, bool fixed>
+    void accelerate(particle_set& particles) {
+        pool_.run(pool_.size(), [&](uint32_t zone) {
+            NBODY_TRACE_SCOPE("tree walk");
+            NBODY_PERF_SCOPE(perf_phase::walk);
+            std::vector<uint32_t> stack;
+            for (uint32_t i = zones_[zone]; i < zones_[zone + 1]; ++i)
+                particles.cost[i] = walk<accumulator, fixed>(particles, i, stack);
+        });
+    }
+
+    // accumulates the acceleration of particle i, returns the number of interactions
+    template<class accumulator, bool fixed>
+    uint32_t walk(const particle_set& particles, uint32_t i, std::vector<uint32_t>& stack) {
+        const float pix = particles.px[i], piy = particles.py[i], piz = particles.pz[i];
+        const int64_t fix = fixed ? particles.fx[i] : 0, fiy = fixed ? particles.fy[i] : 0, fiz = fixed ? particles.fz[i] : 0;
+        const float theta_squared = config_.theta * config_.theta;
+
+        accumulator a;
+        uint32_t interactions = 0;
+
+        stack.clear();
+        stack.push_back(0);
+
+        while (!stack.empty()) {
+            const uint32_t index = stack.back();
+            const node_t& node = nodes_[index];
+            stack.pop_back();
+
+            if (node.child_count == 0) {
+                for (uint32_t j = node.begin; j < node.end; ++j) {
+                    if (fixed)
+                        calculate_acceleration(a, fixed_offset(particles.fx[j], fix), fixed_offset(particles.fy[j], fiy), fixed_offset(particles.fz[j], fiz), particles.mass[j]);
+                    else
+                        calculate_acceleration(a, particles.px[j], particles.py[j], particles.pz[j], pix, piy, piz, particles.mass[j]);
+                }
+                interactions += node.end - node.begin;
+                continue;
+            }
+
+            float dx, dy, dz;
+            if (fixed) {
+                dx = fixed_offset(fixed_com_[index].x, fix);
+                dy = fixed_offset(fixed_com_[index].y, fiy);
+                dz = fixed_offset(fixed_com_[index].z, fiz);
+            }
+            else {
+                dx = node.com_x - pix;
+                dy = node.com_y - piy;
+                dz = node.com_z - piz;
+            }
+            float dist_squared = dx * dx + dy * dy + dz * dz;
+
+            if (node.size * node.size < theta_squared * dist_squared) {
+                if (fixed)
+                    calculate_acceleration(a, dx, dy, dz, node.mass);
+                else
+                    calculate_acceleration(a, node.com_x, node.com_y, node.com_z, pix, piy, piz, node.mass);
+                ++interactions;
+                continue;
+            }
+
+            // push in reverse so that the children are visited in Morton order
+            for (uint32_t c = node.child_count; c-- > 0;)
+                stack.push_back(node.first_child + c);
+        }
+
+        ax_[i] = a.get_x(); ay_[i] = a.get_y(); az_[i] = a.get_z();
+        return interactions;
+    }
+
+    // the walk of walk() for the potential, on the float positions
+    double walk_potential(const particle_set& particles, uint32_t i, std::vector<uint32_t>& stack) const {
+        const double pix = particles.px[i], piy = particles.py[i], piz = particles.pz[i];
+        const double theta_squared = double(config_.theta) * config_.theta;
+        double phi = 0.0;
+
+        stack.clear();
+        stack.push_back(0);
+
+        while (!stack.empty()) {
+            const node_t& node = nodes_[stack.back()];
+            stack.pop_back();
+
+            if (node.child_count == 0) {
+                phi += softened_potential(particles, i, node.begin, node.end);
+                continue;
+            }
+
+            const double dx = node.com_x - pix, dy = node.com_y - piy, dz = node.com_z - piz;
+            if (double(node.size) * node.size < theta_squared * (dx * dx + dy * dy + dz * dz)) {
+                phi += softened_potential(dx, dy, dz, node.mass);
+                continue;
+            }
+
+            for (uint32_t c = node.child_count; c-- > 0;)
+                stack.push_back(node.first_child + c);
+        }
+        return phi;
+    }
+
+protected:
+    bounding_cube           box_ = {};
+    std::vector<uint64_t>   keys_;
+    std::vector<node_t>     nodes_;
+    std::vector<fixed_com_t> fixed_com_;    // per node, only with fixed_positions
+};
+
+using direct_engine = basic_direct_engine<float_accumulator>;
+using tree_engine = basic_tree_engine<float_accumulator>;
+
+template<template<class> class engine>
+inline std::unique_ptr<cpu_engine> make_engine_with_precision(const std::string& precision, const engine_config& config) {
+    if (precision == float_accumulator::name)
+        return std::make_unique<engine<float_accumulator>>(config);
+    if (precision == kahan_accumulator::name)
+        return std::make_unique<engine<kahan_accumulator>>(config);
+    if (precision == double_accumulator::name)
+        return std::make_unique<engine<double_accumulator>>(config);
+    if (precision == full_double_accumulator::name)
+        return std::make_unique<engine<full_double_accumulator>>(config);
+    if (precision == fixed_point_accumulator::name)
+        return std::make_unique<engine<fixed_point_accumulator>>(config);
+    return nullptr;
+}
+
+// returns nullptr for an unknown engine or precision name
+inline std::unique_ptr<cpu_engine> make_engine(const std::string& name, const engine_config& config = {}, const std::string& precision = float_accumulator::name) {
+    if (name == "direct")
+        return make_engine_with_precision<basic_direct_engine>(precision, config);
+    if (name == "tree")
+        return make_engine_with_precision<basic_tree_engine>(precision, config);
+    return nullptr;
+}
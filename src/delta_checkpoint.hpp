@@ -0,0 +1,422 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "simulation.hpp"
+#include "snapshot.hpp"
+#include "trajectory.hpp"
+
+// Delta checkpoints
+//
+// A delta checkpoint stores a state as the difference to the checkpoint
+// before it, its base. Particles are matched by particle_set::id, so the
+// engines may reorder them between checkpoints. Every value is mapped to an
+// integer that orders like the value - the bits of a float with the sign
+// folded in - and the difference to the base value of the same particle is
+// zigzag-encoded and bit-packed in groups of 32 with the width of the
+// largest, as trajectories do. Columns that did not change cost one byte per
+// group, a position that moved a few ulps a few bits. The id column itself is
+// coded against the base ids at the same index, nothing when the order held.
+//
+//   header          64 bytes, see delta_header
+//   snapshot header 512 bytes, of the full snapshot of the state
+//   columns         delta_column_header, groups; the id column first
+//
+// A restore is checked against two checksums of the state the delta was made
+// from: state_checksum(), which the next delta's base_checksum refers to, and
+// snapshot_columns_checksum() over every stored column, so a delta that
+// corrupts the masses, costs or ids is caught as well. Files of writers that
+// left the latter 0 only have the positions, velocities and accelerations
+// checked.
+//
+// A base is found by its step next to the delta: checkpoint_<step>.snap if
+// it exists, otherwise checkpoint_<step>.delta. restore_checkpoint() follows
+// the chain back to a full snapshot and applies the deltas forward;
+// compact_checkpoint() rewrites the deltas of a chain that lie too far from
+// their full snapshot as full snapshots.
+
+constexpr char     delta_magic[8]       = { 'N', 'B', 'O', 'D', 'Y', 'D', 'L', 'T' };
+constexpr uint32_t delta_version        = 1;
+constexpr uint32_t delta_group_size     = 32;
+
+struct delta_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t column_count;
+    uint64_t step;
+    uint64_t base_step;
+    uint64_t base_checksum;     // state_checksum() of the base
+    uint64_t checksum;          // state_checksum() of the restored state
+    uint64_t size;              // of the whole file
+    uint64_t columns_checksum;  // snapshot_columns_checksum() of the restored image, 0 - not recorded
+};
+
+struct delta_column_header {
+    uint32_t id;                // snapshot_column
+    uint32_t reserved;
+    uint64_t size;              // bytes of groups behind this header
+};
+
+static_assert(sizeof(delta_header) == 64, "the delta header is 64 bytes");
+static_assert(sizeof(delta_column_header) == 16, "delta column headers are 16 bytes");
+
+// checkpoint_<step>.<extension>
+inline std::string checkpoint_file_name(uint64_t step, const char* extension) {
+    char name[64];
+    std::snprintf(name, sizeof(name), "checkpoint_%010llu.%s", static_cast<unsigned long long>(step), extension);
+    return name;
+}
+
+// checkpoint_<step>.<extension> in the directory of path
+inline std::string checkpoint_path(const std::string& path, uint64_t step, const char* extension) {
+    const size_t slash = path.find_last_of("/\\");
+    const std::string directory = slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+    return directory + checkpoint_file_name(step, extension);
+}
+
+// the checkpoint of step next to path, the full snapshot if there is one
+inline std::string checkpoint_sibling(const std::string& path, uint64_t step) {
+    const std::string full = checkpoint_path(path, step, "snap");
+    if (FILE* file = std::fopen(full.c_str(), "rb")) {
+        std::fclose(file);
+        return full;
+    }
+    return checkpoint_path(path, step, "delta");
+}
+
+// The state a delta is coded against: the particles in file order and the
+// index of every id
+struct delta_base {
+    particle_set            particles;
+    std::vector<uint32_t>   where;
+    uint64_t                step = 0;
+    uint64_t                checksum = 0;
+    bool                    valid = false;      // the ids are a permutation of 0..n-1
+
+    void assign(uint64_t base_step) {
+        const size_t count = particles.size();
+        step = base_step;
+        checksum = state_checksum(particles);
+        valid = particles.id.size() == count;
+        where.assign(count, UINT32_MAX);
+
+        for (size_t i = 0; valid && i < count; ++i) {
+            const uint32_t id = particles.id[i];
+            valid = id < count && where[id] == UINT32_MAX;
+            if (valid)
+                where[id] = static_cast<uint32_t>(i);
+        }
+    }
+};
+
+// values as integers that order like them, so close values have a small difference
+inline uint64_t delta_ordered(const void* column, snapshot_type type, size_t i) {
+    switch (type) {
+    case snapshot_type::f32: {
+        int32_t bits;
+        std::memcpy(&bits, static_cast<const float*>(column) + i, sizeof(bits));
+        return static_cast<uint64_t>(static_cast<int64_t>(bits ^ ((bits >> 31) & 0x7fffffff)));
+    }
+    case snapshot_type::u32:
+        return static_cast<const uint32_t*>(column)[i];
+    default:
+        return static_cast<uint64_t>(static_cast<const int64_t*>(column)[i]);
+    }
+}
+
+inline void delta_store(uint64_t ordered, snapshot_type type, uint8_t* column, size_t i) {
+    switch (type) {
+    case snapshot_type::f32: {
+        int32_t bits = static_cast<int32_t>(static_cast<uint32_t>(ordered));
+        bits ^= (bits >> 31) & 0x7fffffff;
+        std::memcpy(column + i * sizeof(float), &bits, sizeof(bits));
+        break;
+    }
+    case snapshot_type::u32: {
+        const uint32_t value = static_cast<uint32_t>(ordered);
+        std::memcpy(column + i * sizeof(value), &value, sizeof(value));
+        break;
+    }
+    default:
+        std::memcpy(column + i * sizeof(ordered), &ordered, sizeof(ordered));
+        break;
+    }
+}
+
+// codes the differences of count values in groups
+inline void encode_delta_column(const std::vector<uint64_t>& residuals, std::vector<uint8_t>& out) {
+    uint64_t group[delta_group_size];
+    const size_t count = residuals.size();
+
+    for (size_t begin = 0; begin < count; begin += delta_group_size) {
+        uint64_t combined = 0;
+        for (uint32_t i = 0; i < delta_group_size; ++i) {
+            group[i] = begin + i < count ? residuals[begin + i] : 0;
+            combined |= group[i];
+        }
+
+        const uint32_t width = bit_width(combined);
+        out.push_back(static_cast<uint8_t>(width));
+        pack_bits(group, delta_group_size, width, out);
+    }
+}
+
+inline const uint8_t* decode_delta_column(const uint8_t* in, const uint8_t* end, size_t count, std::vector<uint64_t>& residuals) {
+    uint64_t group[delta_group_size];
+    residuals.resize(count);
+
+    for (size_t begin = 0; begin < count; begin += delta_group_size) {
+        if (in >= end || *in > 64 || in + 1 + 4 * *in > end)
+            throw std::runtime_error("delta: corrupt column");
+
+        const uint32_t width = *in++;
+        in = unpack_bits(in, delta_group_size, width, group);
+
+        for (uint32_t i = 0; i < delta_group_size && begin + i < count; ++i)
+            residuals[begin + i] = group[i];
+    }
+    return in;
+}
+
+// the values of a column of any type
+inline const void* delta_column_data(const snapshot_view& view, const snapshot_column_entry& entry) {
+    if (snapshot_type_size(entry.type) == sizeof(int64_t))
+        return view.column<int64_t>(entry.id);
+    return view.column<uint32_t>(entry.id);
+}
+
+// codes the snapshot image target, whose state_checksum() is checksum,
+// against base into out; false if it cannot be, because the particles or
+// columns differ - write a full snapshot then
+inline bool encode_checkpoint_delta(const snapshot_view& target, uint64_t checksum, const delta_base& base, std::vector<uint8_t>& out) {
+    const size_t count = static_cast<size_t>(target.size());
+    const uint32_t* ids = target.column<uint32_t>(snapshot_column::id);
+    if (!base.valid || base.particles.size() != count || !ids)
+        return false;
+
+    const snapshot_header& header = target.header();
+    for (uint32_t c = 0; c < header.column_count; ++c) {
+        const snapshot_column id = header.columns[c].id;
+        if ((id == snapshot_column::fx || id == snapshot_column::fy || id == snapshot_column::fz) && base.particles.fx.size() != count)
+            return false;
+    }
+    for (size_t i = 0; i < count; ++i)
+        if (ids[i] >= count)
+            return false;
+
+    delta_header delta = {};
+    std::memcpy(delta.magic, delta_magic, sizeof(delta_magic));
+    delta.version = delta_version;
+    delta.column_count = header.column_count;
+    delta.step = header.step;
+    delta.base_step = base.step;
+    delta.base_checksum = base.checksum;
+    delta.checksum = checksum;
+    delta.columns_checksum = snapshot_columns_checksum(target.data(), header);
+
+    out.resize(sizeof(delta) + sizeof(header));
+    std::memcpy(out.data() + sizeof(delta), &header, sizeof(header));
+
+    // the id column first, the others follow the ids to the base
+    std::vector<snapshot_column> order(1, snapshot_column::id);
+    for (uint32_t c = 0; c < header.column_count; ++c)
+        if (header.columns[c].id != snapshot_column::id)
+            order.push_back(header.columns[c].id);
+
+    std::vector<uint64_t> residuals(count);
+    for (snapshot_column id : order) {
+        const snapshot_column_entry* entry = target.find(id);
+        const void* values = delta_column_data(target, *entry);
+        const void* base_values = snapshot_column_data(base.particles, id);
+
+        for (size_t i = 0; i < count; ++i) {
+            const size_t j = id == snapshot_column::id ? i : base.where[ids[i]];
+            residuals[i] = zigzag_encode(static_cast<int64_t>(delta_ordered(values, entry->type, i) - delta_ordered(base_values, entry->type, j)));
+        }
+
+        const size_t at = out.size();
+        out.resize(at + sizeof(delta_column_header));
+        encode_delta_column(residuals, out);
+
+        delta_column_header column = {};
+        column.id = static_cast<uint32_t>(id);
+        column.size = out.size() - at - sizeof(column);
+        std::memcpy(out.data() + at, &column, sizeof(column));
+    }
+
+    delta.size = out.size();
+    std::memcpy(out.data(), &delta, sizeof(delta));
+    return true;
+}
+
+// the delta file image [data, data + size) applied to base, as the image of
+// the full snapshot of the state
+inline void apply_checkpoint_delta(const uint8_t* data, size_t size, const delta_base& base, std::vector<uint8_t>& image) {
+    delta_header delta;
+    snapshot_header header;
+    if (size < sizeof(delta) + sizeof(header))
+        throw std::runtime_error("delta: truncated header");
+    std::memcpy(&delta, data, sizeof(delta));
+    std::memcpy(&header, data + sizeof(delta), sizeof(header));
+
+    if (std::memcmp(delta.magic, delta_magic, sizeof(delta_magic)) != 0)
+        throw std::runtime_error("delta: not a delta checkpoint");
+    if (delta.version == 0 || delta.version > delta_version)
+        throw std::runtime_error("delta: unsupported version " + std::to_string(delta.version));
+    if (delta.size > size || delta.column_count != header.column_count || header.column_count > snapshot_max_columns)
+        throw std::runtime_error("delta: truncated file");
+    if (delta.base_step != base.step || delta.base_checksum != base.checksum)
+        throw std::runtime_error("delta: the base is not the state the delta was made from");
+
+    const size_t count = static_cast<size_t>(header.particle_count);
+    if (!base.valid || base.particles.size() != count)
+        throw std::runtime_error("delta: the base has other particles");
+
+    // the header asks for file_size bytes: no more than its columns can need
+    check_snapshot_layout(header);
+    if (header.file_size > snapshot_size_bound(header))
+        throw std::runtime_error("delta: bad snapshot header");
+    image.assign(static_cast<size_t>(header.file_size), 0);
+    std::memcpy(image.data(), &header, sizeof(header));
+    const snapshot_view shape(image.data(), image.size());
+
+    const uint8_t* in = data + sizeof(delta) + sizeof(header);
+    const uint8_t* end = data + delta.size;
+    const uint32_t* ids = nullptr;
+    std::vector<uint64_t> residuals;
+
+    for (uint32_t c = 0; c < delta.column_count; ++c) {
+        delta_column_header column;
+        if (end - in < static_cast<ptrdiff_t>(sizeof(column)))
+            throw std::runtime_error("delta: truncated file");
+        std::memcpy(&column, in, sizeof(column));
+        in += sizeof(column);
+
+        const snapshot_column id = static_cast<snapshot_column>(column.id);
+        const snapshot_column_entry* entry = shape.find(id);
+        const void* base_values = entry ? snapshot_column_data(base.particles, id) : nullptr;
+        if (!entry || column.size > uint64_t(end - in) || (c == 0) != (id == snapshot_column::id) ||
+            (snapshot_type_size(entry->type) == sizeof(int64_t) && base.particles.fx.size() != count))
+            throw std::runtime_error("delta: bad column table");
+
+        const uint8_t* next = in + column.size;
+        decode_delta_column(in, next, count, residuals);
+        in = next;
+
+        uint8_t* values = image.data() + entry->offset;
+        for (size_t i = 0; i < count; ++i) {
+            const size_t j = id == snapshot_column::id ? i : base.where[ids[i]];
+            delta_store(delta_ordered(base_values, entry->type, j) + static_cast<uint64_t>(zigzag_decode(residuals[i])), entry->type, values, i);
+        }
+
+        if (id == snapshot_column::id) {
+            ids = reinterpret_cast<const uint32_t*>(values);
+            for (size_t i = 0; i < count; ++i)
+                if (ids[i] >= count)
+                    throw std::runtime_error("delta: bad particle id");
+        }
+    }
+}
+
+// true if path starts like a delta checkpoint
+inline bool is_delta_checkpoint(const uint8_t* data, size_t size) {
+    return size >= sizeof(delta_magic) && std::memcmp(data, delta_magic, sizeof(delta_magic)) == 0;
+}
+
+// Walks a chain of checkpoints from its full snapshot to path: calls
+// visit(checkpoint, info, depth, particles) with the state of every
+// checkpoint, depth counting the deltas since the full snapshot
+template<class Visit>
+void walk_checkpoint_chain(const std::string& path, Visit visit) {
+    // newest first, back to the full snapshot
+    std::vector<std::string> chain(1, path);
+    uint64_t step = UINT64_MAX;
+    for (;;) {
+        mapped_file file(chain.back());
+        if (!is_delta_checkpoint(file.data(), file.size()))
+            break;
+
+        delta_header delta;
+        if (file.size() < sizeof(delta))
+            throw std::runtime_error(chain.back() + ": delta: truncated header");
+        std::memcpy(&delta, file.data(), sizeof(delta));
+        if (delta.base_step >= step || delta.base_step >= delta.step)
+            throw std::runtime_error(chain.back() + ": delta: not based on an earlier step");
+        step = delta.base_step;
+        chain.push_back(checkpoint_sibling(path, delta.base_step));
+    }
+
+    delta_base base;
+    snapshot_info info;
+    read_snapshot(chain.back(), base.particles, &info);
+    base.assign(info.step);
+    visit(chain.back(), static_cast<const snapshot_info&>(info), size_t(0), static_cast<const particle_set&>(base.particles));
+
+    std::vector<uint8_t> image;
+    for (size_t link = chain.size() - 1; link-- > 0;) {
+        const std::string& checkpoint = chain[link];
+        {
+            mapped_file file(checkpoint);
+            file.advise_sequential(0, file.size());
+            try {
+                apply_checkpoint_delta(file.data(), file.size(), base, image);
+            }
+            catch (const std::runtime_error& error) {
+                throw std::runtime_error(checkpoint + ": " + error.what());
+            }
+
+            delta_header delta;
+            std::memcpy(&delta, file.data(), sizeof(delta));
+            const snapshot_view view(image.data(), image.size());
+            load_snapshot(view, base.particles);
+            info = make_snapshot_info(view.header());
+            base.assign(info.step);
+            if (base.checksum != delta.checksum ||
+                (delta.columns_checksum && snapshot_columns_checksum(image.data(), view.header()) != delta.columns_checksum))
+                throw std::runtime_error(checkpoint + ": delta: the restored state differs");
+        }
+        visit(checkpoint, static_cast<const snapshot_info&>(info), chain.size() - 1 - link, static_cast<const particle_set&>(base.particles));
+    }
+}
+
+// the state of a full or delta checkpoint
+inline void restore_checkpoint(const std::string& path, particle_set& particles, snapshot_info* info = nullptr) {
+    walk_checkpoint_chain(path, [&](const std::string& checkpoint, const snapshot_info& state_info, size_t, const particle_set& state) {
+        if (checkpoint != path)
+            return;
+        particles = state;
+        if (info)
+            *info = state_info;
+    });
+}
+
+// Rewrites every delta in the chain ending at path that is more than
+// max_chain deltas from a full snapshot as a full snapshot and removes the
+// delta file; the deltas after it then build on the full snapshot. Returns
+// the checkpoints rewritten.
+inline size_t compact_checkpoint(const std::string& path, uint32_t max_chain) {
+    size_t rewritten = 0;
+    size_t since_full = 0;
+
+    walk_checkpoint_chain(path, [&](const std::string& checkpoint, const snapshot_info& info, size_t depth, const particle_set& state) {
+        if (depth == 0 || ++since_full <= max_chain)
+            return;
+
+        const std::string full = checkpoint_path(checkpoint, info.step, "snap");
+        const std::string temporary = full + ".tmp";
+        write_snapshot(temporary, state, info);
+        if (std::rename(temporary.c_str(), full.c_str()) != 0 || std::remove(checkpoint.c_str()) != 0)
+            throw std::runtime_error("cannot write " + full);
+
+        since_full = 0;
+        ++rewritten;
+    });
+    return rewritten;
+}
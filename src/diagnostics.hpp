@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cost_zones.hpp"
+#include "cpu_engine.hpp"
+
+// Conservation diagnostics
+//
+// Every `every` steps conservation_monitor measures the kinetic and the
+// potential energy, the total momentum and the angular momentum about the
+// origin, in double and with parallel reductions over the engine's workers,
+// and keeps them as a time series next to the mean step time since the
+// sample before. The damped Euler update, the precisions and the tree's
+// approximation all trade some of these for speed; the errors against the
+// first sample show how much. Optionally every sample is also appended to a
+// CSV file as it is taken.
+//
+// The potential comes from the engine, cpu_engine::potential_energy(): every
+// pair for the direct engine, a Barnes-Hut walk for the tree engine. Sampled,
+// it is the exact potential at every (n / samples)-th particle scaled up by
+// the mass ratio, O(n samples) whatever the engine.
+
+enum class potential_source {
+    engine,
+    sampled
+};
+
+inline const char* potential_source_name(potential_source source) {
+    return source == potential_source::sampled ? "sampled" : "engine";
+}
+
+inline bool parse_potential_source(const std::string& name, potential_source& source) {
+    if (name == "engine")
+        source = potential_source::engine;
+    else if (name == "sampled")
+        source = potential_source::sampled;
+    else
+        return false;
+    return true;
+}
+
+struct conservation_sample {
+    uint64_t step = 0;
+    double   time = 0.0;
+    double   step_seconds = 0.0;                // mean step time since the sample before
+    double   kinetic = 0.0;
+    double   potential = 0.0;
+    double   momentum[3] = {};
+    double   angular_momentum[3] = {};          // about the origin
+    double   momentum_scale = 0.0;              // sum of m |v|, what momentum errors are relative to
+    double   angular_momentum_scale = 0.0;      // sum of m |r x v|
+    double   seconds = 0.0;                     // what the measurement took
+
+    double total() const { return kinetic + potential; }
+};
+
+class conservation_monitor {
+public:
+    conservation_monitor(uint32_t every, potential_source source = potential_source::engine, uint32_t samples = 1024, const std::string& csv = std::string()) :
+        every_(every),
+        source_(source),
+        samples_((std::max)(1u, samples))
+    {
+        if (csv.empty())
+            return;
+        csv_ = std::fopen(csv.c_str(), "w");
+        if (!csv_)
+            throw std::runtime_error("cannot write " + csv);
+        std::fprintf(csv_, "step,time,step_seconds,kinetic_energy,potential_energy,total_energy,energy_error,"
+            "momentum_x,momentum_y,momentum_z,momentum_error,angular_momentum_x,angular_momentum_y,angular_momentum_z,angular_momentum_error,diagnostics_seconds\n");
+    }
+
+    ~conservation_monitor() {
+        if (csv_)
+            std::fclose(csv_);
+    }
+
+    conservation_monitor(const conservation_monitor&) = delete;
+    conservation_monitor& operator=(const conservation_monitor&) = delete;
+
+    bool due(uint64_t step) const {
+        return every_ > 0 && step % every_ == 0;
+    }
+
+    // the time of every step, for the mean in the next sample
+    void record_step(double seconds) {
+        step_seconds_ += seconds;
+        ++steps_;
+    }
+
+    const conservation_sample& measure(cpu_engine& engine, const particle_set& particles, uint64_t step, double time) {
+        const auto start = std::chrono::steady_clock::now();
+
+        conservation_sample sample = reduce(engine.pool(), particles);
+        sample.step = step;
+        sample.time = time;
+        sample.step_seconds = steps_ ? step_seconds_ / steps_ : 0.0;
+        sample.potential = source_ == potential_source::sampled ? sampled_potential(engine.pool(), particles) : engine.potential_energy(particles);
+        sample.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        step_seconds_ = 0.0;
+        steps_ = 0;
+        series_.push_back(sample);
+
+        if (csv_) {
+            std::fprintf(csv_, "%llu,%.9g,%.9g,%.17g,%.17g,%.17g,%.9g,%.17g,%.17g,%.17g,%.9g,%.17g,%.17g,%.17g,%.9g,%.9g\n",
+                static_cast<unsigned long long>(step), time, sample.step_seconds, sample.kinetic, sample.potential, sample.total(), energy_error(sample),
+                sample.momentum[0], sample.momentum[1], sample.momentum[2], momentum_error(sample),
+                sample.angular_momentum[0], sample.angular_momentum[1], sample.angular_momentum[2], angular_momentum_error(sample), sample.seconds);
+            std::fflush(csv_);
+        }
+        return series_.back();
+    }
+
+    const std::vector<conservation_sample>& series() const {
+        return series_;
+    }
+
+    // |E - E0| / |E0| against the first sample
+    double energy_error(const conservation_sample& sample) const {
+        const double initial = series_.empty() ? sample.total() : series_.front().total();
+        return initial != 0.0 ? std::abs(sample.total() - initial) / std::abs(initial) : 0.0;
+    }
+
+    // |P - P0| relative to the first sample's sum of m |v|
+    double momentum_error(const conservation_sample& sample) const {
+        const conservation_sample& first = series_.empty() ? sample : series_.front();
+        return first.momentum_scale > 0.0 ? distance(sample.momentum, first.momentum) / first.momentum_scale : 0.0;
+    }
+
+    double angular_momentum_error(const conservation_sample& sample) const {
+        const conservation_sample& first = series_.empty() ? sample : series_.front();
+        return first.angular_momentum_scale > 0.0 ? distance(sample.angular_momentum, first.angular_momentum) / first.angular_momentum_scale : 0.0;
+    }
+
+    double max_energy_error() const {
+        double worst = 0.0;
+        for (const conservation_sample& sample : series_)
+            worst = (std::max)(worst, energy_error(sample));
+        return worst;
+    }
+
+private:
+    static double distance(const double (&a)[3], const double (&b)[3]) {
+        return std::sqrt((a[0] - b[0]) * (a[0] - b[0]) + (a[1] - b[1]) * (a[1] - b[1]) + (a[2] - b[2]) * (a[2] - b[2]));
+    }
+
+    // per zone, then over the zones in order, so a thread count gives the same sums every time
+    static conservation_sample reduce(thread_pool& pool, const particle_set& particles) {
+        const std::vector<uint32_t> zones = even_zones(static_cast<uint32_t>(particles.size()), pool.size());
+        std::vector<conservation_sample> sums(pool.size());
+
+        pool.run(pool.size(), [&](uint32_t zone) {
+            conservation_sample& s = sums[zone];
+            for (uint32_t i = zones[zone]; i < zones[zone + 1]; ++i) {
+                const double m = particles.mass[i];
+                const double x = particles.px[i], y = particles.py[i], z = particles.pz[i];
+                const double vx = particles.vx[i], vy = particles.vy[i], vz = particles.vz[i];
+                const double lx = y * vz - z * vy, ly = z * vx - x * vz, lz = x * vy - y * vx;
+
+                s.kinetic += 0.5 * m * (vx * vx + vy * vy + vz * vz);
+                s.momentum[0] += m * vx; s.momentum[1] += m * vy; s.momentum[2] += m * vz;
+                s.angular_momentum[0] += m * lx; s.angular_momentum[1] += m * ly; s.angular_momentum[2] += m * lz;
+                s.momentum_scale += m * std::sqrt(vx * vx + vy * vy + vz * vz);
+                s.angular_momentum_scale += m * std::sqrt(lx * lx + ly * ly + lz * lz);
+            }
+        });
+
+        conservation_sample total;
+        for (const conservation_sample& s : sums) {
+            total.kinetic += s.kinetic;
+            for (int axis = 0; axis < 3; ++axis) {
+                total.momentum[axis] += s.momentum[axis];
+                total.angular_momentum[axis] += s.angular_momentum[axis];
+            }
+            total.momentum_scale += s.momentum_scale;
+            total.angular_momentum_scale += s.angular_momentum_scale;
+        }
+        return total;
+    }
+
+    double sampled_potential(thread_pool& pool, const particle_set& particles) const {
+        const uint32_t count = static_cast<uint32_t>(particles.size());
+        if (count == 0)
+            return 0.0;
+        const uint32_t stride = (std::max)(1u, count / samples_);
+        const uint32_t sampled = (count + stride - 1) / stride;
+        const std::vector<uint32_t> zones = even_zones(sampled, pool.size());
+        std::vector<double> energies(pool.size(), 0.0), masses(pool.size(), 0.0);
+
+        pool.run(pool.size(), [&](uint32_t zone) {
+            for (uint32_t k = zones[zone]; k < zones[zone + 1]; ++k) {
+                const uint32_t i = k * stride;
+                energies[zone] += double(particles.mass[i]) * softened_potential(particles, i, 0, count);
+                masses[zone] += particles.mass[i];
+            }
+        });
+
+        double energy = 0.0, sampled_mass = 0.0, mass = 0.0;
+        for (size_t zone = 0; zone < energies.size(); ++zone) {
+            energy += energies[zone];
+            sampled_mass += masses[zone];
+        }
+        for (float m : particles.mass)
+            mass += m;
+        return sampled_mass > 0.0 ? 0.5 * energy * mass / sampled_mass : 0.0;
+    }
+
+private:
+    const uint32_t                      every_;
+    const potential_source              source_;
+    const uint32_t                      samples_;
+    FILE*                               csv_ = nullptr;
+    std::vector<conservation_sample>    series_;
+    double                              step_seconds_ = 0.0;
+    uint64_t                            steps_ = 0;
+};
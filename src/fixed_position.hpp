@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+#include "simulation.hpp"
+
+// 64-bit fixed-point positions (engine_config::fixed_positions)
+//
+// A float position has 24 bits of mantissa wherever it is, so the further a
+// cluster drifts from the origin the coarser its particles get. With 32.32
+// fixed point the resolution is 2^-32 everywhere within +-2^31 units.
+// The engines then keep particle_set::fx/fy/fz as the master copy and only
+// derive px/py/pz from it for output. Forces are still computed in float, but
+// on offsets that are exact integer differences first, so they are as
+// accurate near the origin as far away from it. The tree takes its Morton
+// keys straight from the integer bits.
+
+constexpr int    fixed_position_fraction_bits = 32;
+constexpr double fixed_position_scale         = 4294967296.0;      // 2^32
+constexpr float  fixed_position_unit          = 1.0f / 4294967296.0f;
+
+inline int64_t to_fixed_position(double value) {
+    return std::llround(value * fixed_position_scale);
+}
+
+inline float from_fixed_position(int64_t value) {
+    return static_cast<float>(value / fixed_position_scale);
+}
+
+// to - from in float, rounded once
+inline float fixed_offset(int64_t to, int64_t from) {
+    return static_cast<float>(to - from) * fixed_position_unit;
+}
+
+inline void load_fixed_positions(particle_set& particles) {
+    const size_t count = particles.size();
+    particles.fx.resize(count);
+    particles.fy.resize(count);
+    particles.fz.resize(count);
+
+    for (size_t i = 0; i < count; ++i) {
+        particles.fx[i] = to_fixed_position(particles.px[i]);
+        particles.fy[i] = to_fixed_position(particles.py[i]);
+        particles.fz[i] = to_fixed_position(particles.pz[i]);
+    }
+}
+
+// re-seeds every fixed-point coordinate whose float copy is no longer the
+// one derived from it, i.e. was written outside the engine since
+inline void sync_fixed_positions(particle_set& particles) {
+    const size_t count = particles.size();
+    for (size_t i = 0; i < count; ++i) {
+        if (particles.px[i] != from_fixed_position(particles.fx[i]))
+            particles.fx[i] = to_fixed_position(particles.px[i]);
+        if (particles.py[i] != from_fixed_position(particles.fy[i]))
+            particles.fy[i] = to_fixed_position(particles.py[i]);
+        if (particles.pz[i] != from_fixed_position(particles.fz[i]))
+            particles.fz[i] = to_fixed_position(particles.pz[i]);
+    }
+}
+
+inline void store_float_positions(particle_set& particles, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+        particles.px[i] = from_fixed_position(particles.fx[i]);
+        particles.py[i] = from_fixed_position(particles.fy[i]);
+        particles.pz[i] = from_fixed_position(particles.fz[i]);
+    }
+}
@@ -0,0 +1,349 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bench_report.hpp"
+#include "cpu_engine.hpp"
+#include "diagnostics.hpp"
+#include "initial_conditions.hpp"
+#include "simulation.hpp"
+
+// Golden trajectories
+//
+// Small canonical systems - a Kepler ellipse, the Chenciner-Montgomery
+// figure eight and a Plummer sphere of 1k particles - run for a fixed number
+// of steps with each integrator on the direct engine in full double on one
+// thread, the most reproducible configuration there is. Blessing stores the
+// state at a few fixed steps as snapshots, and a manifest, golden.json, with
+// the state checksum of each and the largest relative energy error of the
+// run. Checking runs them again and fails if a stored snapshot no longer has
+// its checksum, a state moved away from the stored one by more than the
+// system's tolerance, or the energy error grew by more than a quarter.
+//
+// The Plummer sphere is chaotic: the least change of rounding, e.g. fp64 for
+// double, moves its particles apart within a few crossing times, so it is
+// compared by ensemble quantities - Lagrangian radii and the virial ratio -
+// rather than particle by particle. Its run stops at t = 5, before the first
+// close encounters that the shader's small softening cannot resolve, where
+// the energy error still converges with the time step. None of this covers
+// ComputeShader.hlsl; the engines only share its force law.
+//
+// The systems are in the units of the shader: G and the particle mass are
+// those of gravity::, lengths and times are scaled to fit.
+
+struct golden_system {
+    std::string                             name;
+    std::function<void(particle_set&)>      make;
+    float                                   delta_time;
+    uint32_t                                steps;
+    uint32_t                                every;          // steps between stored states
+    double                                  tolerance;      // largest position and velocity error, relative to the rms radius and speed
+    bool                                    ensemble;       // chaotic: compared by compare_ensembles() rather than compare_states()
+};
+
+// two particles on an ellipse of semi-major axis 10 and eccentricity 0.5,
+// from the apocenter; an orbit takes about 17 time units
+inline void make_kepler(particle_set& particles) {
+    const double a = 10.0, e = 0.5;
+    const double gm = 2.0 * double(gravity::G) * gravity::particle_mass;
+    const double r = a * (1.0 + e);
+    const double v = std::sqrt(gm * (1.0 - e) / r);
+
+    particles = particle_set();
+    particles.resize(2);
+    particles.px[0] = static_cast<float>(-0.5 * r);
+    particles.px[1] = static_cast<float>(0.5 * r);
+    particles.vy[0] = static_cast<float>(-0.5 * v);
+    particles.vy[1] = static_cast<float>(0.5 * v);
+}
+
+// three equal masses chasing each other along a figure eight (Chenciner and
+// Montgomery, 2000), scaled to a length unit of 10; a period takes about 24.5
+inline void make_figure_eight(particle_set& particles) {
+    const double length = 10.0;
+    const double time = std::sqrt(length * length * length / (double(gravity::G) * gravity::particle_mass));
+    const double speed = length / time;
+    const double x1 = 0.97000436, y1 = -0.24308753;
+    const double vx3 = -0.93240737, vy3 = -0.86473146;
+
+    particles = particle_set();
+    particles.resize(3);
+    particles.px[0] = static_cast<float>(x1 * length);
+    particles.py[0] = static_cast<float>(y1 * length);
+    particles.px[1] = static_cast<float>(-x1 * length);
+    particles.py[1] = static_cast<float>(-y1 * length);
+    particles.vx[0] = particles.vx[1] = static_cast<float>(-0.5 * vx3 * speed);
+    particles.vy[0] = particles.vy[1] = static_cast<float>(-0.5 * vy3 * speed);
+    particles.vx[2] = static_cast<float>(vx3 * speed);
+    particles.vy[2] = static_cast<float>(vy3 * speed);
+}
+
+inline std::vector<golden_system> golden_systems() {
+    return {
+        { "kepler",       make_kepler,       0.01f, 2000, 500, 1e-4, false },
+        { "figure-eight", make_figure_eight, 0.01f, 2500, 625, 1e-4, false },
+        { "plummer-1k",   [](particle_set& particles) { make_initial_conditions("plummer", particles, 1000, 400.0, 0, 1); }, 0.01f, 500, 125, 1e-3, true },
+    };
+}
+
+// where a case keeps its state at step, next to the manifest
+inline std::string golden_snapshot_name(const std::string& system, integrator_kind integrator, uint64_t step) {
+    return system + "-" + integrator_name(integrator) + "-" + std::to_string(step) + ".snap";
+}
+
+struct golden_frame {
+    uint64_t     step = 0;
+    std::string  file;          // relative to the manifest
+    uint64_t     checksum = 0;  // state_checksum() of the stored state
+};
+
+struct golden_case {
+    std::string                 system;
+    std::string                 integrator;
+    double                      max_energy_error = 0.0;
+    std::vector<golden_frame>   frames;
+
+    std::string name() const {
+        return system + "/" + integrator;
+    }
+};
+
+// the energy error may grow by this factor, plus float noise, over the
+// blessed run's before check fails
+constexpr double golden_energy_margin = 1.25;
+constexpr double golden_energy_floor = 1e-7;
+
+inline bool golden_energy_accepts(double max_energy_error, double blessed) {
+    return max_energy_error <= blessed * golden_energy_margin + golden_energy_floor;
+}
+
+struct golden_run {
+    std::vector<particle_set>   states;     // every system.every steps
+    std::vector<uint64_t>       steps;
+    double                      max_energy_error = 0.0;
+    double                      seconds = 0.0;
+};
+
+inline golden_run simulate_golden(const golden_system& system, integrator_kind integrator) {
+    engine_config config;
+    config.thread_count = 1;
+    config.integrator = integrator;
+    auto engine = make_engine("direct", config, full_double_accumulator::name);
+
+    particle_set particles;
+    system.make(particles);
+    const compute_data params = make_compute_data(static_cast<uint32_t>(particles.size()), system.delta_time, 1.0f);
+
+    golden_run run;
+    conservation_monitor monitor((std::max)(1u, system.every / 25));
+    monitor.measure(*engine, particles, 0, 0.0);
+
+    const auto start = std::chrono::steady_clock::now();
+    for (uint32_t step = 1; step <= system.steps; ++step) {
+        engine->step(particles, params);
+        if (monitor.due(step))
+            monitor.measure(*engine, particles, step, double(step) * system.delta_time);
+        if (step % system.every == 0) {
+            run.states.push_back(particles);
+            run.steps.push_back(step);
+        }
+    }
+    run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    run.max_energy_error = monitor.max_energy_error();
+    return run;
+}
+
+struct state_difference {
+    double position = 0.0;      // largest |x - x_ref| over the rms radius of the reference
+    double velocity = 0.0;      // largest |v - v_ref| over its rms speed
+};
+
+// particles are matched by id
+inline state_difference compare_states(const particle_set& state, const particle_set& reference) {
+    if (state.size() != reference.size())
+        throw std::runtime_error("golden: " + std::to_string(state.size()) + " particles against " + std::to_string(reference.size()));
+
+    // the reference comes from a file: its ids must be a permutation of
+    // [0, n) too, or particles would pair up wrongly
+    auto positions = [](const particle_set& particles, const char* what) {
+        std::vector<uint32_t> where(particles.size(), UINT32_MAX);
+        if (particles.id.size() != particles.size())
+            throw std::runtime_error(std::string("golden: the ") + what + " has no ids");
+        for (uint32_t i = 0; i < particles.size(); ++i) {
+            const uint32_t id = particles.id[i];
+            if (id >= particles.size() || where[id] != UINT32_MAX)
+                throw std::runtime_error(std::string("golden: the ids of the ") + what + " are not a permutation of 0.." + std::to_string(particles.size() - 1));
+            where[id] = i;
+        }
+        return where;
+    };
+    const std::vector<uint32_t> where = positions(state, "state");
+    positions(reference, "reference");
+
+    double radius = 0.0, speed = 0.0, cx = 0.0, cy = 0.0, cz = 0.0;
+    for (size_t i = 0; i < reference.size(); ++i) {
+        cx += reference.px[i]; cy += reference.py[i]; cz += reference.pz[i];
+    }
+    cx /= reference.size(); cy /= reference.size(); cz /= reference.size();
+    for (size_t i = 0; i < reference.size(); ++i) {
+        const double x = reference.px[i] - cx, y = reference.py[i] - cy, z = reference.pz[i] - cz;
+        radius += x * x + y * y + z * z;
+        speed += double(reference.vx[i]) * reference.vx[i] + double(reference.vy[i]) * reference.vy[i] + double(reference.vz[i]) * reference.vz[i];
+    }
+    radius = std::sqrt(radius / reference.size());
+    speed = std::sqrt(speed / reference.size());
+
+    state_difference difference;
+    for (size_t r = 0; r < reference.size(); ++r) {
+        const uint32_t i = where[reference.id[r]];
+        const double dx = double(state.px[i]) - reference.px[r], dy = double(state.py[i]) - reference.py[r], dz = double(state.pz[i]) - reference.pz[r];
+        const double dvx = double(state.vx[i]) - reference.vx[r], dvy = double(state.vy[i]) - reference.vy[r], dvz = double(state.vz[i]) - reference.vz[r];
+        difference.position = (std::max)(difference.position, std::sqrt(dx * dx + dy * dy + dz * dz) / radius);
+        difference.velocity = (std::max)(difference.velocity, std::sqrt(dvx * dvx + dvy * dvy + dvz * dvz) / speed);
+    }
+    return difference;
+}
+
+// the 10, 50 and 90% Lagrangian radii about the center of mass and the
+// virial ratio 2K / |W| with the softened potential of the engines
+struct ensemble_summary {
+    double radii[3] = {};
+    double virial = 0.0;
+};
+
+inline ensemble_summary summarize_ensemble(const particle_set& particles) {
+    const uint32_t count = static_cast<uint32_t>(particles.size());
+    ensemble_summary summary;
+    if (count == 0)
+        return summary;
+
+    double mass = 0.0, cx = 0.0, cy = 0.0, cz = 0.0;
+    for (uint32_t i = 0; i < count; ++i) {
+        mass += particles.mass[i];
+        cx += double(particles.mass[i]) * particles.px[i];
+        cy += double(particles.mass[i]) * particles.py[i];
+        cz += double(particles.mass[i]) * particles.pz[i];
+    }
+    cx /= mass; cy /= mass; cz /= mass;
+
+    std::vector<std::pair<double, float>> shells(count);
+    double kinetic = 0.0, potential = 0.0;
+    for (uint32_t i = 0; i < count; ++i) {
+        const double x = particles.px[i] - cx, y = particles.py[i] - cy, z = particles.pz[i] - cz;
+        shells[i] = { std::sqrt(x * x + y * y + z * z), particles.mass[i] };
+        kinetic += 0.5 * particles.mass[i] * (double(particles.vx[i]) * particles.vx[i] + double(particles.vy[i]) * particles.vy[i] + double(particles.vz[i]) * particles.vz[i]);
+        potential += 0.5 * particles.mass[i] * softened_potential(particles, i, 0, count);
+    }
+    summary.virial = potential < 0.0 ? 2.0 * kinetic / -potential : 0.0;
+
+    std::sort(shells.begin(), shells.end());
+    const double fractions[3] = { 0.1, 0.5, 0.9 };
+    double enclosed = 0.0;
+    int next = 0;
+    for (uint32_t i = 0; i < count && next < 3; ++i) {
+        enclosed += shells[i].second;
+        while (next < 3 && enclosed >= fractions[next] * mass)
+            summary.radii[next++] = shells[i].first;
+    }
+    return summary;
+}
+
+// position is the largest relative difference of the Lagrangian radii,
+// velocity that of the virial ratio
+inline state_difference compare_ensembles(const particle_set& state, const particle_set& reference) {
+    if (state.size() != reference.size())
+        throw std::runtime_error("golden: " + std::to_string(state.size()) + " particles against " + std::to_string(reference.size()));
+
+    const ensemble_summary current = summarize_ensemble(state);
+    const ensemble_summary blessed = summarize_ensemble(reference);
+    auto relative = [](double value, double base) {
+        return base != 0.0 ? std::fabs(value - base) / std::fabs(base) : std::fabs(value);
+    };
+
+    state_difference difference;
+    for (int r = 0; r < 3; ++r)
+        difference.position = (std::max)(difference.position, relative(current.radii[r], blessed.radii[r]));
+    difference.velocity = relative(current.virial, blessed.virial);
+    return difference;
+}
+
+inline void write_golden_manifest(const std::string& path, const std::vector<golden_case>& cases) {
+    FILE* file = std::fopen(path.c_str(), "w");
+    if (!file)
+        throw std::runtime_error("cannot write " + path);
+
+    std::fprintf(file, "{\n");
+    std::fprintf(file, "  \"schema\": \"nbody-golden/1\",\n");
+    std::fprintf(file, "  \"cases\": [");
+    for (size_t c = 0; c < cases.size(); ++c) {
+        const golden_case& gc = cases[c];
+        std::fprintf(file, "%s\n    {\n", c ? "," : "");
+        std::fprintf(file, "      \"system\": \"%s\",\n", gc.system.c_str());
+        std::fprintf(file, "      \"integrator\": \"%s\",\n", gc.integrator.c_str());
+        std::fprintf(file, "      \"max_energy_error\": %.9g,\n", gc.max_energy_error);
+        std::fprintf(file, "      \"frames\": [");
+        for (size_t f = 0; f < gc.frames.size(); ++f) {
+            // checksums as hex strings, a double would not hold 64 bits
+            std::fprintf(file, "%s\n        { \"step\": %llu, \"file\": \"%s\", \"checksum\": \"%016llx\" }", f ? "," : "",
+                static_cast<unsigned long long>(gc.frames[f].step), gc.frames[f].file.c_str(), static_cast<unsigned long long>(gc.frames[f].checksum));
+        }
+        std::fprintf(file, "\n      ]\n    }");
+    }
+    std::fprintf(file, "\n  ]\n}\n");
+
+    if (std::fclose(file) != 0)
+        throw std::runtime_error("cannot write " + path);
+}
+
+inline std::vector<golden_case> read_golden_manifest(const std::string& path) {
+    FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file)
+        throw std::runtime_error("cannot open " + path);
+    std::string text;
+    char buffer[1 << 16];
+    size_t read;
+    while ((read = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+        text.append(buffer, read);
+    std::fclose(file);
+
+    const json_value root = json_parser(text.data(), text.data() + text.size()).parse();
+    const json_value* schema = root.find("schema");
+    const json_value* cases = root.find("cases");
+    if (!schema || schema->text != "nbody-golden/1" || !cases || cases->kind != json_value::array)
+        throw std::runtime_error("golden: " + path + " is not a golden trajectory manifest");
+
+    std::vector<golden_case> result;
+    for (const json_value& item : cases->items) {
+        golden_case gc;
+        const json_value* system = item.find("system");
+        const json_value* integrator = item.find("integrator");
+        const json_value* energy = item.find("max_energy_error");
+        const json_value* frames = item.find("frames");
+        if (!system || !integrator || !energy || !frames)
+            throw std::runtime_error("golden: a case of " + path + " misses a field");
+        gc.system = system->text;
+        gc.integrator = integrator->text;
+        gc.max_energy_error = energy->value;
+
+        for (const json_value& frame : frames->items) {
+            const json_value* step = frame.find("step");
+            const json_value* name = frame.find("file");
+            const json_value* checksum = frame.find("checksum");
+            if (!step || !name || !checksum)
+                throw std::runtime_error("golden: a frame of " + path + " misses a field");
+            gc.frames.push_back({ static_cast<uint64_t>(step->value), name->text, std::strtoull(checksum->text.c_str(), nullptr, 16) });
+        }
+        result.push_back(gc);
+    }
+    return result;
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "metrics.hpp"
+
+// GPU pass timings from timestamp queries
+//
+// One gpu_timer_ring per queue (timestamps of different queues don't share a
+// clock). It hands out the query indices a frame's begin and end markers are
+// written to, in one of frames slots of 2 * max_passes queries, and the range
+// end_frame() wants resolved into the readback buffer at the same offset.
+// collect() reads the slots whose fence has passed and records every pass
+// into the histogram nbody_gpu_<pass>_seconds of the registry, next to the
+// CPU timings. Nothing ever waits: a slot that comes round again before it
+// was collected is dropped, and its queries reused.
+//
+// The ring only does the bookkeeping; render_system drives it with
+// ID3D12GraphicsCommandList::EndQuery and ResolveQueryData, nbody-bench
+// gpu-timers with a fake queue.
+
+struct gpu_timer_stats {
+    uint64_t frames = 0;
+    uint64_t collected = 0;     // frames whose timings reached the registry
+    uint64_t dropped = 0;       // frames overwritten before they were collected
+};
+
+class gpu_timer_ring {
+public:
+    gpu_timer_ring(metrics_registry& registry, uint32_t frames, uint32_t max_passes, uint64_t ticks_per_second) :
+        registry_(registry),
+        frames_(frames),
+        max_passes_(max_passes),
+        ticks_per_second_(ticks_per_second),
+        slots_(frames)
+    {
+        if (frames == 0 || max_passes == 0 || ticks_per_second == 0)
+            throw std::runtime_error("gpu timers: frames, passes and the timestamp frequency must not be 0");
+        for (slot_t& slot : slots_)
+            slot.used.assign(max_passes, false);
+    }
+
+    // the size of the query heap and, in uint64_t ticks, of the readback buffer
+    uint32_t query_count() const { return frames_ * max_passes_ * 2; }
+
+    // registers a pass; its timings go to nbody_gpu_<name>_seconds
+    uint32_t pass(const std::string& name) {
+        if (histograms_.size() == max_passes_)
+            throw std::runtime_error("gpu timers: more than " + std::to_string(max_passes_) + " passes");
+        histograms_.push_back(&registry_.histogram("nbody_gpu_" + name + "_seconds", "GPU time of the " + name + " pass."));
+        return static_cast<uint32_t>(histograms_.size() - 1);
+    }
+
+    // fence_value is what the queue signals once the frame's work is done
+    void begin_frame(uint64_t fence_value) {
+        slot_t& slot = slots_[current_];
+        if (slot.pending)
+            ++stats_.dropped;
+        slot.fence = fence_value;
+        slot.sequence = ++stats_.frames;
+        slot.pending = false;
+        slot.used.assign(max_passes_, false);
+    }
+
+    // the queries to write the timestamps of pass to
+    uint32_t begin(uint32_t pass) {
+        slots_[current_].used[pass] = true;
+        return base() + 2 * pass;
+    }
+
+    uint32_t end(uint32_t pass) {
+        return base() + 2 * pass + 1;
+    }
+
+    struct resolve_range {
+        uint32_t first;         // query index
+        uint32_t count;         // 0 - nothing to resolve
+        uint64_t offset;        // bytes into the readback buffer
+    };
+
+    resolve_range end_frame() {
+        slot_t& slot = slots_[current_];
+        uint32_t last = 0;
+        for (uint32_t p = 0; p < max_passes_; ++p)
+            if (slot.used[p])
+                last = p + 1;
+
+        const resolve_range range = { base(), 2 * last, uint64_t(base()) * sizeof(uint64_t) };
+        slot.pending = last > 0;
+        current_ = (current_ + 1) % frames_;
+        return range;
+    }
+
+    // records the frames the queue has finished, oldest first; readback is
+    // the mapped readback buffer of query_count() ticks
+    void collect(uint64_t completed_fence, const uint64_t* readback) {
+        for (;;) {
+            slot_t* oldest = nullptr;
+            for (slot_t& slot : slots_)
+                if (slot.pending && slot.fence <= completed_fence && (!oldest || slot.sequence < oldest->sequence))
+                    oldest = &slot;
+            if (!oldest)
+                return;
+
+            const uint32_t first = static_cast<uint32_t>(oldest - slots_.data()) * max_passes_ * 2;
+            for (uint32_t p = 0; p < max_passes_ && p < histograms_.size(); ++p) {
+                if (!oldest->used[p])
+                    continue;
+                const uint64_t begin = readback[first + 2 * p];
+                const uint64_t end = readback[first + 2 * p + 1];
+                if (end >= begin)
+                    histograms_[p]->record_seconds(double(end - begin) / double(ticks_per_second_));
+            }
+            oldest->pending = false;
+            ++stats_.collected;
+        }
+    }
+
+    gpu_timer_stats stats() const { return stats_; }
+
+private:
+    uint32_t base() const { return current_ * max_passes_ * 2; }
+
+    struct slot_t {
+        uint64_t            fence = 0;
+        uint64_t            sequence = 0;
+        bool                pending = false;    // resolved, not collected yet
+        std::vector<bool>   used;
+    };
+
+private:
+    metrics_registry&               registry_;
+    const uint32_t                  frames_;
+    const uint32_t                  max_passes_;
+    const uint64_t                  ticks_per_second_;
+    std::vector<slot_t>             slots_;
+    uint32_t                        current_ = 0;
+    std::vector<latency_histogram*> histograms_;
+    gpu_timer_stats                 stats_;
+};
@@ -0,0 +1,516 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "delta_checkpoint.hpp"
+#include "mapped_file.hpp"
+#include "number_parser.hpp"
+#include "simulation.hpp"
+#include "snapshot.hpp"
+#include "thread_pool.hpp"
+
+// Initial conditions from files
+//
+// load_initial_conditions() reads
+//
+//   - GADGET-2 snapshots (SnapFormat 1 and 2, either byte order, single
+//     file): the positions, velocities and masses of all six particle types,
+//     in type order;
+//   - CSV and whitespace separated text, one particle per line: x y z
+//     [vx vy vz [mass]], or any order given by a header line naming the
+//     columns x, y, z, vx, vy, vz and mass (or m). Lines starting with '#'
+//     are comments;
+//   - our own snapshots (snapshot.hpp) and delta checkpoints, restored
+//     through their chain (delta_checkpoint.hpp).
+//
+// The file is memory-mapped and converted on a thread pool straight into the
+// particle_set columns. Text is split into chunks at line ends, each chunk
+// counts its particles, and after a prefix sum parses them into its slice.
+// Missing velocities are zero, missing masses gravity::particle_mass; the
+// particles are numbered in file order. Only the CPU engines use the masses
+// read: ComputeShader.hlsl and compact storage take gravity::particle_mass
+// for every particle, and render_system warns when a file's masses differ.
+
+enum class ic_format {
+    automatic,  // by content
+    gadget2,
+    csv,
+    snapshot,
+    delta_checkpoint,
+};
+
+struct ic_options {
+    ic_format format          = ic_format::automatic;
+    unsigned  thread_count    = 0;      // 0 - one per hardware thread
+    float     position_scale  = 1.0f;   // file units to simulation units
+    float     velocity_scale  = 1.0f;
+    float     mass_scale      = 1.0f;
+};
+
+// GADGET-2 io_header, 256 bytes
+struct gadget2_header {
+    int32_t  npart[6];
+    double   massarr[6];
+    double   time;
+    double   redshift;
+    int32_t  flag_sfr;
+    int32_t  flag_feedback;
+    uint32_t npart_total[6];
+    int32_t  flag_cooling;
+    int32_t  num_files;
+    double   box_size;
+    double   omega0;
+    double   omega_lambda;
+    double   hubble_param;
+    int32_t  flag_stellarage;
+    int32_t  flag_metals;
+    uint32_t npart_total_high_word[6];
+    int32_t  flag_entropy_instead_u;
+    char     fill[60];
+};
+static_assert(sizeof(gadget2_header) == 256, "the GADGET-2 header is 256 bytes");
+
+constexpr uint64_t ic_chunk_size = 4ull << 20;   // bytes of text per parse task
+
+inline uint32_t byte_swap(uint32_t v) {
+    return (v >> 24) | ((v >> 8) & 0xFF00u) | ((v << 8) & 0xFF0000u) | (v << 24);
+}
+
+inline uint64_t byte_swap(uint64_t v) {
+    return (uint64_t(byte_swap(uint32_t(v))) << 32) | byte_swap(uint32_t(v >> 32));
+}
+
+inline ic_format detect_ic_format(const uint8_t* data, size_t size) {
+    if (size >= sizeof(snapshot_magic) && std::memcmp(data, snapshot_magic, sizeof(snapshot_magic)) == 0)
+        return ic_format::snapshot;
+    if (is_delta_checkpoint(data, size))
+        return ic_format::delta_checkpoint;
+
+    // a GADGET-2 file starts with the record marker of the 256 byte header,
+    // or of the 8 byte block label in SnapFormat 2
+    if (size >= sizeof(uint32_t)) {
+        uint32_t marker;
+        std::memcpy(&marker, data, sizeof(marker));
+        if (marker == 256 || marker == 8 || byte_swap(marker) == 256 || byte_swap(marker) == 8)
+            return ic_format::gadget2;
+    }
+    return ic_format::csv;
+}
+
+// walks the Fortran records of a GADGET-2 file
+class gadget2_reader {
+public:
+    gadget2_reader(const uint8_t* data, size_t size) :
+        data_(data),
+        size_(size)
+    {
+        uint32_t marker = 0;
+        if (size_ >= sizeof(marker))
+            std::memcpy(&marker, data_, sizeof(marker));
+        swapped_ = byte_swap(marker) == 256 || byte_swap(marker) == 8;
+        labelled_ = marker == 8 || byte_swap(marker) == 8;
+    }
+
+    bool swapped() const { return swapped_; }
+
+    // the next block; throws if the file ends or the record markers disagree
+    const uint8_t* next_block(const char* name, uint64_t& size) {
+        // SnapFormat 2 puts a record with the label and the size of the next block in front
+        if (labelled_)
+            record(name, size);
+        return record(name, size);
+    }
+
+private:
+    uint32_t read_marker(const char* name) {
+        if (offset_ + sizeof(uint32_t) > size_)
+            throw std::runtime_error(std::string("gadget2: file ends before the ") + name + " block");
+        uint32_t marker;
+        std::memcpy(&marker, data_ + offset_, sizeof(marker));
+        offset_ += sizeof(marker);
+        return swapped_ ? byte_swap(marker) : marker;
+    }
+
+    const uint8_t* record(const char* name, uint64_t& size) {
+        size = read_marker(name);
+        const uint8_t* block = data_ + offset_;
+        if (offset_ + size > size_)
+            throw std::runtime_error(std::string("gadget2: file ends inside the ") + name + " block");
+        offset_ += size;
+        if (read_marker(name) != size)
+            throw std::runtime_error(std::string("gadget2: broken record around the ") + name + " block");
+        return block;
+    }
+
+private:
+    const uint8_t*  data_;
+    size_t          size_;
+    size_t          offset_ = 0;
+    bool            swapped_ = false;
+    bool            labelled_ = false;
+};
+
+// converts count packed triplets of float or double, byte-swapped if need be, into three columns
+inline void load_gadget2_vectors(const uint8_t* block, uint64_t block_size, size_t count, bool swapped, thread_pool& pool,
+                                 std::vector<float>& x, std::vector<float>& y, std::vector<float>& z, const char* name) {
+    const bool wide = block_size == count * 3 * sizeof(double);
+    if (!wide && block_size != count * 3 * sizeof(float))
+        throw std::runtime_error(std::string("gadget2: the ") + name + " block does not hold 3 floats per particle");
+
+    const size_t chunk = 1 << 16;
+    pool.run(static_cast<uint32_t>((count + chunk - 1) / chunk), [&](uint32_t task) {
+        const size_t begin = task * chunk;
+        const size_t end = (std::min)(begin + chunk, count);
+
+        for (size_t i = begin; i < end; ++i) {
+            float v[3];
+            for (int k = 0; k < 3; ++k) {
+                if (wide) {
+                    uint64_t bits;
+                    std::memcpy(&bits, block + (i * 3 + k) * sizeof(double), sizeof(bits));
+                    bits = swapped ? byte_swap(bits) : bits;
+                    double value;
+                    std::memcpy(&value, &bits, sizeof(value));
+                    v[k] = static_cast<float>(value);
+                }
+                else {
+                    uint32_t bits;
+                    std::memcpy(&bits, block + (i * 3 + k) * sizeof(float), sizeof(bits));
+                    bits = swapped ? byte_swap(bits) : bits;
+                    std::memcpy(&v[k], &bits, sizeof(float));
+                }
+            }
+            x[i] = v[0];
+            y[i] = v[1];
+            z[i] = v[2];
+        }
+    });
+}
+
+inline void load_gadget2(const uint8_t* data, size_t size, particle_set& particles, thread_pool& pool) {
+    gadget2_reader reader(data, size);
+
+    uint64_t block_size;
+    const uint8_t* block = reader.next_block("HEAD", block_size);
+    if (block_size != sizeof(gadget2_header))
+        throw std::runtime_error("gadget2: the header is not 256 bytes");
+
+    gadget2_header header;
+    std::memcpy(&header, block, sizeof(header));
+    if (reader.swapped()) {
+        for (int t = 0; t < 6; ++t) {
+            header.npart[t] = static_cast<int32_t>(byte_swap(static_cast<uint32_t>(header.npart[t])));
+            uint64_t bits;
+            std::memcpy(&bits, &header.massarr[t], sizeof(bits));
+            bits = byte_swap(bits);
+            std::memcpy(&header.massarr[t], &bits, sizeof(bits));
+        }
+        header.num_files = static_cast<int32_t>(byte_swap(static_cast<uint32_t>(header.num_files)));
+    }
+
+    if (header.num_files > 1)
+        throw std::runtime_error("gadget2: snapshots split over several files are not supported");
+
+    size_t count = 0;
+    size_t with_mass = 0;   // particles whose mass is in the MASS block
+    for (int t = 0; t < 6; ++t) {
+        if (header.npart[t] < 0)
+            throw std::runtime_error("gadget2: negative particle count");
+        count += static_cast<size_t>(header.npart[t]);
+        if (header.massarr[t] == 0.0)
+            with_mass += static_cast<size_t>(header.npart[t]);
+    }
+
+    particles.id.clear();
+    particles.resize(count);
+    particles.fx.clear();
+    particles.fy.clear();
+    particles.fz.clear();
+    std::fill(particles.acceleration.begin(), particles.acceleration.end(), 0.0f);
+
+    block = reader.next_block("POS", block_size);
+    load_gadget2_vectors(block, block_size, count, reader.swapped(), pool, particles.px, particles.py, particles.pz, "POS");
+
+    block = reader.next_block("VEL", block_size);
+    load_gadget2_vectors(block, block_size, count, reader.swapped(), pool, particles.vx, particles.vy, particles.vz, "VEL");
+
+    // the IDs are not needed, particles are numbered in file order
+    reader.next_block("ID", block_size);
+
+    const uint8_t* masses = nullptr;
+    bool wide = false;
+    if (with_mass > 0) {
+        masses = reader.next_block("MASS", block_size);
+        wide = block_size == with_mass * sizeof(double);
+        if (!wide && block_size != with_mass * sizeof(float))
+            throw std::runtime_error("gadget2: the MASS block does not hold a mass per particle");
+    }
+
+    size_t first = 0;
+    size_t listed = 0;
+    for (int t = 0; t < 6; ++t) {
+        const size_t n = static_cast<size_t>(header.npart[t]);
+        for (size_t i = first; i < first + n; ++i) {
+            if (header.massarr[t] != 0.0) {
+                particles.mass[i] = static_cast<float>(header.massarr[t]);
+                continue;
+            }
+
+            if (wide) {
+                uint64_t bits;
+                std::memcpy(&bits, masses + listed++ * sizeof(double), sizeof(bits));
+                bits = reader.swapped() ? byte_swap(bits) : bits;
+                double value;
+                std::memcpy(&value, &bits, sizeof(value));
+                particles.mass[i] = static_cast<float>(value);
+            }
+            else {
+                uint32_t bits;
+                std::memcpy(&bits, masses + listed++ * sizeof(float), sizeof(bits));
+                bits = reader.swapped() ? byte_swap(bits) : bits;
+                std::memcpy(&particles.mass[i], &bits, sizeof(float));
+            }
+        }
+        first += n;
+    }
+}
+
+enum ic_column : int {
+    ic_x, ic_y, ic_z, ic_vx, ic_vy, ic_vz, ic_mass,
+    ic_column_count,
+    ic_ignored = -1,
+};
+
+inline bool is_ic_separator(char c) {
+    return c == ',' || c == ';' || c == ' ' || c == '\t' || c == '\r';
+}
+
+// skips separators; a comma or semicolon ends at most one field
+inline const char* skip_ic_separators(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        ++p;
+    if (p < end && (*p == ',' || *p == ';'))
+        ++p;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        ++p;
+    return p;
+}
+
+// a line with nothing to parse
+inline bool is_ic_blank(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        ++p;
+    return p == end || *p == '\n' || *p == '#';
+}
+
+// the column layout from a header line, or false if line holds numbers
+inline bool parse_ic_header(const char* p, const char* end, std::vector<int>& columns) {
+    double value;
+    if (parse_number(p, end, value))
+        return false;
+
+    static const char* const names[] = { "x", "y", "z", "vx", "vy", "vz", "mass" };
+    columns.clear();
+    while (p < end && *p != '\n') {
+        const char* name = p;
+        while (p < end && *p != '\n' && !is_ic_separator(*p))
+            ++p;
+
+        std::string field(name, p);
+        std::transform(field.begin(), field.end(), field.begin(), [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+        if (field == "m")
+            field = "mass";
+
+        int column = ic_ignored;
+        for (int k = 0; k < ic_column_count; ++k)
+            if (field == names[k])
+                column = k;
+        columns.push_back(column);
+
+        p = skip_ic_separators(p, end);
+    }
+    return true;
+}
+
+inline void load_csv(const char* data, size_t size, particle_set& particles, thread_pool& pool) {
+    const char* const end = data + size;
+
+    // the header, or the first data line, fixes the columns
+    const char* body = data;
+    while (body < end && is_ic_blank(body, end))
+        body = next_line(body, end);
+
+    std::vector<int> columns;
+    if (body < end && parse_ic_header(body, find_newline(body, end), columns)) {
+        body = next_line(body, end);
+        for (int required : { ic_x, ic_y, ic_z })
+            if (std::find(columns.begin(), columns.end(), required) == columns.end())
+                throw std::runtime_error("csv: the header names no x, y or z column");
+    }
+    else {
+        // positional: x y z [vx vy vz [mass]]
+        size_t fields = 0;
+        double value;
+        for (const char* p = body; p < end && *p != '\n' && *p != '#'; p = skip_ic_separators(p, end)) {
+            p = parse_number(p, end, value);
+            if (!p)
+                break;
+            ++fields;
+        }
+        if (fields < 3)
+            throw std::runtime_error("csv: a line needs at least x, y and z");
+        for (size_t k = 0; k < fields; ++k)
+            columns.push_back(k < ic_column_count && (fields >= 6 || k < 3) ? static_cast<int>(k) : ic_ignored);
+    }
+
+    bool has_velocity = false;
+    bool has_mass = false;
+    for (int column : columns) {
+        has_velocity = has_velocity || column == ic_vx || column == ic_vy || column == ic_vz;
+        has_mass = has_mass || column == ic_mass;
+    }
+
+    // chunks start at line starts
+    std::vector<const char*> starts;
+    for (const char* p = body; p < end; ) {
+        starts.push_back(p);
+        p = p + ic_chunk_size < end ? next_line(p + ic_chunk_size, end) : end;
+    }
+    const uint32_t chunk_count = static_cast<uint32_t>(starts.size());
+    starts.push_back(end);
+
+    std::vector<size_t> counts(chunk_count + 1, 0);
+    pool.run(chunk_count, [&](uint32_t chunk) {
+        size_t n = 0;
+        for (const char* p = starts[chunk]; p < starts[chunk + 1]; p = next_line(p, end))
+            n += !is_ic_blank(p, end);
+        counts[chunk + 1] = n;
+    });
+    for (uint32_t chunk = 0; chunk < chunk_count; ++chunk)
+        counts[chunk + 1] += counts[chunk];
+
+    particles.id.clear();
+    particles.resize(counts[chunk_count]);
+    particles.fx.clear();
+    particles.fy.clear();
+    particles.fz.clear();
+    std::fill(particles.acceleration.begin(), particles.acceleration.end(), 0.0f);
+    if (!has_velocity) {
+        std::fill(particles.vx.begin(), particles.vx.end(), 0.0f);
+        std::fill(particles.vy.begin(), particles.vy.end(), 0.0f);
+        std::fill(particles.vz.begin(), particles.vz.end(), 0.0f);
+    }
+    if (!has_mass)
+        std::fill(particles.mass.begin(), particles.mass.end(), gravity::particle_mass);
+
+    std::vector<float>* targets[ic_column_count] = {
+        &particles.px, &particles.py, &particles.pz,
+        &particles.vx, &particles.vy, &particles.vz, &particles.mass,
+    };
+
+    // the first bad line of each chunk
+    std::vector<const char*> errors(chunk_count, nullptr);
+
+    pool.run(chunk_count, [&](uint32_t chunk) {
+        size_t i = counts[chunk];
+        for (const char* p = starts[chunk]; p < starts[chunk + 1]; p = next_line(p, end)) {
+            if (is_ic_blank(p, end))
+                continue;
+
+            const char* line = p;
+            const char* q = skip_ic_separators(p, end);
+            for (int column : columns) {
+                double value;
+                q = q < end && *q != '\n' ? parse_number(q, end, value) : nullptr;
+                if (!q)
+                    break;
+                if (column != ic_ignored)
+                    (*targets[column])[i] = static_cast<float>(value);
+                q = skip_ic_separators(q, end);
+            }
+
+            if (!q) {
+                errors[chunk] = line;
+                return;
+            }
+            ++i;
+        }
+    });
+
+    for (const char* error : errors) {
+        if (error) {
+            const size_t line = 1 + static_cast<size_t>(std::count(data, error, '\n'));
+            throw std::runtime_error("csv: cannot parse line " + std::to_string(line));
+        }
+    }
+}
+
+// applies the unit scales of options in place
+inline void scale_initial_conditions(particle_set& particles, const ic_options& options, thread_pool& pool) {
+    if (options.position_scale == 1.0f && options.velocity_scale == 1.0f && options.mass_scale == 1.0f)
+        return;
+
+    const size_t count = particles.size();
+    const size_t chunk = 1 << 16;
+    pool.run(static_cast<uint32_t>((count + chunk - 1) / chunk), [&](uint32_t task) {
+        const size_t begin = task * chunk;
+        const size_t end = (std::min)(begin + chunk, count);
+        for (size_t i = begin; i < end; ++i) {
+            particles.px[i] *= options.position_scale;
+            particles.py[i] *= options.position_scale;
+            particles.pz[i] *= options.position_scale;
+            particles.vx[i] *= options.velocity_scale;
+            particles.vy[i] *= options.velocity_scale;
+            particles.vz[i] *= options.velocity_scale;
+            particles.mass[i] *= options.mass_scale;
+        }
+    });
+}
+
+// replaces particles with the contents of path
+inline void load_initial_conditions(const std::string& path, particle_set& particles, const ic_options& options = {}) {
+    mapped_file file(path);
+    file.advise_sequential(0, file.size());
+
+    ic_format format = options.format;
+    if (format == ic_format::automatic)
+        format = detect_ic_format(file.data(), file.size());
+
+    thread_pool pool(options.thread_count);
+    try {
+        switch (format) {
+        case ic_format::snapshot:
+            load_snapshot(snapshot_view(file.data(), file.size()), particles);
+            particles.fx.clear();
+            particles.fy.clear();
+            particles.fz.clear();
+            break;
+        case ic_format::delta_checkpoint:
+            restore_checkpoint(path, particles);
+            particles.fx.clear();
+            particles.fy.clear();
+            particles.fz.clear();
+            break;
+        case ic_format::gadget2:
+            load_gadget2(file.data(), file.size(), particles, pool);
+            break;
+        default:
+            load_csv(reinterpret_cast<const char*>(file.data()), file.size(), particles, pool);
+            break;
+        }
+    }
+    catch (const std::runtime_error& error) {
+        throw std::runtime_error(path + ": " + error.what());
+    }
+
+    if (particles.size() == 0)
+        throw std::runtime_error(path + ": no particles");
+
+    scale_initial_conditions(particles, options, pool);
+}
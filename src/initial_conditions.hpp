@@ -0,0 +1,383 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+
+#include "philox.hpp"
+#include "simulation.hpp"
+#include "thread_pool.hpp"
+
+// Initial-condition generators
+//
+// Every particle draws its numbers from its own philox_stream keyed by the
+// seed and its index, so the output is the same at any thread count and on
+// any platform. Particles are generated in parallel chunks.
+//
+// Lengths and velocities are in simulation units, G is gravity::G. A total
+// mass of 0 means gravity::particle_mass per particle, the mass the compute
+// shader assumes; all particles of a model weigh the same. Models are built
+// centred on the origin and at rest, and placed with offset_particles().
+
+constexpr double ic_two_pi = 6.283185307179586;
+
+// random number purposes, the third counter word
+enum ic_purpose : uint32_t {
+    ic_purpose_position,
+    ic_purpose_velocity,
+};
+
+struct plummer_config {
+    double mass = 0.0;
+    double scale_radius = 100.0;
+    double truncation = 0.999;      // largest enclosed mass fraction sampled
+};
+
+// Hernquist (1990) halo
+struct hernquist_config {
+    double mass = 0.0;
+    double scale_radius = 100.0;
+    double truncation = 0.99;
+
+    // mass of a component the halo holds, e.g. a disk; deepens the potential
+    // as if it followed the halo profile
+    double embedded_mass = 0.0;
+};
+
+// exponential in radius, sech^2 in height, rotating about z
+struct disk_config {
+    double mass = 0.0;
+    double scale_length = 100.0;
+    double scale_height = 10.0;
+    double radial_dispersion = 0.1;     // of the circular velocity
+    double truncation = 0.999;
+
+    // mass of a Hernquist halo the disk sits in, only for the rotation curve
+    double halo_mass = 0.0;
+    double halo_scale_radius = 200.0;
+};
+
+// a disk in a Hernquist halo, both made of particles; the disk and halo
+// masses only count as their sum, split by halo_fraction
+struct galaxy_config {
+    disk_config         disk;
+    hernquist_config    halo;
+    double              halo_fraction = 0.8;    // of the mass and of the particles
+};
+
+// two galaxies on a Keplerian orbit in the xy plane, the second mass_ratio times the first
+struct merger_config {
+    galaxy_config   galaxy;                     // the first galaxy
+    double          mass_ratio = 1.0;           // lengths scale with its cube root
+    double          separation = 1000.0;
+    double          pericenter = 200.0;
+    double          eccentricity = 1.0;         // 1 - parabolic
+    double          inclination[2] = { 0.0, 1.0 };  // radians, of each disk about the x axis
+};
+
+inline double ic_total_mass(double mass, uint32_t count) {
+    return mass > 0.0 ? mass : double(count) * gravity::particle_mass;
+}
+
+// runs generate(index) for particles [first, first + count) in parallel chunks
+template<class F>
+inline void generate_particles(particle_set& particles, uint32_t first, uint32_t count, thread_pool& pool, F generate) {
+    if (particles.size() < size_t(first) + count)
+        particles.resize(size_t(first) + count);
+
+    const uint32_t chunk = 1 << 14;
+    pool.run((count + chunk - 1) / chunk, [&](uint32_t task) {
+        const uint32_t begin = first + task * chunk;
+        const uint32_t end = first + (std::min)(count, (task + 1) * chunk);
+        for (uint32_t i = begin; i < end; ++i) {
+            generate(i);
+            particles.acceleration[i] = 0.0f;
+        }
+    });
+}
+
+inline void set_particle(particle_set& particles, uint32_t i, double x, double y, double z, double vx, double vy, double vz, double mass) {
+    particles.px[i] = static_cast<float>(x);
+    particles.py[i] = static_cast<float>(y);
+    particles.pz[i] = static_cast<float>(z);
+    particles.vx[i] = static_cast<float>(vx);
+    particles.vy[i] = static_cast<float>(vy);
+    particles.vz[i] = static_cast<float>(vz);
+    particles.mass[i] = static_cast<float>(mass);
+}
+
+// a uniformly filled sphere moving at (vx, vy, vz)
+inline void make_uniform_sphere(particle_set& particles, uint32_t first, uint32_t count, double radius,
+                                double vx, double vy, double vz, uint64_t seed, thread_pool& pool) {
+    generate_particles(particles, first, count, pool, [&](uint32_t i) {
+        philox_stream random(seed, i, ic_purpose_position);
+        const double r = radius * std::cbrt(random.uniform());
+        double x, y, z;
+        random.direction(x, y, z);
+        set_particle(particles, i, r * x, r * y, r * z, vx, vy, vz, gravity::particle_mass);
+    });
+}
+
+// Plummer sphere, velocities from the distribution function by rejection
+// (Aarseth, Henon and Wielen 1974)
+inline void make_plummer(particle_set& particles, uint32_t first, uint32_t count, const plummer_config& config, uint64_t seed, thread_pool& pool) {
+    const double mass = ic_total_mass(config.mass, count);
+    const double a = config.scale_radius;
+
+    generate_particles(particles, first, count, pool, [&](uint32_t i) {
+        philox_stream random(seed, i, ic_purpose_position);
+        const double m = random.uniform() * config.truncation;
+        const double r = a / std::sqrt(std::pow(m, -2.0 / 3.0) - 1.0);
+        double x, y, z;
+        random.direction(x, y, z);
+
+        // q = v / v_escape with density q^2 (1 - q^2)^3.5
+        philox_stream velocity(seed, i, ic_purpose_velocity);
+        double q, g;
+        do {
+            q = velocity.uniform();
+            g = 0.1 * velocity.uniform();
+        } while (g > q * q * std::pow(1.0 - q * q, 3.5));
+
+        const double speed = q * std::sqrt(2.0 * gravity::G * mass / std::sqrt(r * r + a * a));
+        double ux, uy, uz;
+        velocity.direction(ux, uy, uz);
+
+        set_particle(particles, i, r * x, r * y, r * z, speed * ux, speed * uy, speed * uz, mass / count);
+    });
+}
+
+// isotropic radial velocity dispersion squared of a Hernquist halo (Hernquist 1990, eq. 10)
+inline double hernquist_dispersion_squared(double r, double mass, double a) {
+    const double x = r / a;
+    const double bracket = 12.0 * x * std::pow(1.0 + x, 3.0) * std::log1p(1.0 / x)
+                         - x / (1.0 + x) * (25.0 + 52.0 * x + 42.0 * x * x + 12.0 * x * x * x);
+    return (std::max)(gravity::G * mass / (12.0 * a) * bracket, 0.0);
+}
+
+// Hernquist halo, velocities Gaussian with the local isotropic dispersion
+// below the escape speed
+inline void make_hernquist(particle_set& particles, uint32_t first, uint32_t count, const hernquist_config& config, uint64_t seed, thread_pool& pool) {
+    const double mass = ic_total_mass(config.mass, count);
+    const double a = config.scale_radius;
+
+    generate_particles(particles, first, count, pool, [&](uint32_t i) {
+        philox_stream random(seed, i, ic_purpose_position);
+        const double s = std::sqrt(random.uniform() * config.truncation);
+        const double r = a * s / (1.0 - s);
+        double x, y, z;
+        random.direction(x, y, z);
+
+        philox_stream velocity(seed, i, ic_purpose_velocity);
+        const double potential_mass = mass + config.embedded_mass;
+        const double sigma = std::sqrt(hernquist_dispersion_squared(r, potential_mass, a));
+        const double escape_squared = 2.0 * gravity::G * potential_mass / (r + a);
+        double vx, vy, vz;
+        do {
+            vx = sigma * velocity.normal();
+            vy = sigma * velocity.normal();
+            vz = sigma * velocity.normal();
+        } while (vx * vx + vy * vy + vz * vz >= escape_squared);
+
+        set_particle(particles, i, r * x, r * y, r * z, vx, vy, vz, mass / count);
+    });
+}
+
+// Exponential disk. The rotation curve takes the disk mass inside R as if it
+// were spherical, plus the halo; the vertical dispersion is that of an
+// isothermal sheet, sigma_z^2 = pi G Sigma(R) z0.
+inline void make_exponential_disk(particle_set& particles, uint32_t first, uint32_t count, const disk_config& config, uint64_t seed, thread_pool& pool) {
+    const double mass = ic_total_mass(config.mass, count);
+    const double length = config.scale_length;
+    const double height = config.scale_height;
+
+    generate_particles(particles, first, count, pool, [&](uint32_t i) {
+        philox_stream random(seed, i, ic_purpose_position);
+
+        // invert M(<R) / M = 1 - (1 + x) e^-x by Newton's method
+        const double m = random.uniform() * config.truncation;
+        double x = 1.0 + 2.0 * m;
+        for (int iteration = 0; iteration < 32; ++iteration) {
+            const double f = 1.0 - (1.0 + x) * std::exp(-x) - m;
+            const double step = f / (x * std::exp(-x));
+            x = (std::max)(x - step, 0.5 * x);
+            if (std::fabs(step) < 1e-12 * x)
+                break;
+        }
+
+        const double radius = x * length;
+        const double phi = ic_two_pi * random.uniform();
+        const double z = height * std::atanh(random.uniform(-1.0, 1.0));
+        const double cx = std::cos(phi), sy = std::sin(phi);
+
+        // circular velocity from the mass inside R
+        const double enclosed = mass * (1.0 - (1.0 + x) * std::exp(-x))
+                              + config.halo_mass * radius * radius / ((radius + config.halo_scale_radius) * (radius + config.halo_scale_radius));
+        const double circular = std::sqrt(gravity::G * enclosed / radius);
+
+        philox_stream velocity(seed, i, ic_purpose_velocity);
+        const double surface_density = mass / (ic_two_pi * length * length) * std::exp(-x);
+        const double sigma_z = std::sqrt(0.5 * ic_two_pi * gravity::G * surface_density * height);
+        const double sigma_r = config.radial_dispersion * circular;
+
+        const double v_radial = sigma_r * velocity.normal();
+        const double v_tangential = circular + sigma_r * velocity.normal();
+        const double v_z = sigma_z * velocity.normal();
+
+        set_particle(particles, i, radius * cx, radius * sy, z,
+            v_radial * cx - v_tangential * sy, v_radial * sy + v_tangential * cx, v_z, mass / count);
+    });
+}
+
+// a disk in a halo: the first particles are the disk, the rest the halo
+inline void make_galaxy(particle_set& particles, uint32_t first, uint32_t count, const galaxy_config& config, uint64_t seed, thread_pool& pool) {
+    const uint32_t halo_count = static_cast<uint32_t>(std::lround(count * config.halo_fraction));
+    const uint32_t disk_count = count - halo_count;
+    const double mass = ic_total_mass(config.disk.mass + config.halo.mass, count);
+
+    hernquist_config halo = config.halo;
+    halo.mass = mass * halo_count / count;
+    disk_config disk = config.disk;
+    disk.mass = mass * disk_count / count;
+    disk.halo_mass = halo_count > 0 ? halo.mass : 0.0;
+    disk.halo_scale_radius = halo.scale_radius;
+    halo.embedded_mass = disk.mass;
+
+    make_exponential_disk(particles, first, disk_count, disk, seed, pool);
+    if (halo_count > 0)
+        make_hernquist(particles, first + disk_count, halo_count, halo, seed, pool);
+}
+
+// moves particles [first, first + count) by a position and a velocity
+inline void offset_particles(particle_set& particles, uint32_t first, uint32_t count,
+                             double x, double y, double z, double vx, double vy, double vz) {
+    for (uint32_t i = first; i < first + count; ++i) {
+        particles.px[i] += static_cast<float>(x);
+        particles.py[i] += static_cast<float>(y);
+        particles.pz[i] += static_cast<float>(z);
+        particles.vx[i] += static_cast<float>(vx);
+        particles.vy[i] += static_cast<float>(vy);
+        particles.vz[i] += static_cast<float>(vz);
+    }
+}
+
+// rotates particles [first, first + count) by angle about the x axis
+inline void incline_particles(particle_set& particles, uint32_t first, uint32_t count, double angle) {
+    const float c = static_cast<float>(std::cos(angle));
+    const float s = static_cast<float>(std::sin(angle));
+    for (uint32_t i = first; i < first + count; ++i) {
+        const float y = particles.py[i], z = particles.pz[i];
+        particles.py[i] = c * y - s * z;
+        particles.pz[i] = s * y + c * z;
+        const float vy = particles.vy[i], vz = particles.vz[i];
+        particles.vy[i] = c * vy - s * vz;
+        particles.vz[i] = s * vy + c * vz;
+    }
+}
+
+// two galaxies approaching on a Keplerian orbit, the centre of mass at rest in the origin
+inline void make_merger(particle_set& particles, uint32_t count, const merger_config& config, uint64_t seed, thread_pool& pool) {
+    const uint32_t second = static_cast<uint32_t>(std::lround(count * config.mass_ratio / (1.0 + config.mass_ratio)));
+    const uint32_t first = count - second;
+    particles.resize(count);
+
+    const double galaxy_mass = config.galaxy.disk.mass + config.galaxy.halo.mass;
+    const double total = galaxy_mass > 0.0 ? galaxy_mass * (1.0 + config.mass_ratio) : ic_total_mass(0.0, count);
+
+    // equal particle masses throughout, the smaller galaxy is also smaller in size
+    galaxy_config galaxies[2] = { config.galaxy, config.galaxy };
+    const uint32_t counts[2] = { first, second };
+    const double scale = std::cbrt(config.mass_ratio);
+    galaxies[1].disk.scale_length *= scale;
+    galaxies[1].disk.scale_height *= scale;
+    galaxies[1].halo.scale_radius *= scale;
+
+    for (int g = 0; g < 2; ++g) {
+        galaxies[g].disk.mass = total * counts[g] / count;
+        galaxies[g].halo.mass = 0.0;
+    }
+
+    make_galaxy(particles, 0, first, galaxies[0], seed, pool);
+    make_galaxy(particles, first, second, galaxies[1], seed, pool);
+    incline_particles(particles, 0, first, config.inclination[0]);
+    incline_particles(particles, first, second, config.inclination[1]);
+
+    // relative orbit: h^2 = G M rp (1 + e), v^2 = G M (2 / r - (1 - e) / rp)
+    const double mu = gravity::G * total;
+    const double r = config.separation;
+    const double h = std::sqrt(mu * config.pericenter * (1.0 + config.eccentricity));
+    const double speed_squared = mu * (2.0 / r - (1.0 - config.eccentricity) / config.pericenter);
+    const double v_tangential = h / r;
+    const double v_radial = -std::sqrt((std::max)(speed_squared - v_tangential * v_tangential, 0.0));   // approaching
+
+    // split about the centre of mass
+    const double share = double(second) / count;
+    offset_particles(particles, 0, first, -share * r, 0.0, 0.0, -share * v_radial, -share * v_tangential, 0.0);
+    offset_particles(particles, first, second, (1.0 - share) * r, 0.0, 0.0, (1.0 - share) * v_radial, (1.0 - share) * v_tangential, 0.0);
+}
+
+// the two colliding clusters of render_system::create_particles_buffer
+inline void make_two_clusters(particle_set& particles, uint32_t count, float spread, uint64_t seed, thread_pool& pool) {
+    particles.resize(count);
+
+    const double center_spread = spread * 0.5;
+    make_uniform_sphere(particles, 0, count / 2, spread, 0.0, 0.0, -20.0, seed, pool);
+    make_uniform_sphere(particles, count / 2, count - count / 2, spread, 0.0, 0.0, 20.0, seed, pool);
+    offset_particles(particles, 0, count / 2, center_spread, 0.0, 0.0, 0.0, 0.0, 0.0);
+    offset_particles(particles, count / 2, count - count / 2, -center_spread, 0.0, 0.0, 0.0, 0.0, 0.0);
+}
+
+inline void make_two_clusters(particle_set& particles, uint32_t count, float spread = 400.0f, uint64_t seed = 0, unsigned thread_count = 0) {
+    thread_pool pool(thread_count);
+    particles.id.clear();
+    make_two_clusters(particles, count, spread, seed, pool);
+}
+
+// the models by name, sized by a characteristic radius: "two-clusters",
+// "plummer", "hernquist", "disk", "galaxy" or "merger"; false for an unknown name
+inline bool make_initial_conditions(const std::string& model, particle_set& particles, uint32_t count, double radius = 400.0,
+                                    uint64_t seed = 0, unsigned thread_count = 0) {
+    thread_pool pool(thread_count);
+    particles.id.clear();
+    particles.resize(count);
+
+    if (model == "two-clusters") {
+        make_two_clusters(particles, count, static_cast<float>(radius), seed, pool);
+    }
+    else if (model == "plummer") {
+        plummer_config config;
+        config.scale_radius = radius / 4.0;
+        make_plummer(particles, 0, count, config, seed, pool);
+    }
+    else if (model == "hernquist") {
+        hernquist_config config;
+        config.scale_radius = radius / 4.0;
+        make_hernquist(particles, 0, count, config, seed, pool);
+    }
+    else if (model == "disk") {
+        disk_config config;
+        config.scale_length = radius / 4.0;
+        config.scale_height = radius / 40.0;
+        make_exponential_disk(particles, 0, count, config, seed, pool);
+    }
+    else if (model == "galaxy" || model == "merger") {
+        galaxy_config galaxy;
+        galaxy.disk.scale_length = radius / 8.0;
+        galaxy.disk.scale_height = radius / 80.0;
+        galaxy.halo.scale_radius = radius / 4.0;
+
+        if (model == "galaxy")
+            make_galaxy(particles, 0, count, galaxy, seed, pool);
+        else {
+            merger_config config;
+            config.galaxy = galaxy;
+            config.separation = 2.5 * radius;
+            config.pericenter = 0.5 * radius;
+            make_merger(particles, count, config, seed, pool);
+        }
+    }
+    else
+        return false;
+    return true;
+}
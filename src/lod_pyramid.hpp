@@ -0,0 +1,406 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "morton.hpp"
+#include "simulation.hpp"
+#include "snapshot.hpp"
+
+// Level-of-detail pyramids for viewing large snapshots
+//
+// Level l of a pyramid holds one aggregated point per occupied cell of an
+// octree of depth l over the bounding cube: level 0 is a single point for
+// the whole system, every level down has up to eight times as many. A point
+// carries the total mass of its particles and their mass-weighted position,
+// velocity and |a| - the value the shaders color by - plus the rms distance
+// of the particles from it, for the splat size.
+//
+// lod_builder takes the particles in batches, so a snapshot of any size is
+// aggregated in memory proportional to the occupied cells of the finest
+// level, and builds the coarser levels from the finer ones. The pyramid file
+// stores the levels coarse to fine, each in Morton order and on a 64-byte
+// boundary; lod_file maps it, and a viewer reads only the levels the camera
+// needs:
+//
+//   header          512 bytes, see lod_header
+//   levels          lod_point x count of each level
+
+constexpr char     lod_magic[8]      = { 'N', 'B', 'O', 'D', 'Y', 'L', 'O', 'D' };
+constexpr uint32_t lod_version       = 1;
+constexpr uint32_t lod_max_levels    = 20;
+
+struct lod_point {
+    float    position[3];   // center of mass
+    float    mass;
+    float    velocity[3];   // mass-weighted
+    float    acceleration;  // mass-weighted |a|
+    float    radius;        // rms distance of the particles from position
+    uint32_t count;         // particles aggregated
+};
+
+struct lod_level_entry {
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct lod_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t level_count;
+    uint64_t particle_count;
+    double   total_mass;
+    float    bounds_min[3];
+    float    bounds_size;
+    lod_level_entry levels[lod_max_levels];
+    uint8_t  reserved[144];
+};
+
+static_assert(sizeof(lod_point) == 40, "lod points are 40 bytes");
+static_assert(sizeof(lod_header) == 512, "the lod header is 512 bytes");
+
+struct lod_pyramid {
+    bounding_cube                       bounds = { 0.0f, 0.0f, 0.0f, 1.0f };
+    uint64_t                            particle_count = 0;
+    double                              total_mass = 0.0;
+    std::vector<std::vector<lod_point>> levels;     // coarse to fine
+};
+
+// the sums of one cell, in double so that batches of any size add up alike
+struct lod_accumulator {
+    double   mass = 0.0;
+    double   position[3] = {};      // sum of m x
+    double   second_moment = 0.0;   // sum of m |x|^2
+    double   velocity[3] = {};
+    double   acceleration = 0.0;
+    uint64_t count = 0;
+
+    void add(const lod_accumulator& other) {
+        mass += other.mass;
+        for (int axis = 0; axis < 3; ++axis) {
+            position[axis] += other.position[axis];
+            velocity[axis] += other.velocity[axis];
+        }
+        second_moment += other.second_moment;
+        acceleration += other.acceleration;
+        count += other.count;
+    }
+
+    lod_point point() const {
+        lod_point p = {};
+        const double inverse = mass > 0.0 ? 1.0 / mass : 0.0;
+        double spread = second_moment * inverse;
+        for (int axis = 0; axis < 3; ++axis) {
+            p.position[axis] = static_cast<float>(position[axis] * inverse);
+            p.velocity[axis] = static_cast<float>(velocity[axis] * inverse);
+            spread -= (position[axis] * inverse) * (position[axis] * inverse);
+        }
+        p.mass = static_cast<float>(mass);
+        p.acceleration = static_cast<float>(acceleration * inverse);
+        p.radius = static_cast<float>(std::sqrt((std::max)(spread, 0.0)));
+        p.count = static_cast<uint32_t>((std::min)(count, uint64_t(UINT32_MAX)));
+        return p;
+    }
+};
+
+// Aggregates particles into the finest level of a pyramid over bounds;
+// add() may be called any number of times before build()
+class lod_builder {
+public:
+    explicit lod_builder(const bounding_cube& bounds, uint32_t level_count = 10) :
+        bounds_(bounds),
+        level_count_((std::min)((std::max)(level_count, 1u), lod_max_levels)),
+        cells_per_unit_(morton_cells / bounds.size)
+    {
+    }
+
+    void add(const particle_set& particles) {
+        const uint32_t shift = 3 * (morton_bits - (level_count_ - 1));
+        cells_.reserve(cells_.size() + particles.size() / 8);
+
+        for (size_t i = 0; i < particles.size(); ++i) {
+            const uint64_t key = morton_key(
+                morton_quantize(particles.px[i], bounds_.min_x, cells_per_unit_),
+                morton_quantize(particles.py[i], bounds_.min_y, cells_per_unit_),
+                morton_quantize(particles.pz[i], bounds_.min_z, cells_per_unit_)) >> shift;
+
+            const double m = particles.mass[i];
+            const double x = particles.px[i], y = particles.py[i], z = particles.pz[i];
+
+            lod_accumulator& cell = cells_[key];
+            cell.mass += m;
+            cell.position[0] += m * x;
+            cell.position[1] += m * y;
+            cell.position[2] += m * z;
+            cell.second_moment += m * (x * x + y * y + z * z);
+            cell.velocity[0] += m * particles.vx[i];
+            cell.velocity[1] += m * particles.vy[i];
+            cell.velocity[2] += m * particles.vz[i];
+            cell.acceleration += m * particles.acceleration[i];
+            ++cell.count;
+        }
+        particle_count_ += particles.size();
+    }
+
+    // the finest level is the occupied cells in Morton order, every coarser
+    // one merges the children of each cell of the level below
+    lod_pyramid build() const {
+        std::vector<std::pair<uint64_t, lod_accumulator>> level(cells_.begin(), cells_.end());
+        std::sort(level.begin(), level.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+        lod_pyramid pyramid;
+        pyramid.bounds = bounds_;
+        pyramid.particle_count = particle_count_;
+        pyramid.levels.resize(level_count_);
+
+        for (uint32_t l = level_count_; l-- > 0;) {
+            std::vector<lod_point>& points = pyramid.levels[l];
+            points.reserve(level.size());
+            for (const auto& cell : level)
+                points.push_back(cell.second.point());
+
+            if (l == 0)
+                break;
+
+            size_t parents = 0;
+            for (size_t i = 0; i < level.size(); ++i) {
+                const uint64_t parent = level[i].first >> 3;
+                if (parents > 0 && level[parents - 1].first == parent)
+                    level[parents - 1].second.add(level[i].second);
+                else
+                    level[parents++] = { parent, level[i].second };
+            }
+            level.resize(parents);
+        }
+
+        if (!level.empty())
+            pyramid.total_mass = level.front().second.mass;
+        return pyramid;
+    }
+
+    uint64_t particle_count() const { return particle_count_; }
+    size_t cell_count() const { return cells_.size(); }
+
+private:
+    const bounding_cube                             bounds_;
+    const uint32_t                                  level_count_;
+    const float                                     cells_per_unit_;
+    std::unordered_map<uint64_t, lod_accumulator>   cells_;
+    uint64_t                                        particle_count_ = 0;
+};
+
+// the cube around a snapshot: the union of the chunk boxes if it is indexed,
+// otherwise one pass over the positions
+inline bounding_cube snapshot_bounds(const snapshot_view& view) {
+    float lo[3] = { 0.0f, 0.0f, 0.0f };
+    float hi[3] = { 0.0f, 0.0f, 0.0f };
+
+    if (const snapshot_chunk* chunks = view.chunks()) {
+        for (uint32_t c = 0; c < view.chunk_count(); ++c) {
+            for (int axis = 0; axis < 3; ++axis) {
+                lo[axis] = c == 0 ? chunks[c].min[axis] : (std::min)(lo[axis], chunks[c].min[axis]);
+                hi[axis] = c == 0 ? chunks[c].max[axis] : (std::max)(hi[axis], chunks[c].max[axis]);
+            }
+        }
+    }
+    else {
+        const float* columns[3] = {
+            view.column<float>(snapshot_column::px),
+            view.column<float>(snapshot_column::py),
+            view.column<float>(snapshot_column::pz),
+        };
+        if (!columns[0] || !columns[1] || !columns[2])
+            throw std::runtime_error("snapshot: no positions");
+
+        for (int axis = 0; axis < 3; ++axis) {
+            if (view.size() == 0)
+                break;
+            const auto range = std::minmax_element(columns[axis], columns[axis] + view.size());
+            lo[axis] = *range.first;
+            hi[axis] = *range.second;
+        }
+    }
+
+    float size = (std::max)({ hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2] });
+    size = size > 0.0f ? size * 1.0001f : 1.0f;    // as compute_bounds
+    return { lo[0], lo[1], lo[2], size };
+}
+
+// the pyramid of a snapshot, read batch_size particles at a time
+inline lod_pyramid build_lod_pyramid(const snapshot_view& view, uint32_t level_count = 10, size_t batch_size = size_t(1) << 20) {
+    lod_builder builder(snapshot_bounds(view), level_count);
+
+    const size_t count = static_cast<size_t>(view.size());
+    const float* px = view.column<float>(snapshot_column::px);
+    const float* py = view.column<float>(snapshot_column::py);
+    const float* pz = view.column<float>(snapshot_column::pz);
+    const float* vx = view.column<float>(snapshot_column::vx);
+    const float* vy = view.column<float>(snapshot_column::vy);
+    const float* vz = view.column<float>(snapshot_column::vz);
+    const float* mass = view.column<float>(snapshot_column::mass);
+    const float* acceleration = view.column<float>(snapshot_column::acceleration);
+
+    auto copy = [](const float* column, size_t first, size_t n, std::vector<float>& batch) {
+        if (column)
+            std::copy(column + first, column + first + n, batch.begin());
+    };
+
+    particle_set batch;
+    for (size_t first = 0; first < count; first += batch_size) {
+        const size_t n = (std::min)(batch_size, count - first);
+        batch.id.clear();
+        batch.resize(n);
+        copy(px, first, n, batch.px);
+        copy(py, first, n, batch.py);
+        copy(pz, first, n, batch.pz);
+        copy(vx, first, n, batch.vx);
+        copy(vy, first, n, batch.vy);
+        copy(vz, first, n, batch.vz);
+        copy(mass, first, n, batch.mass);
+        copy(acceleration, first, n, batch.acceleration);
+        builder.add(batch);
+    }
+    return builder.build();
+}
+
+inline void write_lod_pyramid(const std::string& path, const lod_pyramid& pyramid) {
+    lod_header header = {};
+    std::memcpy(header.magic, lod_magic, sizeof(lod_magic));
+    header.version = lod_version;
+    header.level_count = static_cast<uint32_t>(pyramid.levels.size());
+    header.particle_count = pyramid.particle_count;
+    header.total_mass = pyramid.total_mass;
+    header.bounds_min[0] = pyramid.bounds.min_x;
+    header.bounds_min[1] = pyramid.bounds.min_y;
+    header.bounds_min[2] = pyramid.bounds.min_z;
+    header.bounds_size = pyramid.bounds.size;
+
+    if (header.level_count > lod_max_levels)
+        throw std::runtime_error("lod: too many levels");
+
+    uint64_t offset = snapshot_align(sizeof(header));
+    for (uint32_t l = 0; l < header.level_count; ++l) {
+        header.levels[l].offset = offset;
+        header.levels[l].count = pyramid.levels[l].size();
+        offset = snapshot_align(offset + pyramid.levels[l].size() * sizeof(lod_point));
+    }
+
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file)
+        throw std::runtime_error("cannot write " + path);
+
+    static const uint8_t padding[snapshot_alignment] = {};
+    uint64_t written = 0;
+    bool ok = true;
+    auto write = [&](const void* data, uint64_t bytes) {
+        ok = ok && std::fwrite(data, 1, static_cast<size_t>(bytes), file) == bytes;
+        written += bytes;
+    };
+
+    write(&header, sizeof(header));
+    for (uint32_t l = 0; l < header.level_count; ++l) {
+        write(padding, header.levels[l].offset - written);
+        write(pyramid.levels[l].data(), pyramid.levels[l].size() * sizeof(lod_point));
+    }
+    write(padding, snapshot_align(written) - written);
+
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok)
+        throw std::runtime_error("cannot write " + path);
+}
+
+// A pyramid file mapped into memory; only the levels used are paged in
+class lod_file {
+public:
+    explicit lod_file(const std::string& path) :
+        file_(path)
+    {
+        if (file_.size() < sizeof(lod_header))
+            throw std::runtime_error("lod: truncated header");
+
+        std::memcpy(&header_, file_.data(), sizeof(header_));
+
+        if (std::memcmp(header_.magic, lod_magic, sizeof(lod_magic)) != 0)
+            throw std::runtime_error("lod: not a pyramid file");
+        if (header_.version == 0 || header_.version > lod_version)
+            throw std::runtime_error("lod: unsupported version " + std::to_string(header_.version));
+        if (header_.level_count == 0 || header_.level_count > lod_max_levels)
+            throw std::runtime_error("lod: bad level table");
+
+        for (uint32_t l = 0; l < header_.level_count; ++l) {
+            const lod_level_entry& entry = header_.levels[l];
+            if (entry.offset % snapshot_alignment != 0 || entry.offset > file_.size() ||
+                entry.count > (file_.size() - entry.offset) / sizeof(lod_point))
+                throw std::runtime_error("lod: bad level table");
+        }
+    }
+
+    const lod_header& header() const { return header_; }
+    uint32_t level_count() const { return header_.level_count; }
+
+    bounding_cube bounds() const {
+        return { header_.bounds_min[0], header_.bounds_min[1], header_.bounds_min[2], header_.bounds_size };
+    }
+
+    const lod_point* level(uint32_t l) const {
+        return reinterpret_cast<const lod_point*>(file_.data() + header_.levels[l].offset);
+    }
+    size_t level_size(uint32_t l) const { return static_cast<size_t>(header_.levels[l].count); }
+
+    // the finest level with at most budget points
+    uint32_t level_for_budget(size_t budget) const {
+        uint32_t l = 0;
+        while (l + 1 < header_.level_count && level_size(l + 1) <= budget)
+            ++l;
+        return l;
+    }
+
+    // the coarsest level whose cells seen from distance cover at most
+    // pixel_tolerance pixels of a viewport viewport_height pixels high
+    uint32_t level_for_view(float distance, float fov_y, float viewport_height, float pixel_tolerance = 1.0f) const {
+        const float pixels_per_unit = viewport_height / (2.0f * (std::max)(distance, 1e-6f) * std::tan(fov_y * 0.5f));
+        float cell = header_.bounds_size;
+        uint32_t l = 0;
+        while (l + 1 < header_.level_count && cell * pixels_per_unit > pixel_tolerance) {
+            cell *= 0.5f;
+            ++l;
+        }
+        return l;
+    }
+
+    // one level as particles for store_particle_set or pack_compact
+    void load_level(uint32_t l, particle_set& particles) const {
+        const lod_point* points = level(l);
+        const size_t count = level_size(l);
+        particles.id.clear();
+        particles.resize(count);
+        particles.fx.clear();
+        particles.fy.clear();
+        particles.fz.clear();
+
+        for (size_t i = 0; i < count; ++i) {
+            particles.px[i] = points[i].position[0];
+            particles.py[i] = points[i].position[1];
+            particles.pz[i] = points[i].position[2];
+            particles.vx[i] = points[i].velocity[0];
+            particles.vy[i] = points[i].velocity[1];
+            particles.vz[i] = points[i].velocity[2];
+            particles.mass[i] = points[i].mass;
+            particles.acceleration[i] = points[i].acceleration;
+            particles.cost[i] = points[i].count;
+        }
+    }
+
+private:
+    mapped_file file_;
+    lod_header  header_;
+};
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A read-only memory mapping of a whole file. Pages are only read in when
+// they are touched, so opening is O(1) regardless of the file size.
+class mapped_file {
+public:
+    mapped_file() = default;
+
+    explicit mapped_file(const std::string& path) {
+#ifdef _WIN32
+        file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("cannot open " + path);
+
+        LARGE_INTEGER size;
+        GetFileSizeEx(file_, &size);
+        size_ = static_cast<size_t>(size.QuadPart);
+
+        if (size_ > 0) {
+            mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping_)
+                data_ = static_cast<const uint8_t*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+            if (!data_) {
+                close();
+                throw std::runtime_error("cannot map " + path);
+            }
+        }
+#else
+        fd_ = ::open(path.c_str(), O_RDONLY);
+        if (fd_ < 0)
+            throw std::runtime_error("cannot open " + path);
+
+        struct stat status;
+        if (::fstat(fd_, &status) != 0) {
+            close();
+            throw std::runtime_error("cannot stat " + path);
+        }
+        size_ = static_cast<size_t>(status.st_size);
+
+        if (size_ > 0) {
+            void* data = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+            if (data == MAP_FAILED) {
+                close();
+                throw std::runtime_error("cannot map " + path);
+            }
+            data_ = static_cast<const uint8_t*>(data);
+        }
+#endif
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    mapped_file(mapped_file&& other) noexcept {
+        swap(other);
+    }
+
+    mapped_file& operator=(mapped_file&& other) noexcept {
+        if (this != &other) {
+            close();
+            swap(other);
+        }
+        return *this;
+    }
+
+    ~mapped_file() {
+        close();
+    }
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+    // hint that [offset, offset + length) will be read front to back
+    void advise_sequential(size_t offset, size_t length) const {
+#ifndef _WIN32
+        if (!data_ || length == 0)
+            return;
+
+        const size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        const size_t begin = offset / page * page;
+        uint8_t* start = const_cast<uint8_t*>(data_) + begin;
+        const size_t bytes = (std::min)(offset + length, size_) - begin;
+        // advice values are not flags, each needs its own call
+        ::madvise(start, bytes, MADV_SEQUENTIAL);
+        ::madvise(start, bytes, MADV_WILLNEED);
+#else
+        (void)offset;
+        (void)length;
+#endif
+    }
+
+    // hint that pages will be read in no particular order, so the OS reads
+    // in only the pages touched and no read-ahead around them
+    void advise_random() const {
+#ifndef _WIN32
+        if (data_)
+            ::madvise(const_cast<uint8_t*>(data_), size_, MADV_RANDOM);
+#endif
+    }
+
+private:
+    void close() {
+#ifdef _WIN32
+        if (data_)
+            UnmapViewOfFile(data_);
+        if (mapping_)
+            CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE)
+            CloseHandle(file_);
+        mapping_ = nullptr;
+        file_ = INVALID_HANDLE_VALUE;
+#else
+        if (data_)
+            ::munmap(const_cast<uint8_t*>(data_), size_);
+        if (fd_ >= 0)
+            ::close(fd_);
+        fd_ = -1;
+#endif
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    void swap(mapped_file& other) noexcept {
+#ifdef _WIN32
+        std::swap(file_, other.file_);
+        std::swap(mapping_, other.mapping_);
+#else
+        std::swap(fd_, other.fd_);
+#endif
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+    }
+
+private:
+#ifdef _WIN32
+    HANDLE          file_ = INVALID_HANDLE_VALUE;
+    HANDLE          mapping_ = nullptr;
+#else
+    int             fd_ = -1;
+#endif
+    const uint8_t*  data_ = nullptr;
+    size_t          size_ = 0;
+};
@@ -0,0 +1,279 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Metrics registry
+//
+// Latencies go into log-linear histograms in the manner of HdrHistogram:
+// values below 128 have a bucket each, above that every power of two is
+// split into 64 buckets, so any value from 1 ns to centuries is kept to
+// within 1/64 of itself in a fixed 30 KB. Recording is a few relaxed atomic
+// adds, from any thread. Percentiles report the top of their bucket, never
+// less than the true value.
+//
+// Counters and gauges sit next to the histograms, and write_prometheus()
+// writes all of them in the Prometheus text exposition format, histograms as
+// summaries in seconds with their p50/p90/p99 and a _max gauge.
+// prometheus_exporter rewrites such a file periodically for a scraper, e.g.
+// node_exporter's textfile collector.
+
+class latency_histogram;
+
+// the counts of a histogram at one point; the difference of two is the
+// histogram of what was recorded in between
+struct histogram_snapshot {
+    std::vector<uint64_t> counts;
+    uint64_t              count = 0;
+    uint64_t              sum = 0;       // ns
+    uint64_t              max = 0;       // ns, over the whole life of the histogram
+
+    // the value below which fraction of the recordings lie, in ns
+    uint64_t percentile(double fraction) const;
+
+    // the largest recording, to bucket precision; unlike max this works on differences
+    uint64_t top() const;
+
+    histogram_snapshot operator-(const histogram_snapshot& earlier) const {
+        histogram_snapshot d = *this;
+        for (size_t i = 0; i < d.counts.size() && i < earlier.counts.size(); ++i)
+            d.counts[i] -= earlier.counts[i];
+        d.count -= earlier.count;
+        d.sum -= earlier.sum;
+        return d;
+    }
+};
+
+class latency_histogram {
+public:
+    static constexpr uint32_t linear = 128;                 // values with a bucket each
+    static constexpr uint32_t sub_buckets = linear / 2;     // buckets per power of two above
+    static constexpr uint32_t bucket_count = linear + 57 * sub_buckets;
+
+    latency_histogram() : counts_(new std::atomic<uint64_t>[bucket_count]) {
+        for (uint32_t i = 0; i < bucket_count; ++i)
+            counts_[i].store(0, std::memory_order_relaxed);
+    }
+
+    static uint32_t bucket(uint64_t value) {
+        if (value < linear)
+            return static_cast<uint32_t>(value);
+        uint32_t msb = 63;
+        while (!(value >> msb))
+            --msb;
+        const uint32_t shift = msb - 6;     // value >> shift in [64, 128)
+        return linear + (shift - 1) * sub_buckets + static_cast<uint32_t>((value >> shift) - sub_buckets);
+    }
+
+    // the largest value of a bucket
+    static uint64_t bucket_top(uint32_t index) {
+        if (index < linear)
+            return index;
+        const uint32_t shift = (index - linear) / sub_buckets + 1;
+        const uint64_t sub = (index - linear) % sub_buckets + sub_buckets;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    void record(uint64_t ns) {
+        counts_[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        while (ns > max && !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+        }
+    }
+
+    void record_seconds(double seconds) {
+        record(seconds > 0.0 ? static_cast<uint64_t>(seconds * 1e9 + 0.5) : 0);
+    }
+
+    // not atomic as a whole: recordings racing with it may be partly in it
+    histogram_snapshot snapshot() const {
+        histogram_snapshot s;
+        s.counts.resize(bucket_count);
+        for (uint32_t i = 0; i < bucket_count; ++i)
+            s.counts[i] = counts_[i].load(std::memory_order_relaxed);
+        s.count = 0;
+        for (uint64_t c : s.counts)
+            s.count += c;
+        s.sum = sum_.load(std::memory_order_relaxed);
+        s.max = max_.load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:
+    std::unique_ptr<std::atomic<uint64_t>[]>    counts_;
+    std::atomic<uint64_t>                       sum_{ 0 };
+    std::atomic<uint64_t>                       max_{ 0 };
+};
+
+inline uint64_t histogram_snapshot::percentile(double fraction) const {
+    if (count == 0)
+        return 0;
+    const uint64_t rank = (std::max)(uint64_t(1), static_cast<uint64_t>(fraction * double(count) + 0.999999));
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < counts.size(); ++i) {
+        seen += counts[i];
+        if (seen >= rank)
+            return (std::min)(latency_histogram::bucket_top(i), max ? max : latency_histogram::bucket_top(i));
+    }
+    return max;
+}
+
+inline uint64_t histogram_snapshot::top() const {
+    for (size_t i = counts.size(); i-- > 0;)
+        if (counts[i])
+            return (std::min)(latency_histogram::bucket_top(static_cast<uint32_t>(i)), max ? max : latency_histogram::bucket_top(static_cast<uint32_t>(i)));
+    return 0;
+}
+
+class metrics_registry {
+public:
+    // the metric of that name, created on first use; references stay valid
+    // for the life of the registry. Names follow Prometheus: [a-z_:][a-z0-9_:]*
+    latency_histogram& histogram(const std::string& name, const std::string& help = std::string()) {
+        return get(histograms_, name, help);
+    }
+
+    std::atomic<uint64_t>& counter(const std::string& name, const std::string& help = std::string()) {
+        return get(counters_, name, help);
+    }
+
+    std::atomic<double>& gauge(const std::string& name, const std::string& help = std::string()) {
+        return get(gauges_, name, help);
+    }
+
+    void write_prometheus(FILE* file) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        for (const auto& entry : counters_) {
+            write_help(file, entry.first, "counter");
+            std::fprintf(file, "%s %llu\n", entry.first.c_str(), static_cast<unsigned long long>(entry.second->load(std::memory_order_relaxed)));
+        }
+        for (const auto& entry : gauges_) {
+            write_help(file, entry.first, "gauge");
+            std::fprintf(file, "%s %.9g\n", entry.first.c_str(), entry.second->load(std::memory_order_relaxed));
+        }
+        for (const auto& entry : histograms_) {
+            const std::string& name = entry.first;
+            const histogram_snapshot s = entry.second->snapshot();
+            write_help(file, name, "summary");
+            const double quantiles[] = { 0.5, 0.9, 0.99 };
+            for (double q : quantiles)
+                std::fprintf(file, "%s{quantile=\"%g\"} %.9g\n", name.c_str(), q, s.percentile(q) * 1e-9);
+            std::fprintf(file, "%s_sum %.9g\n", name.c_str(), s.sum * 1e-9);
+            std::fprintf(file, "%s_count %llu\n", name.c_str(), static_cast<unsigned long long>(s.count));
+            std::fprintf(file, "# TYPE %s_max gauge\n", name.c_str());
+            std::fprintf(file, "%s_max %.9g\n", name.c_str(), s.max * 1e-9);
+        }
+    }
+
+    // to path + ".tmp", then renamed over path so a scraper never sees half a file
+    void write_prometheus(const std::string& path) const {
+        const std::string temporary = path + ".tmp";
+        FILE* file = std::fopen(temporary.c_str(), "w");
+        if (!file)
+            throw std::runtime_error("cannot write " + temporary);
+        write_prometheus(file);
+        if (std::fclose(file) != 0)
+            throw std::runtime_error("cannot write " + temporary);
+
+#ifdef _WIN32
+        std::remove(path.c_str());
+#endif
+        if (std::rename(temporary.c_str(), path.c_str()) != 0)
+            throw std::runtime_error("cannot write " + path);
+    }
+
+private:
+    template<class T>
+    T& get(std::map<std::string, std::unique_ptr<T>>& metrics, const std::string& name, const std::string& help) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::unique_ptr<T>& metric = metrics[name];
+        if (!metric) {
+            metric.reset(new T());
+            help_[name] = help;
+        }
+        return *metric;
+    }
+
+    void write_help(FILE* file, const std::string& name, const char* type) const {
+        auto help = help_.find(name);
+        if (help != help_.end() && !help->second.empty())
+            std::fprintf(file, "# HELP %s %s\n", name.c_str(), help->second.c_str());
+        std::fprintf(file, "# TYPE %s %s\n", name.c_str(), type);
+    }
+
+private:
+    mutable std::mutex                                          mutex_;
+    std::map<std::string, std::unique_ptr<latency_histogram>>   histograms_;
+    std::map<std::string, std::unique_ptr<std::atomic<uint64_t>>> counters_;
+    std::map<std::string, std::unique_ptr<std::atomic<double>>> gauges_;
+    std::map<std::string, std::string>                          help_;
+};
+
+// rewrites the registry's Prometheus file every interval on its own thread,
+// and once more when destroyed
+class prometheus_exporter {
+public:
+    prometheus_exporter(const metrics_registry& registry, const std::string& path, std::chrono::milliseconds interval) :
+        registry_(registry),
+        path_(path),
+        interval_(interval),
+        thread_([this] { export_thread_proc(); })
+    {
+    }
+
+    prometheus_exporter(const prometheus_exporter&) = delete;
+    prometheus_exporter& operator=(const prometheus_exporter&) = delete;
+
+    ~prometheus_exporter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            terminating_ = true;
+        }
+        changed_.notify_all();
+        thread_.join();
+    }
+
+    // files written; a failed write is retried on the next round
+    uint64_t exports() const { return exports_.load(); }
+
+private:
+    void export_thread_proc() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            const bool terminating = changed_.wait_for(lock, interval_, [this] { return terminating_; });
+            lock.unlock();
+            try {
+                registry_.write_prometheus(path_);
+                ++exports_;
+            }
+            catch (const std::exception&) {
+            }
+            lock.lock();
+            if (terminating)
+                return;
+        }
+    }
+
+private:
+    const metrics_registry&     registry_;
+    const std::string           path_;
+    const std::chrono::milliseconds interval_;
+    std::mutex                  mutex_;
+    std::condition_variable     changed_;
+    bool                        terminating_ = false;
+    std::atomic<uint64_t>       exports_{ 0 };
+    std::thread                 thread_;        // last, starts once everything else is constructed
+};
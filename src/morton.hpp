@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "simulation.hpp"
+
+// 21 bits per axis, so a key of all three axes fits into 63 bits
+constexpr uint32_t morton_bits = 21;
+constexpr uint32_t morton_cells = 1u << morton_bits;
+
+// spread the lower 21 bits of v so that there are two zero bits between each of them
+inline uint64_t morton_expand_bits(uint32_t v) {
+    uint64_t x = v & 0x1fffff;
+    x = (x | x << 32) & 0x001f00000000ffffull;
+    x = (x | x << 16) & 0x001f0000ff0000ffull;
+    x = (x | x << 8)  & 0x100f00f00f00f00full;
+    x = (x | x << 4)  & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2)  & 0x1249249249249249ull;
+    return x;
+}
+
+inline uint64_t morton_key(uint32_t x, uint32_t y, uint32_t z) {
+    return morton_expand_bits(x) | (morton_expand_bits(y) << 1) | (morton_expand_bits(z) << 2);
+}
+
+// the octant (0..7) a key falls into at the given tree level, level 0 being the root's children
+inline uint32_t morton_octant(uint64_t key, uint32_t level) {
+    return static_cast<uint32_t>(key >> (3 * (morton_bits - 1 - level))) & 7;
+}
+
+struct bounding_cube {
+    float min_x, min_y, min_z;
+    float size;
+};
+
+inline bounding_cube compute_bounds(const particle_set& particles) {
+    if (particles.size() == 0)
+        return { 0.0f, 0.0f, 0.0f, 1.0f };
+
+    float lo[3] = { particles.px[0], particles.py[0], particles.pz[0] };
+    float hi[3] = { lo[0], lo[1], lo[2] };
+
+    for (size_t i = 1; i < particles.size(); ++i) {
+        lo[0] = (std::min)(lo[0], particles.px[i]); hi[0] = (std::max)(hi[0], particles.px[i]);
+        lo[1] = (std::min)(lo[1], particles.py[i]); hi[1] = (std::max)(hi[1], particles.py[i]);
+        lo[2] = (std::min)(lo[2], particles.pz[i]); hi[2] = (std::max)(hi[2], particles.pz[i]);
+    }
+
+    float size = (std::max)({ hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2] });
+
+    // grow the cube slightly so that the largest coordinate still maps inside the grid
+    size = size > 0.0f ? size * 1.0001f : 1.0f;
+
+    return { lo[0], lo[1], lo[2], size };
+}
+
+inline uint32_t morton_quantize(float v, float lo, float cells_per_unit) {
+    float cell = (v - lo) * cells_per_unit;
+    if (!(cell > 0.0f))
+        return 0;
+    return (std::min)(static_cast<uint32_t>(cell), morton_cells - 1);
+}
+
+// the cube of a fixed-point position set: a cell is 2^shift fixed-point units
+struct fixed_bounding_cube {
+    int64_t  min_x, min_y, min_z;
+    uint32_t shift;
+};
+
+inline fixed_bounding_cube compute_fixed_bounds(const particle_set& particles) {
+    if (particles.fx.empty())
+        return { 0, 0, 0, 0 };
+
+    int64_t lo[3] = { particles.fx[0], particles.fy[0], particles.fz[0] };
+    int64_t hi[3] = { lo[0], lo[1], lo[2] };
+
+    for (size_t i = 1; i < particles.fx.size(); ++i) {
+        lo[0] = (std::min)(lo[0], particles.fx[i]); hi[0] = (std::max)(hi[0], particles.fx[i]);
+        lo[1] = (std::min)(lo[1], particles.fy[i]); hi[1] = (std::max)(hi[1], particles.fy[i]);
+        lo[2] = (std::min)(lo[2], particles.fz[i]); hi[2] = (std::max)(hi[2], particles.fz[i]);
+    }
+
+    uint64_t extent = static_cast<uint64_t>((std::max)({ hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2] }));
+
+    // the smallest shift that brings the extent below 2^21 cells
+    uint32_t shift = 0;
+    while ((extent >> shift) >= morton_cells)
+        ++shift;
+
+    return { lo[0], lo[1], lo[2], shift };
+}
+
+inline void morton_sort_entries(particle_set& particles, std::vector<std::pair<uint64_t, uint32_t>>& entries, std::vector<uint64_t>& keys) {
+    const size_t count = entries.size();
+
+    std::sort(entries.begin(), entries.end());
+
+    std::vector<uint32_t> order(count);
+    keys.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        keys[i] = entries[i].first;
+        order[i] = entries[i].second;
+    }
+
+    particles.permute(order);
+}
+
+// sort the particles along the Z-order curve of the bounding cube;
+// keys receives the sorted keys, ties are broken by the original index so the
+// order is the same on every run
+inline void morton_sort(particle_set& particles, const bounding_cube& box, std::vector<uint64_t>& keys) {
+    const size_t count = particles.size();
+    const float cells_per_unit = morton_cells / box.size;
+
+    std::vector<std::pair<uint64_t, uint32_t>> entries(count);
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t key = morton_key(
+            morton_quantize(particles.px[i], box.min_x, cells_per_unit),
+            morton_quantize(particles.py[i], box.min_y, cells_per_unit),
+            morton_quantize(particles.pz[i], box.min_z, cells_per_unit));
+        entries[i] = { key, static_cast<uint32_t>(i) };
+    }
+
+    morton_sort_entries(particles, entries, keys);
+}
+
+// the same for fixed-point positions: the cell coordinates are the top bits of
+// the integer offsets, no float quantization involved
+inline void morton_sort(particle_set& particles, const fixed_bounding_cube& box, std::vector<uint64_t>& keys) {
+    const size_t count = particles.fx.size();
+
+    std::vector<std::pair<uint64_t, uint32_t>> entries(count);
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t key = morton_key(
+            static_cast<uint32_t>(static_cast<uint64_t>(particles.fx[i] - box.min_x) >> box.shift),
+            static_cast<uint32_t>(static_cast<uint64_t>(particles.fy[i] - box.min_y) >> box.shift),
+            static_cast<uint32_t>(static_cast<uint64_t>(particles.fz[i] - box.min_z) >> box.shift));
+        entries[i] = { key, static_cast<uint32_t>(i) };
+    }
+
+    morton_sort_entries(particles, entries, keys);
+}
@@ -0,0 +1,2221 @@
+// nbody-bench: measurements of the CPU engines.
+//
+//   nbody-bench determinism [--engine tree|direct] [--particles N] [--steps S]
+//       runs the two-cluster setup on 1, 8 and 64 threads in float and in
+//       fixed point, compares the final state checksums and reports what
+//       fixed point costs. Fails if the runs of either differ.
+//
+//   nbody-bench precision [--engine direct|tree] [--particles N] [--samples S] [--csv FILE]
+//       accuracy against throughput of the accumulation precisions: one force
+//       evaluation per precision, compared with a long double direct sum on
+//       S sample particles.
+//
+//   nbody-bench offset [--engine direct|tree] [--particles N] [--samples S]
+//       moves the two clusters further and further away from the origin and
+//       compares the accelerations with float and with 64-bit fixed-point
+//       positions against a long double direct sum of the unmoved clusters.
+//       Fails unless positions rewritten between two evaluations reach the
+//       fixed-point copy.
+//
+//   nbody-bench checkpoint [--engine tree|direct] [--particles N] [--steps S] [--every K] [--dir DIR]
+//       runs S steps with a checkpoint every K steps, once written
+//       synchronously and once through checkpoint_writer, and reports how
+//       long each stalls the simulation.
+//
+//   nbody-bench delta [--engine tree|direct] [--particles N] [--steps S] [--every K] [--chain C] [--dir DIR]
+//       writes a checkpoint every step, a full snapshot every K (default 4)
+//       and delta checkpoints between, reports their sizes and how long a
+//       restore through the chain takes, then compacts the chains to at most
+//       C deltas (default 0). Fails unless every checkpoint restores the
+//       simulated state, before and after compaction.
+//
+//   nbody-bench compact [--chain C] [--dir DIR]
+//       the compaction tool: rewrites the delta checkpoints in DIR that are
+//       more than C deltas from a full snapshot as full snapshots.
+//
+//   nbody-bench trajectory [--engine tree|direct] [--particles N] [--steps S] [--tolerance T] [--dir DIR]
+//       records S steps with trajectory_writer, reports the size per particle
+//       and frame and the encoder throughput, then decodes the file and checks
+//       every position against the tolerance.
+//
+//   nbody-bench playback [--engine tree|direct] [--particles N] [--steps S] [--dir DIR]
+//       records S steps, plays them back with trajectory_player at several
+//       speeds on a simulated 60 Hz display and reports the frames shown,
+//       skipped and late, and how long a seek takes to show its frame. Fails
+//       if a shown frame differs from the decoded trajectory, or if playing
+//       the file with its block data overwritten reports no error.
+//
+//   nbody-bench load [--particles N] [--dir DIR]
+//       writes the two-cluster setup as CSV, as GADGET-2 in both snapshot
+//       formats and byte orders, and as a snapshot, loads each file back with
+//       ic_loader and reports the throughput. Fails if a loaded state differs.
+//
+//   nbody-bench ic [--particles N]
+//       checks Philox4x32-10 against the known-answer vectors of Random123,
+//       generates every initial-condition model on 1, 4 and 16 threads,
+//       reports the throughput and the virial ratio 2K/|W|, and fails unless
+//       the thread counts give identical states.
+//
+//   nbody-bench query [--particles N] [--dir DIR]
+//       writes a Plummer sphere as a spatially indexed snapshot and runs box,
+//       sphere and k-nearest queries of growing size around its center,
+//       reporting the share of the chunks and bytes each reads. Fails unless
+//       every result matches a brute-force scan of the particles.
+//
+//   nbody-bench lod [--particles N] [--dir DIR]
+//       writes a galaxy as a snapshot, builds its LOD pyramid from the file
+//       and reports the points, size and build time of every level. Fails
+//       unless every level holds all the mass and particles around the same
+//       center of mass, building from the file in small batches gives the
+//       pyramid built in one, and the pyramid file reads back unchanged.
+//
+//   nbody-bench mirror [--engine tree|direct] [--particles N] [--steps S] [--every K]
+//       runs S steps (default 64) with state_mirror fed every K steps
+//       (default 16) from two stand-in readback buffers in the renderer's
+//       interleaved layout, then loses the device: reports what the mirror
+//       cost the simulation thread, the steps lost and how long the restore
+//       takes. Fails unless the restored state is the one of the mirrored
+//       step, or more than K steps are lost.
+//
+//   nbody-bench suite [--profile smoke|full] [--engine tree|direct] [--repetitions R] [--warmup W] [--json FILE]
+//       the benchmark suite: times single steps of every engine and
+//       precision over particle counts and thread counts, after W warmup
+//       steps, R times each, and writes the samples with interactions/s,
+//       GFLOP/s, ns per particle and step, the scaling efficiency over one
+//       thread and 95% confidence intervals to FILE (default
+//       bench-<profile>.json, see bench_report.hpp). The full profile goes
+//       from 1k to 10M particles, the direct engine up to 100k; smoke runs
+//       1k and 10k, float only, on one thread and all of them. A build with
+//       NBODY_PERF_COUNTERS on adds the cycles, instructions, cache misses
+//       and thread time of the build, walk and integrate phases to every
+//       case, or the thread time alone where the kernel refuses counters.
+//
+//   nbody-bench compare --baseline FILE --json FILE [--threshold T]
+//       the regression gate: compares the cases of two suite reports with a
+//       one-sided Mann-Whitney U test on their samples each way and prints a
+//       summary table. A case whose median step time grew by more than T
+//       (default 0.05) with p < 0.05 is a regression and fails the run;
+//       e.g. nbody-bench suite --profile smoke --json current.json first.
+//
+//   nbody-bench trace [--engine tree|direct] [--particles N] [--steps S] [--dir DIR]
+//       what tracing costs: the time of one trace_scope, and with a build
+//       that has NBODY_TRACE on, the events per step and their share of the
+//       step time. Such a build also writes DIR/trace.json and fails unless
+//       it reads back with the engine's phases in it.
+//
+//   nbody-bench gpu-timers [--steps S]
+//       drives gpu_timer_ring with a fake queue that finishes frames 1, 2, 3
+//       and 8 frames late, S frames (default 1000) with a simulate and a
+//       draw pass of known length each, and reports the timings that reached
+//       the registry and what the ring costs per frame. Fails unless they
+//       match the passes to histogram precision, or a ring that is deep
+//       enough drops a frame, or one that is not drops none.
+//
+//   nbody-bench conservation [--engine tree|direct] [--particles N] [--steps S] [--every K] [--csv FILE]
+//       the accuracy/throughput trade-off: runs a Plummer sphere for S steps
+//       (default 100) with every precision and integrator of the engine,
+//       measures energy, momentum and angular momentum every K steps
+//       (default 10) with conservation_monitor, and reports the step time
+//       next to their errors against step 0. FILE gets every sample of every
+//       case.
+//
+//   nbody-bench storage [--particles N]
+//       packs every initial-condition model into each compact storage
+//       format (compact_storage.hpp) and unpacks it again. Reports the bytes
+//       per particle, the largest position and velocity errors over their
+//       bounds, and how many masses the layout lost. Fails if an error
+//       exceeds its bound or |a| does not come back exactly.
+//
+//   nbody-bench validate [--engine tree|direct] [--particles N] [--samples S] [--tolerances FILE] [--csv FILE]
+//       the accuracy gate: for every initial-condition model, the sample's
+//       two clusters first, compares the accelerations of every engine and
+//       precision, and of the direct engine on positions from both compact
+//       storage encodings, with a double direct sum on S sample particles
+//       and reports the RMS, median, p90, p99 and largest relative error.
+//       Fails if one is above the tolerance of its engine and precision, the
+//       defaults of validation.hpp or those of FILE (engine,precision,rms,
+//       p99,max with a header line; * matches any, the first match wins).
+//
+//   nbody-bench golden [--bless] [--dir DIR]
+//       the integration-quality gate: runs the golden trajectories of
+//       golden.hpp - Kepler, figure eight and a 1k Plummer sphere under both
+//       integrators - and compares them with the snapshots and the energy
+//       errors blessed into DIR (default golden). Fails if a snapshot lost
+//       its checksum, a state moved away from its snapshot by more than the
+//       system's tolerance or the energy error grew. --bless writes them anew.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench_report.hpp"
+#include "checkpoint_writer.hpp"
+#include "compact_storage.hpp"
+#include "cpu_engine.hpp"
+#include "delta_checkpoint.hpp"
+#include "diagnostics.hpp"
+#include "golden.hpp"
+#include "gpu_profiler.hpp"
+#include "ic_loader.hpp"
+#include "initial_conditions.hpp"
+#include "lod_pyramid.hpp"
+#include "perf_counters.hpp"
+#include "philox.hpp"
+#include "snapshot_query.hpp"
+#include "state_mirror.hpp"
+#include "trace.hpp"
+#include "trajectory_player.hpp"
+#include "trajectory_writer.hpp"
+#include "validation.hpp"
+
+namespace {
+
+struct options {
+    std::string mode;
+    std::string engine;     // direct for precision and offset, tree otherwise
+    uint32_t    particles = 20000;
+    uint32_t    steps     = 5;
+    uint32_t    samples   = 256;
+    uint32_t    every     = 1;
+    uint32_t    chain     = 0;
+    double      tolerance = 1e-3;
+    std::string csv;
+    std::string json;
+    std::string profile   = "full";
+    uint32_t    repetitions = 0;    // 0 - the profile's
+    uint32_t    warmup    = 0;
+    std::string baseline;
+    double      threshold = 0.05;
+    std::string dir       = ".";
+    std::string tolerances;
+    bool        bless     = false;
+};
+
+struct run_result {
+    uint64_t checksum;
+    double   seconds;
+};
+
+run_result run(const options& opts, unsigned thread_count, const char* precision) {
+    particle_set particles;
+    make_two_clusters(particles, opts.particles);
+
+    engine_config config;
+    config.thread_count = thread_count;
+
+    auto engine = make_engine(opts.engine, config, precision);
+    compute_data params = make_compute_data(opts.particles);
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t step = 0; step < opts.steps; ++step)
+        engine->step(particles, params);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    return { state_checksum(particles), elapsed.count() };
+}
+
+int run_determinism(const options& opts) {
+    const unsigned thread_counts[] = { 1, 8, 64 };
+
+    std::printf("engine %s, %u particles, %u steps\n\n", opts.engine.c_str(), opts.particles, opts.steps);
+    std::printf("%8s  %-18s %10s  %-18s %10s %9s\n", "threads", "float checksum", "seconds", "fixed checksum", "seconds", "cost");
+
+    bool float_identical = true;
+    bool fixed_identical = true;
+    uint64_t float_reference = 0, fixed_reference = 0;
+
+    for (unsigned thread_count : thread_counts) {
+        run_result single = run(opts, thread_count, float_accumulator::name);
+        run_result fixed = run(opts, thread_count, fixed_point_accumulator::name);
+
+        if (thread_count == thread_counts[0]) {
+            float_reference = single.checksum;
+            fixed_reference = fixed.checksum;
+        }
+        float_identical &= single.checksum == float_reference;
+        fixed_identical &= fixed.checksum == fixed_reference;
+
+        std::printf("%8u  %016llx %10.3f  %016llx %10.3f %8.1f%%\n",
+            thread_count,
+            static_cast<unsigned long long>(single.checksum), single.seconds,
+            static_cast<unsigned long long>(fixed.checksum), fixed.seconds,
+            100.0 * (fixed.seconds / single.seconds - 1.0));
+    }
+
+    std::printf("\nfloat: %s across thread counts\n", float_identical ? "identical" : "DIFFERS");
+    std::printf("fixed: %s across thread counts\n", fixed_identical ? "identical" : "DIFFERS");
+
+    return float_identical && fixed_identical ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+struct precision_result {
+    std::string precision;
+    double      interactions_per_second;
+    double      rms_error;
+    double      max_error;
+};
+
+// relative errors of the engine's accelerations against a long double direct sum
+precision_result measure_precision(const options& opts, const char* precision) {
+    particle_set particles;
+    make_two_clusters(particles, opts.particles);
+
+    auto engine = make_engine(opts.engine, engine_config(), precision);
+
+    auto start = std::chrono::steady_clock::now();
+    engine->compute_accelerations(particles);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    uint64_t interactions = 0;
+    for (uint32_t cost : particles.cost)
+        interactions += cost;
+
+    const uint32_t count = static_cast<uint32_t>(particles.size());
+    const uint32_t samples = (std::min)(opts.samples, count);
+
+    double sum_squared = 0.0, max_error = 0.0;
+    for (uint32_t s = 0; s < samples; ++s) {
+        const uint32_t i = static_cast<uint32_t>(uint64_t(s) * count / samples);
+
+        long double ax = 0, ay = 0, az = 0;
+        for (uint32_t j = 0; j < count; ++j) {
+            long double rx = (long double)particles.px[j] - particles.px[i];
+            long double ry = (long double)particles.py[j] - particles.py[i];
+            long double rz = (long double)particles.pz[j] - particles.pz[i];
+            long double dist = std::sqrt(rx * rx + ry * ry + rz * rz + (long double)gravity::softening_squared);
+            long double F = (long double)gravity::G * particles.mass[j] / (dist * dist * dist);
+            ax += rx * F; ay += ry * F; az += rz * F;
+        }
+
+        long double ex = engine->ax()[i] - ax, ey = engine->ay()[i] - ay, ez = engine->az()[i] - az;
+        double error = static_cast<double>(std::sqrt((ex * ex + ey * ey + ez * ez) / (ax * ax + ay * ay + az * az)));
+
+        sum_squared += error * error;
+        max_error = (std::max)(max_error, error);
+    }
+
+    return { engine->precision(), interactions / elapsed.count(), std::sqrt(sum_squared / samples), max_error };
+}
+
+int run_precision(const options& opts) {
+    std::vector<precision_result> results = {
+        measure_precision(opts, float_accumulator::name),
+        measure_precision(opts, kahan_accumulator::name),
+        measure_precision(opts, double_accumulator::name),
+        measure_precision(opts, full_double_accumulator::name),
+        measure_precision(opts, fixed_point_accumulator::name),
+    };
+
+    std::printf("engine %s, %u particles, %u samples\n\n", opts.engine.c_str(), opts.particles, opts.samples);
+    std::printf("%-10s %16s %14s %14s  %s\n", "precision", "interactions/s", "rms rel err", "max rel err", "-log10(rms)");
+
+    for (const auto& r : results) {
+        int bar = r.rms_error > 0.0 ? static_cast<int>(-std::log10(r.rms_error) * 4.0) : 64;
+        bar = (std::max)(0, (std::min)(bar, 64));
+
+        std::printf("%-10s %16.4g %14.3e %14.3e  %s\n", r.precision.c_str(), r.interactions_per_second, r.rms_error, r.max_error, std::string(bar, '#').c_str());
+    }
+
+    if (!opts.csv.empty()) {
+        FILE* file = std::fopen(opts.csv.c_str(), "w");
+        if (!file) {
+            std::fprintf(stderr, "cannot write %s\n", opts.csv.c_str());
+            return EXIT_FAILURE;
+        }
+
+        std::fprintf(file, "precision,interactions_per_second,rms_relative_error,max_relative_error\n");
+        for (const auto& r : results)
+            std::fprintf(file, "%s,%.6g,%.6e,%.6e\n", r.precision.c_str(), r.interactions_per_second, r.rms_error, r.max_error);
+        std::fclose(file);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// the relative acceleration error of the clusters moved by offset along every
+// axis; vx carries the original index through the tree engine's sort
+double measure_offset(const options& opts, const particle_set& original, const std::vector<uint32_t>& samples,
+                      const std::vector<long double>& reference, double offset, bool fixed) {
+    particle_set particles = original;
+    const uint32_t count = static_cast<uint32_t>(particles.size());
+
+    if (fixed) {
+        load_fixed_positions(particles);
+        for (uint32_t i = 0; i < count; ++i) {
+            particles.fx[i] += to_fixed_position(offset);
+            particles.fy[i] += to_fixed_position(offset);
+            particles.fz[i] += to_fixed_position(offset);
+        }
+        store_float_positions(particles, 0, count);
+    }
+    else {
+        for (uint32_t i = 0; i < count; ++i) {
+            particles.px[i] = static_cast<float>(particles.px[i] + offset);
+            particles.py[i] = static_cast<float>(particles.py[i] + offset);
+            particles.pz[i] = static_cast<float>(particles.pz[i] + offset);
+        }
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+        particles.vx[i] = static_cast<float>(i);
+
+    engine_config config;
+    config.fixed_positions = fixed;
+    auto engine = make_engine(opts.engine, config);
+    engine->compute_accelerations(particles);
+
+    std::vector<uint32_t> position(count);
+    for (uint32_t i = 0; i < count; ++i)
+        position[static_cast<uint32_t>(particles.vx[i])] = i;
+
+    double sum_squared = 0.0;
+    for (size_t s = 0; s < samples.size(); ++s) {
+        const uint32_t i = position[samples[s]];
+        const long double* a = &reference[s * 3];
+
+        long double ex = engine->ax()[i] - a[0], ey = engine->ay()[i] - a[1], ez = engine->az()[i] - a[2];
+        sum_squared += static_cast<double>((ex * ex + ey * ey + ez * ez) / (a[0] * a[0] + a[1] * a[1] + a[2] * a[2]));
+    }
+
+    return std::sqrt(sum_squared / samples.size());
+}
+
+int run_offset(const options& opts) {
+    particle_set original;
+    make_two_clusters(original, opts.particles);
+
+    const uint32_t count = static_cast<uint32_t>(original.size());
+    std::vector<uint32_t> samples((std::min)(opts.samples, count));
+    std::vector<long double> reference(samples.size() * 3);
+
+    for (size_t s = 0; s < samples.size(); ++s) {
+        const uint32_t i = static_cast<uint32_t>(uint64_t(s) * count / samples.size());
+        samples[s] = i;
+
+        long double ax = 0, ay = 0, az = 0;
+        for (uint32_t j = 0; j < count; ++j) {
+            long double rx = (long double)original.px[j] - original.px[i];
+            long double ry = (long double)original.py[j] - original.py[i];
+            long double rz = (long double)original.pz[j] - original.pz[i];
+            long double dist = std::sqrt(rx * rx + ry * ry + rz * rz + (long double)gravity::softening_squared);
+            long double F = (long double)gravity::G * original.mass[j] / (dist * dist * dist);
+            ax += rx * F; ay += ry * F; az += rz * F;
+        }
+        reference[s * 3 + 0] = ax;
+        reference[s * 3 + 1] = ay;
+        reference[s * 3 + 2] = az;
+    }
+
+    std::printf("engine %s, %u particles, %zu samples\n\n", opts.engine.c_str(), opts.particles, samples.size());
+    std::printf("%12s %16s %16s\n", "offset", "float rms err", "fixed rms err");
+
+    for (double offset : { 0.0, 1e3, 1e4, 1e5, 1e6, 1e7 }) {
+        std::printf("%12.0e %16.3e %16.3e\n", offset,
+            measure_offset(opts, original, samples, reference, offset, false),
+            measure_offset(opts, original, samples, reference, offset, true));
+    }
+
+    // the float positions rewritten at the same particle count, as a loader
+    // or a tool would, must give what a fresh particle set at them gives
+    engine_config config;
+    config.fixed_positions = true;
+    auto engine = make_engine(opts.engine, config);
+    particle_set particles = original;
+    engine->compute_accelerations(particles);
+    for (uint32_t i = 0; i < count; ++i)
+        particles.px[i] += 100.0f;
+
+    particle_set fresh = particles;
+    fresh.fx.clear();
+    fresh.fy.clear();
+    fresh.fz.clear();
+    auto fresh_engine = make_engine(opts.engine, config);
+    engine->compute_accelerations(particles);
+    fresh_engine->compute_accelerations(fresh);
+
+    if (engine->ax() != fresh_engine->ax() || engine->ay() != fresh_engine->ay() || engine->az() != fresh_engine->az()) {
+        std::printf("FAILED: rewritten positions do not reach the fixed-point copy\n");
+        return EXIT_FAILURE;
+    }
+    std::printf("\nrewritten positions reach the fixed-point copy\n");
+    return EXIT_SUCCESS;
+}
+
+int run_checkpoint(const options& opts) {
+    const uint32_t every = (std::max)(opts.every, 1u);
+    double stall[2] = {}, total[2] = {}, max_stall[2] = {};
+    uint64_t image_size = 0;
+
+    for (int async = 0; async < 2; ++async) {
+        particle_set particles;
+        make_two_clusters(particles, opts.particles);
+
+        auto engine = make_engine(opts.engine);
+        compute_data params = make_compute_data(opts.particles);
+        checkpoint_writer writer(opts.dir);
+
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t step = 1; step <= opts.steps; ++step) {
+            engine->step(particles, params);
+            if (step % every != 0)
+                continue;
+
+            const snapshot_info info = make_snapshot_info(params, step);
+            image_size = make_snapshot_header(particles, info).file_size;
+
+            auto checkpoint_start = std::chrono::steady_clock::now();
+            if (async)
+                writer.submit(particles, info);
+            else
+                write_snapshot(writer.path(step), particles, info);
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - checkpoint_start).count();
+
+            stall[async] += seconds;
+            max_stall[async] = (std::max)(max_stall[async], seconds);
+        }
+        total[async] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        writer.flush();
+    }
+
+    std::printf("engine %s, %u particles, %u steps, %u checkpoints of %.1f MB\n\n",
+        opts.engine.c_str(), opts.particles, opts.steps, opts.steps / every, image_size / 1e6);
+    std::printf("%-6s %12s %12s %14s %10s\n", "mode", "run s", "stall s", "max stall ms", "stall");
+
+    const char* names[] = { "sync", "async" };
+    for (int async = 0; async < 2; ++async) {
+        std::printf("%-6s %12.3f %12.3f %14.2f %9.1f%%\n", names[async], total[async], stall[async], max_stall[async] * 1000.0,
+            100.0 * stall[async] / total[async]);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// compacts every chain of delta checkpoints in directory; returns the checkpoints rewritten
+size_t compact_directory(const std::string& directory, uint32_t max_chain) {
+    std::vector<std::pair<uint64_t, std::string>> deltas;
+    std::vector<uint64_t> bases;
+    for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+        if (entry.path().extension() != ".delta")
+            continue;
+
+        mapped_file file(entry.path().string());
+        delta_header header;
+        if (!is_delta_checkpoint(file.data(), file.size()) || file.size() < sizeof(header))
+            continue;
+        std::memcpy(&header, file.data(), sizeof(header));
+        deltas.emplace_back(header.step, entry.path().string());
+        bases.push_back(header.base_step);
+    }
+
+    // the newest delta of every chain is no other delta's base
+    size_t rewritten = 0;
+    for (const auto& delta : deltas)
+        if (std::find(bases.begin(), bases.end(), delta.first) == bases.end())
+            rewritten += compact_checkpoint(delta.second, max_chain);
+    return rewritten;
+}
+
+int run_delta(const options& opts) {
+    const uint32_t full_every = opts.every > 1 ? opts.every : 4;
+    const std::string directory = opts.dir + "/delta";
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+
+    particle_set particles;
+    make_two_clusters(particles, opts.particles);
+    auto engine = make_engine(opts.engine);
+    compute_data params = make_compute_data(opts.particles);
+
+    std::vector<uint64_t> checksums(opts.steps + 1);
+    checkpoint_stats stats;
+    {
+        checkpoint_writer writer(directory, true, full_every);
+        for (uint32_t step = 1; step <= opts.steps; ++step) {
+            engine->step(particles, params);
+            writer.submit(particles, make_snapshot_info(params, step));
+            checksums[step] = state_checksum(particles);
+        }
+        writer.flush();
+        stats = writer.stats();
+    }
+
+    auto checkpoint = [&](uint32_t step) {
+        const std::string full = directory + "/" + checkpoint_file_name(step, "snap");
+        return std::filesystem::exists(full) ? full : directory + "/" + checkpoint_file_name(step, "delta");
+    };
+
+    // restores every checkpoint and compares it with the simulated state
+    bool ok = true;
+    auto verify = [&](bool print) {
+        const double full_size = static_cast<double>(make_snapshot_header(particles, snapshot_info{}).file_size);
+        for (uint32_t step = 1; step <= opts.steps; ++step) {
+            const std::string path = checkpoint(step);
+            const bool delta = path.size() > 6 && path.compare(path.size() - 6, 6, ".delta") == 0;
+            const double size = static_cast<double>(std::filesystem::file_size(path));
+
+            particle_set restored;
+            const auto start = std::chrono::steady_clock::now();
+            restore_checkpoint(path, restored);
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            const bool same = state_checksum(restored) == checksums[step];
+            ok = ok && same;
+            if (print)
+                std::printf("%-6u %-6s %10.1f %9.1f%% %12.2f%s\n", step, delta ? "delta" : "full", size / 1e3, 100.0 * size / full_size,
+                    seconds * 1000.0, same ? "" : "  differs");
+            else if (!same)
+                std::printf("step %u differs after compaction\n", step);
+        }
+    };
+
+    std::printf("engine %s, %u particles, %u checkpoints, a full one every %u: %llu deltas, %.1f MB\n\n%-6s %-6s %10s %10s %12s\n",
+        opts.engine.c_str(), opts.particles, opts.steps, full_every, static_cast<unsigned long long>(stats.deltas), stats.bytes / 1e6,
+        "step", "kind", "KB", "of full", "restore ms");
+    verify(true);
+
+    const size_t rewritten = compact_directory(directory, opts.chain);
+    verify(false);
+    std::printf("\ncompacted to chains of at most %u deltas: %zu rewritten\n", opts.chain, rewritten);
+
+    if (!ok)
+        std::printf("FAILED: a restored checkpoint differs from the simulated state\n");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int run_compact(const options& opts) {
+    const size_t rewritten = compact_directory(opts.dir, opts.chain);
+    std::printf("%zu delta checkpoints rewritten as full snapshots\n", rewritten);
+    return EXIT_SUCCESS;
+}
+
+int run_trajectory(const options& opts) {
+    particle_set particles;
+    make_two_clusters(particles, opts.particles);
+
+    auto engine = make_engine(opts.engine);
+    compute_data params = make_compute_data(opts.particles);
+    const std::string path = opts.dir + "/trajectory.trj";
+
+    trajectory_config config;
+    config.tolerance = opts.tolerance;
+
+    // what was pushed, in id order, to check the decoded frames against
+    std::vector<trajectory_frame> reference(opts.steps);
+    trajectory_stats stats;
+    double simulation_seconds = 0.0;
+    {
+        trajectory_writer writer(path, opts.particles, config);
+
+        for (uint32_t step = 0; step < opts.steps; ++step) {
+            auto start = std::chrono::steady_clock::now();
+            engine->step(particles, params);
+            simulation_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            writer.push(particles, step, step * double(params.paramf[0]));
+
+            trajectory_frame& frame = reference[step];
+            frame.px.resize(opts.particles);
+            frame.py.resize(opts.particles);
+            frame.pz.resize(opts.particles);
+            for (uint32_t i = 0; i < opts.particles; ++i) {
+                frame.px[particles.id[i]] = particles.px[i];
+                frame.py[particles.id[i]] = particles.py[i];
+                frame.pz[particles.id[i]] = particles.pz[i];
+            }
+        }
+
+        writer.close();
+        stats = writer.stats();
+    }
+
+    // decoded positions are floats again, far out their rounding adds to the tolerance
+    double max_error = 0.0;
+    uint64_t out_of_tolerance = 0;
+    auto check = [&](float decoded, float expected) {
+        const double error = std::fabs(double(decoded) - expected);
+        max_error = (std::max)(max_error, error);
+        out_of_tolerance += error > opts.tolerance + std::fabs(expected) * std::ldexp(1.0, -23);
+    };
+
+    trajectory_reader reader(path, 0);
+    trajectory_frame frame;
+
+    for (size_t f = 0; f < reader.frame_count(); ++f) {
+        reader.read(f, frame);
+        for (uint32_t i = 0; i < opts.particles; ++i) {
+            check(frame.px[i], reference[f].px[i]);
+            check(frame.py[i], reference[f].py[i]);
+            check(frame.pz[i], reference[f].pz[i]);
+        }
+    }
+
+    const double frames = double(stats.frames);
+    std::printf("engine %s, %u particles, %u frames, tolerance %g\n\n", opts.engine.c_str(), opts.particles, opts.steps, opts.tolerance);
+    std::printf("bytes per particle and frame  %8.2f  (particle_t: 32, ratio %.1fx)\n",
+        stats.bytes / (frames * opts.particles), double(stats.raw_bytes) / stats.bytes);
+    std::printf("encoder                       %8.1f frames/s (%.1f M particles/s)\n",
+        frames / stats.encode_seconds, frames * opts.particles / stats.encode_seconds / 1e6);
+    std::printf("time in push()                %8.2f%% of the simulation time\n", 100.0 * stats.push_seconds / simulation_seconds);
+    std::printf("decoded frames                %8zu, max error %.3g, %llu coordinates out of tolerance\n",
+        reader.frame_count(), max_error, static_cast<unsigned long long>(out_of_tolerance));
+
+    const bool ok = reader.frame_count() == opts.steps && out_of_tolerance == 0;
+    if (!ok)
+        std::printf("FAILED: trajectory does not match\n");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int run_playback(const options& opts) {
+    particle_set particles;
+    make_two_clusters(particles, opts.particles);
+
+    auto engine = make_engine(opts.engine);
+    compute_data params = make_compute_data(opts.particles);
+    const std::string path = opts.dir + "/playback.trj";
+    {
+        trajectory_writer writer(path, opts.particles);
+        for (uint32_t step = 0; step < opts.steps; ++step) {
+            engine->step(particles, params);
+            writer.push(particles, step, step * double(params.paramf[0]));
+        }
+        writer.close();
+    }
+
+    // what every shown frame must equal
+    trajectory_reader reader(path, 0);
+    std::vector<trajectory_frame> decoded(reader.frame_count());
+    for (size_t f = 0; f < decoded.size(); ++f)
+        reader.read(f, decoded[f]);
+
+    uint64_t mismatches = 0;
+    auto check = [&](const trajectory_player& player, const particle_set& frame) {
+        const trajectory_frame& expected = decoded[static_cast<size_t>(player.shown())];
+        mismatches += frame.px != expected.px || frame.py != expected.py || frame.pz != expected.pz;
+    };
+
+    const double frames_per_second = 30.0;
+    const double display_interval = 1.0 / 60.0;
+    const double seconds = 2.0;
+
+    std::printf("engine %s, %u particles, %zu frames at %g frames/s, %g s per speed on a 60 Hz display\n\n",
+        opts.engine.c_str(), opts.particles, decoded.size(), frames_per_second, seconds);
+    std::printf("%8s %8s %8s %8s %10s\n", "speed", "shown", "skipped", "late", "frames/s");
+
+    const double speeds[] = { 1.0, 4.0, 16.0, -4.0 };
+    for (double speed : speeds) {
+        trajectory_player player(path, 8, 0, frames_per_second);
+        player.set_speed(speed);
+
+        const auto start = std::chrono::steady_clock::now();
+        auto last = start;
+        for (;;) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(display_interval));
+
+            const auto now = std::chrono::steady_clock::now();
+            const particle_set* frame = player.update(std::chrono::duration<double>(now - last).count());
+            last = now;
+            if (frame)
+                check(player, *frame);
+
+            if (std::chrono::duration<double>(now - start).count() >= seconds)
+                break;
+        }
+
+        const playback_stats stats = player.stats();
+        std::printf("%8g %8llu %8llu %8llu %10.1f\n", speed,
+            static_cast<unsigned long long>(stats.shown), static_cast<unsigned long long>(stats.skipped),
+            static_cast<unsigned long long>(stats.late), stats.shown / seconds);
+    }
+
+    // scrubbing: seek to spread out frames and wait for each to show
+    trajectory_player player(path, 8, 0, frames_per_second);
+    player.pause();
+
+    const uint32_t seeks = 16;
+    double total = 0.0;
+    double slowest = 0.0;
+    for (uint32_t k = 0; k < seeks; ++k) {
+        const size_t target = (k * 7919u) % decoded.size();
+        const auto start = std::chrono::steady_clock::now();
+        player.seek(double(target));
+
+        const particle_set* frame = nullptr;
+        while (!(frame = player.update(0.0)) && player.shown() != int64_t(target))
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        if (frame)
+            check(player, *frame);
+
+        const double latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        total += latency;
+        slowest = (std::max)(slowest, latency);
+    }
+
+    std::printf("\nseek to shown frame  %.2f ms on average, %.2f ms at most\n", 1000.0 * total / seeks, 1000.0 * slowest);
+
+    // a corrupt file must reach update() as an error, with blocks decoded on
+    // every hardware thread: overwrite the block data of every frame
+    const std::string corrupt_path = opts.dir + "/playback-corrupt.trj";
+    std::filesystem::copy_file(path, corrupt_path, std::filesystem::copy_options::overwrite_existing);
+    {
+        const uint32_t blocks = (opts.particles + reader.header().block_size - 1) / reader.header().block_size;
+        FILE* file = std::fopen(corrupt_path.c_str(), "r+b");
+        if (!file) {
+            std::printf("FAILED: cannot write %s\n", corrupt_path.c_str());
+            return EXIT_FAILURE;
+        }
+        for (size_t f = 0; f < reader.frame_count(); ++f) {
+            const uint64_t begin = reader.frame(f).offset + sizeof(trajectory_frame_header) + blocks * sizeof(uint32_t);
+            const uint64_t end = f + 1 < reader.frame_count() ? reader.frame(f + 1).offset : std::filesystem::file_size(path);
+            const std::vector<uint8_t> garbage(static_cast<size_t>(end - begin), 0xff);
+            std::fseek(file, static_cast<long>(begin), SEEK_SET);
+            std::fwrite(garbage.data(), 1, garbage.size(), file);
+        }
+        std::fclose(file);
+    }
+
+    std::string corrupt_error;
+    {
+        trajectory_player corrupt(corrupt_path, 8, 0, frames_per_second);
+        const auto start = std::chrono::steady_clock::now();
+        while (corrupt_error.empty() && std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+            try {
+                corrupt.update(display_interval);
+            }
+            catch (const std::exception& e) {
+                corrupt_error = e.what();
+            }
+            std::this_thread::sleep_for(std::chrono::duration<double>(display_interval));
+        }
+    }
+    std::printf("corrupt file         %s\n", corrupt_error.empty() ? "no error" : corrupt_error.c_str());
+
+    if (mismatches)
+        std::printf("FAILED: %llu shown frames differ from the trajectory\n", static_cast<unsigned long long>(mismatches));
+    if (corrupt_error.empty())
+        std::printf("FAILED: playing a corrupt trajectory reported no error\n");
+    return mismatches || corrupt_error.empty() ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// a GADGET-2 file of particles as type 1 with per-particle masses in the MASS block
+void write_gadget2(const std::string& path, const particle_set& particles, bool labelled, bool swapped) {
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file)
+        throw std::runtime_error("cannot write " + path);
+
+    auto put = [&](uint32_t value) {
+        value = swapped ? byte_swap(value) : value;
+        std::fwrite(&value, sizeof(value), 1, file);
+    };
+    // values of width bytes each, swapped if need be
+    auto block = [&](const char* label, std::vector<uint8_t> bytes, size_t width) {
+        if (labelled) {
+            put(8);
+            std::fwrite(label, 1, 4, file);
+            put(static_cast<uint32_t>(bytes.size() + 8));
+            put(8);
+        }
+        if (swapped)
+            for (size_t i = 0; i + width <= bytes.size(); i += width)
+                std::reverse(bytes.begin() + i, bytes.begin() + i + width);
+
+        put(static_cast<uint32_t>(bytes.size()));
+        std::fwrite(bytes.data(), 1, bytes.size(), file);
+        put(static_cast<uint32_t>(bytes.size()));
+    };
+    auto vectors = [&](const std::vector<float>& x, const std::vector<float>& y, const std::vector<float>& z) {
+        std::vector<uint8_t> bytes(x.size() * 12);
+        for (size_t i = 0; i < x.size(); ++i) {
+            std::memcpy(&bytes[i * 12 + 0], &x[i], 4);
+            std::memcpy(&bytes[i * 12 + 4], &y[i], 4);
+            std::memcpy(&bytes[i * 12 + 8], &z[i], 4);
+        }
+        return bytes;
+    };
+
+    gadget2_header header = {};
+    header.npart[1] = static_cast<int32_t>(particles.size());
+    header.npart_total[1] = static_cast<uint32_t>(particles.size());
+    header.num_files = 1;
+    if (swapped) {
+        // the fields the loader reads
+        header.npart[1] = static_cast<int32_t>(byte_swap(static_cast<uint32_t>(header.npart[1])));
+        header.num_files = static_cast<int32_t>(byte_swap(static_cast<uint32_t>(header.num_files)));
+    }
+    std::vector<uint8_t> head(sizeof(header));
+    std::memcpy(head.data(), &header, sizeof(header));
+    block("HEAD", head, 1);
+
+    block("POS ", vectors(particles.px, particles.py, particles.pz), 4);
+    block("VEL ", vectors(particles.vx, particles.vy, particles.vz), 4);
+
+    std::vector<uint8_t> ids(particles.size() * 4);
+    for (uint32_t i = 0; i < particles.size(); ++i)
+        std::memcpy(&ids[i * 4], &i, 4);
+    block("ID  ", ids, 4);
+
+    std::vector<uint8_t> masses(particles.size() * 4);
+    std::memcpy(masses.data(), particles.mass.data(), masses.size());
+    block("MASS", masses, 4);
+
+    if (std::fclose(file) != 0)
+        throw std::runtime_error("cannot write " + path);
+}
+
+void write_csv(const std::string& path, const particle_set& particles) {
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file)
+        throw std::runtime_error("cannot write " + path);
+
+    // nine significant digits take every float there and back
+    std::fprintf(file, "# two clusters\nx,y,z,vx,vy,vz,mass\n");
+    for (size_t i = 0; i < particles.size(); ++i)
+        std::fprintf(file, "%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g\n", particles.px[i], particles.py[i], particles.pz[i],
+            particles.vx[i], particles.vy[i], particles.vz[i], particles.mass[i]);
+
+    if (std::fclose(file) != 0)
+        throw std::runtime_error("cannot write " + path);
+}
+
+int run_load(const options& opts) {
+    particle_set particles;
+    make_two_clusters(particles, opts.particles);
+
+    // give every particle its own mass so the MASS block and column are checked
+    for (uint32_t i = 0; i < opts.particles; ++i)
+        particles.mass[i] = gravity::particle_mass * (1.0f + (i % 7) * 0.125f);
+
+    struct file_t {
+        const char* name;
+        std::string path;
+    };
+    const file_t files[] = {
+        { "csv", opts.dir + "/ic.csv" },
+        { "gadget2", opts.dir + "/ic.gadget2" },
+        { "gadget2 format 2, swapped", opts.dir + "/ic_swapped.gadget2" },
+        { "snapshot", opts.dir + "/ic.snap" },
+    };
+
+    write_csv(files[0].path, particles);
+    write_gadget2(files[1].path, particles, false, false);
+    write_gadget2(files[2].path, particles, true, true);
+    write_snapshot(files[3].path, particles, snapshot_info{});
+
+    std::printf("%u particles\n\n%-28s %10s %10s %12s\n", opts.particles, "format", "MB", "ms", "M particles/s");
+
+    bool ok = true;
+    for (const file_t& file : files) {
+        const double megabytes = mapped_file(file.path).size() / 1e6;
+
+        particle_set loaded;
+        const auto start = std::chrono::steady_clock::now();
+        load_initial_conditions(file.path, loaded);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        const bool same = loaded.size() == particles.size() &&
+            loaded.px == particles.px && loaded.py == particles.py && loaded.pz == particles.pz &&
+            loaded.vx == particles.vx && loaded.vy == particles.vy && loaded.vz == particles.vz &&
+            loaded.mass == particles.mass;
+        ok = ok && same;
+
+        std::printf("%-28s %10.1f %10.1f %12.1f%s\n", file.name, megabytes, seconds * 1000.0,
+            opts.particles / seconds / 1e6, same ? "" : "  differs");
+    }
+
+    if (!ok)
+        std::printf("FAILED: a loaded state differs from the written one\n");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// 2K / |W|, the potential from every k-th particle weighing k times as much
+double virial_ratio(const particle_set& particles) {
+    const size_t count = particles.size();
+    const size_t stride = (std::max)(count / 8192, size_t(1));
+
+    double kinetic = 0.0;
+    for (size_t i = 0; i < count; ++i)
+        kinetic += 0.5 * particles.mass[i] * (double(particles.vx[i]) * particles.vx[i] + double(particles.vy[i]) * particles.vy[i] + double(particles.vz[i]) * particles.vz[i]);
+
+    double potential = 0.0;
+    for (size_t i = 0; i < count; i += stride)
+        for (size_t j = i + stride; j < count; j += stride) {
+            const double dx = double(particles.px[i]) - particles.px[j];
+            const double dy = double(particles.py[i]) - particles.py[j];
+            const double dz = double(particles.pz[i]) - particles.pz[j];
+            potential -= gravity::G * double(particles.mass[i]) * stride * particles.mass[j] * stride / std::sqrt(dx * dx + dy * dy + dz * dz + gravity::softening_squared);
+        }
+
+    return 2.0 * kinetic / std::fabs(potential);
+}
+
+int run_ic(const options& opts) {
+    // kat_vectors of Random123: counter, key, expected output
+    struct known_answer {
+        philox_block counter;
+        uint32_t     key[2];
+        philox_block expected;
+    };
+    const known_answer known_answers[] = {
+        { { { 0x00000000u, 0x00000000u, 0x00000000u, 0x00000000u } }, { 0x00000000u, 0x00000000u }, { { 0x6627e8d5u, 0xe169c58du, 0xbc57ac4cu, 0x9b00dbd8u } } },
+        { { { 0xffffffffu, 0xffffffffu, 0xffffffffu, 0xffffffffu } }, { 0xffffffffu, 0xffffffffu }, { { 0x408f276du, 0x41c83b0eu, 0xa20bc7c6u, 0x6d5451fdu } } },
+        { { { 0x243f6a88u, 0x85a308d3u, 0x13198a2eu, 0x03707344u } }, { 0xa4093822u, 0x299f31d0u }, { { 0xd16cfe09u, 0x94fdccebu, 0x5001e420u, 0x24126ea1u } } },
+    };
+    for (const known_answer& answer : known_answers) {
+        const philox_block output = philox4x32(answer.counter, answer.key[0], answer.key[1]);
+        if (std::memcmp(output.v, answer.expected.v, sizeof(output.v)) != 0) {
+            std::printf("FAILED: Philox4x32-10 of %08x %08x %08x %08x, key %08x %08x gives %08x %08x %08x %08x instead of %08x %08x %08x %08x\n",
+                answer.counter.v[0], answer.counter.v[1], answer.counter.v[2], answer.counter.v[3], answer.key[0], answer.key[1],
+                output.v[0], output.v[1], output.v[2], output.v[3],
+                answer.expected.v[0], answer.expected.v[1], answer.expected.v[2], answer.expected.v[3]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    const char* const models[] = { "two-clusters", "plummer", "hernquist", "disk", "galaxy", "merger" };
+    const unsigned thread_counts[] = { 1, 4, 16 };
+
+    std::printf("Philox4x32-10 known answers: ok\n%u particles\n\n%-14s %-18s %12s %10s  %s\n", opts.particles, "model", "checksum", "M particles/s", "2K/|W|", "threads");
+
+    bool identical = true;
+    for (const char* model : models) {
+        uint64_t reference = 0;
+        double seconds = 0.0;
+        bool same = true;
+        particle_set particles;
+
+        for (unsigned thread_count : thread_counts) {
+            const auto start = std::chrono::steady_clock::now();
+            make_initial_conditions(model, particles, opts.particles, 400.0, 0, thread_count);
+            const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            const uint64_t checksum = state_checksum(particles);
+            if (thread_count == thread_counts[0]) {
+                reference = checksum;
+                seconds = elapsed;
+            }
+            same = same && checksum == reference;
+            seconds = (std::min)(seconds, elapsed);
+        }
+        identical = identical && same;
+
+        std::printf("%-14s %016llx %12.1f %10.3f  %s\n", model, static_cast<unsigned long long>(reference),
+            opts.particles / seconds / 1e6, virial_ratio(particles), same ? "identical" : "DIFFER");
+    }
+
+    if (!identical)
+        std::printf("FAILED: a model depends on the thread count\n");
+    return identical ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// the ids of the particles, sorted
+std::vector<uint32_t> sorted_ids(const particle_set& particles) {
+    std::vector<uint32_t> ids = particles.id;
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
+
+int run_query(const options& opts) {
+    const uint32_t chunk_size = 1024;
+    const std::string path = opts.dir + "/query.snap";
+
+    particle_set particles;
+    make_initial_conditions("plummer", particles, opts.particles);
+    write_indexed_snapshot(path, particles, snapshot_info{}, chunk_size);
+
+    indexed_snapshot snapshot(path);
+    const double total_bytes = static_cast<double>(snapshot.size()) * snapshot.row_bytes();
+
+    const bounding_cube bounds = compute_bounds(particles);
+    const float center[3] = { bounds.min_x + bounds.size * 0.5f, bounds.min_y + bounds.size * 0.5f, bounds.min_z + bounds.size * 0.5f };
+
+    std::printf("%u particles, %u chunks of %u\n\n%-8s %10s %10s %10s %10s %10s\n", opts.particles, snapshot.chunk_count(), chunk_size,
+        "query", "size", "found", "chunks %", "bytes %", "ms");
+
+    bool ok = true;
+    particle_set result;
+    auto report = [&](const char* query, double size, double seconds, bool same) {
+        const snapshot_query_stats& stats = snapshot.stats();
+        std::printf("%-8s %10.4g %10zu %10.2f %10.2f %10.3f%s\n", query, size, result.size(),
+            100.0 * stats.chunks_read / snapshot.chunk_count(), 100.0 * stats.bytes_read / total_bytes,
+            seconds * 1000.0, same ? "" : "  differs");
+        ok = ok && same;
+        snapshot.reset_stats();
+    };
+
+    for (double fraction : { 0.001, 0.01, 0.05, 0.1, 0.25, 1.0 }) {
+        const float half = static_cast<float>(bounds.size * fraction * 0.5);
+        const float lo[3] = { center[0] - half, center[1] - half, center[2] - half };
+        const float hi[3] = { center[0] + half, center[1] + half, center[2] + half };
+
+        const auto start = std::chrono::steady_clock::now();
+        snapshot.query_box(lo, hi, result);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        particle_set expected;
+        for (uint32_t i = 0; i < opts.particles; ++i)
+            if (particles.px[i] >= lo[0] && particles.px[i] <= hi[0] &&
+                particles.py[i] >= lo[1] && particles.py[i] <= hi[1] &&
+                particles.pz[i] >= lo[2] && particles.pz[i] <= hi[2])
+                expected.id.push_back(particles.id[i]);
+
+        report("box", 2.0 * half, seconds, sorted_ids(result) == sorted_ids(expected));
+    }
+
+    for (double fraction : { 0.001, 0.01, 0.05, 0.1, 0.25, 1.0 }) {
+        const float radius = static_cast<float>(bounds.size * fraction * 0.5);
+
+        const auto start = std::chrono::steady_clock::now();
+        snapshot.query_sphere(center, radius, result);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        particle_set expected;
+        for (uint32_t i = 0; i < opts.particles; ++i) {
+            const double dx = double(particles.px[i]) - center[0];
+            const double dy = double(particles.py[i]) - center[1];
+            const double dz = double(particles.pz[i]) - center[2];
+            if (dx * dx + dy * dy + dz * dz <= double(radius) * radius)
+                expected.id.push_back(particles.id[i]);
+        }
+
+        report("sphere", radius, seconds, sorted_ids(result) == sorted_ids(expected));
+    }
+
+    std::vector<double> distances(opts.particles);
+    for (uint32_t i = 0; i < opts.particles; ++i) {
+        const double dx = double(particles.px[i]) - center[0];
+        const double dy = double(particles.py[i]) - center[1];
+        const double dz = double(particles.pz[i]) - center[2];
+        distances[i] = dx * dx + dy * dy + dz * dz;
+    }
+    std::sort(distances.begin(), distances.end());
+
+    for (size_t k : { 1, 16, 256, 4096 }) {
+        k = (std::min)(k, size_t(opts.particles));
+
+        const auto start = std::chrono::steady_clock::now();
+        snapshot.query_nearest(center, k, result);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        // ties may pick other particles, the distances must agree
+        bool same = result.size() == k;
+        for (size_t i = 0; same && i < k; ++i) {
+            const double dx = double(result.px[i]) - center[0];
+            const double dy = double(result.py[i]) - center[1];
+            const double dz = double(result.pz[i]) - center[2];
+            same = dx * dx + dy * dy + dz * dz == distances[i];
+        }
+
+        report("nearest", double(k), seconds, same);
+    }
+
+    if (!ok)
+        std::printf("FAILED: a query result differs from the brute-force scan\n");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int run_lod(const options& opts) {
+    const uint32_t level_count = 10;
+    const std::string snapshot_path = opts.dir + "/lod.snap";
+    const std::string pyramid_path = opts.dir + "/lod.pyramid";
+
+    particle_set particles;
+    make_initial_conditions("galaxy", particles, opts.particles);
+    write_snapshot(snapshot_path, particles, snapshot_info{});
+
+    // from the file, a few batches
+    snapshot_file snapshot(snapshot_path);
+    const auto start = std::chrono::steady_clock::now();
+    const lod_pyramid pyramid = build_lod_pyramid(snapshot.view(), level_count, (opts.particles + 3) / 4);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    write_lod_pyramid(pyramid_path, pyramid);
+
+    // in memory, one batch
+    lod_builder builder(snapshot_bounds(snapshot.view()), level_count);
+    builder.add(particles);
+    const lod_pyramid reference = builder.build();
+
+    double mass = 0.0, com[3] = {};
+    for (uint32_t i = 0; i < opts.particles; ++i) {
+        mass += particles.mass[i];
+        com[0] += double(particles.mass[i]) * particles.px[i];
+        com[1] += double(particles.mass[i]) * particles.py[i];
+        com[2] += double(particles.mass[i]) * particles.pz[i];
+    }
+
+    std::printf("%u particles, built in %.1f ms (%.1f M particles/s)\n\n%-6s %10s %10s %12s %12s\n", opts.particles,
+        seconds * 1000.0, opts.particles / seconds / 1e6, "level", "points", "MB", "mass error", "com error");
+
+    const lod_file file(pyramid_path);
+    bool ok = file.level_count() == level_count;
+    for (uint32_t l = 0; l < pyramid.levels.size(); ++l) {
+        const std::vector<lod_point>& points = pyramid.levels[l];
+
+        double level_mass = 0.0, level_com[3] = {};
+        uint64_t count = 0;
+        for (const lod_point& p : points) {
+            level_mass += p.mass;
+            for (int axis = 0; axis < 3; ++axis)
+                level_com[axis] += double(p.mass) * p.position[axis];
+            count += p.count;
+        }
+
+        const double mass_error = std::fabs(level_mass - mass) / mass;
+        double com_error = 0.0;
+        for (int axis = 0; axis < 3; ++axis)
+            com_error = (std::max)(com_error, std::fabs(level_com[axis] / level_mass - com[axis] / mass) / pyramid.bounds.size);
+
+        const bool same = count == opts.particles && mass_error < 1e-5 && com_error < 1e-5 &&
+            reference.levels[l].size() == points.size() &&
+            !std::memcmp(reference.levels[l].data(), points.data(), points.size() * sizeof(lod_point)) &&
+            file.level_size(l) == points.size() &&
+            !std::memcmp(file.level(l), points.data(), points.size() * sizeof(lod_point));
+        ok = ok && same;
+
+        std::printf("%-6u %10zu %10.2f %12.2e %12.2e%s\n", l, points.size(), points.size() * sizeof(lod_point) / 1e6,
+            mass_error, com_error, same ? "" : "  differs");
+    }
+
+    std::printf("\nlevel for 100k points: %u, for a 1080p view from 3x the size: %u\n",
+        file.level_for_budget(100000), file.level_for_view(3.0f * pyramid.bounds.size, 0.785f, 1080.0f));
+
+    if (!ok)
+        std::printf("FAILED: a level lost mass or particles, or the pyramids differ\n");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// the renderer's particle_t: position and mass, velocity and |a|
+void store_interleaved(const particle_set& particles, float* destination) {
+    for (size_t i = 0; i < particles.size(); ++i, destination += 8) {
+        destination[0] = particles.px[i]; destination[1] = particles.py[i]; destination[2] = particles.pz[i]; destination[3] = particles.mass[i];
+        destination[4] = particles.vx[i]; destination[5] = particles.vy[i]; destination[6] = particles.vz[i]; destination[7] = particles.acceleration[i];
+    }
+}
+
+void load_interleaved(const float* source, size_t count, particle_set& particles) {
+    particles.resize(count);
+    for (size_t i = 0; i < count; ++i, source += 8) {
+        particles.px[i] = source[0]; particles.py[i] = source[1]; particles.pz[i] = source[2]; particles.mass[i] = source[3];
+        particles.vx[i] = source[4]; particles.vy[i] = source[5]; particles.vz[i] = source[6]; particles.acceleration[i] = source[7];
+    }
+}
+
+int run_mirror(const options& opts) {
+    const uint32_t steps = opts.steps > 5 ? opts.steps : 64;
+    const uint32_t every = opts.every > 1 ? opts.every : 16;
+
+    particle_set particles;
+    make_two_clusters(particles, opts.particles);
+    auto engine = make_engine(opts.engine);
+    compute_data params = make_compute_data(opts.particles);
+
+    // the readback buffers the GPU copies into
+    std::vector<float> readback[2];
+    readback[0].resize(size_t(opts.particles) * 8);
+    readback[1].resize(size_t(opts.particles) * 8);
+
+    std::vector<uint64_t> checksums(steps + 1);
+    state_mirror mirror(every);
+    double simulate = 0.0, overhead = 0.0;
+
+    for (uint32_t step = 1; step <= steps; ++step) {
+        auto start = std::chrono::steady_clock::now();
+        engine->step(particles, params);
+        simulate += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        checksums[step] = state_checksum(particles);
+
+        // acquire() and submit() are all the simulation thread does; the
+        // stand-in copy takes the place of CopyResource on the GPU timeline
+        if (!mirror.due(step))
+            continue;
+        const uint32_t slot = mirror.slot(step);
+
+        start = std::chrono::steady_clock::now();
+        mirror.acquire(slot);
+        overhead += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        store_interleaved(particles, readback[slot].data());
+
+        start = std::chrono::steady_clock::now();
+        mirror.submit(slot, step, readback[slot].data(), readback[slot].size() * sizeof(float));
+        overhead += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // the device is lost after the last step: restore_resources() flushes,
+    // then create_particles_buffer() uploads the mirror's image
+    auto start = std::chrono::steady_clock::now();
+    mirror.flush();
+    particle_set restored;
+    uint64_t restored_step = 0;
+    const bool valid = mirror.read([&](const void* state, size_t size, uint64_t step) {
+        load_interleaved(static_cast<const float*>(state), size / (8 * sizeof(float)), restored);
+        restored_step = step;
+    });
+    const double restore = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const mirror_stats stats = mirror.stats();
+    const uint64_t lost = steps - restored_step;
+    const bool same = valid && restored.size() == opts.particles && restored_step <= steps && state_checksum(restored) == checksums[restored_step];
+    const bool ok = same && lost <= every;
+
+    std::printf("engine %s, %u particles, %u steps, a mirror every %u steps of %.1f MB\n\n",
+        opts.engine.c_str(), opts.particles, steps, every, readback[0].size() * sizeof(float) / 1e6);
+    std::printf("simulation s         %10.3f\n", simulate);
+    std::printf("mirror stall s       %10.6f  (%.3f%%)\n", overhead, 100.0 * overhead / simulate);
+    std::printf("longest acquire ms   %10.3f\n", stats.max_wait * 1000.0);
+    std::printf("last copy ms         %10.3f\n", stats.last_copy * 1000.0);
+    std::printf("mirrored / published %6llu / %llu\n",
+        static_cast<unsigned long long>(stats.submitted), static_cast<unsigned long long>(stats.published));
+    std::printf("restored step        %10llu  (%llu lost)\n",
+        static_cast<unsigned long long>(restored_step), static_cast<unsigned long long>(lost));
+    std::printf("restore ms           %10.3f\n", restore * 1000.0);
+
+    if (!ok)
+        std::printf("FAILED: %s\n", same ? "more steps lost than the mirror interval" : "the restored state differs from the mirrored step");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+struct bench_profile {
+    std::vector<uint32_t>    particles;
+    std::vector<const char*> precisions;
+    std::vector<unsigned>    threads;
+    uint32_t                 direct_max;    // direct sums beyond this take minutes a step
+    uint32_t                 warmup;
+    uint32_t                 repetitions;
+};
+
+bench_profile make_bench_profile(const std::string& name) {
+    const unsigned hardware = (std::max)(1u, std::thread::hardware_concurrency());
+
+    bench_profile profile;
+    if (name == "smoke") {
+        profile.particles = { 1000, 10000 };
+        profile.precisions = { float_accumulator::name };
+        profile.threads = { 1, hardware };
+        profile.direct_max = 10000;
+        profile.warmup = 1;
+        profile.repetitions = 5;
+    }
+    else if (name == "full") {
+        profile.particles = { 1000, 10000, 100000, 1000000, 10000000 };
+        profile.precisions = { float_accumulator::name, kahan_accumulator::name, double_accumulator::name, full_double_accumulator::name };
+        for (unsigned threads = 1; threads < hardware; threads *= 2)
+            profile.threads.push_back(threads);
+        profile.threads.push_back(hardware);
+        profile.direct_max = 100000;
+        profile.warmup = 2;
+        profile.repetitions = 10;
+    }
+    else {
+        throw std::runtime_error("unknown profile " + name);
+    }
+
+    profile.threads.erase(std::unique(profile.threads.begin(), profile.threads.end()), profile.threads.end());
+    return profile;
+}
+
+int run_suite(const options& opts) {
+    const bench_profile profile = make_bench_profile(opts.profile);
+    const std::vector<std::string> engines = opts.engine.empty() ? std::vector<std::string>{ "direct", "tree" } : std::vector<std::string>{ opts.engine };
+
+    bench_report report;
+    report.profile = opts.profile;
+    report.isa = build_isa();
+    report.compiler = build_compiler();
+    report.hardware_threads = (std::max)(1u, std::thread::hardware_concurrency());
+    report.warmup = opts.warmup ? opts.warmup : profile.warmup;
+    report.repetitions = opts.repetitions ? opts.repetitions : profile.repetitions;
+
+    std::printf("profile %s, %s, %u hardware threads, %u warmup steps, %u repetitions\n\n",
+        report.profile.c_str(), report.isa.c_str(), report.hardware_threads, report.warmup, report.repetitions);
+#ifdef NBODY_PERF_COUNTERS
+    // the main thread's group tells whether the kernel allows counters at all
+    perf_counters::instance().group();
+    std::printf("hardware counters: %s\n\n", perf_counters::instance().status().c_str());
+#endif
+    std::printf("%-36s %10s %21s %12s %9s %10s %7s\n", "case", "median ms", "95% CI of mean ms", "Minter/s", "GFLOP/s", "ns/p/step", "eff");
+
+    for (uint32_t count : profile.particles) {
+        // the same Plummer sphere for every case of a size
+        particle_set initial;
+        make_initial_conditions("plummer", initial, count);
+
+        for (const std::string& engine_name : engines) {
+            if (engine_name == "direct" && count > profile.direct_max)
+                continue;
+
+            for (const char* precision : profile.precisions) {
+                double one_thread = 0.0;
+
+                for (unsigned threads : profile.threads) {
+                    engine_config config;
+                    config.thread_count = threads;
+                    auto engine = make_engine(engine_name, config, precision);
+                    particle_set particles = initial;
+                    compute_data params = make_compute_data(count);
+
+                    for (uint32_t step = 0; step < report.warmup; ++step)
+                        engine->step(particles, params);
+
+                    bench_case bc;
+                    bc.engine = engine_name;
+                    bc.precision = precision;
+                    bc.particles = count;
+                    bc.threads = engine->thread_count();
+
+                    perf_counters::instance().reset();
+                    for (uint32_t repetition = 0; repetition < report.repetitions; ++repetition) {
+                        auto start = std::chrono::steady_clock::now();
+                        engine->step(particles, params);
+                        bc.seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+                        uint64_t interactions = 0;
+                        for (uint32_t cost : particles.cost)
+                            interactions += cost;
+                        bc.interactions += double(interactions) / report.repetitions;
+                    }
+
+                    const sample_summary s = summarize(bc.seconds);
+                    if (bc.threads == 1)
+                        one_thread = s.mean;
+                    bc.scaling_efficiency = one_thread > 0.0 ? one_thread / (s.mean * bc.threads) : 0.0;
+
+                    std::printf("%-36s %10.3f %10.3f..%-9.3f %12.1f %9.2f %10.2f %7.2f\n", bc.name().c_str(),
+                        s.median * 1000.0, s.ci_low * 1000.0, s.ci_high * 1000.0, bc.interactions / s.mean * 1e-6,
+                        bc.interactions * flops_per_interaction / s.mean * 1e-9, s.mean / count * 1e9, bc.scaling_efficiency);
+
+#ifdef NBODY_PERF_COUNTERS
+                    // per step, under the case; thread time only where the kernel refused the counters
+                    for (uint32_t phase = 0; phase < static_cast<uint32_t>(perf_phase::count); ++phase) {
+                        const perf_values values = perf_counters::instance().totals(static_cast<perf_phase>(phase));
+                        if (values.calls == 0)
+                            continue;
+
+                        phase_counters pc;
+                        pc.phase = perf_phase_name(static_cast<perf_phase>(phase));
+                        pc.seconds = values.ns * 1e-9 / report.repetitions;
+                        pc.cycles = double(values.events[perf_cycles]) / report.repetitions;
+                        pc.instructions = double(values.events[perf_instructions]) / report.repetitions;
+                        pc.cache_references = double(values.events[perf_cache_references]) / report.repetitions;
+                        pc.cache_misses = double(values.events[perf_cache_misses]) / report.repetitions;
+                        pc.flops = static_cast<perf_phase>(phase) == perf_phase::walk ? bc.interactions * flops_per_interaction : 0.0;
+                        bc.counters.push_back(pc);
+
+                        std::printf("    %-10s %10.3f ms thread time", pc.phase.c_str(), pc.seconds * 1000.0);
+                        if (values.counted)
+                            std::printf("  IPC %5.2f  cache misses/kinstr %7.3f", values.ipc(), values.mpki());
+                        else
+                            std::printf("  no counters");
+                        if (values.counted && pc.flops > 0.0 && pc.cycles > 0.0)
+                            std::printf("  FLOP/cycle %5.2f", pc.flops / pc.cycles);
+                        std::printf("\n");
+                    }
+#endif
+                    std::fflush(stdout);
+
+                    report.cases.push_back(bc);
+                }
+            }
+        }
+    }
+
+    const std::string path = opts.json.empty() ? "bench-" + opts.profile + ".json" : opts.json;
+    write_bench_report(path, report);
+    std::printf("\n%zu cases written to %s\n", report.cases.size(), path.c_str());
+    return EXIT_SUCCESS;
+}
+
+int run_compare(const options& opts) {
+    if (opts.baseline.empty() || opts.json.empty()) {
+        std::fprintf(stderr, "compare needs --baseline FILE and --json FILE\n");
+        return EXIT_FAILURE;
+    }
+
+    const double alpha = 0.05;
+    bench_report baseline, current;
+    try {
+        baseline = read_bench_report(opts.baseline);
+        current = read_bench_report(opts.json);
+    }
+    catch (const std::exception& e) {
+        std::printf("FAILED: %s\n", e.what());
+        return EXIT_FAILURE;
+    }
+
+    std::printf("baseline %s: %s, %s, %s, %u hardware threads\n", opts.baseline.c_str(),
+        baseline.profile.c_str(), baseline.isa.c_str(), baseline.compiler.c_str(), baseline.hardware_threads);
+    std::printf("current  %s: %s, %s, %s, %u hardware threads\n", opts.json.c_str(),
+        current.profile.c_str(), current.isa.c_str(), current.compiler.c_str(), current.hardware_threads);
+    if (baseline.isa != current.isa || baseline.compiler != current.compiler || baseline.hardware_threads != current.hardware_threads)
+        std::printf("note: the builds or machines differ\n");
+    std::printf("threshold %.1f%%, significance %.2f\n\n", opts.threshold * 100.0, alpha);
+
+    std::printf("%-36s %12s %12s %9s %9s  %s\n", "case", "baseline ms", "current ms", "change", "p", "verdict");
+
+    size_t regressions = 0, improvements = 0, unchanged = 0, unmatched = 0;
+    for (const bench_case& now : current.cases) {
+        const std::string name = now.name();
+        auto before = std::find_if(baseline.cases.begin(), baseline.cases.end(), [&](const bench_case& c) { return c.name() == name; });
+        if (before == baseline.cases.end()) {
+            std::printf("%-36s %12s %12.3f %9s %9s  new\n", name.c_str(), "-", summarize(now.seconds).median * 1000.0, "-", "-");
+            ++unmatched;
+            continue;
+        }
+
+        const sample_comparison c = compare_samples(before->seconds, now.seconds);
+        const char* verdict = "same";
+        double p = (std::min)(c.p_slower, c.p_faster);
+        if (c.change > opts.threshold && c.p_slower < alpha) {
+            verdict = "REGRESSION";
+            p = c.p_slower;
+            ++regressions;
+        }
+        else if (c.change < -opts.threshold && c.p_faster < alpha) {
+            verdict = "faster";
+            p = c.p_faster;
+            ++improvements;
+        }
+        else {
+            // beyond the threshold but within the noise, or significant but small
+            if (std::fabs(c.change) > opts.threshold)
+                verdict = "unclear";
+            ++unchanged;
+        }
+
+        std::printf("%-36s %12.3f %12.3f %+8.1f%% %9.4f  %s\n", name.c_str(),
+            c.baseline_median * 1000.0, c.current_median * 1000.0, c.change * 100.0, p, verdict);
+    }
+
+    for (const bench_case& old : baseline.cases) {
+        const std::string name = old.name();
+        if (std::none_of(current.cases.begin(), current.cases.end(), [&](const bench_case& c) { return c.name() == name; })) {
+            std::printf("%-36s %12.3f %12s %9s %9s  missing\n", name.c_str(), summarize(old.seconds).median * 1000.0, "-", "-", "-");
+            ++unmatched;
+        }
+    }
+
+    std::printf("\n%zu regressions, %zu faster, %zu unchanged, %zu without a counterpart\n", regressions, improvements, unchanged, unmatched);
+    if (regressions)
+        std::printf("FAILED: %zu cases regressed by more than %.1f%%\n", regressions, opts.threshold * 100.0);
+    return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int run_trace(const options& opts) {
+    // the cost of one event, whatever the build
+    const uint32_t scopes = 1000000;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < scopes; ++i)
+        trace_scope scope("bench");
+    const double per_scope = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / scopes;
+
+    particle_set particles;
+    make_two_clusters(particles, opts.particles);
+    auto engine = make_engine(opts.engine);
+    compute_data params = make_compute_data(opts.particles);
+
+    const uint64_t events_before = tracer::instance().event_count();
+    start = std::chrono::steady_clock::now();
+    for (uint32_t step = 0; step < opts.steps; ++step)
+        engine->step(particles, params);
+    const double per_step = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / opts.steps;
+    const double events = double(tracer::instance().event_count() - events_before) / opts.steps;
+
+    std::printf("engine %s, %u particles, %u steps, %u threads\n\n", opts.engine.c_str(), opts.particles, opts.steps, engine->thread_count());
+    std::printf("ns per trace_scope   %10.1f\n", per_scope * 1e9);
+    std::printf("ms per step          %10.3f\n", per_step * 1000.0);
+
+#ifdef NBODY_TRACE
+    std::printf("events per step      %10.1f\n", events);
+    std::printf("tracing overhead     %9.4f%%\n", 100.0 * events * per_scope / per_step);
+
+    const std::string path = opts.dir + "/trace.json";
+    tracer::instance().write_chrome_trace(path);
+
+    // it must read back, with the phases of the engine
+    FILE* file = std::fopen(path.c_str(), "rb");
+    std::string text;
+    char buffer[1 << 16];
+    size_t read;
+    while (file && (read = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+        text.append(buffer, read);
+    if (file)
+        std::fclose(file);
+
+    const char* phases[] = { "force", "integrate", opts.engine == "tree" ? "tree walk" : "force zone" };
+    bool ok = true;
+    size_t count = 0;
+    try {
+        const json_value root = json_parser(text.data(), text.data() + text.size()).parse();
+        const json_value* trace_events = root.find("traceEvents");
+        count = trace_events ? trace_events->items.size() : 0;
+        for (const char* phase : phases) {
+            ok = ok && trace_events && std::any_of(trace_events->items.begin(), trace_events->items.end(), [&](const json_value& event) {
+                const json_value* name = event.find("name");
+                return name && name->text == phase;
+            });
+        }
+    }
+    catch (const std::exception&) {
+        ok = false;
+    }
+    std::printf("\n%zu events written to %s\n", count, path.c_str());
+
+    if (!ok)
+        std::printf("FAILED: the trace does not read back with the engine's phases\n");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+#else
+    (void)events;
+    std::printf("tracing              compiled out, configure with -DNBODY_TRACE=ON\n");
+    return EXIT_SUCCESS;
+#endif
+}
+
+// Stands in for a queue and its timestamp query heap: the timestamps a frame's
+// EndQuery calls write and the copy of ResolveQueryData happen when the frame
+// completes, latency frames after it was submitted.
+class fake_timestamp_queue {
+public:
+    fake_timestamp_queue(uint32_t query_count, uint32_t latency) :
+        heap_(query_count),
+        readback_(query_count),
+        latency_(latency)
+    {
+    }
+
+    // one EndQuery; the clock advances by the work recorded before it
+    void end_query(uint32_t query, uint64_t ticks_before) {
+        clock_ += ticks_before;
+        recording_.writes.push_back({ query, clock_ });
+    }
+
+    void submit(uint64_t fence, gpu_timer_ring::resolve_range range) {
+        recording_.fence = fence;
+        recording_.range = range;
+        in_flight_.push_back(recording_);
+        recording_ = frame_t();
+        submitted_ = fence;
+    }
+
+    // the fence value the queue has reached; finish() lets it catch up
+    uint64_t completed(bool finish = false) {
+        const uint64_t reached = finish ? submitted_ : (submitted_ > latency_ ? submitted_ - latency_ : 0);
+        while (!in_flight_.empty() && in_flight_.front().fence <= reached) {
+            const frame_t& frame = in_flight_.front();
+            for (const auto& write : frame.writes)
+                heap_[write.first] = write.second;
+            std::copy(heap_.begin() + frame.range.first, heap_.begin() + frame.range.first + frame.range.count, readback_.begin() + size_t(frame.range.offset / sizeof(uint64_t)));
+            in_flight_.erase(in_flight_.begin());
+        }
+        return reached;
+    }
+
+    const uint64_t* readback() const { return readback_.data(); }
+
+private:
+    struct frame_t {
+        uint64_t                                    fence = 0;
+        gpu_timer_ring::resolve_range               range = {};
+        std::vector<std::pair<uint32_t, uint64_t>>  writes;
+    };
+
+    std::vector<uint64_t>   heap_;
+    std::vector<uint64_t>   readback_;
+    const uint32_t          latency_;
+    uint64_t                clock_ = 0;
+    uint64_t                submitted_ = 0;
+    frame_t                 recording_;
+    std::vector<frame_t>    in_flight_;
+};
+
+// the lengths of the fake passes, in ticks
+uint64_t simulate_ticks(uint64_t frame) { return 1000 + (frame % 7) * 10; }
+uint64_t draw_ticks(uint64_t frame) { return 250 + (frame % 3) * 50; }
+
+int run_gpu_timers(const options& opts) {
+    const uint32_t frames = opts.steps > 5 ? opts.steps : 1000;
+    const uint32_t ring_frames = 4;
+    const uint64_t ticks_per_second = 1000000;     // a tick is 1 us
+
+    std::printf("%u frames, a ring of %u frames, timestamps at %llu Hz\n\n", frames, ring_frames, static_cast<unsigned long long>(ticks_per_second));
+    std::printf("latency  collected  dropped  simulate p50/p99/max us   draw p50/p99/max us   ns per frame\n");
+
+    bool ok = true;
+    const uint32_t latencies[] = { 1, 2, 3, 8 };
+    for (uint32_t latency : latencies) {
+        metrics_registry registry;
+        gpu_timer_ring ring(registry, ring_frames, 2, ticks_per_second);
+        const uint32_t simulate = ring.pass("simulate");
+        const uint32_t draw = ring.pass("draw");
+        fake_timestamp_queue queue(ring.query_count(), latency);
+
+        // what the ring does per frame, without the fake queue's share
+        double ring_seconds = 0.0;
+        for (uint64_t frame = 1; frame <= frames; ++frame) {
+            const uint64_t completed = queue.completed();
+
+            auto start = std::chrono::steady_clock::now();
+            ring.collect(completed, queue.readback());
+            ring.begin_frame(frame);
+            const uint32_t simulate_begin = ring.begin(simulate);
+            const uint32_t simulate_end = ring.end(simulate);
+            const uint32_t draw_begin = ring.begin(draw);
+            const uint32_t draw_end = ring.end(draw);
+            const gpu_timer_ring::resolve_range range = ring.end_frame();
+            ring_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            queue.end_query(simulate_begin, 100);
+            queue.end_query(simulate_end, simulate_ticks(frame));
+            queue.end_query(draw_begin, 20);
+            queue.end_query(draw_end, draw_ticks(frame));
+            queue.submit(frame, range);
+        }
+        ring.collect(queue.completed(true), queue.readback());
+
+        // a frame is collected unless its slot came round again before that
+        const gpu_timer_stats stats = ring.stats();
+        const bool deep_enough = latency < ring_frames;
+        if (stats.collected + stats.dropped != frames || (deep_enough ? stats.dropped != 0 : stats.dropped == 0))
+            ok = false;
+
+        // the collected frames are the last ones of every run of drops; with
+        // no drops all of them, and the histograms must hold their passes
+        const histogram_snapshot simulate_seconds = registry.histogram("nbody_gpu_simulate_seconds").snapshot();
+        const histogram_snapshot draw_seconds = registry.histogram("nbody_gpu_draw_seconds").snapshot();
+        if (simulate_seconds.count != stats.collected || draw_seconds.count != stats.collected)
+            ok = false;
+
+        if (deep_enough) {
+            auto check = [&](const histogram_snapshot& histogram, uint64_t (*ticks)(uint64_t)) {
+                std::vector<uint64_t> expected;
+                for (uint64_t frame = 1; frame <= frames; ++frame)
+                    expected.push_back(ticks(frame) * 1000);
+                std::sort(expected.begin(), expected.end());
+
+                const double quantiles[] = { 0.5, 0.9, 0.99 };
+                for (double q : quantiles) {
+                    const size_t rank = (std::max)(size_t(1), static_cast<size_t>(std::ceil(q * expected.size())));
+                    const uint64_t exact = expected[rank - 1];
+                    const uint64_t reported = histogram.percentile(q);
+                    if (reported < exact || reported > exact + exact / 64)
+                        ok = false;
+                }
+                if (histogram.max != expected.back())
+                    ok = false;
+            };
+            check(simulate_seconds, simulate_ticks);
+            check(draw_seconds, draw_ticks);
+        }
+
+        std::printf("%7u  %9llu  %7llu  %7.1f/%7.1f/%7.1f   %6.1f/%6.1f/%6.1f   %12.1f\n", latency,
+            static_cast<unsigned long long>(stats.collected), static_cast<unsigned long long>(stats.dropped),
+            simulate_seconds.percentile(0.5) * 1e-3, simulate_seconds.percentile(0.99) * 1e-3, simulate_seconds.max * 1e-3,
+            draw_seconds.percentile(0.5) * 1e-3, draw_seconds.percentile(0.99) * 1e-3, draw_seconds.max * 1e-3,
+            ring_seconds / frames * 1e9);
+    }
+
+    if (!ok)
+        std::printf("FAILED: the collected timings do not match the passes\n");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int run_conservation(const options& opts) {
+    const uint32_t steps = opts.steps > 5 ? opts.steps : 100;
+    const uint32_t every = opts.every > 1 ? opts.every : 10;
+    const char* precisions[] = { float_accumulator::name, kahan_accumulator::name, double_accumulator::name };
+    const integrator_kind integrators[] = { integrator_kind::euler_damped, integrator_kind::leapfrog };
+
+    particle_set initial;
+    make_initial_conditions("plummer", initial, opts.particles);
+    const compute_data params = make_compute_data(opts.particles);
+
+    FILE* csv = nullptr;
+    if (!opts.csv.empty()) {
+        csv = std::fopen(opts.csv.c_str(), "w");
+        if (!csv) {
+            std::printf("FAILED: cannot write %s\n", opts.csv.c_str());
+            return EXIT_FAILURE;
+        }
+        std::fprintf(csv, "precision,integrator,step,time,step_seconds,total_energy,energy_error,momentum_error,angular_momentum_error\n");
+    }
+
+    std::printf("engine %s, Plummer sphere of %u particles, %u steps of dt %g, a sample every %u steps\n\n", opts.engine.c_str(), opts.particles, steps, params.paramf[0], every);
+    std::printf("%-10s %-13s %10s %10s %12s %12s %12s %12s\n", "precision", "integrator", "ms/step", "diag ms", "dE/E0 last", "dE/E0 max", "dP/P", "dL/L");
+
+    for (const char* precision : precisions) {
+        for (integrator_kind integrator : integrators) {
+            engine_config config;
+            config.integrator = integrator;
+            auto engine = make_engine(opts.engine, config, precision);
+            particle_set particles = initial;
+
+            conservation_monitor monitor(every);
+            monitor.measure(*engine, particles, 0, 0.0);
+            double simulate = 0.0, diagnose = 0.0;
+            for (uint32_t step = 1; step <= steps; ++step) {
+                auto start = std::chrono::steady_clock::now();
+                engine->step(particles, params);
+                const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                simulate += seconds;
+                monitor.record_step(seconds);
+                if (monitor.due(step))
+                    diagnose += monitor.measure(*engine, particles, step, double(step) * params.paramf[0]).seconds;
+            }
+
+            const conservation_sample& last = monitor.series().back();
+            std::printf("%-10s %-13s %10.3f %10.3f %12.3e %12.3e %12.3e %12.3e\n", precision, integrator_name(integrator),
+                simulate / steps * 1000.0, diagnose / (std::max)(size_t(1), monitor.series().size() - 1) * 1000.0,
+                monitor.energy_error(last), monitor.max_energy_error(), monitor.momentum_error(last), monitor.angular_momentum_error(last));
+            std::fflush(stdout);
+
+            for (const conservation_sample& sample : monitor.series()) {
+                if (csv)
+                    std::fprintf(csv, "%s,%s,%llu,%.9g,%.9g,%.17g,%.9g,%.9g,%.9g\n", precision, integrator_name(integrator),
+                        static_cast<unsigned long long>(sample.step), sample.time, sample.step_seconds, sample.total(),
+                        monitor.energy_error(sample), monitor.momentum_error(sample), monitor.angular_momentum_error(sample));
+            }
+        }
+    }
+
+    if (csv)
+        std::fclose(csv);
+    return EXIT_SUCCESS;
+}
+
+int run_storage(const options& opts) {
+    const char* const models[] = { "two-clusters", "plummer", "hernquist", "disk", "galaxy", "merger" };
+    struct encoding {
+        const char*     name;
+        compact_format  format;
+    };
+    const encoding encodings[] = {
+        { "float+half",   { position_encoding::float_relative, velocity_encoding::half } },
+        { "float+bf16",   { position_encoding::float_relative, velocity_encoding::bfloat16 } },
+        { "fixed16+half", { position_encoding::fixed16, velocity_encoding::half } },
+        { "fixed16+bf16", { position_encoding::fixed16, velocity_encoding::bfloat16 } },
+    };
+
+    std::printf("%u particles\n\n%-13s %-13s %7s %11s %11s %7s %8s  %s\n", opts.particles, "model", "format", "bytes", "position", "velocity", "|a|", "masses", "verdict");
+
+    // error over bound; a zero bound takes no error at all
+    auto ratio = [](double error, double bound) {
+        return bound > 0.0 ? error / bound : error > 0.0 ? HUGE_VAL : 0.0;
+    };
+
+    uint32_t failures = 0;
+    for (const char* model : models) {
+        particle_set initial;
+        make_initial_conditions(model, initial, opts.particles);
+        const uint32_t count = static_cast<uint32_t>(initial.size());
+
+        uint32_t lost = 0;
+        for (float mass : initial.mass)
+            lost += mass != gravity::particle_mass;
+
+        for (const encoding& e : encodings) {
+            std::vector<uint8_t> packed;
+            pack_compact(initial, e.format, packed);
+            particle_set particles;
+            unpack_compact(packed.data(), count, e.format, particles);
+            const compact_layout layout = make_compact_layout(count, e.format);
+
+            double position = 0.0, velocity = 0.0;
+            for (uint32_t i = 0; i < count; ++i) {
+                float header[4];
+                std::memcpy(header, packed.data() + uint64_t(i / compact_block_size) * compact_header_size, sizeof(header));
+
+                const float original[6] = { initial.px[i], initial.py[i], initial.pz[i], initial.vx[i], initial.vy[i], initial.vz[i] };
+                const float restored[6] = { particles.px[i], particles.py[i], particles.pz[i], particles.vx[i], particles.vy[i], particles.vz[i] };
+                for (int axis = 0; axis < 3; ++axis) {
+                    const double error = std::fabs(double(restored[axis]) - original[axis]);
+                    position = (std::max)(position, ratio(error, compact_position_bound(original[axis], header[axis], header[3], e.format.position)));
+                }
+                for (int axis = 3; axis < 6; ++axis) {
+                    const double error = std::fabs(double(restored[axis]) - original[axis]);
+                    velocity = (std::max)(velocity, ratio(error, compact_velocity_bound(original[axis], e.format.velocity)));
+                }
+            }
+            const bool exact = std::memcmp(particles.acceleration.data(), initial.acceleration.data(), count * sizeof(float)) == 0;
+
+            // NaN compares false, so !(x <= 1) catches it too
+            const bool passed = position <= 1.0 && velocity <= 1.0 && exact;
+            if (!passed)
+                ++failures;
+
+            std::printf("%-13s %-13s %7.2f %11.3f %11.3f %7s %8u  %s\n", model, e.name, double(layout.size) / (std::max)(count, 1u),
+                position, velocity, exact ? "exact" : "DIFFERS", lost, passed ? "ok" : "BEYOND BOUND");
+            std::fflush(stdout);
+        }
+    }
+
+    std::printf("\nposition, velocity: largest error over its bound; masses: particles whose mass is lost, the layout assumes gravity::particle_mass\n");
+    if (failures) {
+        std::printf("FAILED: %u round trips beyond their bounds\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int run_validate(const options& opts) {
+    std::vector<accuracy_tolerance> tolerances = default_tolerances();
+    if (!opts.tolerances.empty()) {
+        try {
+            tolerances = read_tolerances(opts.tolerances);
+        }
+        catch (const std::exception& e) {
+            std::printf("FAILED: %s\n", e.what());
+            return EXIT_FAILURE;
+        }
+    }
+    const std::vector<std::string> engines = opts.engine.empty() ? std::vector<std::string>{ "direct", "tree" } : std::vector<std::string>{ opts.engine };
+    const char* models[] = { "two-clusters", "plummer", "hernquist", "disk", "galaxy", "merger" };
+
+    // the accumulations of the engines, then fixed point, then the positions
+    // the GPU kernel reads from compact storage (compact_storage.hpp): packed
+    // and unpacked again, for the direct engine in float like the shader
+    struct variant {
+        const char* precision;
+        const char* storage;        // nullptr - the particles as they are
+        compact_format format;
+    };
+    const variant variants[] = {
+        { float_accumulator::name, nullptr, {} },
+        { kahan_accumulator::name, nullptr, {} },
+        { double_accumulator::name, nullptr, {} },
+        { full_double_accumulator::name, nullptr, {} },
+        { fixed_point_accumulator::name, nullptr, {} },
+        { float_accumulator::name, "compact-float", { position_encoding::float_relative, velocity_encoding::half } },
+        { float_accumulator::name, "compact-fixed16", { position_encoding::fixed16, velocity_encoding::half } },
+    };
+
+    FILE* csv = nullptr;
+    if (!opts.csv.empty()) {
+        csv = std::fopen(opts.csv.c_str(), "w");
+        if (!csv) {
+            std::printf("FAILED: cannot write %s\n", opts.csv.c_str());
+            return EXIT_FAILURE;
+        }
+        std::fprintf(csv, "model,engine,precision,samples,rms,p50,p90,p99,max,passed\n");
+    }
+
+    thread_pool pool;
+    std::printf("%u particles, %u samples against a double direct sum\n\n", opts.particles, (std::min)(opts.samples, opts.particles));
+    std::printf("%-13s %-7s %-15s %11s %11s %11s %11s %11s  %s\n", "model", "engine", "prec", "rms", "p50", "p90", "p99", "max", "verdict");
+
+    uint32_t failures = 0;
+    for (const char* model : models) {
+        particle_set initial;
+        make_initial_conditions(model, initial, opts.particles);
+        const std::vector<uint32_t> sample = sample_particles(static_cast<uint32_t>(initial.size()), opts.samples);
+        const std::vector<double> reference = reference_accelerations(initial, sample, pool);
+
+        for (const std::string& engine_name : engines) {
+            for (const variant& v : variants) {
+                if (v.storage && engine_name != "direct")
+                    continue;
+
+                auto engine = make_engine(engine_name, engine_config(), v.precision);
+                particle_set particles = initial;
+                if (v.storage) {
+                    // the layout assumes gravity::particle_mass; the masses
+                    // are put back so that only the positions differ
+                    std::vector<uint8_t> packed;
+                    pack_compact(initial, v.format, packed);
+                    unpack_compact(packed.data(), static_cast<uint32_t>(initial.size()), v.format, particles);
+                    particles.mass = initial.mass;
+                }
+                engine->compute_accelerations(particles);
+                const std::string precision = v.storage ? v.storage : engine->precision();
+
+                // the tree engine sorts the particles; the ids say where each went
+                std::vector<uint32_t> where(particles.size());
+                for (uint32_t i = 0; i < particles.size(); ++i)
+                    where[particles.id[i]] = i;
+                std::vector<uint32_t> position(sample.size());
+                for (size_t s = 0; s < sample.size(); ++s)
+                    position[s] = where[initial.id[sample[s]]];
+
+                const error_summary errors = acceleration_errors(*engine, position, reference);
+                const accuracy_tolerance* tolerance = find_tolerance(tolerances, engine_name, precision);
+                const bool passed = tolerance && tolerance->accepts(errors);
+                if (!passed)
+                    ++failures;
+
+                std::printf("%-13s %-7s %-15s %11.3e %11.3e %11.3e %11.3e %11.3e  %s\n", model, engine_name.c_str(), precision.c_str(),
+                    errors.rms, errors.p50, errors.p90, errors.p99, errors.max, !tolerance ? "no tolerance" : passed ? "ok" : "TOO LARGE");
+                std::fflush(stdout);
+                if (csv)
+                    std::fprintf(csv, "%s,%s,%s,%u,%.6e,%.6e,%.6e,%.6e,%.6e,%d\n", model, engine_name.c_str(), precision.c_str(),
+                        errors.samples, errors.rms, errors.p50, errors.p90, errors.p99, errors.max, passed ? 1 : 0);
+            }
+        }
+    }
+
+    if (csv)
+        std::fclose(csv);
+
+    if (failures) {
+        std::printf("FAILED: %u cases above or without a tolerance\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int run_golden(const options& opts) {
+    const std::string dir = opts.dir == "." ? "golden" : opts.dir;
+    const std::string manifest = dir + "/golden.json";
+    const integrator_kind integrators[] = { integrator_kind::euler_damped, integrator_kind::leapfrog };
+
+    std::vector<golden_case> blessed;
+    if (!opts.bless) {
+        try {
+            blessed = read_golden_manifest(manifest);
+        }
+        catch (const std::exception& e) {
+            std::printf("FAILED: %s\n", e.what());
+            return EXIT_FAILURE;
+        }
+    }
+    else {
+        std::filesystem::create_directories(dir);
+    }
+
+    std::printf("%s %s, direct engine in %s on one thread\n\n", opts.bless ? "blessing" : "checking", manifest.c_str(), full_double_accumulator::name);
+    std::printf("%-26s %6s %9s %11s %11s %11s %11s %9s  %s\n", "case", "steps", "frames", "position", "velocity", "energy", "blessed", "time", "verdict");
+
+    std::vector<golden_case> cases;
+    uint32_t failures = 0;
+    for (const golden_system& system : golden_systems()) {
+        for (integrator_kind integrator : integrators) {
+            golden_case current;
+            current.system = system.name;
+            current.integrator = integrator_name(integrator);
+
+            const golden_case* reference = nullptr;
+            for (const golden_case& gc : blessed)
+                if (gc.system == current.system && gc.integrator == current.integrator)
+                    reference = &gc;
+            if (!opts.bless && !reference) {
+                std::printf("%-26s %6u %9s %11s %11s %11s %11s %9s  %s\n", current.name().c_str(), system.steps, "-", "-", "-", "-", "-", "-", "NOT BLESSED");
+                ++failures;
+                continue;
+            }
+
+            const golden_run run = simulate_golden(system, integrator);
+            current.max_energy_error = run.max_energy_error;
+
+            state_difference worst;
+            uint32_t exact = 0;
+            std::string problem;
+            try {
+                if (opts.bless) {
+                    compute_data params = make_compute_data(static_cast<uint32_t>(run.states.front().size()), system.delta_time, 1.0f);
+                    for (size_t f = 0; f < run.states.size(); ++f) {
+                        snapshot_info info = make_snapshot_info(params, run.steps[f]);
+                        info.integrator = current.integrator;
+                        const std::string name = golden_snapshot_name(system.name, integrator, run.steps[f]);
+                        write_snapshot(dir + "/" + name, run.states[f], info);
+                        current.frames.push_back({ run.steps[f], name, state_checksum(run.states[f]) });
+                    }
+                }
+                else {
+                    for (const golden_frame& frame : reference->frames) {
+                        particle_set stored;
+                        read_snapshot(dir + "/" + frame.file, stored);
+                        if (state_checksum(stored) != frame.checksum)
+                            throw std::runtime_error(frame.file + " does not match its checksum");
+
+                        const auto at = std::find(run.steps.begin(), run.steps.end(), frame.step);
+                        if (at == run.steps.end())
+                            throw std::runtime_error(frame.file + " is of step " + std::to_string(frame.step) + ", which the case does not store");
+                        const particle_set& state = run.states[at - run.steps.begin()];
+                        const state_difference difference = system.ensemble ? compare_ensembles(state, stored) : compare_states(state, stored);
+                        worst.position = (std::max)(worst.position, difference.position);
+                        worst.velocity = (std::max)(worst.velocity, difference.velocity);
+                        if (state_checksum(state) == frame.checksum)
+                            ++exact;
+                    }
+                    if (reference->frames.size() != run.states.size())
+                        problem = std::to_string(reference->frames.size()) + " frames blessed, " + std::to_string(run.states.size()) + " stored";
+                    else if (worst.position > system.tolerance || worst.velocity > system.tolerance)
+                        problem = "MOVED";
+                    else if (!golden_energy_accepts(run.max_energy_error, reference->max_energy_error))
+                        problem = "ENERGY DRIFT";
+                }
+            }
+            catch (const std::exception& e) {
+                problem = e.what();
+            }
+            if (!problem.empty())
+                ++failures;
+
+            const std::string frames = opts.bless ? std::to_string(current.frames.size()) : std::to_string(exact) + "/" + std::to_string(reference->frames.size());
+            std::printf("%-26s %6u %9s %11.3e %11.3e %11.3e %11.3e %8.2fs  %s\n", current.name().c_str(), system.steps, frames.c_str(),
+                worst.position, worst.velocity, run.max_energy_error, opts.bless ? run.max_energy_error : reference->max_energy_error,
+                run.seconds, !problem.empty() ? problem.c_str() : opts.bless ? "blessed" : "ok");
+            std::fflush(stdout);
+            cases.push_back(current);
+        }
+    }
+
+    if (opts.bless) {
+        try {
+            write_golden_manifest(manifest, cases);
+        }
+        catch (const std::exception& e) {
+            std::printf("FAILED: %s\n", e.what());
+            return EXIT_FAILURE;
+        }
+    }
+    else {
+        std::printf("\nframes: bit-identical to the blessed state of all; position and velocity: largest error relative to the rms radius and speed,\n"
+            "or of the Lagrangian radii and the virial ratio for chaotic systems\n");
+    }
+
+    if (failures) {
+        std::printf("FAILED: %u cases off their golden trajectory\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void usage() {
+    std::fprintf(stderr,
+        "usage: nbody-bench determinism [--engine tree|direct] [--particles N] [--steps S]\n"
+        "       nbody-bench precision [--engine direct|tree] [--particles N] [--samples S] [--csv FILE]\n"
+        "       nbody-bench offset [--engine direct|tree] [--particles N] [--samples S]\n"
+        "       nbody-bench checkpoint [--engine tree|direct] [--particles N] [--steps S] [--every K] [--dir DIR]\n"
+        "       nbody-bench delta [--engine tree|direct] [--particles N] [--steps S] [--every K] [--chain C] [--dir DIR]\n"
+        "       nbody-bench compact [--chain C] [--dir DIR]\n"
+        "       nbody-bench trajectory [--engine tree|direct] [--particles N] [--steps S] [--tolerance T] [--dir DIR]\n"
+        "       nbody-bench playback [--engine tree|direct] [--particles N] [--steps S] [--dir DIR]\n"
+        "       nbody-bench load [--particles N] [--dir DIR]\n"
+        "       nbody-bench ic [--particles N]\n"
+        "       nbody-bench query [--particles N] [--dir DIR]\n"
+        "       nbody-bench lod [--particles N] [--dir DIR]\n"
+        "       nbody-bench mirror [--engine tree|direct] [--particles N] [--steps S] [--every K]\n"
+        "       nbody-bench suite [--profile smoke|full] [--engine tree|direct] [--repetitions R] [--warmup W] [--json FILE]\n"
+        "       nbody-bench compare --baseline FILE --json FILE [--threshold T]\n"
+        "       nbody-bench trace [--engine tree|direct] [--particles N] [--steps S] [--dir DIR]\n"
+        "       nbody-bench gpu-timers [--steps S]\n"
+        "       nbody-bench conservation [--engine tree|direct] [--particles N] [--steps S] [--every K] [--csv FILE]\n"
+        "       nbody-bench storage [--particles N]\n"
+        "       nbody-bench validate [--engine tree|direct] [--particles N] [--samples S] [--tolerances FILE] [--csv FILE]\n"
+        "       nbody-bench golden [--bless] [--dir DIR]\n");
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    options opts;
+    opts.mode = argv[1];
+
+    for (int i = 2; i < argc; ++i) {
+        const bool has_value = i + 1 < argc;
+
+        if (!std::strcmp(argv[i], "--engine") && has_value)
+            opts.engine = argv[++i];
+        else if (!std::strcmp(argv[i], "--particles") && has_value)
+            opts.particles = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        else if (!std::strcmp(argv[i], "--steps") && has_value)
+            opts.steps = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        else if (!std::strcmp(argv[i], "--samples") && has_value)
+            opts.samples = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        else if (!std::strcmp(argv[i], "--csv") && has_value)
+            opts.csv = argv[++i];
+        else if (!std::strcmp(argv[i], "--every") && has_value)
+            opts.every = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        else if (!std::strcmp(argv[i], "--chain") && has_value)
+            opts.chain = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        else if (!std::strcmp(argv[i], "--dir") && has_value)
+            opts.dir = argv[++i];
+        else if (!std::strcmp(argv[i], "--tolerance") && has_value)
+            opts.tolerance = std::strtod(argv[++i], nullptr);
+        else if (!std::strcmp(argv[i], "--json") && has_value)
+            opts.json = argv[++i];
+        else if (!std::strcmp(argv[i], "--profile") && has_value)
+            opts.profile = argv[++i];
+        else if (!std::strcmp(argv[i], "--repetitions") && has_value)
+            opts.repetitions = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        else if (!std::strcmp(argv[i], "--warmup") && has_value)
+            opts.warmup = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        else if (!std::strcmp(argv[i], "--baseline") && has_value)
+            opts.baseline = argv[++i];
+        else if (!std::strcmp(argv[i], "--threshold") && has_value)
+            opts.threshold = std::strtod(argv[++i], nullptr);
+        else if (!std::strcmp(argv[i], "--tolerances") && has_value)
+            opts.tolerances = argv[++i];
+        else if (!std::strcmp(argv[i], "--bless"))
+            opts.bless = true;
+        else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    // the suite and validation run every engine unless given one, compare needs none
+    if (opts.engine.empty() && opts.mode != "suite" && opts.mode != "validate" && opts.mode != "compare")
+        opts.engine = opts.mode == "precision" || opts.mode == "offset" ? "direct" : "tree";
+
+    if (!opts.engine.empty() && !make_engine(opts.engine, engine_config{ 1 })) {
+        std::fprintf(stderr, "unknown engine '%s'\n", opts.engine.c_str());
+        return EXIT_FAILURE;
+    }
+
+    if (opts.mode == "determinism")
+        return run_determinism(opts);
+    if (opts.mode == "precision")
+        return run_precision(opts);
+    if (opts.mode == "offset")
+        return run_offset(opts);
+    if (opts.mode == "checkpoint")
+        return run_checkpoint(opts);
+    if (opts.mode == "delta")
+        return run_delta(opts);
+    if (opts.mode == "compact")
+        return run_compact(opts);
+    if (opts.mode == "trajectory")
+        return run_trajectory(opts);
+    if (opts.mode == "playback")
+        return run_playback(opts);
+    if (opts.mode == "load")
+        return run_load(opts);
+    if (opts.mode == "ic")
+        return run_ic(opts);
+    if (opts.mode == "query")
+        return run_query(opts);
+    if (opts.mode == "lod")
+        return run_lod(opts);
+    if (opts.mode == "mirror")
+        return run_mirror(opts);
+    if (opts.mode == "suite")
+        return run_suite(opts);
+    if (opts.mode == "compare")
+        return run_compare(opts);
+    if (opts.mode == "trace")
+        return run_trace(opts);
+    if (opts.mode == "gpu-timers")
+        return run_gpu_timers(opts);
+    if (opts.mode == "conservation")
+        return run_conservation(opts);
+    if (opts.mode == "storage")
+        return run_storage(opts);
+    if (opts.mode == "validate")
+        return run_validate(opts);
+    if (opts.mode == "golden")
+        return run_golden(opts);
+
+    usage();
+    return EXIT_FAILURE;
+}
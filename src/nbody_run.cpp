@@ -0,0 +1,320 @@
+// nbody-run: runs a simulation on the CPU engines without a window.
+//
+//   nbody-run [--engine tree|direct] [--precision P] [--threads T]
+//             [--particles N] [--ic MODEL|FILE] [--radius R] [--seed S]
+//             [--steps S] [--dt DT] [--damping D] [--integrator euler-damped|leapfrog]
+//             [--snapshot-every K] [--full-every F] [--dir DIR] [--metrics FILE]
+//             [--trace FILE] [--prometheus FILE]
+//             [--conservation FILE] [--conservation-every K] [--potential engine|sampled] [--samples S]
+//
+//       --ic takes a model of make_initial_conditions ("two-clusters",
+//       "plummer", "hernquist", "disk", "galaxy", "merger"; default
+//       two-clusters), sized by --radius, or a file ic_loader reads: CSV,
+//       GADGET-2 or a snapshot, which then sets the particle count.
+//
+//       Every K steps the state goes through checkpoint_writer to
+//       DIR/checkpoint_<step>.snap, with delta checkpoints between full
+//       snapshots every F checkpoints (default 1, full snapshots only); step
+//       0 is written too. --metrics writes one CSV row per step: the time,
+//       the seconds the step took, the interactions evaluated and their
+//       rate, the largest |a|, the kinetic energy and the total momentum.
+//       --prometheus keeps FILE up to date with the step time histogram in
+//       the Prometheus text format, rewritten every second, see metrics.hpp.
+//       --trace writes the trace events of a build with NBODY_TRACE on, see
+//       trace.hpp.
+//
+//       --conservation measures the energies, momentum and angular momentum
+//       at step 0 and every K steps (default 10) and appends them to the CSV
+//       FILE with the mean step time since the row before and their errors
+//       against step 0. The potential is the engine's or sampled at S
+//       particles (default 1024), see diagnostics.hpp.
+//
+// The parameters are those of the shader, compute_data from simulation.hpp;
+// dt and damping default to the sample's.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "checkpoint_writer.hpp"
+#include "cpu_engine.hpp"
+#include "diagnostics.hpp"
+#include "ic_loader.hpp"
+#include "initial_conditions.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+namespace {
+
+struct options {
+    std::string engine     = "tree";
+    std::string precision  = float_accumulator::name;
+    unsigned    threads    = 0;
+    uint32_t    particles  = 20000;
+    std::string ic         = "two-clusters";
+    double      radius     = 400.0;
+    uint64_t    seed       = 0;
+    uint32_t    steps      = 100;
+    float       dt         = 0.1f;
+    float       damping    = 1.0f;
+    std::string integrator = "euler-damped";
+    uint32_t    snapshot_every = 0;
+    uint32_t    full_every = 1;
+    std::string dir        = ".";
+    std::string metrics;
+    std::string trace;
+    std::string prometheus;
+    std::string conservation;
+    uint32_t    conservation_every = 10;
+    std::string potential  = "engine";
+    uint32_t    samples    = 1024;
+};
+
+struct step_metrics {
+    double   seconds;
+    uint64_t interactions;
+    float    max_acceleration;
+    double   kinetic_energy;
+    double   momentum;
+};
+
+step_metrics measure(const particle_set& particles, double seconds) {
+    step_metrics m = { seconds, 0, 0.0f, 0.0, 0.0 };
+    double px = 0.0, py = 0.0, pz = 0.0;
+    for (size_t i = 0; i < particles.size(); ++i) {
+        const double mass = particles.mass[i];
+        const double vx = particles.vx[i], vy = particles.vy[i], vz = particles.vz[i];
+        m.interactions += particles.cost[i];
+        m.max_acceleration = (std::max)(m.max_acceleration, particles.acceleration[i]);
+        m.kinetic_energy += 0.5 * mass * (vx * vx + vy * vy + vz * vz);
+        px += mass * vx; py += mass * vy; pz += mass * vz;
+    }
+    m.momentum = std::sqrt(px * px + py * py + pz * pz);
+    return m;
+}
+
+int run(const options& opts) {
+    integrator_kind integrator;
+    if (!parse_integrator(opts.integrator, integrator)) {
+        std::fprintf(stderr, "unknown integrator '%s'\n", opts.integrator.c_str());
+        return EXIT_FAILURE;
+    }
+
+    potential_source potential;
+    if (!parse_potential_source(opts.potential, potential)) {
+        std::fprintf(stderr, "unknown potential '%s'\n", opts.potential.c_str());
+        return EXIT_FAILURE;
+    }
+
+    engine_config config;
+    config.thread_count = opts.threads;
+    config.integrator = integrator;
+
+    auto engine = make_engine(opts.engine, config, opts.precision);
+    if (!engine) {
+        std::fprintf(stderr, "unknown engine '%s' or precision '%s'\n", opts.engine.c_str(), opts.precision.c_str());
+        return EXIT_FAILURE;
+    }
+
+    // a model name, otherwise a file
+    particle_set particles;
+    auto start = std::chrono::steady_clock::now();
+    if (!make_initial_conditions(opts.ic, particles, opts.particles, opts.radius, opts.seed, opts.threads)) {
+        ic_options ic;
+        ic.thread_count = opts.threads;
+        load_initial_conditions(opts.ic, particles, ic);
+    }
+    const double setup = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const uint32_t count = static_cast<uint32_t>(particles.size());
+    const compute_data params = make_compute_data(count, opts.dt, opts.damping);
+
+    std::printf("engine %s (%s, %u threads), %s, %u particles from %s in %.3f s\n",
+        engine->name(), engine->precision(), engine->thread_count(), integrator_name(integrator), count, opts.ic.c_str(), setup);
+    std::printf("%u steps of dt %g, damping %g\n", opts.steps, opts.dt, opts.damping);
+
+    std::unique_ptr<checkpoint_writer> writer;
+    auto snapshot = [&](uint64_t step) {
+        snapshot_info info = make_snapshot_info(params, step);
+        info.integrator = integrator_name(integrator);
+        writer->submit(particles, info);
+    };
+    if (opts.snapshot_every > 0) {
+        std::filesystem::create_directories(opts.dir);
+        writer = std::make_unique<checkpoint_writer>(opts.dir, true, opts.full_every);
+        snapshot(0);
+    }
+
+    FILE* metrics = nullptr;
+    if (!opts.metrics.empty()) {
+        metrics = std::fopen(opts.metrics.c_str(), "w");
+        if (!metrics)
+            throw std::runtime_error("cannot write " + opts.metrics);
+        std::fprintf(metrics, "step,time,seconds,interactions,interactions_per_second,max_acceleration,kinetic_energy,momentum\n");
+    }
+
+    metrics_registry registry;
+    latency_histogram& step_seconds = registry.histogram("nbody_step_seconds", "Simulation step time.");
+    registry.gauge("nbody_particles", "Particles simulated.").store(count);
+    std::atomic<uint64_t>& steps_done = registry.counter("nbody_steps_total", "Simulation steps done.");
+    std::unique_ptr<prometheus_exporter> exporter;
+    if (!opts.prometheus.empty())
+        exporter = std::make_unique<prometheus_exporter>(registry, opts.prometheus, std::chrono::milliseconds(1000));
+
+    std::unique_ptr<conservation_monitor> monitor;
+    if (!opts.conservation.empty()) {
+        monitor = std::make_unique<conservation_monitor>(opts.conservation_every, potential, opts.samples, opts.conservation);
+        monitor->measure(*engine, particles, 0, 0.0);
+    }
+
+    const step_metrics initial = measure(particles, 0.0);
+    double total = 0.0;
+    uint64_t interactions = 0;
+
+    for (uint32_t step = 1; step <= opts.steps; ++step) {
+        start = std::chrono::steady_clock::now();
+        engine->step(particles, params);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        total += seconds;
+        step_seconds.record_seconds(seconds);
+        ++steps_done;
+
+        if (monitor) {
+            monitor->record_step(seconds);
+            if (monitor->due(step))
+                monitor->measure(*engine, particles, step, double(step) * opts.dt);
+        }
+
+        if (writer && step % opts.snapshot_every == 0)
+            snapshot(step);
+
+        if (metrics) {
+            const step_metrics m = measure(particles, seconds);
+            std::fprintf(metrics, "%u,%.9g,%.9g,%llu,%.9g,%.9g,%.9g,%.9g\n", step, double(step) * opts.dt, m.seconds,
+                static_cast<unsigned long long>(m.interactions), m.interactions / m.seconds, m.max_acceleration, m.kinetic_energy, m.momentum);
+            interactions += m.interactions;
+        }
+    }
+
+    if (metrics)
+        std::fclose(metrics);
+
+    const step_metrics last = measure(particles, 0.0);
+    std::printf("\n%-24s %12.3f\n", "simulation s", total);
+    std::printf("%-24s %12.3f\n", "ms per step", opts.steps ? 1000.0 * total / opts.steps : 0.0);
+    const histogram_snapshot steps = step_seconds.snapshot();
+    std::printf("%-24s %12.3f / %.3f / %.3f / %.3f\n", "step ms p50/p90/p99/max",
+        steps.percentile(0.5) * 1e-6, steps.percentile(0.9) * 1e-6, steps.percentile(0.99) * 1e-6, steps.max * 1e-6);
+    if (metrics)
+        std::printf("%-24s %12.3e\n", "interactions per second", interactions / total);
+    std::printf("%-24s %12.6g -> %.6g\n", "kinetic energy", initial.kinetic_energy, last.kinetic_energy);
+    std::printf("%-24s %12.6g -> %.6g\n", "momentum", initial.momentum, last.momentum);
+    if (monitor) {
+        const conservation_sample& sample = monitor->series().back();
+        std::printf("%-24s %12.3e, largest %.3e\n", "energy error", monitor->energy_error(sample), monitor->max_energy_error());
+        std::printf("%-24s %12.3e\n", "momentum error", monitor->momentum_error(sample));
+        std::printf("%-24s %12.3e\n", "angular momentum error", monitor->angular_momentum_error(sample));
+        std::printf("%-24s %12zu in %s, %.3f ms each\n", "conservation samples", monitor->series().size(), opts.conservation.c_str(), sample.seconds * 1000.0);
+    }
+    std::printf("%-24s %016llx\n", "state checksum", static_cast<unsigned long long>(state_checksum(particles)));
+
+    if (writer) {
+        writer->flush();
+        const checkpoint_stats stats = writer->stats();
+        std::printf("%-24s %12llu in %s, %.1f MB, longest stall %.2f ms\n", "snapshots",
+            static_cast<unsigned long long>(stats.written), opts.dir.c_str(), stats.bytes / 1e6, stats.max_stall * 1000.0);
+    }
+
+    if (!opts.trace.empty()) {
+#ifdef NBODY_TRACE
+        tracer::instance().write_chrome_trace(opts.trace);
+        std::printf("%-24s %12llu in %s\n", "trace events", static_cast<unsigned long long>(tracer::instance().event_count()), opts.trace.c_str());
+#else
+        std::printf("tracing is compiled out, configure with -DNBODY_TRACE=ON\n");
+#endif
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void usage() {
+    std::fprintf(stderr,
+        "usage: nbody-run [--engine tree|direct] [--precision P] [--threads T]\n"
+        "                 [--particles N] [--ic MODEL|FILE] [--radius R] [--seed S]\n"
+        "                 [--steps S] [--dt DT] [--damping D] [--integrator euler-damped|leapfrog]\n"
+        "                 [--snapshot-every K] [--full-every F] [--dir DIR] [--metrics FILE]\n"
+        "                 [--trace FILE] [--prometheus FILE]\n"
+        "                 [--conservation FILE] [--conservation-every K] [--potential engine|sampled] [--samples S]\n");
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    options opts;
+
+    for (int i = 1; i < argc; ++i) {
+        const bool has_value = i + 1 < argc;
+
+        if (!std::strcmp(argv[i], "--engine") && has_value)
+            opts.engine = argv[++i];
+        else if (!std::strcmp(argv[i], "--precision") && has_value)
+            opts.precision = argv[++i];
+        else if (!std::strcmp(argv[i], "--threads") && has_value)
+            opts.threads = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+        else if (!std::strcmp(argv[i], "--particles") && has_value)
+            opts.particles = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        else if (!std::strcmp(argv[i], "--ic") && has_value)
+            opts.ic = argv[++i];
+        else if (!std::strcmp(argv[i], "--radius") && has_value)
+            opts.radius = std::strtod(argv[++i], nullptr);
+        else if (!std::strcmp(argv[i], "--seed") && has_value)
+            opts.seed = std::strtoull(argv[++i], nullptr, 10);
+        else if (!std::strcmp(argv[i], "--steps") && has_value)
+            opts.steps = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        else if (!std::strcmp(argv[i], "--dt") && has_value)
+            opts.dt = std::strtof(argv[++i], nullptr);
+        else if (!std::strcmp(argv[i], "--damping") && has_value)
+            opts.damping = std::strtof(argv[++i], nullptr);
+        else if (!std::strcmp(argv[i], "--integrator") && has_value)
+            opts.integrator = argv[++i];
+        else if (!std::strcmp(argv[i], "--snapshot-every") && has_value)
+            opts.snapshot_every = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        else if (!std::strcmp(argv[i], "--full-every") && has_value)
+            opts.full_every = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        else if (!std::strcmp(argv[i], "--dir") && has_value)
+            opts.dir = argv[++i];
+        else if (!std::strcmp(argv[i], "--metrics") && has_value)
+            opts.metrics = argv[++i];
+        else if (!std::strcmp(argv[i], "--trace") && has_value)
+            opts.trace = argv[++i];
+        else if (!std::strcmp(argv[i], "--prometheus") && has_value)
+            opts.prometheus = argv[++i];
+        else if (!std::strcmp(argv[i], "--conservation") && has_value)
+            opts.conservation = argv[++i];
+        else if (!std::strcmp(argv[i], "--conservation-every") && has_value)
+            opts.conservation_every = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        else if (!std::strcmp(argv[i], "--potential") && has_value)
+            opts.potential = argv[++i];
+        else if (!std::strcmp(argv[i], "--samples") && has_value)
+            opts.samples = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    try {
+        return run(opts);
+    }
+    catch (const std::exception& e) {
+        std::fprintf(stderr, "nbody-run: %s\n", e.what());
+        return EXIT_FAILURE;
+    }
+}
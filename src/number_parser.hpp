@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NBODY_SSE2 1
+#endif
+
+// Fast ASCII number parsing for the initial-condition loader
+//
+// Text is scanned 16 bytes at a time with SSE2 to find line ends, and digits
+// are converted eight at a time with SWAR (SIMD within a 64-bit register).
+// Decimal numbers with at most 19 significant digits and a small exponent -
+// what %g and most tools print - are converted exactly with one double
+// multiplication or division; everything else goes through strtod.
+
+// the first '\n' in [p, end), or end
+inline const char* find_newline(const char* p, const char* end) {
+#ifdef NBODY_SSE2
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; p + 16 <= end; p += 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+        if (mask) {
+            int offset = 0;
+            while (!(mask & (1 << offset)))
+                ++offset;
+            return p + offset;
+        }
+    }
+#endif
+    const void* found = std::memchr(p, '\n', static_cast<size_t>(end - p));
+    return found ? static_cast<const char*>(found) : end;
+}
+
+// the start of the line after the one p is in, or end
+inline const char* next_line(const char* p, const char* end) {
+    p = find_newline(p, end);
+    return p < end ? p + 1 : end;
+}
+
+inline bool is_eight_digits(const char* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return (((v & 0xF0F0F0F0F0F0F0F0ull) | (((v + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) >> 4)) == 0x3333333333333333ull);
+}
+
+// the value of eight ASCII digits, most significant first
+inline uint32_t parse_eight_digits(const char* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    v -= 0x3030303030303030ull;
+    v = (v * 10) + (v >> 8);    // pairs of digits
+    v = (((v & 0x000000FF000000FFull) * (100 + (1000000ull << 32))) +
+         (((v >> 16) & 0x000000FF000000FFull) * (1 + (10000ull << 32)))) >> 32;
+    return static_cast<uint32_t>(v);
+}
+
+// accumulates the digits at p into mantissa while it holds fewer than 19;
+// returns the end of the digits, counting those taken in digits and the rest
+// in dropped
+inline const char* parse_digits(const char* p, const char* end, uint64_t& mantissa, int& digits, int& dropped) {
+    // eight at a time while they fit
+    while (digits + 8 <= 19 && p + 8 <= end && is_eight_digits(p)) {
+        mantissa = mantissa * 100000000ull + parse_eight_digits(p);
+        digits += 8;
+        p += 8;
+    }
+
+    for (; p < end && unsigned(*p - '0') < 10; ++p) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + unsigned(*p - '0');
+            ++digits;
+        }
+        else
+            ++dropped;
+    }
+    return p;
+}
+
+// strtod on the token at p, for what the fast path does not take
+inline const char* parse_number_slow(const char* p, const char* end, double& value) {
+    char token[64];
+    size_t length = 0;
+    for (const char* q = p; q < end && length + 1 < sizeof(token); ++q) {
+        const char c = *q;
+        if (c == ',' || c == ';' || c == ' ' || c == '\t' || c == '\r' || c == '\n')
+            break;
+        token[length++] = c;
+    }
+    token[length] = '\0';
+
+    char* parsed = nullptr;
+    value = std::strtod(token, &parsed);
+    return parsed == token ? nullptr : p + (parsed - token);
+}
+
+// parses one number at p; returns the position after it, or nullptr if p
+// does not start a number
+inline const char* parse_number(const char* p, const char* end, double& value) {
+    static const double powers_of_ten[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    const char* start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int dropped = 0;
+    int exponent = 0;
+    const char* first = p;
+
+    // leading zeros take no room in the mantissa
+    while (p < end && *p == '0')
+        ++p;
+    p = parse_digits(p, end, mantissa, digits, dropped);
+    exponent += dropped;
+    bool any = p != first;
+
+    if (p < end && *p == '.') {
+        const char* fraction = ++p;
+        if (mantissa == 0) {
+            while (p < end && *p == '0')
+                ++p;
+            exponent -= static_cast<int>(p - fraction);
+        }
+
+        const int taken = digits;
+        int ignored = 0;
+        p = parse_digits(p, end, mantissa, digits, ignored);
+        exponent -= digits - taken;
+        dropped += ignored;
+        any = any || p != fraction;
+    }
+
+    if (!any)
+        return parse_number_slow(start, end, value);   // inf, nan
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char* e = p + 1;
+        bool negative_exponent = false;
+        if (e < end && (*e == '-' || *e == '+'))
+            negative_exponent = *e++ == '-';
+
+        // a lone e ends the number
+        if (e < end && unsigned(*e - '0') < 10) {
+            int written = 0;
+            for (; e < end && unsigned(*e - '0') < 10; ++e)
+                written = written < 100000 ? written * 10 + (*e - '0') : written;
+            exponent += negative_exponent ? -written : written;
+            p = e;
+        }
+    }
+
+    if (mantissa == 0) {
+        value = negative ? -0.0 : 0.0;
+        return p;
+    }
+
+    // Clinger's fast path: the mantissa and the power of ten are exact doubles,
+    // one correctly rounded operation gives the correctly rounded result
+    if (dropped == 0 && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22) {
+        const double result = exponent < 0 ? double(mantissa) / powers_of_ten[-exponent] : double(mantissa) * powers_of_ten[exponent];
+        value = negative ? -result : result;
+        return p;
+    }
+
+    return parse_number_slow(start, end, value);
+}
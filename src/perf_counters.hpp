@@ -0,0 +1,317 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware performance counters per engine phase
+//
+// NBODY_PERF_SCOPE(perf_phase::walk) reads a group of the calling thread's
+// hardware counters (cycles, instructions, cache references and cache misses)
+// when the scope starts and when it ends, and adds the difference to the
+// totals of the phase. Every thread opens its own group with perf_event_open
+// on first use, counting user space only, which perf_event_paranoid 2 allows,
+// and closes it when it exits. The totals sum over the threads and are scaled
+// up by time enabled over time running when the kernel multiplexes a group.
+//
+// When the kernel refuses the counters (no PMU in a virtual machine or
+// container, perf_event_paranoid 3, not Linux) the scopes still count calls
+// and wall time, and status() says why. There is no portable FLOP event;
+// reports derive FLOPs from the interaction count instead, see
+// flops_per_interaction in bench_report.hpp.
+//
+// The macro compiles to nothing unless NBODY_PERF_COUNTERS is defined (the
+// CMake option of the same name).
+
+enum class perf_phase : uint32_t {
+    build,          // the tree build
+    walk,           // the force kernel: tree walk or direct sum
+    integrate,      // kicks and drifts
+    count
+};
+
+inline const char* perf_phase_name(perf_phase phase) {
+    switch (phase) {
+    case perf_phase::build:     return "build";
+    case perf_phase::walk:      return "walk";
+    case perf_phase::integrate: return "integrate";
+    default:                    return "?";
+    }
+}
+
+enum perf_event_index : uint32_t {
+    perf_cycles,
+    perf_instructions,
+    perf_cache_references,
+    perf_cache_misses,
+    perf_event_count
+};
+
+inline const char* perf_event_name(uint32_t event) {
+    const char* names[perf_event_count] = { "cycles", "instructions", "cache_references", "cache_misses" };
+    return event < perf_event_count ? names[event] : "?";
+}
+
+// the totals of a phase
+struct perf_values {
+    uint64_t calls = 0;
+    uint64_t counted = 0;                       // calls whose counters could be read
+    uint64_t ns = 0;
+    uint64_t events[perf_event_count] = {};
+
+    double ipc() const {
+        return events[perf_cycles] ? double(events[perf_instructions]) / double(events[perf_cycles]) : 0.0;
+    }
+
+    // cache misses per thousand instructions
+    double mpki() const {
+        return events[perf_instructions] ? 1000.0 * double(events[perf_cache_misses]) / double(events[perf_instructions]) : 0.0;
+    }
+};
+
+// the counters of one thread since its group was opened
+struct perf_reading {
+    uint64_t events[perf_event_count] = {};
+    uint64_t enabled = 0;       // ns the group was enabled
+    uint64_t running = 0;       // ns it was actually on the PMU
+};
+
+class perf_counter_group {
+public:
+    perf_counter_group() {
+        for (int& fd : fds_)
+            fd = -1;
+#ifdef __linux__
+        const uint64_t configs[perf_event_count] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES
+        };
+
+        for (uint32_t event = 0; event < perf_event_count; ++event) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[event];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            // this thread on any CPU; the cycles counter leads the group
+            const long fd = syscall(__NR_perf_event_open, &attr, 0, -1, event == 0 ? -1 : fds_[0], PERF_FLAG_FD_CLOEXEC);
+            if (fd < 0) {
+                // without a leader there is no group; other events are optional
+                if (event == 0) {
+                    error_ = errno;
+                    return;
+                }
+                continue;
+            }
+            fds_[event] = static_cast<int>(fd);
+            order_[opened_++] = event;
+        }
+#endif
+    }
+
+    ~perf_counter_group() {
+#ifdef __linux__
+        for (int fd : fds_)
+            if (fd >= 0)
+                close(fd);
+#endif
+    }
+
+    perf_counter_group(const perf_counter_group&) = delete;
+    perf_counter_group& operator=(const perf_counter_group&) = delete;
+
+    bool valid() const { return fds_[0] >= 0; }
+
+    // errno of the failed perf_event_open, 0 if the group is open or not on Linux
+    int error() const { return error_; }
+
+    bool supports(uint32_t event) const { return fds_[event] >= 0; }
+
+    bool read(perf_reading& reading) const {
+#ifdef __linux__
+        if (!valid())
+            return false;
+
+        // nr, time enabled, time running, then one value per event in the order opened
+        uint64_t buffer[3 + perf_event_count];
+        const ssize_t size = ::read(fds_[0], buffer, sizeof(buffer));
+        if (size < ssize_t(3 * sizeof(uint64_t)) || buffer[0] != opened_)
+            return false;
+
+        reading.enabled = buffer[1];
+        reading.running = buffer[2];
+        for (uint32_t i = 0; i < opened_; ++i)
+            reading.events[order_[i]] = buffer[3 + i];
+        return true;
+#else
+        (void)reading;
+        return false;
+#endif
+    }
+
+private:
+    int         fds_[perf_event_count];
+    uint32_t    order_[perf_event_count] = {};
+    uint32_t    opened_ = 0;
+    int         error_ = 0;
+};
+
+class perf_counters {
+public:
+    static perf_counters& instance() {
+        static perf_counters counters;
+        return counters;
+    }
+
+    // the calling thread's group, opened on first use
+    const perf_counter_group& group() {
+        thread_local perf_counter_group group;
+        thread_local bool noted = false;
+        if (!noted) {
+            note(group);
+            noted = true;
+        }
+        return group;
+    }
+
+    // whether any thread got its counters; status() says why not
+    bool available() const { return available_.load(); }
+
+    std::string status() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return status_;
+    }
+
+    void add(perf_phase phase, uint64_t ns, const perf_reading* begin, const perf_reading* end) {
+        totals_t& totals = totals_[static_cast<uint32_t>(phase)];
+        totals.calls.fetch_add(1, std::memory_order_relaxed);
+        totals.ns.fetch_add(ns, std::memory_order_relaxed);
+        if (!begin || !end)
+            return;
+
+        // scaled up for the time the group was multiplexed out
+        const uint64_t enabled = end->enabled - begin->enabled;
+        const uint64_t running = end->running - begin->running;
+        const double scale = running ? double(enabled) / double(running) : 0.0;
+        for (uint32_t event = 0; event < perf_event_count; ++event)
+            totals.events[event].fetch_add(static_cast<uint64_t>(double(end->events[event] - begin->events[event]) * scale + 0.5), std::memory_order_relaxed);
+        totals.counted.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    perf_values totals(perf_phase phase) const {
+        const totals_t& totals = totals_[static_cast<uint32_t>(phase)];
+        perf_values values;
+        values.calls = totals.calls.load(std::memory_order_relaxed);
+        values.counted = totals.counted.load(std::memory_order_relaxed);
+        values.ns = totals.ns.load(std::memory_order_relaxed);
+        for (uint32_t event = 0; event < perf_event_count; ++event)
+            values.events[event] = totals.events[event].load(std::memory_order_relaxed);
+        return values;
+    }
+
+    // not atomic as a whole; call it while no scope is open
+    void reset() {
+        for (totals_t& totals : totals_) {
+            totals.calls.store(0, std::memory_order_relaxed);
+            totals.counted.store(0, std::memory_order_relaxed);
+            totals.ns.store(0, std::memory_order_relaxed);
+            for (auto& event : totals.events)
+                event.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    perf_counters() = default;
+
+    void note(const perf_counter_group& group) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (group.valid()) {
+            available_ = true;
+            status_ = "counting";
+            for (uint32_t event = 0; event < perf_event_count; ++event)
+                if (!group.supports(event))
+                    status_ += std::string(", no ") + perf_event_name(event);
+            return;
+        }
+        if (available_)
+            return;
+
+#ifdef __linux__
+        const int error = group.error();
+        status_ = std::string("perf_event_open: ") + std::strerror(error);
+        if (error == EACCES || error == EPERM)
+            status_ += " (see /proc/sys/kernel/perf_event_paranoid)";
+        else if (error == ENOENT || error == EOPNOTSUPP || error == ENODEV)
+            status_ += " (no hardware counters, e.g. in a virtual machine)";
+#else
+        status_ = "hardware counters need perf_event_open, Linux only";
+#endif
+    }
+
+    struct totals_t {
+        std::atomic<uint64_t> calls{ 0 };
+        std::atomic<uint64_t> counted{ 0 };
+        std::atomic<uint64_t> ns{ 0 };
+        std::atomic<uint64_t> events[perf_event_count];
+
+        totals_t() {
+            for (auto& event : events)
+                event.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    mutable std::mutex  mutex_;
+    std::string         status_ = "no phase measured yet";
+    std::atomic<bool>   available_{ false };
+    totals_t            totals_[static_cast<uint32_t>(perf_phase::count)];
+};
+
+class perf_scope {
+public:
+    explicit perf_scope(perf_phase phase) :
+        phase_(phase),
+        group_(perf_counters::instance().group()),
+        start_(std::chrono::steady_clock::now())
+    {
+        counted_ = group_.read(begin_);
+    }
+
+    ~perf_scope() {
+        perf_reading end;
+        const bool counted = counted_ && group_.read(end);
+        const uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count());
+        perf_counters::instance().add(phase_, ns, counted ? &begin_ : nullptr, counted ? &end : nullptr);
+    }
+
+    perf_scope(const perf_scope&) = delete;
+    perf_scope& operator=(const perf_scope&) = delete;
+
+private:
+    const perf_phase                                phase_;
+    const perf_counter_group&                       group_;
+    const std::chrono::steady_clock::time_point     start_;
+    perf_reading                                    begin_;
+    bool                                            counted_;
+};
+
+#define NBODY_PERF_CONCAT_(a, b) a##b
+#define NBODY_PERF_CONCAT(a, b) NBODY_PERF_CONCAT_(a, b)
+
+#ifdef NBODY_PERF_COUNTERS
+#define NBODY_PERF_SCOPE(phase) perf_scope NBODY_PERF_CONCAT(perf_scope_, __LINE__)(phase)
+#else
+#define NBODY_PERF_SCOPE(phase) ((void)0)
+#endif
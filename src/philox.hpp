@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3")
+//
+// A counter-based generator: the output is a pure function of a 128-bit
+// counter and a 64-bit key, so any particle's numbers can be drawn without
+// the ones before them. Initial conditions use the particle index as the
+// counter, which makes them independent of the thread count and of the
+// order particles are generated in, and identical on every platform.
+
+struct philox_block {
+    uint32_t v[4];
+};
+
+inline philox_block philox4x32(philox_block counter, uint32_t key0, uint32_t key1) {
+    const uint32_t multiplier0 = 0xD2511F53u;
+    const uint32_t multiplier1 = 0xCD9E8D57u;
+    const uint32_t weyl0 = 0x9E3779B9u;
+    const uint32_t weyl1 = 0xBB67AE85u;
+
+    for (int round = 0; round < 10; ++round) {
+        const uint64_t product0 = uint64_t(multiplier0) * counter.v[0];
+        const uint64_t product1 = uint64_t(multiplier1) * counter.v[2];
+
+        const philox_block next = { {
+            uint32_t(product1 >> 32) ^ counter.v[1] ^ key0,
+            uint32_t(product1),
+            uint32_t(product0 >> 32) ^ counter.v[3] ^ key1,
+            uint32_t(product0),
+        } };
+        counter = next;
+
+        key0 += weyl0;
+        key1 += weyl1;
+    }
+    return counter;
+}
+
+// the random numbers of one particle for one purpose: counter words 0 and 1
+// hold the particle index, word 2 the purpose and word 3 counts the blocks
+class philox_stream {
+public:
+    philox_stream(uint64_t seed, uint64_t index, uint32_t purpose = 0) :
+        key0_(uint32_t(seed)),
+        key1_(uint32_t(seed >> 32))
+    {
+        counter_.v[0] = uint32_t(index);
+        counter_.v[1] = uint32_t(index >> 32);
+        counter_.v[2] = purpose;
+        counter_.v[3] = 0;
+    }
+
+    uint32_t next() {
+        if (used_ == 4) {
+            block_ = philox4x32(counter_, key0_, key1_);
+            ++counter_.v[3];
+            used_ = 0;
+        }
+        return block_.v[used_++];
+    }
+
+    // in (0, 1), 53 bits
+    double uniform() {
+        const uint64_t high = next() >> 5;
+        const uint64_t low = next() >> 6;
+        return ((high << 26 | low) + 0.5) * (1.0 / 9007199254740992.0);
+    }
+
+    double uniform(double low, double high) {
+        return low + (high - low) * uniform();
+    }
+
+    // standard normal, Box-Muller
+    double normal() {
+        if (has_spare_) {
+            has_spare_ = false;
+            return spare_;
+        }
+
+        const double radius = std::sqrt(-2.0 * std::log(uniform()));
+        const double angle = 6.283185307179586 * uniform();
+        spare_ = radius * std::sin(angle);
+        has_spare_ = true;
+        return radius * std::cos(angle);
+    }
+
+    // a uniformly distributed direction
+    void direction(double& x, double& y, double& z) {
+        const double cos_theta = uniform(-1.0, 1.0);
+        const double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
+        const double phi = 6.283185307179586 * uniform();
+        x = sin_theta * std::cos(phi);
+        y = sin_theta * std::sin(phi);
+        z = cos_theta;
+    }
+
+private:
+    uint32_t        key0_;
+    uint32_t        key1_;
+    philox_block    counter_;
+    philox_block    block_ = {};
+    int             used_ = 4;
+    double          spare_ = 0.0;
+    bool            has_spare_ = false;
+};
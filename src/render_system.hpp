@@ -5,6 +5,16 @@
 #include "StepTimer.h"
 
 #include "logging.hpp"
+#include "simulation.hpp"
+#include "compact_storage.hpp"
+#include "gpu_profiler.hpp"
+#include "checkpoint_writer.hpp"
+#include "ic_loader.hpp"
+#include "metrics.hpp"
+#include "initial_conditions.hpp"
+#include "state_mirror.hpp"
+#include "trace.hpp"
+#include "trajectory_player.hpp"
 
 
 #define InterlockedGetValue(object) InterlockedCompareExchange(object, 0, 0)
@@ -47,16 +57,11 @@ struct vertex_data {
 struct geometry_data {
     XMFLOAT4X4 mvp;
     XMFLOAT4X4 inverse_view;
+    uint32_t particle_params[4]; // particle_params[0] - particles amount, particle_params[1] - compact storage blocks
 
     // Constant buffers are 256-byte aligned in GPU memory.
     // Padding is added for convenience when computing the struct's size.
-    float padding[32];
-};
-
-struct compute_data {
-    uint32_t param[4];  // param[0] - particles amount, param[1] - dimx
-    float    paramf[4]; // paramf[0] - time interval, paramf[1] - damping
-    // 4 variables for alignment
+    float padding[28];
 };
 
 // while ComPtr is used to manage the lifetime of resources on the CPU,
@@ -90,7 +95,13 @@ public:
         render_context_fence_value_(0),
         terminating_(0),
         SRVindex_{},
-        frame_fence_values_{}
+        frame_fence_values_{},
+        simulation_steps_{},
+        playback_upload_data_{},
+        render_timestamps_data_(nullptr),
+        draw_pass_(0),
+        compute_timestamps_data_{},
+        simulate_pass_(0)
     {
         WCHAR assetsPath[512];
         GetAssetsPath(assetsPath, _countof(assetsPath));
@@ -121,12 +132,23 @@ public:
         load_pipeline();
         load_assets();
         create_async_contexts();
+        if (gpu_timestamps_)
+            create_timestamp_queries();
+
+        // outlives device resets like the registry
+        if (!metrics_exporter_ && metrics_interval_ > 0)
+            metrics_exporter_ = std::make_unique<prometheus_exporter>(metrics_, checkpoint_directory() + "/nbody.prom", std::chrono::milliseconds(metrics_interval_ * 1000));
     }
 
     // update frame-based values
     void update() {
+        NBODY_TRACE_SCOPE("update");
+
         // wait for the previous Present to complete
-        WaitForSingleObjectEx(swapchain_event_, 100, FALSE);
+        {
+            NBODY_TRACE_SCOPE("wait on present");
+            WaitForSingleObjectEx(swapchain_event_, 100, FALSE);
+        }
 
         timer_.Tick(NULL);
         camera_.update(static_cast<float>(timer_.GetElapsedSeconds()));
@@ -134,6 +156,8 @@ public:
         geometry_data constantBufferGS = {};
         XMStoreFloat4x4(&constantBufferGS.mvp, XMMatrixMultiply(camera_.view_matrix(), camera_.projection_matrix(0.8f, aspect_ratio_, 1.0f, 5000.0f)));
         XMStoreFloat4x4(&constantBufferGS.inverse_view, XMMatrixInverse(nullptr, camera_.view_matrix()));
+        constantBufferGS.particle_params[0] = particle_count_;
+        constantBufferGS.particle_params[1] = make_compact_layout(particle_count_, compact_format_).blocks;
 
         uint8_t* destination = geometry_constant_buffer_data_ + sizeof(geometry_data) * current_frame_;
         memcpy(destination, &constantBufferGS, sizeof(geometry_data));
@@ -141,26 +165,39 @@ public:
         update_FPS();
     }
 
+    // the title shows the last second of the frame and step time histograms
     void update_FPS() {
-        static float FPS = 0.0f;
-        static int frame_count = 0;
-        static float elapsed_time = 0.0f;
-
-        elapsed_time += timer_.GetElapsedSeconds();
-
-        ++frame_count;
+        const double elapsed = timer_.GetElapsedSeconds();
+        frame_seconds_.record_seconds(elapsed);
+        title_elapsed_ += elapsed;
+
+        if (title_elapsed_ >= 1.0) {
+            const histogram_snapshot frames = frame_seconds_.snapshot();
+            const histogram_snapshot steps = step_seconds_.snapshot();
+            const histogram_snapshot frameWindow = frames - title_frames_;
+            const histogram_snapshot stepWindow = steps - title_steps_;
+
+            wchar_t text[256];
+            swprintf_s(text, L"%.1f FPS, frame p50 %.2f p99 %.2f max %.2f ms, step p50 %.2f p99 %.2f max %.2f ms",
+                frameWindow.count / title_elapsed_,
+                frameWindow.percentile(0.5) * 1e-6, frameWindow.percentile(0.99) * 1e-6, frameWindow.top() * 1e-6,
+                stepWindow.percentile(0.5) * 1e-6, stepWindow.percentile(0.99) * 1e-6, stepWindow.top() * 1e-6);
+
+            std::wstring title = text;
+            if (checkpoint_writer_) {
+                const checkpoint_stats stats = checkpoint_writer_->stats();
+                title += L", checkpoint stall " + std::to_wstring(stats.last_stall * 1000.0) + L" ms (max " + std::to_wstring(stats.max_stall * 1000.0) + L" ms)";
+            }
+            set_window_title(title);
 
-        if (elapsed_time >= 1.0f) {
-            FPS = static_cast<float>(frame_count) / elapsed_time;
-            
-            set_window_title(std::to_wstring(FPS) + L" FPS");
-            
-            frame_count = 0;
-            elapsed_time = 0.0f;
+            title_frames_ = frames;
+            title_steps_ = steps;
+            title_elapsed_ = 0.0;
         }
     }
 
     void render() {
+        NBODY_TRACE_SCOPE("render");
         try {
             // let the compute thread know that a new frame is being rendered.
             for (int n = 0; n < thread_count_; ++n)
@@ -179,12 +216,22 @@ public:
                 }
             }
 
-            record_command_list();
+            // the timings of the frames the GPU has finished
+            if (render_timers_)
+                render_timers_->collect(render_context_fence_->GetCompletedValue(), render_timestamps_data_);
+
+            {
+                NBODY_TRACE_SCOPE("record");
+                record_command_list();
+            }
 
             ID3D12CommandList* ppCommandLists[] = { command_list_.Get() };
             command_queue_->ExecuteCommandLists(_countof(ppCommandLists), ppCommandLists);
 
-            ThrowIfFailed(swapchain_->Present(1, 0));
+            {
+                NBODY_TRACE_SCOPE("present");
+                ThrowIfFailed(swapchain_->Present(1, 0));
+            }
 
             acquire_next_frame();
         }
@@ -201,6 +248,19 @@ public:
         InterlockedExchange(&terminating_, 1);
         WaitForMultipleObjects(thread_count_, thread_handle_, TRUE, INFINITE);
 
+        // let the last checkpoints reach the disk
+        if (checkpoint_writer_)
+            checkpoint_writer_->flush();
+        for (auto& mirror : mirrors_) {
+            if (mirror)
+                mirror->flush();
+        }
+
+#ifdef NBODY_TRACE
+        // what the threads recorded, for chrome://tracing or ui.perfetto.dev
+        tracer::instance().write_chrome_trace(checkpoint_directory() + "/trace.json");
+#endif
+
         // ensure that the GPU is no longer referencing resources that are about to be
         // cleaned up by the destructor
         queue_wait_idle();
@@ -214,6 +274,37 @@ public:
     
     void key_down(UINT8 key) {
         camera_.on_keydown(key);
+
+        // playback controls: pause, scrub a second back and forth, slower, faster, reverse, rewind
+        for (uint32_t n = 0; n < thread_count_; ++n) {
+            trajectory_player* player = players_[n].get();
+            if (!player)
+                continue;
+
+            switch (key) {
+            case VK_SPACE:
+                player->playing() ? player->pause() : player->play();
+                break;
+            case 'Q':
+                player->seek(player->position() - playback_frames_per_second_);
+                break;
+            case 'E':
+                player->seek(player->position() + playback_frames_per_second_);
+                break;
+            case 'Z':
+                player->set_speed(player->speed() * 0.5);
+                break;
+            case 'X':
+                player->set_speed(player->speed() * 2.0);
+                break;
+            case 'R':
+                player->set_speed(-player->speed());
+                break;
+            case VK_HOME:
+                player->seek(0.0);
+                break;
+            }
+        }
     }
 
     void key_up(UINT8 key) {
@@ -405,10 +496,25 @@ private:
 #else
             UINT compileFlags = 0;
 #endif
-            ThrowIfFailed(D3DCompileFromFile(asset_full_path(L"VertexGeometryPixelShader.hlsl").c_str(), nullptr, nullptr, "VS_main", "vs_5_0", compileFlags, 0, &vertexShader, nullptr));
-            ThrowIfFailed(D3DCompileFromFile(asset_full_path(L"VertexGeometryPixelShader.hlsl").c_str(), nullptr, nullptr, "GS_main", "gs_5_0", compileFlags, 0, &geometryShader, nullptr));
-            ThrowIfFailed(D3DCompileFromFile(asset_full_path(L"VertexGeometryPixelShader.hlsl").c_str(), nullptr, nullptr, "PS_main", "ps_5_0", compileFlags, 0, &pixelShader, nullptr));
-            ThrowIfFailed(D3DCompileFromFile(asset_full_path(L"ComputeShader.hlsl").c_str(), nullptr, nullptr, "main", "cs_5_0", compileFlags, 0, &computeShader, nullptr));
+            std::vector<D3D_SHADER_MACRO> defines;
+            if (deterministic_)
+                defines.push_back({ "DETERMINISTIC", "1" });
+            if (compact_storage_) {
+                defines.push_back({ "COMPACT_STORAGE", "1" });
+                if (compact_format_.position == position_encoding::fixed16)
+                    defines.push_back({ "COMPACT_POSITION_FIXED16", "1" });
+                if (compact_format_.velocity == velocity_encoding::bfloat16)
+                    defines.push_back({ "COMPACT_VELOCITY_BF16", "1" });
+            }
+            defines.push_back({ nullptr, nullptr });
+
+            // bit-reproducible simulation: strict IEEE math and a fixed accumulation order
+            const UINT computeCompileFlags = deterministic_ ? compileFlags | D3DCOMPILE_IEEE_STRICTNESS : compileFlags;
+
+            ThrowIfFailed(D3DCompileFromFile(asset_full_path(L"VertexGeometryPixelShader.hlsl").c_str(), defines.data(), D3D_COMPILE_STANDARD_FILE_INCLUDE, "VS_main", "vs_5_0", compileFlags, 0, &vertexShader, nullptr));
+            ThrowIfFailed(D3DCompileFromFile(asset_full_path(L"VertexGeometryPixelShader.hlsl").c_str(), defines.data(), D3D_COMPILE_STANDARD_FILE_INCLUDE, "GS_main", "gs_5_0", compileFlags, 0, &geometryShader, nullptr));
+            ThrowIfFailed(D3DCompileFromFile(asset_full_path(L"VertexGeometryPixelShader.hlsl").c_str(), defines.data(), D3D_COMPILE_STANDARD_FILE_INCLUDE, "PS_main", "ps_5_0", compileFlags, 0, &pixelShader, nullptr));
+            ThrowIfFailed(D3DCompileFromFile(asset_full_path(L"ComputeShader.hlsl").c_str(), defines.data(), D3D_COMPILE_STANDARD_FILE_INCLUDE, "main", "cs_5_0", computeCompileFlags, 0, &computeShader, nullptr));
 
             D3D12_INPUT_ELEMENT_DESC inputElementDescs[] = {
                 { "COLOR", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, 0, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
@@ -459,6 +565,7 @@ private:
         ThrowIfFailed(device_->CreateCommandList(0, D3D12_COMMAND_LIST_TYPE_DIRECT, command_allocators_[current_frame_].Get(), pipeline_state_.Get(), IID_PPV_ARGS(&command_list_)));
         NAME_D3D12_OBJECT(command_list_);
 
+        load_initial_conditions_file();
         create_vertex_buffer();
         create_particles_buffer();
 
@@ -486,14 +593,10 @@ private:
 
             NAME_D3D12_OBJECT(compute_constant_buffer_);
 
-            compute_data constantBufferCS = {};
-            constantBufferCS.param[0] = particle_count_;
-            constantBufferCS.param[1] = int(ceil(particle_count_ / 128.0f));
-            constantBufferCS.paramf[0] = 0.1f;
-            constantBufferCS.paramf[1] = 1.0f;
+            compute_params_ = make_compute_data(particle_count_, 0.1f, 1.0f);
 
             D3D12_SUBRESOURCE_DATA computeCBData = {};
-            computeCBData.pData = reinterpret_cast<UINT8*>(&constantBufferCS);
+            computeCBData.pData = reinterpret_cast<UINT8*>(&compute_params_);
             computeCBData.RowPitch = bufferSize;
             computeCBData.SlicePitch = computeCBData.RowPitch;
 
@@ -541,6 +644,16 @@ private:
     }
 
     void restore_resources() {
+        // the compute threads use the resources about to go and submit to the
+        // mirrors; init() starts new ones once the new buffers exist
+        InterlockedExchange(&terminating_, 1);
+        WaitForMultipleObjects(thread_count_, thread_handle_, TRUE, INFINITE);
+        for (int n = 0; n < thread_count_; ++n) {
+            CloseHandle(thread_handle_[n]);
+            CloseHandle(thread_fence_events_[n]);
+        }
+        InterlockedExchange(&terminating_, 0);
+
         // give GPU a chance to finish its execution in progress.
         try {
             wait_idle();
@@ -548,6 +661,13 @@ private:
         catch (HrException&) {
             // do nothing, currently attached adapter is unresponsive.
         }
+
+        // the mirrors read the readback buffers until their copies are done;
+        // create_particles_buffer() starts from what they hold
+        for (auto& mirror : mirrors_) {
+            if (mirror)
+                mirror->flush();
+        }
         release_resources();
         init();
     }
@@ -577,6 +697,49 @@ private:
         ++render_context_fence_values_[current_frame_];
     }
 
+    // a query heap, a persistently mapped readback buffer and a ring per queue
+    void create_timestamp_queries() {
+        auto create = [this](ID3D12CommandQueue* pQueue, std::unique_ptr<gpu_timer_ring>& timers, ComPtr<ID3D12QueryHeap>& heap, ComPtr<ID3D12Resource>& readback, uint64_t*& readbackData) {
+            uint64_t frequency;
+            ThrowIfFailed(pQueue->GetTimestampFrequency(&frequency));
+            timers = std::make_unique<gpu_timer_ring>(metrics_, timestamp_frames_, 2, frequency);
+
+            D3D12_QUERY_HEAP_DESC heapDesc = { D3D12_QUERY_HEAP_TYPE_TIMESTAMP, timers->query_count(), 0 };
+            ThrowIfFailed(device_->CreateQueryHeap(&heapDesc, IID_PPV_ARGS(&heap)));
+
+            ThrowIfFailed(device_->CreateCommittedResource(
+                &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK),
+                D3D12_HEAP_FLAG_NONE,
+                &CD3DX12_RESOURCE_DESC::Buffer(timers->query_count() * sizeof(uint64_t)),
+                D3D12_RESOURCE_STATE_COPY_DEST,
+                nullptr,
+                IID_PPV_ARGS(&readback))
+            );
+
+            CD3DX12_RANGE readRange(0, timers->query_count() * sizeof(uint64_t));
+            ThrowIfFailed(readback->Map(0, &readRange, reinterpret_cast<void**>(&readbackData)));
+        };
+
+        create(command_queue_.Get(), render_timers_, render_query_heap_, render_timestamps_, render_timestamps_data_);
+        draw_pass_ = render_timers_->pass("draw");
+        NAME_D3D12_OBJECT(render_query_heap_);
+        NAME_D3D12_OBJECT(render_timestamps_);
+
+        for (uint32_t index = 0; index < thread_count_; ++index) {
+            create(compute_command_queue_[index].Get(), compute_timers_[index], compute_query_heap_[index], compute_timestamps_[index], compute_timestamps_data_[index]);
+            simulate_pass_ = compute_timers_[index]->pass("simulate");
+            NAME_D3D12_OBJECT_INDEXED(compute_query_heap_, index);
+            NAME_D3D12_OBJECT_INDEXED(compute_timestamps_, index);
+        }
+    }
+
+    // resolves the queries of the frame just recorded into its readback slot
+    static void resolve_timestamps(ID3D12GraphicsCommandList* pCommandList, gpu_timer_ring& timers, ID3D12QueryHeap* pHeap, ID3D12Resource* pReadback) {
+        const gpu_timer_ring::resolve_range range = timers.end_frame();
+        if (range.count > 0)
+            pCommandList->ResolveQueryData(pHeap, D3D12_QUERY_TYPE_TIMESTAMP, range.first, range.count, pReadback, range.offset);
+    }
+
     void create_async_contexts() {
         for (uint32_t thread_index = 0; thread_index < thread_count_; ++thread_index) {
             // compute resources
@@ -647,41 +810,80 @@ private:
         vertex_buffer_view_.StrideInBytes = sizeof(vertex_data);
     }
 
-    // from -1 to 1
-    float random_percent() {
-        float ret = static_cast<float>((rand() % 10000) - 5000);
-        return ret / 5000.0f;
+    static void load_particle_set(const particle_t* source, uint32_t count, particle_set& particles) {
+        particles.resize(count);
+
+        for (uint32_t i = 0; i < count; ++i) {
+            particles.px[i] = source[i].position.x;
+            particles.py[i] = source[i].position.y;
+            particles.pz[i] = source[i].position.z;
+            particles.mass[i] = source[i].position.w;
+            particles.vx[i] = source[i].velocity.x;
+            particles.vy[i] = source[i].velocity.y;
+            particles.vz[i] = source[i].velocity.z;
+            particles.acceleration[i] = source[i].velocity.w;
+        }
     }
 
-    void init_particles(particle_t* pParticles, const XMFLOAT3& center, const XMFLOAT4& velocity, float spread, UINT numParticles) {
-        srand(0);
-
-        for (UINT i = 0; i < numParticles; ++i) {
-            XMFLOAT3 delta(spread, spread, spread);
-
-            while (XMVectorGetX(XMVector3LengthSq(XMLoadFloat3(&delta))) > spread * spread) {
-                delta.x = random_percent() * spread;
-                delta.y = random_percent() * spread;
-                delta.z = random_percent() * spread;
-            }
-
-            pParticles[i].position.x = center.x + delta.x;
-            pParticles[i].position.y = center.y + delta.y;
-            pParticles[i].position.z = center.z + delta.z;
-            pParticles[i].position.w = 10000.0f * 10000.0f;
+    static void store_particle_set(const particle_set& particles, particle_t* destination) {
+        for (size_t i = 0; i < particles.size(); ++i) {
+            destination[i].position = XMFLOAT4(particles.px[i], particles.py[i], particles.pz[i], particles.mass[i]);
+            destination[i].velocity = XMFLOAT4(particles.vx[i], particles.vy[i], particles.vz[i], particles.acceleration[i]);
+        }
+    }
 
-            pParticles[i].velocity = velocity;
+    // the particle count follows the file; kept for restore_resources()
+    void load_initial_conditions_file() {
+        if (initial_conditions_file_.empty())
+            return;
+
+        if (initial_particles_.size() == 0) {
+            load_initial_conditions(checkpoint_directory() + "/" + initial_conditions_file_, initial_particles_);
+
+            // the masses go into position.w, but the kernel uses
+            // gravity::particle_mass for every particle
+            size_t other = 0;
+            for (float mass : initial_particles_.mass)
+                other += mass != gravity::particle_mass;
+            if (other)
+                OutputDebugStringA((initial_conditions_file_ + ": " + std::to_string(other) + " particles have a mass other than gravity::particle_mass, "
+                    "which the GPU simulation uses for all of them\n").c_str());
         }
+        particle_count_ = static_cast<uint32_t>(initial_particles_.size());
     }
 
     void create_particles_buffer() {
-        std::vector<particle_t> data(particle_count_);
-        const uint32_t dataSize = particle_count_ * sizeof(particle_t);
+        // after a device reset every simulation goes on from its mirrored state
+        std::vector<uint8_t> mirrored[thread_count_];
+        uint64_t mirroredSteps[thread_count_] = {};
+        bool restoring = true;
+        for (uint32_t index = 0; index < thread_count_; ++index) {
+            restoring = restoring && mirrors_[index] && mirrors_[index]->read([&](const void* state, size_t size, uint64_t step) {
+                mirrored[index].assign(static_cast<const uint8_t*>(state), static_cast<const uint8_t*>(state) + size);
+                mirroredSteps[index] = step;
+            });
+        }
+
+        // otherwise from the loaded file, or the generated model
+        particle_set generated;
+        std::vector<particle_t> data;
+        std::vector<uint8_t> compactData;
+        if (!restoring) {
+            if (initial_particles_.size() == 0 && !make_initial_conditions(initial_model_, generated, particle_count_, particle_spread_))
+                throw std::runtime_error("unknown initial conditions model " + initial_model_);
+            const particle_set& initial = initial_particles_.size() > 0 ? initial_particles_ : generated;
+
+            data.resize(particle_count_);
+            store_particle_set(initial, data.data());
+
+            // the compact layout is packed once here, from then on the kernel keeps it up to date
+            if (compact_storage_)
+                pack_compact(initial, compact_format_, compactData);
+        }
 
-        // split the particles into two groups
-        float centerSpread = particle_spread_ * 0.50f;
-        init_particles(&data[0], XMFLOAT3(centerSpread, 0, 0), XMFLOAT4(0, 0, -20, 1 / 100000000.0f), particle_spread_, particle_count_ / 2);
-        init_particles(&data[particle_count_ / 2], XMFLOAT3(-centerSpread, 0, 0), XMFLOAT4(0, 0, 20, 1 / 100000000.0f), particle_spread_, particle_count_ / 2);
+        const void* uploadData = compact_storage_ ? static_cast<const void*>(compactData.data()) : static_cast<const void*>(data.data());
+        const uint32_t dataSize = restoring ? static_cast<uint32_t>(mirrored[0].size()) :
+            compact_storage_ ? static_cast<uint32_t>(compactData.size()) : particle_count_ * sizeof(particle_t);
 
         D3D12_HEAP_PROPERTIES defaultHeapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT);
         D3D12_HEAP_PROPERTIES uploadHeapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD);
@@ -730,11 +932,73 @@ private:
                 IID_PPV_ARGS(&particle_buffer1_upload_[index]))
             );
 
+            // the simulation copies its output here at checkpoint steps
+            if (checkpoint_interval_ > 0) {
+                ThrowIfFailed(device_->CreateCommittedResource(
+                    &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK),
+                    D3D12_HEAP_FLAG_NONE,
+                    &uploadBufferDesc,
+                    D3D12_RESOURCE_STATE_COPY_DEST,
+                    nullptr,
+                    IID_PPV_ARGS(&checkpoint_readback_[index]))
+                );
+                NAME_D3D12_OBJECT_INDEXED(checkpoint_readback_, index);
+            }
+
+            // and every mirror_interval_ steps here, alternating, for the CPU mirror
+            if (mirror_interval_ > 0) {
+                for (uint32_t slot = 0; slot < 2; ++slot) {
+                    ThrowIfFailed(device_->CreateCommittedResource(
+                        &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK),
+                        D3D12_HEAP_FLAG_NONE,
+                        &uploadBufferDesc,
+                        D3D12_RESOURCE_STATE_COPY_DEST,
+                        nullptr,
+                        IID_PPV_ARGS(&mirror_readback_[index][slot]))
+                    );
+
+                    // persistently mapped, the mirror copies straight out of it
+                    CD3DX12_RANGE readRange(0, dataSize);
+                    ThrowIfFailed(mirror_readback_[index][slot]->Map(0, &readRange, reinterpret_cast<void**>(&mirror_readback_data_[index][slot])));
+                }
+                if (!mirrors_[index])
+                    mirrors_[index] = std::make_unique<state_mirror>(mirror_interval_);
+            }
+            simulation_steps_[index] = restoring ? mirroredSteps[index] : 0;
+
+            if (restoring)
+                uploadData = mirrored[index].data();
+
+            // a recorded run replaces the simulation, its frames are copied in from here
+            if (!playback_file_.empty()) {
+                if (!players_[index]) {
+                    players_[index] = std::make_unique<trajectory_player>(checkpoint_directory() + "/" + playback_file_, 8, 0, playback_frames_per_second_);
+                    if (players_[index]->particle_count() != particle_count_)
+                        throw std::runtime_error("trajectory: " + playback_file_ + " does not hold " + std::to_string(particle_count_) + " particles");
+                }
+
+                ThrowIfFailed(device_->CreateCommittedResource(
+                    &uploadHeapProperties,
+                    D3D12_HEAP_FLAG_NONE,
+                    &uploadBufferDesc,
+                    D3D12_RESOURCE_STATE_GENERIC_READ,
+                    nullptr,
+                    IID_PPV_ARGS(&playback_upload_[index]))
+                );
+                NAME_D3D12_OBJECT_INDEXED(playback_upload_, index);
+
+                // persistently mapped, starts out as the initial state
+                CD3DX12_RANGE readRange(0, 0);
+                ThrowIfFailed(playback_upload_[index]->Map(0, &readRange, reinterpret_cast<void**>(&playback_upload_data_[index])));
+                memcpy(playback_upload_data_[index], uploadData, dataSize);
+                playback_clock_[index] = std::chrono::steady_clock::now();
+            }
+
             NAME_D3D12_OBJECT_INDEXED(particle_buffer0_, index);
             NAME_D3D12_OBJECT_INDEXED(particle_buffer1_, index);
 
             D3D12_SUBRESOURCE_DATA particleData = {};
-            particleData.pData = reinterpret_cast<UINT8*>(&data[0]);
+            particleData.pData = uploadData;
             particleData.RowPitch = dataSize;
             particleData.SlicePitch = particleData.RowPitch;
 
@@ -752,6 +1016,14 @@ private:
             srvDesc.Buffer.StructureByteStride = sizeof(particle_t);
             srvDesc.Buffer.Flags = D3D12_BUFFER_SRV_FLAG_NONE;
 
+            // the compact layout is read as a raw buffer
+            if (compact_storage_) {
+                srvDesc.Format = DXGI_FORMAT_R32_TYPELESS;
+                srvDesc.Buffer.NumElements = dataSize / 4;
+                srvDesc.Buffer.StructureByteStride = 0;
+                srvDesc.Buffer.Flags = D3D12_BUFFER_SRV_FLAG_RAW;
+            }
+
             CD3DX12_CPU_DESCRIPTOR_HANDLE srvHandle0(SRV_UAVheap_->GetCPUDescriptorHandleForHeapStart(), SRV_particle_buf_0 + index, SRV_UAVdescriptor_size_);
             CD3DX12_CPU_DESCRIPTOR_HANDLE srvHandle1(SRV_UAVheap_->GetCPUDescriptorHandleForHeapStart(), SRV_particle_buf_1 + index, SRV_UAVdescriptor_size_);
             device_->CreateShaderResourceView(particle_buffer0_[index].Get(), &srvDesc, srvHandle0);
@@ -766,6 +1038,13 @@ private:
             uavDesc.Buffer.CounterOffsetInBytes = 0;
             uavDesc.Buffer.Flags = D3D12_BUFFER_UAV_FLAG_NONE;
 
+            if (compact_storage_) {
+                uavDesc.Format = DXGI_FORMAT_R32_TYPELESS;
+                uavDesc.Buffer.NumElements = dataSize / 4;
+                uavDesc.Buffer.StructureByteStride = 0;
+                uavDesc.Buffer.Flags = D3D12_BUFFER_UAV_FLAG_RAW;
+            }
+
             CD3DX12_CPU_DESCRIPTOR_HANDLE uavHandle0(SRV_UAVheap_->GetCPUDescriptorHandleForHeapStart(), UAV_particle_buf_0 + index, SRV_UAVdescriptor_size_);
             CD3DX12_CPU_DESCRIPTOR_HANDLE uavHandle1(SRV_UAVheap_->GetCPUDescriptorHandleForHeapStart(), UAV_particle_buf_1 + index, SRV_UAVdescriptor_size_);
             device_->CreateUnorderedAccessView(particle_buffer0_[index].Get(), nullptr, &uavDesc, uavHandle0);
@@ -806,6 +1085,11 @@ private:
         command_list_->ClearRenderTargetView(rtvHandle, clearColor, 0, nullptr);
 
         // Render the particles.
+        if (render_timers_) {
+            render_timers_->begin_frame(render_context_fence_value_);
+            command_list_->EndQuery(render_query_heap_.Get(), D3D12_QUERY_TYPE_TIMESTAMP, render_timers_->begin(draw_pass_));
+        }
+
         float viewportHeight = static_cast<float>(viewport_.Height / height_instances_);
         float viewportWidth = static_cast<float>(viewport_.Width / width_instances_);
         for (uint32_t n = 0; n < thread_count_; ++n) {
@@ -825,6 +1109,11 @@ private:
             command_list_->DrawInstanced(particle_count_, 1, 0, 0);
         }
 
+        if (render_timers_) {
+            command_list_->EndQuery(render_query_heap_.Get(), D3D12_QUERY_TYPE_TIMESTAMP, render_timers_->end(draw_pass_));
+            resolve_timestamps(command_list_.Get(), *render_timers_, render_query_heap_.Get(), render_timestamps_.Get());
+        }
+
         command_list_->RSSetViewports(1, &viewport_);
 
         // the back buffer will now be used to present
@@ -843,9 +1132,37 @@ private:
         ID3D12CommandAllocator* pCommandAllocator = compute_allocator_[thread_index].Get();
         ID3D12GraphicsCommandList* pCommandList = compute_command_list_[thread_index].Get();
         ID3D12Fence* pFence = thread_fences_[thread_index].Get();
+        NBODY_TRACE_THREAD("compute " + std::to_string(thread_index));
 
         while (InterlockedGetValue(&terminating_) == 0) {
-            run_simulation(thread_index);
+            NBODY_TRACE_SCOPE("compute step");
+            const auto stepStart = std::chrono::steady_clock::now();
+
+            // the queue signals the next fence value once this step is done
+            if (compute_timers_[thread_index])
+                compute_timers_[thread_index]->begin_frame(InterlockedGetValue(&thread_fence_values_[thread_index]) + 1);
+            if (players_[thread_index])
+                run_playback(thread_index);
+            else
+                run_simulation(thread_index);
+
+            const bool simulating = !players_[thread_index];
+            const uint64_t step = simulating ? ++simulation_steps_[thread_index] : simulation_steps_[thread_index];
+
+            const bool checkpoint = simulating && checkpoint_interval_ > 0 && step % checkpoint_interval_ == 0;
+            if (checkpoint)
+                record_readback_copy(thread_index, checkpoint_readback_[thread_index].Get());
+
+            // the mirror's readback buffer is free once its last copy is done
+            const bool mirror = simulating && mirrors_[thread_index] && mirrors_[thread_index]->due(step);
+            const uint32_t mirrorSlot = mirror ? mirrors_[thread_index]->slot(step) : 0;
+            if (mirror) {
+                mirrors_[thread_index]->acquire(mirrorSlot);
+                record_readback_copy(thread_index, mirror_readback_[thread_index][mirrorSlot].Get());
+            }
+
+            if (compute_timers_[thread_index])
+                resolve_timestamps(pCommandList, *compute_timers_[thread_index], compute_query_heap_[thread_index].Get(), compute_timestamps_[thread_index].Get());
 
             ThrowIfFailed(pCommandList->Close());
             ID3D12CommandList* ppCommandLists[] = { pCommandList };
@@ -856,7 +1173,28 @@ private:
             uint64_t threadFenceValue = InterlockedIncrement(&thread_fence_values_[thread_index]);
             ThrowIfFailed(pCommandQueue->Signal(pFence, threadFenceValue));
             ThrowIfFailed(pFence->SetEventOnCompletion(threadFenceValue, thread_fence_events_[thread_index]));
-            WaitForSingleObject(thread_fence_events_[thread_index], INFINITE);
+            {
+                NBODY_TRACE_SCOPE("wait on fence");
+                const auto waitStart = std::chrono::steady_clock::now();
+                WaitForSingleObject(thread_fence_events_[thread_index], INFINITE);
+                fence_wait_seconds_.record_seconds(std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count());
+            }
+            step_seconds_.record_seconds(std::chrono::duration<double>(std::chrono::steady_clock::now() - stepStart).count());
+            if (compute_timers_[thread_index])
+                compute_timers_[thread_index]->collect(pFence->GetCompletedValue(), compute_timestamps_data_[thread_index]);
+
+            // a removed device never ran the copies; stop here rather than hand
+            // the stale readback buffers on, restore_resources() takes over
+            if (device_lost(pFence))
+                return 0;
+
+            // the readback is complete, hand the state to the I/O thread
+            if (checkpoint)
+                submit_checkpoint(thread_index);
+            if (mirror) {
+                mirrors_[thread_index]->submit(mirrorSlot, step, mirror_readback_data_[thread_index][mirrorSlot],
+                    static_cast<size_t>(mirror_readback_[thread_index][mirrorSlot]->GetDesc().Width));
+            }
 
             // wait for the render thread to be done with the SRV so that
             // the next frame in the simulation can run
@@ -877,6 +1215,12 @@ private:
         return 0;
     }
 
+    // after a device removal fences read UINT64_MAX, so waits on them return
+    // at once whether or not the GPU did the work
+    bool device_lost(ID3D12Fence* pFence) const {
+        return pFence->GetCompletedValue() == UINT64_MAX || device_->GetDeviceRemovedReason() != S_OK;
+    }
+
     void run_simulation(uint32_t thread_index) {
         ID3D12GraphicsCommandList* pCommandList = compute_command_list_[thread_index].Get();
 
@@ -911,11 +1255,79 @@ private:
         pCommandList->SetComputeRootDescriptorTable(computeSRVtable, srvHandle);
         pCommandList->SetComputeRootDescriptorTable(computeUAVtable, uavHandle);
 
+        gpu_timer_ring* pTimers = compute_timers_[thread_index].get();
+        if (pTimers)
+            pCommandList->EndQuery(compute_query_heap_[thread_index].Get(), D3D12_QUERY_TYPE_TIMESTAMP, pTimers->begin(simulate_pass_));
+
         pCommandList->Dispatch(static_cast<int>(ceil(particle_count_ / 128.0f)), 1, 1);
 
+        if (pTimers)
+            pCommandList->EndQuery(compute_query_heap_[thread_index].Get(), D3D12_QUERY_TYPE_TIMESTAMP, pTimers->end(simulate_pass_));
+
         pCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(pUavResource, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE));
     }
 
+    // stands in for run_simulation() while a trajectory plays: writes the frame
+    // under the playhead to the buffer the simulation would have written
+    void run_playback(uint32_t thread_index) {
+        ID3D12GraphicsCommandList* pCommandList = compute_command_list_[thread_index].Get();
+
+        const auto now = std::chrono::steady_clock::now();
+        const double elapsed = std::chrono::duration<double>(now - playback_clock_[thread_index]).count();
+        playback_clock_[thread_index] = now;
+
+        // the last copy has completed, the upload buffer is free to overwrite
+        if (const particle_set* frame = players_[thread_index]->update(elapsed)) {
+            if (compact_storage_) {
+                pack_compact(*frame, compact_format_, playback_compact_);
+                memcpy(playback_upload_data_[thread_index], playback_compact_.data(), playback_compact_.size());
+            }
+            else
+                store_particle_set(*frame, reinterpret_cast<particle_t*>(playback_upload_data_[thread_index]));
+        }
+
+        // copied every step, the SRV and UAV swap afterwards like after a simulation step
+        ID3D12Resource* pOutput = SRVindex_[thread_index] == 0 ? particle_buffer1_[thread_index].Get() : particle_buffer0_[thread_index].Get();
+
+        pCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(pOutput, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE, D3D12_RESOURCE_STATE_COPY_DEST));
+        pCommandList->CopyResource(pOutput, playback_upload_[thread_index].Get());
+        pCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(pOutput, D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE));
+    }
+
+    void record_readback_copy(uint32_t thread_index, ID3D12Resource* pReadback) {
+        ID3D12GraphicsCommandList* pCommandList = compute_command_list_[thread_index].Get();
+
+        // the buffer run_simulation() just wrote
+        ID3D12Resource* pOutput = SRVindex_[thread_index] == 0 ? particle_buffer1_[thread_index].Get() : particle_buffer0_[thread_index].Get();
+
+        pCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(pOutput, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE, D3D12_RESOURCE_STATE_COPY_SOURCE));
+        pCommandList->CopyResource(pReadback, pOutput);
+        pCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(pOutput, D3D12_RESOURCE_STATE_COPY_SOURCE, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE));
+    }
+
+    // runs on the simulation thread; the time spent here is the checkpoint's stall
+    void submit_checkpoint(uint32_t thread_index) {
+        if (!checkpoint_writer_)
+            checkpoint_writer_ = std::make_unique<checkpoint_writer>(checkpoint_directory(), true, checkpoint_full_every_);
+
+        ID3D12Resource* pReadback = checkpoint_readback_[thread_index].Get();
+        const uint64_t size = pReadback->GetDesc().Width;
+
+        void* pData;
+        CD3DX12_RANGE readRange(0, static_cast<SIZE_T>(size));
+        ThrowIfFailed(pReadback->Map(0, &readRange, &pData));
+
+        if (compact_storage_)
+            unpack_compact(static_cast<const uint8_t*>(pData), particle_count_, compact_format_, checkpoint_particles_);
+        else
+            load_particle_set(static_cast<const particle_t*>(pData), particle_count_, checkpoint_particles_);
+
+        CD3DX12_RANGE writtenRange(0, 0);
+        pReadback->Unmap(0, &writtenRange);
+
+        checkpoint_writer_->submit(checkpoint_particles_, make_snapshot_info(compute_params_, simulation_steps_[thread_index]));
+    }
+
     // wait for render context
     void queue_wait_idle() {
         // add a signal command to the queue
@@ -947,6 +1359,7 @@ private:
 
         // if the next frame is not ready to be rendered yet, wait until it is ready.
         if (render_context_fence_->GetCompletedValue() < frame_fence_values_[current_frame_]) {
+            NBODY_TRACE_SCOPE("wait on frame fence");
             ThrowIfFailed(render_context_fence_->SetEventOnCompletion(frame_fence_values_[current_frame_], render_context_fence_event_));
             WaitForSingleObject(render_context_fence_event_, INFINITE);
         }
@@ -1021,11 +1434,34 @@ private:
         applicationView->Title = ref new Platform::String(title.c_str());
     }
 
+    // the app's local folder, the one place a packaged app may write to
+    static std::string checkpoint_directory() {
+        auto folder = Windows::Storage::ApplicationData::Current->LocalFolder->Path;
+
+        std::string path(WideCharToMultiByte(CP_UTF8, 0, folder->Data(), -1, nullptr, 0, nullptr, nullptr), '\0');
+        WideCharToMultiByte(CP_UTF8, 0, folder->Data(), -1, &path[0], static_cast<int>(path.size()), nullptr, nullptr);
+        path.resize(path.size() - 1);
+        return path;
+    }
+
 private:
     static const uint32_t               max_frames_in_flight_   = 2;
     static const uint32_t               thread_count_           = 1;
-    const uint32_t                      particle_count_         = 10000;
+    uint32_t                            particle_count_         = 10000;   // or that of initial_conditions_file_
     const float                         particle_spread_        = 400.0f;
+    const bool                          deterministic_          = false;
+    const bool                          compact_storage_        = false;   // see compact_storage.hpp
+    const compact_format                compact_format_         = { position_encoding::fixed16, velocity_encoding::half };
+    const uint32_t                      checkpoint_interval_    = 0;       // simulation steps between checkpoints, 0 - off; see checkpoint_writer.hpp
+    const uint32_t                      checkpoint_full_every_  = 8;       // a full snapshot every that many checkpoints, delta checkpoints between
+    const bool                          gpu_timestamps_         = true;    // GPU times of the simulate and draw passes into the metrics; see gpu_profiler.hpp
+    const uint32_t                      timestamp_frames_       = 4;       // frames of timestamps in flight per queue
+    const uint32_t                      metrics_interval_       = 10;      // seconds between rewrites of nbody.prom in the checkpoint directory, 0 - off; see metrics.hpp
+    const uint32_t                      mirror_interval_        = 16;      // simulation steps between updates of the CPU mirror device resets restore, 0 - off; see state_mirror.hpp
+    const std::string                   playback_file_;                    // trajectory in the local folder to play instead of simulating, empty - off; see trajectory_player.hpp
+    const double                        playback_frames_per_second_ = 30.0;
+    const std::string                   initial_model_          = "two-clusters";  // see make_initial_conditions()
+    const std::string                   initial_conditions_file_;          // GADGET-2, CSV, snapshot or checkpoint in the local folder to start from, empty - two clusters; see ic_loader.hpp
 
     // pipeline objects
     CD3DX12_VIEWPORT                    viewport_;
@@ -1057,6 +1493,7 @@ private:
     ComPtr<ID3D12Resource>              geometry_constant_buffer_;
     uint8_t*                            geometry_constant_buffer_data_;
     ComPtr<ID3D12Resource>              compute_constant_buffer_;
+    compute_data                        compute_params_;
 
     uint32_t                            SRVindex_[thread_count_];           // which of the particle buffer resource views is the SRV (0 or 1) 
                                                                             // the UAV is 1 - srvIndex
@@ -1071,6 +1508,48 @@ private:
     ComPtr<ID3D12CommandQueue>          compute_command_queue_[thread_count_];
     ComPtr<ID3D12GraphicsCommandList>   compute_command_list_[thread_count_];
 
+    // checkpointing
+    ComPtr<ID3D12Resource>              checkpoint_readback_[thread_count_];
+    uint64_t                            simulation_steps_[thread_count_];
+    particle_set                        checkpoint_particles_;
+    std::unique_ptr<checkpoint_writer>  checkpoint_writer_;
+
+    // the CPU mirror; outlives device resets
+    ComPtr<ID3D12Resource>              mirror_readback_[thread_count_][2];
+    uint8_t*                            mirror_readback_data_[thread_count_][2];
+    std::unique_ptr<state_mirror>       mirrors_[thread_count_];
+
+    // metrics; the histograms are recorded from the render and compute threads
+    metrics_registry                    metrics_;
+    latency_histogram&                  frame_seconds_ = metrics_.histogram("nbody_frame_seconds", "Time between frames.");
+    latency_histogram&                  step_seconds_ = metrics_.histogram("nbody_step_seconds", "Simulation step time on the compute thread, submission to completion.");
+    latency_histogram&                  fence_wait_seconds_ = metrics_.histogram("nbody_fence_wait_seconds", "Time the compute thread waits on its fence.");
+    std::unique_ptr<prometheus_exporter> metrics_exporter_;
+
+    // GPU timestamps, per queue
+    ComPtr<ID3D12QueryHeap>             render_query_heap_;
+    ComPtr<ID3D12Resource>              render_timestamps_;
+    uint64_t*                           render_timestamps_data_;
+    std::unique_ptr<gpu_timer_ring>     render_timers_;
+    uint32_t                            draw_pass_;
+    ComPtr<ID3D12QueryHeap>             compute_query_heap_[thread_count_];
+    ComPtr<ID3D12Resource>              compute_timestamps_[thread_count_];
+    uint64_t*                           compute_timestamps_data_[thread_count_];
+    std::unique_ptr<gpu_timer_ring>     compute_timers_[thread_count_];
+    uint32_t                            simulate_pass_;
+    histogram_snapshot                  title_frames_;
+    histogram_snapshot                  title_steps_;
+    double                              title_elapsed_ = 0.0;
+
+    // trajectory playback
+    std::unique_ptr<trajectory_player>  players_[thread_count_];
+    ComPtr<ID3D12Resource>              playback_upload_[thread_count_];
+    uint8_t*                            playback_upload_data_[thread_count_];
+    std::chrono::steady_clock::time_point playback_clock_[thread_count_];
+    std::vector<uint8_t>                playback_compact_;
+
+    particle_set                        initial_particles_;
+
     // synchronization objects
     HANDLE                              swapchain_event_;
     ComPtr<ID3D12Fence>                 render_context_fence_;
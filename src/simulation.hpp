@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Everything in here is platform independent: no windows.h, DXGI or DirectXMath,
+// so the CPU engines and tools can be built anywhere.
+
+struct compute_data {
+    uint32_t param[4];  // param[0] - particles amount, param[1] - dimx
+    float    paramf[4]; // paramf[0] - time interval, paramf[1] - damping
+    // 4 variables for alignment
+};
+
+inline compute_data make_compute_data(uint32_t particle_count, float delta_time = 0.1f, float damping = 1.0f) {
+    compute_data data = {};
+    data.param[0] = particle_count;
+    data.param[1] = (particle_count + 127) / 128;
+    data.paramf[0] = delta_time;
+    data.paramf[1] = damping;
+    return data;
+}
+
+// the constants baked into ComputeShader.hlsl
+namespace gravity {
+    constexpr float softening_squared = 0.0012500000f * 0.0012500000f;
+    constexpr float scale_factor = 10000.0f;
+    constexpr float G = 6.67300e-11f * scale_factor;
+    constexpr float particle_mass = scale_factor * scale_factor;
+}
+
+// Structure-of-arrays particle storage used by the CPU engines.
+// The GPU keeps the interleaved particle_t layout: position.w holds the mass
+// and velocity.w the acceleration magnitude used for coloring.
+struct particle_set {
+    std::vector<float>    px, py, pz;
+    std::vector<float>    vx, vy, vz;
+    std::vector<float>    mass;
+    std::vector<float>    acceleration; // |a| of the last step
+    std::vector<uint32_t> cost;         // interactions evaluated for each particle during the last step
+    std::vector<int64_t>  fx, fy, fz;   // fixed-point master positions, only with engine_config::fixed_positions
+    std::vector<uint32_t> id;           // index at creation, follows the particle through permute()
+
+    size_t size() const {
+        return px.size();
+    }
+
+    void resize(size_t count) {
+        px.resize(count); py.resize(count); pz.resize(count);
+        vx.resize(count); vy.resize(count); vz.resize(count);
+        mass.resize(count, gravity::particle_mass);
+        acceleration.resize(count);
+        cost.resize(count, 1);
+
+        const size_t created = id.size();
+        id.resize(count);
+        for (size_t i = created; i < count; ++i)
+            id[i] = static_cast<uint32_t>(i);
+    }
+
+    // reorder all columns so that particle i becomes order[i]
+    void permute(const std::vector<uint32_t>& order) {
+        permute_column(px, order); permute_column(py, order); permute_column(pz, order);
+        permute_column(vx, order); permute_column(vy, order); permute_column(vz, order);
+        permute_column(mass, order);
+        permute_column(acceleration, order);
+        permute_column(cost, order);
+        permute_column(fx, order); permute_column(fy, order); permute_column(fz, order);
+        permute_column(id, order);
+    }
+
+private:
+    template<class T>
+    static void permute_column(std::vector<T>& column, const std::vector<uint32_t>& order) {
+        if (column.empty())
+            return;
+
+        std::vector<T> reordered(column.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            reordered[i] = column[order[i]];
+        column.swap(reordered);
+    }
+};
+
+// FNV-1a over the bits of the positions, velocities and accelerations -
+// two states hash equal only if they are bit-identical
+inline uint64_t state_checksum(const particle_set& particles) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    auto mix = [&hash](const std::vector<float>& column) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(column.data());
+        for (size_t i = 0; i < column.size() * sizeof(float); ++i) {
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ull;
+        }
+    };
+
+    mix(particles.px); mix(particles.py); mix(particles.pz);
+    mix(particles.vx); mix(particles.vy); mix(particles.vz);
+    mix(particles.acceleration);
+
+    return hash;
+}
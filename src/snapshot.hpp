@@ -0,0 +1,442 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "simulation.hpp"
+
+// Binary snapshots of a particle_set
+//
+// A snapshot is a fixed 512-byte header followed by one column per particle
+// attribute (structure of arrays), each starting on a 64-byte boundary:
+//
+//   header          magic, version, particle count, step, time, integrator,
+//                   dt, damping, the gravity:: constants and a column table
+//   columns         px py pz vx vy vz mass acceleration cost id [fx fy fz]
+//   [index]         bounding box and particle range of every chunk
+//
+// The column table gives the type and the file offset of every column, so a
+// reader maps the file and uses the columns in place - snapshot_view does no
+// parsing beyond validating the header, and a 100M-particle snapshot opens in
+// the time it takes to page in what is read. Everything is little endian.
+//
+// Since version 2 a snapshot may carry a spatial index: its particles are in
+// Morton order and split into chunks of consecutive particles, and the index
+// lists the bounding box of each. Region queries (snapshot_query.hpp) then
+// touch only the chunks they overlap.
+//
+// Readers accept any version up to snapshot_version; a newer version may add
+// columns and header fields behind the existing ones, but never moves them.
+
+constexpr char     snapshot_magic[8]     = { 'N', 'B', 'O', 'D', 'Y', 'S', 'N', 'P' };
+constexpr uint32_t snapshot_version      = 2;
+constexpr uint64_t snapshot_alignment    = 64;
+constexpr uint32_t snapshot_max_columns  = 16;
+
+enum class snapshot_column : uint32_t {
+    px, py, pz,
+    vx, vy, vz,
+    mass,
+    acceleration,
+    cost,
+    fx, fy, fz,     // fixed-point positions, see fixed_position.hpp
+    id,             // particle_set::id
+};
+
+enum class snapshot_type : uint32_t {
+    f32,
+    u32,
+    i64,
+};
+
+inline uint32_t snapshot_type_size(snapshot_type type) {
+    return type == snapshot_type::i64 ? 8 : 4;
+}
+
+inline snapshot_type snapshot_column_type(snapshot_column id) {
+    switch (id) {
+    case snapshot_column::cost:
+    case snapshot_column::id:
+        return snapshot_type::u32;
+    case snapshot_column::fx:
+    case snapshot_column::fy:
+    case snapshot_column::fz:
+        return snapshot_type::i64;
+    default:
+        return snapshot_type::f32;
+    }
+}
+
+struct snapshot_column_entry {
+    snapshot_column id;
+    snapshot_type   type;
+    uint64_t        offset;     // from the start of the file
+};
+
+struct snapshot_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t particle_count;
+    uint64_t file_size;
+    uint64_t step;
+    double   time;
+    char     integrator[32];    // update rule of the positions, see make_snapshot_info
+    float    delta_time;
+    float    damping;
+    float    G;
+    float    softening_squared;
+    float    scale_factor;
+    float    particle_mass;
+    uint32_t column_count;
+    uint32_t reserved0;
+    uint64_t index_offset;      // version 2: the chunk index, 0 - none
+    uint32_t chunk_count;
+    uint32_t chunk_size;        // particles in the largest chunk
+    uint8_t  reserved[128];
+    snapshot_column_entry columns[snapshot_max_columns];
+};
+
+// an entry of the spatial index
+struct snapshot_chunk {
+    float    min[3];
+    float    max[3];
+    uint64_t first;             // particle range
+    uint64_t count;
+};
+
+static_assert(sizeof(snapshot_column_entry) == 16, "snapshot column entries are 16 bytes");
+static_assert(sizeof(snapshot_header) == 512, "the snapshot header is 512 bytes");
+static_assert(sizeof(snapshot_chunk) == 40, "snapshot chunks are 40 bytes");
+
+// what the snapshot records about the run besides the particles
+struct snapshot_info {
+    uint64_t    step = 0;
+    double      time = 0.0;
+    float       delta_time = 0.1f;
+    float       damping = 1.0f;
+    std::string integrator = "euler-damped";
+};
+
+inline snapshot_info make_snapshot_info(const compute_data& params, uint64_t step) {
+    snapshot_info info;
+    info.step = step;
+    info.delta_time = params.paramf[0];
+    info.damping = params.paramf[1];
+    info.time = double(step) * info.delta_time;
+    return info;
+}
+
+inline uint64_t snapshot_align(uint64_t offset) {
+    return (offset + snapshot_alignment - 1) / snapshot_alignment * snapshot_alignment;
+}
+
+// the header of a snapshot of particles, with the column offsets filled in;
+// with an index, room for it behind the columns
+inline snapshot_header make_snapshot_header(const particle_set& particles, const snapshot_info& info, const std::vector<snapshot_chunk>* index = nullptr) {
+    snapshot_header header = {};
+    std::memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+    header.version = snapshot_version;
+    header.header_size = sizeof(snapshot_header);
+    header.particle_count = particles.size();
+    header.step = info.step;
+    header.time = info.time;
+    std::memcpy(header.integrator, info.integrator.c_str(), (std::min)(info.integrator.size(), sizeof(header.integrator) - 1));
+    header.delta_time = info.delta_time;
+    header.damping = info.damping;
+    header.G = gravity::G;
+    header.softening_squared = gravity::softening_squared;
+    header.scale_factor = gravity::scale_factor;
+    header.particle_mass = gravity::particle_mass;
+
+    std::vector<snapshot_column> columns = {
+        snapshot_column::px, snapshot_column::py, snapshot_column::pz,
+        snapshot_column::vx, snapshot_column::vy, snapshot_column::vz,
+        snapshot_column::mass, snapshot_column::acceleration, snapshot_column::cost, snapshot_column::id,
+    };
+    if (!particles.fx.empty())
+        columns.insert(columns.end(), { snapshot_column::fx, snapshot_column::fy, snapshot_column::fz });
+
+    uint64_t offset = snapshot_align(sizeof(snapshot_header));
+    for (size_t c = 0; c < columns.size(); ++c) {
+        snapshot_column_entry& entry = header.columns[c];
+        entry.id = columns[c];
+        entry.type = snapshot_column_type(entry.id);
+        entry.offset = offset;
+        offset = snapshot_align(offset + header.particle_count * snapshot_type_size(entry.type));
+    }
+
+    header.column_count = static_cast<uint32_t>(columns.size());
+
+    if (index && !index->empty()) {
+        header.index_offset = offset;
+        header.chunk_count = static_cast<uint32_t>(index->size());
+        for (const snapshot_chunk& chunk : *index)
+            header.chunk_size = (std::max)(header.chunk_size, static_cast<uint32_t>(chunk.count));
+        offset = snapshot_align(offset + index->size() * sizeof(snapshot_chunk));
+    }
+
+    header.file_size = offset;
+    return header;
+}
+
+inline const void* snapshot_column_data(const particle_set& particles, snapshot_column id) {
+    switch (id) {
+    case snapshot_column::px:           return particles.px.data();
+    case snapshot_column::py:           return particles.py.data();
+    case snapshot_column::pz:           return particles.pz.data();
+    case snapshot_column::vx:           return particles.vx.data();
+    case snapshot_column::vy:           return particles.vy.data();
+    case snapshot_column::vz:           return particles.vz.data();
+    case snapshot_column::mass:         return particles.mass.data();
+    case snapshot_column::acceleration: return particles.acceleration.data();
+    case snapshot_column::cost:         return particles.cost.data();
+    case snapshot_column::fx:           return particles.fx.data();
+    case snapshot_column::fy:           return particles.fy.data();
+    case snapshot_column::fz:           return particles.fz.data();
+    case snapshot_column::id:           return particles.id.data();
+    }
+    return nullptr;
+}
+
+// writes the complete file image to image, which must hold header.file_size bytes
+inline void serialize_snapshot(const particle_set& particles, const snapshot_header& header, uint8_t* image, const std::vector<snapshot_chunk>* index = nullptr) {
+    std::memset(image, 0, snapshot_align(sizeof(header)));
+    std::memcpy(image, &header, sizeof(header));
+
+    const uint64_t columns_end = header.chunk_count ? header.index_offset : header.file_size;
+    for (uint32_t c = 0; c < header.column_count; ++c) {
+        const snapshot_column_entry& entry = header.columns[c];
+        const uint64_t bytes = header.particle_count * snapshot_type_size(entry.type);
+        const uint64_t end = c + 1 < header.column_count ? header.columns[c + 1].offset : columns_end;
+
+        std::memcpy(image + entry.offset, snapshot_column_data(particles, entry.id), bytes);
+        std::memset(image + entry.offset + bytes, 0, end - entry.offset - bytes);
+    }
+
+    if (header.chunk_count) {
+        const uint64_t bytes = header.chunk_count * sizeof(snapshot_chunk);
+        std::memcpy(image + header.index_offset, index->data(), bytes);
+        std::memset(image + header.index_offset + bytes, 0, header.file_size - header.index_offset - bytes);
+    }
+}
+
+// writes the columns straight from the particle set, without a staging copy;
+// index must describe the order particles are in
+inline void write_snapshot(const std::string& path, const particle_set& particles, const snapshot_info& info, const std::vector<snapshot_chunk>* index = nullptr) {
+    const snapshot_header header = make_snapshot_header(particles, info, index);
+
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file)
+        throw std::runtime_error("cannot write " + path);
+
+    static const uint8_t padding[snapshot_alignment] = {};
+    uint64_t written = 0;
+    bool ok = true;
+
+    auto write = [&](const void* data, uint64_t bytes) {
+        ok = ok && std::fwrite(data, 1, bytes, file) == bytes;
+        written += bytes;
+    };
+
+    write(&header, sizeof(header));
+    for (uint32_t c = 0; c < header.column_count; ++c) {
+        const snapshot_column_entry& entry = header.columns[c];
+        write(padding, entry.offset - written);
+        write(snapshot_column_data(particles, entry.id), header.particle_count * snapshot_type_size(entry.type));
+    }
+    if (header.chunk_count) {
+        write(padding, header.index_offset - written);
+        write(index->data(), header.chunk_count * sizeof(snapshot_chunk));
+    }
+    write(padding, header.file_size - written);
+
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok)
+        throw std::runtime_error("cannot write " + path);
+}
+
+// throws unless the columns and the chunk index of header lie within its
+// file_size, in a form that cannot wrap around for a crafted offset or count
+inline void check_snapshot_layout(const snapshot_header& header) {
+    if (header.column_count > snapshot_max_columns)
+        throw std::runtime_error("snapshot: bad column table");
+
+    for (uint32_t c = 0; c < header.column_count; ++c) {
+        const snapshot_column_entry& entry = header.columns[c];
+        if (entry.offset % snapshot_alignment != 0 || entry.offset > header.file_size ||
+            header.particle_count > (header.file_size - entry.offset) / snapshot_type_size(entry.type))
+            throw std::runtime_error("snapshot: bad column table");
+    }
+
+    // version 1 left the index fields zero
+    if (header.chunk_count) {
+        if (header.index_offset % snapshot_alignment != 0 || header.index_offset > header.file_size ||
+            header.chunk_count > (header.file_size - header.index_offset) / sizeof(snapshot_chunk))
+            throw std::runtime_error("snapshot: bad chunk index");
+    }
+}
+
+// the most a file with header's particles, columns and chunks needs, each
+// aligned; for checks before an allocation of file_size bytes
+inline uint64_t snapshot_size_bound(const snapshot_header& header) {
+    uint64_t size = snapshot_align(sizeof(snapshot_header));
+    for (uint32_t c = 0; c < header.column_count && c < snapshot_max_columns; ++c)
+        size += snapshot_align(header.particle_count * snapshot_type_size(header.columns[c].type));
+    if (header.chunk_count)
+        size += snapshot_align(uint64_t(header.chunk_count) * sizeof(snapshot_chunk));
+    return size;
+}
+
+// FNV-1a over the bytes of every column, in the order of the column table;
+// unlike state_checksum() it covers mass, cost, id and the fixed-point
+// positions too
+inline uint64_t snapshot_columns_checksum(const uint8_t* image, const snapshot_header& header) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (uint32_t c = 0; c < header.column_count; ++c) {
+        const uint8_t* bytes = image + header.columns[c].offset;
+        const uint64_t size = header.particle_count * snapshot_type_size(header.columns[c].type);
+        for (uint64_t i = 0; i < size; ++i) {
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ull;
+        }
+    }
+    return hash;
+}
+
+// A validated, zero-copy view of a snapshot image in memory
+class snapshot_view {
+public:
+    snapshot_view(const uint8_t* data, size_t size) :
+        data_(data)
+    {
+        if (size < sizeof(snapshot_header))
+            throw std::runtime_error("snapshot: truncated header");
+
+        std::memcpy(&header_, data, sizeof(header_));
+
+        if (std::memcmp(header_.magic, snapshot_magic, sizeof(snapshot_magic)) != 0)
+            throw std::runtime_error("snapshot: not a snapshot file");
+        if (header_.version == 0 || header_.version > snapshot_version)
+            throw std::runtime_error("snapshot: unsupported version " + std::to_string(header_.version));
+        if (header_.header_size < sizeof(snapshot_header))
+            throw std::runtime_error("snapshot: bad header size");
+        if (header_.file_size > size)
+            throw std::runtime_error("snapshot: truncated file");
+        check_snapshot_layout(header_);
+    }
+
+    const uint8_t* data() const { return data_; }
+    const snapshot_header& header() const { return header_; }
+    uint64_t size() const { return header_.particle_count; }
+
+    // the spatial index, nullptr without one
+    uint32_t chunk_count() const { return header_.chunk_count; }
+    const snapshot_chunk* chunks() const {
+        return header_.chunk_count ? reinterpret_cast<const snapshot_chunk*>(data_ + header_.index_offset) : nullptr;
+    }
+
+    const snapshot_column_entry* find(snapshot_column id) const {
+        for (uint32_t c = 0; c < header_.column_count; ++c) {
+            if (header_.columns[c].id == id)
+                return &header_.columns[c];
+        }
+        return nullptr;
+    }
+
+    // nullptr if the snapshot has no such column of type T
+    template<class T>
+    const T* column(snapshot_column id) const {
+        const snapshot_column_entry* entry = find(id);
+        if (!entry || snapshot_type_size(entry->type) != sizeof(T))
+            return nullptr;
+        return reinterpret_cast<const T*>(data_ + entry->offset);
+    }
+
+private:
+    const uint8_t*  data_;
+    snapshot_header header_;
+};
+
+// A snapshot file mapped into memory
+class snapshot_file {
+public:
+    explicit snapshot_file(const std::string& path) :
+        file_(path),
+        view_(file_.data(), file_.size())
+    {
+    }
+
+    const snapshot_view& view() const { return view_; }
+    const mapped_file& file() const { return file_; }
+
+private:
+    mapped_file     file_;
+    snapshot_view   view_;
+};
+
+// copies the snapshot into particles; columns the snapshot lacks get the
+// particle_set defaults
+inline void load_snapshot(const snapshot_view& view, particle_set& particles) {
+    const size_t count = static_cast<size_t>(view.size());
+    particles.id.clear();   // resize() numbers the particles in file order
+    particles.resize(count);
+
+    auto copy = [&](snapshot_column id, auto& column) {
+        using T = typename std::decay_t<decltype(column)>::value_type;
+        if (const T* data = view.column<T>(id))
+            std::memcpy(column.data(), data, count * sizeof(T));
+    };
+
+    copy(snapshot_column::px, particles.px);
+    copy(snapshot_column::py, particles.py);
+    copy(snapshot_column::pz, particles.pz);
+    copy(snapshot_column::vx, particles.vx);
+    copy(snapshot_column::vy, particles.vy);
+    copy(snapshot_column::vz, particles.vz);
+    copy(snapshot_column::mass, particles.mass);
+    copy(snapshot_column::acceleration, particles.acceleration);
+    copy(snapshot_column::cost, particles.cost);
+    copy(snapshot_column::id, particles.id);
+
+    if (view.find(snapshot_column::fx)) {
+        particles.fx.resize(count);
+        particles.fy.resize(count);
+        particles.fz.resize(count);
+        copy(snapshot_column::fx, particles.fx);
+        copy(snapshot_column::fy, particles.fy);
+        copy(snapshot_column::fz, particles.fz);
+    }
+    else {
+        particles.fx.clear();
+        particles.fy.clear();
+        particles.fz.clear();
+    }
+}
+
+// the run parameters a header records
+inline snapshot_info make_snapshot_info(const snapshot_header& header) {
+    snapshot_info info;
+    info.step = header.step;
+    info.time = header.time;
+    info.delta_time = header.delta_time;
+    info.damping = header.damping;
+    const void* end = std::memchr(header.integrator, 0, sizeof(header.integrator));
+    info.integrator.assign(header.integrator, end ? static_cast<const char*>(end) : header.integrator + sizeof(header.integrator));
+    return info;
+}
+
+inline void read_snapshot(const std::string& path, particle_set& particles, snapshot_info* info = nullptr) {
+    snapshot_file file(path);
+    load_snapshot(file.view(), particles);
+
+    if (info)
+        *info = make_snapshot_info(file.view().header());
+}
@@ -0,0 +1,319 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "morton.hpp"
+#include "simulation.hpp"
+#include "snapshot.hpp"
+
+// Region queries on spatially indexed snapshots
+//
+// write_indexed_snapshot stores the particles in Morton order and cuts them
+// into chunks of at most chunk_size consecutive particles along octree cell
+// bounds, so every chunk is compact in space, and adds the bounding box of
+// every chunk. indexed_snapshot maps such a file and
+// answers box, sphere and k-nearest queries by scanning only the chunks whose
+// box can hold a result: the pages read grow with the queried volume, not
+// with the snapshot. Fully covered chunks are copied without testing.
+
+// the chunk of particles [first, first + count), with its bounding box
+inline snapshot_chunk make_snapshot_chunk(const particle_set& particles, uint64_t first, uint64_t count) {
+    snapshot_chunk chunk = {};
+    chunk.first = first;
+    chunk.count = count;
+    chunk.min[0] = chunk.max[0] = particles.px[first];
+    chunk.min[1] = chunk.max[1] = particles.py[first];
+    chunk.min[2] = chunk.max[2] = particles.pz[first];
+
+    for (uint64_t i = first + 1; i < first + count; ++i) {
+        chunk.min[0] = (std::min)(chunk.min[0], particles.px[i]); chunk.max[0] = (std::max)(chunk.max[0], particles.px[i]);
+        chunk.min[1] = (std::min)(chunk.min[1], particles.py[i]); chunk.max[1] = (std::max)(chunk.max[1], particles.py[i]);
+        chunk.min[2] = (std::min)(chunk.min[2], particles.pz[i]); chunk.max[2] = (std::max)(chunk.max[2], particles.pz[i]);
+    }
+    return chunk;
+}
+
+// splits the Morton-sorted particles [begin, end) of the cell at level into
+// chunks: children with more than chunk_size particles are split further,
+// runs of smaller siblings are merged while they fit. Cutting at cell bounds
+// keeps a chunk from spanning the jump between two distant cells.
+inline void index_morton_cell(const particle_set& particles, const std::vector<uint64_t>& keys, uint64_t begin, uint64_t end,
+    uint32_t level, uint32_t chunk_size, std::vector<snapshot_chunk>& index)
+{
+    auto emit = [&](uint64_t first, uint64_t last) {
+        for (; first < last; first += chunk_size)
+            index.push_back(make_snapshot_chunk(particles, first, (std::min)(uint64_t(chunk_size), last - first)));
+    };
+
+    if (end - begin <= chunk_size || level == morton_bits) {
+        emit(begin, end);
+        return;
+    }
+
+    uint64_t run = begin;
+    for (uint64_t child = begin; child < end;) {
+        const uint32_t octant = morton_octant(keys[child], level);
+        uint64_t child_end = child;
+        while (child_end < end && morton_octant(keys[child_end], level) == octant)
+            ++child_end;
+
+        if (child_end - child > chunk_size) {
+            emit(run, child);
+            index_morton_cell(particles, keys, child, child_end, level + 1, chunk_size, index);
+            run = child_end;
+        }
+        else if (child_end - run > chunk_size) {
+            emit(run, child);
+            run = child;
+        }
+        child = child_end;
+    }
+    emit(run, end);
+}
+
+// the index of Morton-sorted particles with their keys, chunks of at most
+// chunk_size particles
+inline std::vector<snapshot_chunk> make_snapshot_index(const particle_set& particles, const std::vector<uint64_t>& keys, uint32_t chunk_size) {
+    std::vector<snapshot_chunk> index;
+    index_morton_cell(particles, keys, 0, particles.size(), 0, (std::max)(chunk_size, 1u), index);
+    return index;
+}
+
+// writes a Morton-ordered copy of particles with its index; particle ids
+// keep the original order
+inline void write_indexed_snapshot(const std::string& path, const particle_set& particles, const snapshot_info& info, uint32_t chunk_size = 4096) {
+    particle_set sorted = particles;
+    std::vector<uint64_t> keys;
+    morton_sort(sorted, compute_bounds(sorted), keys);
+
+    const std::vector<snapshot_chunk> index = make_snapshot_index(sorted, keys, chunk_size);
+    write_snapshot(path, sorted, info, &index);
+}
+
+struct snapshot_query_stats {
+    uint64_t chunks_read = 0;
+    uint64_t particles_scanned = 0;
+    uint64_t bytes_read = 0;    // column bytes the queries touched
+};
+
+// A mapped snapshot with a spatial index. Query results replace the contents
+// of the particle set passed in; fixed-point positions are not read.
+class indexed_snapshot {
+public:
+    explicit indexed_snapshot(const std::string& path) :
+        file_(path)
+    {
+        const snapshot_view& view = file_.view();
+        if (!view.chunks())
+            throw std::runtime_error("snapshot: " + path + " has no spatial index");
+
+        px_ = view.column<float>(snapshot_column::px);
+        py_ = view.column<float>(snapshot_column::py);
+        pz_ = view.column<float>(snapshot_column::pz);
+        if (!px_ || !py_ || !pz_)
+            throw std::runtime_error("snapshot: " + path + " has no positions");
+
+        vx_ = view.column<float>(snapshot_column::vx);
+        vy_ = view.column<float>(snapshot_column::vy);
+        vz_ = view.column<float>(snapshot_column::vz);
+        mass_ = view.column<float>(snapshot_column::mass);
+        acceleration_ = view.column<float>(snapshot_column::acceleration);
+        cost_ = view.column<uint32_t>(snapshot_column::cost);
+        id_ = view.column<uint32_t>(snapshot_column::id);
+
+        const snapshot_chunk* chunks = view.chunks();
+        for (uint32_t c = 0; c < view.chunk_count(); ++c) {
+            if (chunks[c].first + chunks[c].count > view.size() || chunks[c].first + chunks[c].count < chunks[c].first)
+                throw std::runtime_error("snapshot: bad chunk index");
+        }
+
+        row_bytes_ = 0;
+        for (uint32_t c = 0; c < view.header().column_count; ++c)
+            row_bytes_ += snapshot_type_size(view.header().columns[c].type);
+
+        file_.file().advise_random();
+    }
+
+    uint64_t size() const { return file_.view().size(); }
+    uint32_t chunk_count() const { return file_.view().chunk_count(); }
+    const snapshot_chunk* chunks() const { return file_.view().chunks(); }
+    const snapshot_view& view() const { return file_.view(); }
+
+    // bytes of all columns of one particle
+    uint64_t row_bytes() const { return row_bytes_; }
+
+    // the particles with min <= p <= max
+    void query_box(const float min[3], const float max[3], particle_set& result) {
+        clear(result);
+        for (uint32_t c = 0; c < chunk_count(); ++c) {
+            const snapshot_chunk& chunk = chunks()[c];
+            if (chunk.max[0] < min[0] || chunk.min[0] > max[0] ||
+                chunk.max[1] < min[1] || chunk.min[1] > max[1] ||
+                chunk.max[2] < min[2] || chunk.min[2] > max[2])
+                continue;
+
+            const bool covered =
+                chunk.min[0] >= min[0] && chunk.max[0] <= max[0] &&
+                chunk.min[1] >= min[1] && chunk.max[1] <= max[1] &&
+                chunk.min[2] >= min[2] && chunk.max[2] <= max[2];
+
+            scan(chunk, covered, result, [&](uint64_t i) {
+                return px_[i] >= min[0] && px_[i] <= max[0] &&
+                       py_[i] >= min[1] && py_[i] <= max[1] &&
+                       pz_[i] >= min[2] && pz_[i] <= max[2];
+            });
+        }
+    }
+
+    // the particles within radius of center
+    void query_sphere(const float center[3], float radius, particle_set& result) {
+        clear(result);
+        const double radius_squared = double(radius) * radius;
+
+        for (uint32_t c = 0; c < chunk_count(); ++c) {
+            const snapshot_chunk& chunk = chunks()[c];
+            if (box_distance_squared(chunk, center) > radius_squared)
+                continue;
+
+            // the farthest corner is inside
+            double far = 0.0;
+            for (int axis = 0; axis < 3; ++axis) {
+                const double d = (std::max)(std::fabs(double(center[axis]) - chunk.min[axis]), std::fabs(double(center[axis]) - chunk.max[axis]));
+                far += d * d;
+            }
+
+            scan(chunk, far <= radius_squared, result, [&](uint64_t i) {
+                return distance_squared(i, center) <= radius_squared;
+            });
+        }
+    }
+
+    // the k particles nearest to point, nearest first. Chunks are visited in
+    // the order of their distance and the search stops at the first chunk
+    // farther than the k-th nearest particle found so far.
+    void query_nearest(const float point[3], size_t k, particle_set& result) {
+        clear(result);
+        if (k == 0)
+            return;
+
+        std::vector<std::pair<double, uint32_t>> order(chunk_count());
+        for (uint32_t c = 0; c < chunk_count(); ++c)
+            order[c] = { box_distance_squared(chunks()[c], point), c };
+        std::sort(order.begin(), order.end());
+
+        // max-heap of the nearest particles so far
+        std::priority_queue<std::pair<double, uint64_t>> nearest;
+        for (const auto& entry : order) {
+            if (nearest.size() == k && entry.first > nearest.top().first)
+                break;
+
+            const snapshot_chunk& chunk = chunks()[entry.second];
+            account(chunk.count, 3 * sizeof(float));
+            for (uint64_t i = chunk.first; i < chunk.first + chunk.count; ++i) {
+                const double d = distance_squared(i, point);
+                if (nearest.size() < k)
+                    nearest.emplace(d, i);
+                else if (d < nearest.top().first) {
+                    nearest.pop();
+                    nearest.emplace(d, i);
+                }
+            }
+        }
+
+        std::vector<uint64_t> found(nearest.size());
+        for (size_t i = found.size(); i-- > 0; nearest.pop())
+            found[i] = nearest.top().second;
+        for (uint64_t i : found)
+            append(i, result);
+        stats_.bytes_read += found.size() * (row_bytes_ - 3 * sizeof(float));
+    }
+
+    const snapshot_query_stats& stats() const { return stats_; }
+    void reset_stats() { stats_ = snapshot_query_stats(); }
+
+private:
+    static double box_distance_squared(const snapshot_chunk& chunk, const float point[3]) {
+        double sum = 0.0;
+        for (int axis = 0; axis < 3; ++axis) {
+            const double d = (std::max)({ double(chunk.min[axis]) - point[axis], double(point[axis]) - chunk.max[axis], 0.0 });
+            sum += d * d;
+        }
+        return sum;
+    }
+
+    double distance_squared(uint64_t i, const float point[3]) const {
+        const double dx = double(px_[i]) - point[0];
+        const double dy = double(py_[i]) - point[1];
+        const double dz = double(pz_[i]) - point[2];
+        return dx * dx + dy * dy + dz * dz;
+    }
+
+    void account(uint64_t scanned, uint64_t bytes_per_particle) {
+        ++stats_.chunks_read;
+        stats_.particles_scanned += scanned;
+        stats_.bytes_read += scanned * bytes_per_particle;
+    }
+
+    // appends the particles of chunk that pass inside, all of them if covered
+    template<class Inside>
+    void scan(const snapshot_chunk& chunk, bool covered, particle_set& result, Inside inside) {
+        const size_t before = result.size();
+        const uint64_t end = chunk.first + chunk.count;
+
+        if (covered) {
+            for (uint64_t i = chunk.first; i < end; ++i)
+                append(i, result);
+        }
+        else {
+            for (uint64_t i = chunk.first; i < end; ++i)
+                if (inside(i))
+                    append(i, result);
+        }
+
+        account(chunk.count, 3 * sizeof(float));
+        stats_.bytes_read += (result.size() - before) * (row_bytes_ - 3 * sizeof(float));
+    }
+
+    void append(uint64_t i, particle_set& result) const {
+        result.px.push_back(px_[i]);
+        result.py.push_back(py_[i]);
+        result.pz.push_back(pz_[i]);
+        result.vx.push_back(vx_ ? vx_[i] : 0.0f);
+        result.vy.push_back(vy_ ? vy_[i] : 0.0f);
+        result.vz.push_back(vz_ ? vz_[i] : 0.0f);
+        result.mass.push_back(mass_ ? mass_[i] : gravity::particle_mass);
+        result.acceleration.push_back(acceleration_ ? acceleration_[i] : 0.0f);
+        result.cost.push_back(cost_ ? cost_[i] : 1);
+        result.id.push_back(id_ ? id_[i] : static_cast<uint32_t>(i));
+    }
+
+    static void clear(particle_set& result) {
+        result.id.clear();
+        result.resize(0);
+        result.fx.clear();
+        result.fy.clear();
+        result.fz.clear();
+    }
+
+private:
+    snapshot_file           file_;
+    const float*            px_ = nullptr;
+    const float*            py_ = nullptr;
+    const float*            pz_ = nullptr;
+    const float*            vx_ = nullptr;
+    const float*            vy_ = nullptr;
+    const float*            vz_ = nullptr;
+    const float*            mass_ = nullptr;
+    const float*            acceleration_ = nullptr;
+    const uint32_t*         cost_ = nullptr;
+    const uint32_t*         id_ = nullptr;
+    uint64_t                row_bytes_ = 0;
+    snapshot_query_stats    stats_;
+};
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "trace.hpp"
+
+// A CPU mirror of the simulation state for recovering from device removal
+//
+// Every interval steps the simulation copies its output buffer into one of
+// two readback buffers on the GPU timeline, alternating between them, and
+// hands the mapped buffer to submit() once the step's fence has passed. A
+// worker thread copies it into the back image and publishes it as the
+// newest state, so the simulation thread pays for neither the copy nor a
+// wait - acquire() only blocks if a readback buffer comes round again before
+// its copy finished, i.e. when interval steps are quicker than one memcpy.
+//
+// The images are the bytes of the GPU buffer, whatever its layout; after a
+// device reset they are uploaded as they are, losing at most interval steps.
+
+struct mirror_stats {
+    uint64_t submitted = 0;
+    uint64_t published = 0;
+    double   last_copy = 0.0;       // seconds the worker spent on the last image
+    double   max_wait = 0.0;        // longest acquire() on the simulation thread
+};
+
+class state_mirror {
+public:
+    explicit state_mirror(uint32_t interval) :
+        interval_(interval),
+        worker_([this] { worker_thread_proc(); })
+    {
+    }
+
+    state_mirror(const state_mirror&) = delete;
+    state_mirror& operator=(const state_mirror&) = delete;
+
+    ~state_mirror() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            terminating_ = true;
+        }
+        changed_.notify_all();
+        worker_.join();
+    }
+
+    uint32_t interval() const { return interval_; }
+
+    // whether the output of step is to be read back
+    bool due(uint64_t step) const {
+        return interval_ > 0 && step % interval_ == 0;
+    }
+
+    // the readback buffer for step
+    uint32_t slot(uint64_t step) const {
+        return static_cast<uint32_t>(step / interval_ % 2);
+    }
+
+    // simulation thread, before recording a copy into slot's readback buffer:
+    // waits until the worker is done reading it
+    void acquire(uint32_t slot) {
+        NBODY_TRACE_SCOPE("mirror acquire");
+        const auto start = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [&] { return !jobs_[slot].pending; });
+        const double waited = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        stats_.max_wait = waited > stats_.max_wait ? waited : stats_.max_wait;
+    }
+
+    // simulation thread, once the GPU has written the state of step to the
+    // readback buffer of slot: data stays valid until acquire(slot) returns
+    void submit(uint32_t slot, uint64_t step, const void* data, size_t size) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_t& job = jobs_[slot];
+            job.data = data;
+            job.size = size;
+            job.step = step;
+            job.sequence = ++sequence_;
+            job.pending = true;
+            ++stats_.submitted;
+        }
+        changed_.notify_all();
+    }
+
+    // waits for the copies in flight; before the readback buffers go away
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this] { return !jobs_[0].pending && !jobs_[1].pending; });
+    }
+
+    // calls read(data, size, step) with the newest complete state and returns
+    // true, false if there is none yet. Any thread; the state is held until
+    // read returns.
+    template<class Read>
+    bool read(Read read) const {
+        std::lock_guard<std::mutex> lock(published_mutex_);
+        if (!valid_)
+            return false;
+        read(static_cast<const void*>(images_[front_].data()), images_[front_].size(), step_);
+        return true;
+    }
+
+    bool valid() const {
+        std::lock_guard<std::mutex> lock(published_mutex_);
+        return valid_;
+    }
+
+    // step of the newest complete state
+    uint64_t step() const {
+        std::lock_guard<std::mutex> lock(published_mutex_);
+        return step_;
+    }
+
+    // forgets the state, e.g. when the simulation restarts from scratch
+    void reset() {
+        flush();
+        std::lock_guard<std::mutex> lock(published_mutex_);
+        valid_ = false;
+        step_ = 0;
+    }
+
+    mirror_stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    struct job_t {
+        const void* data = nullptr;
+        size_t      size = 0;
+        uint64_t    step = 0;
+        uint64_t    sequence = 0;
+        bool        pending = false;
+    };
+
+    void worker_thread_proc() {
+        NBODY_TRACE_THREAD("state mirror");
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            changed_.wait(lock, [this] { return terminating_ || jobs_[0].pending || jobs_[1].pending; });
+            if (!jobs_[0].pending && !jobs_[1].pending)
+                return;
+
+            // oldest first
+            job_t* job = &jobs_[0];
+            if (!job->pending || (jobs_[1].pending && jobs_[1].sequence < job->sequence))
+                job = &jobs_[1];
+            const job_t copy = *job;
+            lock.unlock();
+
+            // the back image is the worker's alone
+            NBODY_TRACE_SCOPE("mirror copy");
+            const auto start = std::chrono::steady_clock::now();
+            std::vector<uint8_t>& image = images_[1 - front_];
+            image.resize(copy.size);
+            std::memcpy(image.data(), copy.data, copy.size);
+
+            {
+                std::lock_guard<std::mutex> published(published_mutex_);
+                front_ = 1 - front_;
+                step_ = copy.step;
+                valid_ = true;
+            }
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            lock.lock();
+            job->pending = false;
+            ++stats_.published;
+            stats_.last_copy = seconds;
+            changed_.notify_all();
+        }
+    }
+
+private:
+    const uint32_t                  interval_;
+
+    // jobs, shared with the worker
+    mutable std::mutex              mutex_;
+    std::condition_variable         changed_;
+    job_t                           jobs_[2];
+    uint64_t                        sequence_ = 0;
+    mirror_stats                    stats_;
+    bool                            terminating_ = false;
+
+    // the published state; front_ changes only on the worker, under published_mutex_
+    mutable std::mutex              published_mutex_;
+    std::vector<uint8_t>            images_[2];
+    int                             front_ = 0;
+    uint64_t                        step_ = 0;
+    bool                            valid_ = false;
+
+    std::thread                     worker_;        // last, starts once everything else is constructed
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fork-join pool: run() hands out task indices to the workers and to the
+// calling thread, and returns once every task has finished. If a task
+// throws, the tasks not yet started are skipped and run() rethrows the first
+// exception on the calling thread.
+class thread_pool {
+public:
+    explicit thread_pool(unsigned thread_count = 0) {
+        if (thread_count == 0)
+            thread_count = (std::max)(1u, std::thread::hardware_concurrency());
+
+        for (unsigned i = 1; i < thread_count; ++i)
+            workers_.emplace_back([this] { worker_loop(); });
+    }
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+
+        for (auto& worker : workers_)
+            worker.join();
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    // workers plus the calling thread
+    unsigned size() const {
+        return static_cast<unsigned>(workers_.size()) + 1;
+    }
+
+    void run(uint32_t task_count, const std::function<void(uint32_t)>& task) {
+        if (workers_.empty() || task_count == 1) {
+            for (uint32_t i = 0; i < task_count; ++i)
+                task(i);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            task_ = &task;
+            task_count_ = task_count;
+            next_task_.store(0);
+            busy_workers_ = static_cast<uint32_t>(workers_.size());
+            error_ = nullptr;
+            ++generation_;
+        }
+        wake_.notify_all();
+
+        drain(task, task_count);
+
+        std::exception_ptr error;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_.wait(lock, [this] { return busy_workers_ == 0; });
+            task_ = nullptr;
+            std::swap(error, error_);
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+private:
+    void drain(const std::function<void(uint32_t)>& task, uint32_t task_count) {
+        try {
+            for (uint32_t i = next_task_++; i < task_count; i = next_task_++)
+                task(i);
+        }
+        catch (...) {
+            next_task_.store(task_count);
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!error_)
+                error_ = std::current_exception();
+        }
+    }
+
+    void worker_loop() {
+        uint64_t seen_generation = 0;
+
+        for (;;) {
+            const std::function<void(uint32_t)>* task;
+            uint32_t task_count;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return stopping_ || generation_ != seen_generation; });
+                if (stopping_)
+                    return;
+
+                seen_generation = generation_;
+                task = task_;
+                task_count = task_count_;
+            }
+
+            drain(*task, task_count);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--busy_workers_ == 0)
+                done_.notify_one();
+        }
+    }
+
+private:
+    std::vector<std::thread>                workers_;
+    std::mutex                              mutex_;
+    std::condition_variable                 wake_;
+    std::condition_variable                 done_;
+
+    const std::function<void(uint32_t)>*    task_ = nullptr;
+    uint32_t                                task_count_ = 0;
+    std::atomic<uint32_t>                   next_task_{ 0 };
+    uint32_t                                busy_workers_ = 0;
+    uint64_t                                generation_ = 0;
+    std::exception_ptr                      error_;                 // the first a task threw in this run
+    bool                                    stopping_ = false;
+};
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Scoped tracing
+//
+// NBODY_TRACE_SCOPE("name") records how long the enclosing scope took as one
+// complete event into a ring owned by the calling thread: two clock reads
+// and four relaxed stores, no locks and no allocation after a thread's first
+// event. The rings keep the newest trace_ring::capacity events per thread and
+// outlive their threads, so write_chrome_trace() can dump them any time as
+// Chrome trace-event JSON, which chrome://tracing and ui.perfetto.dev open.
+// Up to tracer::max_rings rings are kept; past that a new thread takes over
+// the ring of one that has exited, dropping its events, so re-created thread
+// pools don't grow the tracer without bound. Only more live threads than
+// max_rings at once add rings beyond it.
+//
+// The macros compile to nothing unless NBODY_TRACE is defined (the CMake
+// option of the same name); the classes are always there for tools that
+// measure them. Names must be string literals or otherwise outlive the dump.
+
+struct trace_event {
+    std::atomic<const char*> name{ nullptr };
+    std::atomic<uint64_t>    begin{ 0 };    // ns since the tracer started
+    std::atomic<uint64_t>    end{ 0 };
+};
+
+// Single producer: only the owning thread writes, and publishes an event by
+// bumping head_ with a release store. A reader that races with the writer
+// may see slots being overwritten; it drops everything the writer could have
+// reached by the time it is done, see read().
+class trace_ring {
+public:
+    static constexpr uint32_t capacity = 1u << 16;
+
+    trace_ring(uint32_t thread_id, std::string thread_name) :
+        thread_id_(thread_id),
+        thread_name_(std::move(thread_name)),
+        events_(new trace_event[capacity])
+    {
+    }
+
+    void push(const char* name, uint64_t begin, uint64_t end) {
+        const uint64_t head = head_.load(std::memory_order_relaxed);
+        trace_event& event = events_[head & (capacity - 1)];
+        event.name.store(name, std::memory_order_relaxed);
+        event.begin.store(begin, std::memory_order_relaxed);
+        event.end.store(end, std::memory_order_relaxed);
+        head_.store(head + 1, std::memory_order_release);
+    }
+
+    struct record {
+        const char* name;
+        uint64_t    begin;
+        uint64_t    end;
+    };
+
+    // the events still in the ring, oldest first
+    std::vector<record> read() const {
+        const uint64_t head = head_.load(std::memory_order_acquire);
+        const uint64_t first = head > capacity ? head - capacity : 0;
+
+        std::vector<record> records;
+        records.reserve(static_cast<size_t>(head - first));
+        for (uint64_t i = first; i < head; ++i) {
+            const trace_event& event = events_[i & (capacity - 1)];
+            records.push_back({ event.name.load(std::memory_order_relaxed), event.begin.load(std::memory_order_relaxed), event.end.load(std::memory_order_relaxed) });
+        }
+
+        // whatever the writer got to meanwhile may be torn, including the
+        // slot of event now, which it may be writing before it publishes it
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint64_t now = head_.load(std::memory_order_relaxed);
+        const uint64_t overwritten = now + 1 > capacity ? now + 1 - capacity : 0;
+        if (overwritten > first) {
+            const size_t dropped = static_cast<size_t>((std::min)(overwritten - first, uint64_t(records.size())));
+            records.erase(records.begin(), records.begin() + dropped);
+        }
+        return records;
+    }
+
+    // hands the ring to another thread, dropping its events; only while no
+    // thread writes to it or reads it
+    void reset(uint32_t thread_id, std::string thread_name) {
+        thread_id_ = thread_id;
+        thread_name_ = std::move(thread_name);
+        head_.store(0, std::memory_order_release);
+    }
+
+    uint32_t thread_id() const { return thread_id_; }
+    const std::string& thread_name() const { return thread_name_; }
+    void set_thread_name(std::string name) { thread_name_ = std::move(name); }
+
+    // events ever pushed, including the overwritten ones
+    uint64_t count() const { return head_.load(std::memory_order_acquire); }
+
+private:
+    uint32_t                        thread_id_;
+    std::string                     thread_name_;   // set before the first dump, not synchronized
+    std::unique_ptr<trace_event[]>  events_;
+    std::atomic<uint64_t>           head_{ 0 };
+};
+
+class tracer {
+public:
+    static tracer& instance() {
+        static tracer t;
+        return t;
+    }
+
+    uint64_t now() const {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count());
+    }
+
+    static constexpr size_t max_rings = 64;
+
+    // the calling thread's ring, registered on first use and retired when
+    // the thread exits
+    trace_ring& ring() {
+        struct owner_t {
+            trace_ring* ring = nullptr;
+            ~owner_t() {
+                if (ring)
+                    tracer::instance().retire(ring);
+            }
+        };
+        thread_local owner_t owner;
+        if (!owner.ring)
+            owner.ring = acquire();
+        return *owner.ring;
+    }
+
+    void set_thread_name(const std::string& name) {
+        ring().set_thread_name(name);
+    }
+
+    // Chrome trace-event JSON: one complete ("X") event per scope, times in
+    // microseconds, and a thread_name metadata event per ring
+    void write_chrome_trace(const std::string& path) {
+        FILE* file = std::fopen(path.c_str(), "w");
+        if (!file)
+            throw std::runtime_error("cannot write " + path);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+        bool first = true;
+        for (const auto& ring : rings_) {
+            std::fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",", ring->thread_id(), json_escape(ring->thread_name()).c_str());
+            first = false;
+
+            for (const trace_ring::record& r : ring->read()) {
+                std::fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    json_escape(r.name ? r.name : "?").c_str(), ring->thread_id(), r.begin / 1000.0, (r.end - r.begin) / 1000.0);
+            }
+        }
+        std::fprintf(file, "\n]}\n");
+
+        if (std::fclose(file) != 0)
+            throw std::runtime_error("cannot write " + path);
+    }
+
+    // events recorded so far on all threads, including the overwritten ones
+    uint64_t event_count() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t count = 0;
+        for (const auto& ring : rings_)
+            count += ring->count();
+        return count;
+    }
+
+private:
+    tracer() : start_(std::chrono::steady_clock::now()) {}
+
+    trace_ring* acquire() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const uint32_t id = ++last_id_;
+        if (rings_.size() >= max_rings && !retired_.empty()) {
+            trace_ring* ring = retired_.front();
+            retired_.erase(retired_.begin());
+            ring->reset(id, "thread " + std::to_string(id));
+            return ring;
+        }
+        rings_.push_back(std::make_unique<trace_ring>(id, "thread " + std::to_string(id)));
+        return rings_.back().get();
+    }
+
+    // the events stay until another thread takes the ring over, oldest first
+    void retire(trace_ring* ring) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        retired_.push_back(ring);
+    }
+
+    static std::string json_escape(const std::string& text) {
+        std::string escaped;
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+                escaped += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20) {
+                char code[8];
+                std::snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned>(c));
+                escaped += code;
+            }
+            else
+                escaped += c;
+        }
+        return escaped;
+    }
+
+    const std::chrono::steady_clock::time_point start_;
+    std::mutex                                  mutex_;
+    std::vector<std::unique_ptr<trace_ring>>    rings_;
+    std::vector<trace_ring*>                    retired_;
+    uint32_t                                    last_id_ = 0;
+};
+
+class trace_scope {
+public:
+    explicit trace_scope(const char* name) :
+        name_(name),
+        begin_(tracer::instance().now())
+    {
+    }
+
+    ~trace_scope() {
+        tracer& t = tracer::instance();
+        t.ring().push(name_, begin_, t.now());
+    }
+
+    trace_scope(const trace_scope&) = delete;
+    trace_scope& operator=(const trace_scope&) = delete;
+
+private:
+    const char* name_;
+    uint64_t    begin_;
+};
+
+#define NBODY_TRACE_CONCAT_(a, b) a##b
+#define NBODY_TRACE_CONCAT(a, b) NBODY_TRACE_CONCAT_(a, b)
+
+#ifdef NBODY_TRACE
+#define NBODY_TRACE_SCOPE(name) trace_scope NBODY_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define NBODY_TRACE_THREAD(name) tracer::instance().set_thread_name(name)
+#else
+#define NBODY_TRACE_SCOPE(name) ((void)0)
+#define NBODY_TRACE_THREAD(name) ((void)0)
+#endif
@@ -0,0 +1,372 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "thread_pool.hpp"
+
+// Compressed trajectories
+//
+// A trajectory is a stream of position frames in particle_set::id order. Each
+// coordinate is quantized to a multiple of 2 x tolerance, so a decoded
+// position is never further than tolerance from the simulated one, and then
+// predicted from the previous frame: the prediction is the last position plus
+// the last displacement, i.e. position + velocity * dt with the velocity the
+// decoder itself can see. Only the residuals of the prediction are stored,
+// zigzag-encoded and bit-packed in groups of 32 with the width of the largest.
+// Smooth motion leaves residuals of a few bits, against the 32 bytes of
+// particle_t.
+//
+// Frames are split into blocks of block_size particles that are coded
+// independently, so both sides work on the blocks in parallel. Every
+// keyframe_interval frames a keyframe stores the quantized positions coded
+// against their neighbor in the block, restarting the prediction; readers
+// seek to the nearest keyframe and decode forward from there.
+//
+//   file header     64 bytes, see trajectory_header
+//   frames          trajectory_frame_header, block_count x uint32 block sizes, blocks
+//
+// Within a block the x, y and z residuals follow each other, each as groups
+// of one width byte and 4 x width bytes of packed values.
+
+constexpr char     trajectory_magic[8]      = { 'N', 'B', 'O', 'D', 'Y', 'T', 'R', 'J' };
+constexpr uint32_t trajectory_version       = 1;
+constexpr uint32_t trajectory_group_size    = 32;
+
+struct trajectory_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t particle_count;
+    double   tolerance;
+    uint32_t block_size;
+    uint32_t keyframe_interval;
+    uint8_t  reserved[24];
+};
+
+struct trajectory_frame_header {
+    uint64_t step;
+    double   time;
+    uint64_t size;          // bytes after this header: block table and blocks
+    uint32_t block_count;
+    uint32_t keyframe;
+};
+
+static_assert(sizeof(trajectory_header) == 64, "the trajectory header is 64 bytes");
+static_assert(sizeof(trajectory_frame_header) == 32, "trajectory frame headers are 32 bytes");
+
+// positions of one frame, in id order
+struct trajectory_frame {
+    uint64_t            step = 0;
+    double              time = 0.0;
+    std::vector<float>  px, py, pz;
+};
+
+inline uint64_t zigzag_encode(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t zigzag_decode(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+inline uint32_t bit_width(uint64_t value) {
+    uint32_t width = 0;
+    while (value) {
+        ++width;
+        value >>= 1;
+    }
+    return width;
+}
+
+// packs count values of width bits, LSB first
+inline void pack_bits(const uint64_t* values, uint32_t count, uint32_t width, std::vector<uint8_t>& out) {
+    uint64_t accumulator = 0;
+    uint32_t filled = 0;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        uint64_t value = values[i];
+        uint32_t remaining = width;
+
+        while (remaining > 0) {
+            const uint32_t take = (std::min)(remaining, 64 - filled);
+            const uint64_t part = take == 64 ? value : value & ((uint64_t(1) << take) - 1);
+            accumulator |= part << filled;
+            filled += take;
+            remaining -= take;
+            value = take == 64 ? 0 : value >> take;
+
+            if (filled == 64) {
+                for (int b = 0; b < 8; ++b)
+                    out.push_back(static_cast<uint8_t>(accumulator >> (8 * b)));
+                accumulator = 0;
+                filled = 0;
+            }
+        }
+    }
+
+    for (uint32_t b = 0; b * 8 < filled; ++b)
+        out.push_back(static_cast<uint8_t>(accumulator >> (8 * b)));
+}
+
+inline const uint8_t* unpack_bits(const uint8_t* in, uint32_t count, uint32_t width, uint64_t* values) {
+    uint32_t bit = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint64_t value = 0;
+        for (uint32_t got = 0; got < width;) {
+            const uint32_t offset = bit & 7;
+            const uint32_t take = (std::min)(width - got, 8 - offset);
+            const uint64_t part = (in[bit >> 3] >> offset) & ((1u << take) - 1);
+            value |= part << got;
+            got += take;
+            bit += take;
+        }
+        values[i] = value;
+    }
+    return in + (uint64_t(count) * width + 7) / 8;
+}
+
+// residuals of one axis of one block, in groups of 32
+inline void encode_residuals(const int64_t* residuals, uint32_t count, std::vector<uint8_t>& out) {
+    uint64_t group[trajectory_group_size];
+
+    for (uint32_t begin = 0; begin < count; begin += trajectory_group_size) {
+        uint64_t combined = 0;
+        for (uint32_t i = 0; i < trajectory_group_size; ++i) {
+            group[i] = begin + i < count ? zigzag_encode(residuals[begin + i]) : 0;
+            combined |= group[i];
+        }
+
+        const uint32_t width = bit_width(combined);
+        out.push_back(static_cast<uint8_t>(width));
+        pack_bits(group, trajectory_group_size, width, out);
+    }
+}
+
+inline const uint8_t* decode_residuals(const uint8_t* in, const uint8_t* end, uint32_t count, int64_t* residuals) {
+    uint64_t group[trajectory_group_size];
+
+    for (uint32_t begin = 0; begin < count; begin += trajectory_group_size) {
+        if (in >= end || *in > 64 || in + 1 + 4 * *in > end)
+            throw std::runtime_error("trajectory: corrupt block");
+
+        const uint32_t width = *in++;
+        in = unpack_bits(in, trajectory_group_size, width, group);
+
+        for (uint32_t i = 0; i < trajectory_group_size && begin + i < count; ++i)
+            residuals[begin + i] = zigzag_decode(group[i]);
+    }
+    return in;
+}
+
+// The per-particle prediction state both sides keep: the last quantized
+// position and the displacement that led to it.
+struct trajectory_state {
+    std::vector<int64_t> q[3];
+    std::vector<int64_t> d[3];
+
+    void resize(size_t count) {
+        for (int axis = 0; axis < 3; ++axis) {
+            q[axis].assign(count, 0);
+            d[axis].assign(count, 0);
+        }
+    }
+};
+
+inline int64_t trajectory_quantize(float value, double quantum) {
+    return std::llround(double(value) / quantum);
+}
+
+// codes particles [begin, end) of a frame into out and advances the state
+inline void encode_trajectory_block(const trajectory_frame& frame, double quantum, bool keyframe,
+                                    uint32_t begin, uint32_t end, trajectory_state& state, std::vector<uint8_t>& out) {
+    const float* columns[3] = { frame.px.data(), frame.py.data(), frame.pz.data() };
+    std::vector<int64_t> residuals(end - begin);
+
+    out.clear();
+    for (int axis = 0; axis < 3; ++axis) {
+        int64_t* q = state.q[axis].data();
+        int64_t* d = state.d[axis].data();
+
+        for (uint32_t i = begin; i < end; ++i) {
+            const int64_t value = trajectory_quantize(columns[axis][i], quantum);
+
+            if (keyframe) {
+                residuals[i - begin] = value - (i > begin ? q[i - 1] : 0);
+                d[i] = 0;
+            }
+            else {
+                residuals[i - begin] = value - (q[i] + d[i]);
+                d[i] = value - q[i];
+            }
+            q[i] = value;
+        }
+
+        encode_residuals(residuals.data(), end - begin, out);
+    }
+}
+
+inline void decode_trajectory_block(const uint8_t* in, const uint8_t* in_end, double quantum, bool keyframe,
+                                    uint32_t begin, uint32_t end, trajectory_state& state, trajectory_frame& frame) {
+    float* columns[3] = { frame.px.data(), frame.py.data(), frame.pz.data() };
+    std::vector<int64_t> residuals(end - begin);
+
+    for (int axis = 0; axis < 3; ++axis) {
+        in = decode_residuals(in, in_end, end - begin, residuals.data());
+
+        int64_t* q = state.q[axis].data();
+        int64_t* d = state.d[axis].data();
+
+        for (uint32_t i = begin; i < end; ++i) {
+            int64_t value;
+            if (keyframe) {
+                value = residuals[i - begin] + (i > begin ? q[i - 1] : 0);
+                d[i] = 0;
+            }
+            else {
+                value = residuals[i - begin] + q[i] + d[i];
+                d[i] = value - q[i];
+            }
+            q[i] = value;
+            columns[axis][i] = static_cast<float>(value * quantum);
+        }
+    }
+}
+
+// Random access to a trajectory file through a memory mapping. Opening scans
+// the frame headers once; read() decodes sequentially when frames are read in
+// order and restarts from the nearest keyframe otherwise.
+class trajectory_reader {
+public:
+    struct frame_entry {
+        uint64_t step;
+        double   time;
+        uint64_t offset;        // of the frame header
+        bool     keyframe;
+    };
+
+    explicit trajectory_reader(const std::string& path, unsigned thread_count = 1) :
+        file_(path),
+        pool_(thread_count)
+    {
+        if (file_.size() < sizeof(header_))
+            throw std::runtime_error("trajectory: truncated header");
+
+        std::memcpy(&header_, file_.data(), sizeof(header_));
+        if (std::memcmp(header_.magic, trajectory_magic, sizeof(trajectory_magic)) != 0)
+            throw std::runtime_error("trajectory: not a trajectory file");
+        if (header_.version == 0 || header_.version > trajectory_version)
+            throw std::runtime_error("trajectory: unsupported version " + std::to_string(header_.version));
+        if (header_.block_size == 0 || header_.tolerance <= 0.0)
+            throw std::runtime_error("trajectory: bad header");
+
+        // a frame cut short by a crash ends the trajectory
+        uint64_t offset = header_.header_size;
+        while (offset + sizeof(trajectory_frame_header) <= file_.size()) {
+            trajectory_frame_header frame;
+            std::memcpy(&frame, file_.data() + offset, sizeof(frame));
+
+            const uint64_t end = offset + sizeof(frame) + frame.size;
+            if (end > file_.size() || frame.block_count != block_count())
+                break;
+
+            frames_.push_back({ frame.step, frame.time, offset, frame.keyframe != 0 });
+            offset = end;
+        }
+
+        if (!frames_.empty() && !frames_.front().keyframe)
+            throw std::runtime_error("trajectory: the first frame is not a keyframe");
+
+        state_.resize(particle_count());
+    }
+
+    const trajectory_header& header() const { return header_; }
+    uint32_t particle_count() const { return static_cast<uint32_t>(header_.particle_count); }
+    size_t frame_count() const { return frames_.size(); }
+    const frame_entry& frame(size_t index) const { return frames_[index]; }
+
+    // asks the OS to page in frames [first, first + count) ahead of time
+    void prefetch(size_t first, size_t count) const {
+        if (first >= frames_.size())
+            return;
+
+        const size_t last = (std::min)(first + count, frames_.size());
+        const uint64_t begin = frames_[first].offset;
+        const uint64_t end = last < frames_.size() ? frames_[last].offset : file_.size();
+        file_.advise_sequential(static_cast<size_t>(begin), static_cast<size_t>(end - begin));
+    }
+
+    // decodes frame index into frame
+    void read(size_t index, trajectory_frame& frame) {
+        if (index >= frames_.size())
+            throw std::out_of_range("trajectory: no frame " + std::to_string(index));
+
+        frame.px.resize(particle_count());
+        frame.py.resize(particle_count());
+        frame.pz.resize(particle_count());
+
+        // the state holds frame current_: go on from there unless a keyframe is closer
+        size_t first = index;
+        while (!frames_[first].keyframe)
+            --first;
+        if (current_ != npos && current_ < index && current_ >= first)
+            first = current_ + 1;
+
+        // a frame that fails to decode leaves the state half updated
+        current_ = npos;
+        for (size_t f = first; f <= index; ++f)
+            decode(f, frame);
+
+        current_ = index;
+        frame.step = frames_[index].step;
+        frame.time = frames_[index].time;
+    }
+
+private:
+    uint32_t block_count() const {
+        return static_cast<uint32_t>((header_.particle_count + header_.block_size - 1) / header_.block_size);
+    }
+
+    void decode(size_t index, trajectory_frame& frame) {
+        const uint8_t* base = file_.data() + frames_[index].offset;
+        const uint8_t* end = base + sizeof(trajectory_frame_header);
+
+        trajectory_frame_header frame_header;
+        std::memcpy(&frame_header, base, sizeof(frame_header));
+        end += frame_header.size;
+
+        const uint32_t blocks = frame_header.block_count;
+        std::vector<uint32_t> sizes(blocks);
+        std::memcpy(sizes.data(), base + sizeof(frame_header), blocks * sizeof(uint32_t));
+
+        std::vector<uint64_t> offsets(blocks + 1);
+        offsets[0] = sizeof(frame_header) + blocks * sizeof(uint32_t);
+        for (uint32_t b = 0; b < blocks; ++b)
+            offsets[b + 1] = offsets[b] + sizes[b];
+        if (base + offsets[blocks] > end)
+            throw std::runtime_error("trajectory: corrupt frame");
+
+        const double quantum = 2.0 * header_.tolerance;
+        pool_.run(blocks, [&](uint32_t block) {
+            const uint32_t first = block * header_.block_size;
+            const uint32_t last = (std::min)(first + header_.block_size, particle_count());
+            decode_trajectory_block(base + offsets[block], base + offsets[block + 1], quantum, frame_header.keyframe != 0, first, last, state_, frame);
+        });
+    }
+
+private:
+    static constexpr size_t npos = ~size_t(0);
+
+    mapped_file                 file_;
+    thread_pool                 pool_;
+    trajectory_header           header_ = {};
+    std::vector<frame_entry>    frames_;
+    trajectory_state            state_;
+    size_t                      current_ = npos;
+};
@@ -0,0 +1,338 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "bounded_queue.hpp"
+#include "simulation.hpp"
+#include "trajectory.hpp"
+
+struct playback_stats {
+    uint64_t shown = 0;     // frames update() returned
+    uint64_t skipped = 0;   // decoded frames the playhead passed before they were shown
+    uint64_t late = 0;      // update() calls that wanted a frame the decoder had not finished
+};
+
+// Plays a recorded trajectory back in real time instead of simulating it.
+//
+// A decoder thread walks the trajectory in playback direction and keeps up to
+// read_ahead decoded frames queued, decompressing the blocks of each frame on
+// its own thread pool and asking the OS to page in the frames after them.
+// update() moves the playhead by the elapsed time times the speed and hands
+// out the frame under it. Scrubbing with seek() or changing direction drops
+// the queued frames and restarts the decoder at the playhead; when the
+// playhead runs ahead of the decoder, the decoder jumps after it. Above one
+// frame per update() the decoder only hands out every stride-th frame, the
+// stride being how far the playhead moved in the last update().
+//
+// Trajectories hold positions only. Velocities and |a| - which the shaders
+// use for coloring - are estimated from the previously decoded frames.
+class trajectory_player {
+public:
+    explicit trajectory_player(const std::string& path, uint32_t read_ahead = 8, unsigned thread_count = 0, double frames_per_second = 30.0) :
+        reader_(path, thread_count),
+        queue_(read_ahead),
+        read_ahead_((std::max)(read_ahead, 1u)),
+        frames_per_second_(frames_per_second)
+    {
+        current_.resize(reader_.particle_count());
+        decoder_ = std::thread([this] { decoder_thread_proc(); });
+    }
+
+    trajectory_player(const trajectory_player&) = delete;
+    trajectory_player& operator=(const trajectory_player&) = delete;
+
+    ~trajectory_player() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        queue_.close();
+        changed_.notify_all();
+        decoder_.join();
+    }
+
+    uint32_t particle_count() const { return reader_.particle_count(); }
+    size_t frame_count() const { return reader_.frame_count(); }
+
+    void play() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        playing_ = true;
+    }
+
+    void pause() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        playing_ = false;
+    }
+
+    bool playing() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return playing_;
+    }
+
+    // a multiple of frames_per_second; negative plays backwards
+    void set_speed(double speed) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const bool reversed = (speed < 0.0) != (speed_ < 0.0);
+        speed_ = speed;
+        if (reversed)
+            restart(static_cast<int64_t>(std::floor(playhead_)));
+    }
+
+    double speed() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return speed_;
+    }
+
+    void set_loop(bool loop) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        loop_ = loop;
+    }
+
+    // moves the playhead to a (fractional) frame
+    void seek(double frame) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        playhead_ = wrap(frame);
+        restart(static_cast<int64_t>(std::floor(playhead_)));
+    }
+
+    double position() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return playhead_;
+    }
+
+    // advances the playhead by elapsed seconds; returns the frame under it if
+    // that is not the one returned last time and has been decoded, otherwise
+    // nullptr. The frame stays valid until the next call. Rethrows decoder errors.
+    const particle_set* update(double elapsed) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (error_)
+            std::rethrow_exception(error_);
+
+        const double advance = playing_ ? elapsed * frames_per_second_ * speed_ : 0.0;
+        playhead_ = wrap(playhead_ + advance);
+        stride_ = (std::max)(static_cast<int64_t>(std::fabs(advance)), int64_t(1));
+
+        const int64_t target = static_cast<int64_t>(std::floor(playhead_));
+        const uint64_t generation = generation_;
+        const int64_t direction = speed_ < 0.0 ? -1 : 1;
+        lock.unlock();
+
+        if (target == shown_)
+            return nullptr;
+
+        // frames before the target in playback direction are too late to show
+        decoded_frame frame;
+        bool overshot = false;
+        while (queue_.try_pop(frame)) {
+            if (frame.generation != generation)
+                continue;
+
+            const int64_t ahead = (frame.index - target) * direction;
+            if (ahead < 0) {
+                ++stats_.skipped;
+                continue;
+            }
+            if (ahead > 0) {
+                // the playhead went back through a loop
+                overshot = true;
+                break;
+            }
+
+            current_.px.swap(frame.particles.px);
+            current_.py.swap(frame.particles.py);
+            current_.pz.swap(frame.particles.pz);
+            current_.vx.swap(frame.particles.vx);
+            current_.vy.swap(frame.particles.vy);
+            current_.vz.swap(frame.particles.vz);
+            current_.acceleration.swap(frame.particles.acceleration);
+            shown_ = target;
+            ++stats_.shown;
+            return &current_;
+        }
+
+        ++stats_.late;
+
+        // too far behind to catch up in order, jump to the playhead
+        lock.lock();
+        if (generation == generation_ && (overshot || (target - next_) * direction > int64_t(read_ahead_)))
+            restart(target);
+        return nullptr;
+    }
+
+    // frame index update() last returned, -1 before the first
+    int64_t shown() const { return shown_; }
+
+    playback_stats stats() const { return stats_; }
+
+private:
+    struct decoded_frame {
+        uint64_t     generation = 0;
+        int64_t      index = 0;
+        particle_set particles;
+    };
+
+    // requires mutex_
+    double wrap(double frame) const {
+        const double count = static_cast<double>(reader_.frame_count());
+        if (count == 0.0)
+            return 0.0;
+        if (loop_) {
+            frame = std::fmod(frame, count);
+            return frame < 0.0 ? frame + count : frame;
+        }
+        return (std::min)((std::max)(frame, 0.0), count - 1.0);
+    }
+
+    // requires mutex_; drops the queued frames and decodes from frame on
+    void restart(int64_t frame) {
+        ++generation_;
+        next_ = frame;
+        queue_.clear();
+        changed_.notify_all();
+    }
+
+    // requires mutex_; the frame after index in playback direction, out of range at the end
+    int64_t advance(int64_t index, int64_t direction) const {
+        const int64_t count = static_cast<int64_t>(reader_.frame_count());
+        int64_t next = index + direction * stride_;
+        if (loop_)
+            return (next % count + count) % count;
+
+        // do not stride over the last frame
+        if (next >= count && index != count - 1)
+            next = count - 1;
+        else if (next < 0 && index != 0)
+            next = 0;
+        return next;
+    }
+
+    // velocity from the last frame, |a| from the last two; frames decoded
+    // earlier in playback direction, not necessarily neighbours
+    static void estimate_motion(const trajectory_frame& frame, const trajectory_frame* previous, const trajectory_frame* before, particle_set& particles) {
+        const uint32_t count = static_cast<uint32_t>(frame.px.size());
+        particles.resize(count);
+        std::copy(frame.px.begin(), frame.px.end(), particles.px.begin());
+        std::copy(frame.py.begin(), frame.py.end(), particles.py.begin());
+        std::copy(frame.pz.begin(), frame.pz.end(), particles.pz.begin());
+
+        const double dt = previous ? frame.time - previous->time : 0.0;
+        if (dt == 0.0) {
+            std::fill(particles.vx.begin(), particles.vx.end(), 0.0f);
+            std::fill(particles.vy.begin(), particles.vy.end(), 0.0f);
+            std::fill(particles.vz.begin(), particles.vz.end(), 0.0f);
+            std::fill(particles.acceleration.begin(), particles.acceleration.end(), 0.0f);
+            return;
+        }
+
+        const double before_dt = before ? previous->time - before->time : 0.0;
+        const float inverse_dt = static_cast<float>(1.0 / dt);
+        const float inverse_before_dt = before_dt != 0.0 ? static_cast<float>(1.0 / before_dt) : 0.0f;
+        const float inverse_span = before_dt != 0.0 ? static_cast<float>(2.0 / (dt + before_dt)) : 0.0f;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            const float vx = (frame.px[i] - previous->px[i]) * inverse_dt;
+            const float vy = (frame.py[i] - previous->py[i]) * inverse_dt;
+            const float vz = (frame.pz[i] - previous->pz[i]) * inverse_dt;
+            particles.vx[i] = vx;
+            particles.vy[i] = vy;
+            particles.vz[i] = vz;
+
+            float a = 0.0f;
+            if (inverse_span != 0.0f) {
+                const float ax = vx - (previous->px[i] - before->px[i]) * inverse_before_dt;
+                const float ay = vy - (previous->py[i] - before->py[i]) * inverse_before_dt;
+                const float az = vz - (previous->pz[i] - before->pz[i]) * inverse_before_dt;
+                a = std::sqrt(ax * ax + ay * ay + az * az) * inverse_span;
+            }
+            particles.acceleration[i] = a;
+        }
+    }
+
+    void decoder_thread_proc() {
+        // the last decoded frames, for the motion estimate
+        trajectory_frame frames[3];
+        int64_t indices[3] = { -1, -1, -1 };
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            changed_.wait(lock, [this] {
+                return stopping_ || (next_ >= 0 && next_ < int64_t(reader_.frame_count()));
+            });
+            if (stopping_)
+                return;
+
+            // the playhead passed the decoder, frames before it would be skipped anyway
+            const int64_t playhead = static_cast<int64_t>(std::floor(playhead_));
+            if ((playhead - next_) * (speed_ < 0.0 ? -1 : 1) > 0)
+                next_ = playhead;
+
+            const uint64_t generation = generation_;
+            const int64_t index = next_;
+            const int64_t direction = speed_ < 0.0 ? -1 : 1;
+            lock.unlock();
+
+            decoded_frame decoded;
+            try {
+                reader_.prefetch(static_cast<size_t>(direction > 0 ? index + 1 : (std::max)(index - int64_t(read_ahead_), int64_t(0))), read_ahead_);
+
+                // rotate: frames[0] is the newest
+                std::swap(frames[2], frames[1]);
+                std::swap(frames[1], frames[0]);
+                indices[2] = indices[1];
+                indices[1] = indices[0];
+                reader_.read(static_cast<size_t>(index), frames[0]);
+                indices[0] = index;
+
+                const bool previous = indices[1] >= 0 && (index - indices[1]) * direction > 0;
+                const bool before = previous && indices[2] >= 0 && (indices[1] - indices[2]) * direction > 0;
+                estimate_motion(frames[0], previous ? &frames[1] : nullptr, before ? &frames[2] : nullptr, decoded.particles);
+            }
+            catch (...) {
+                lock.lock();
+                error_ = std::current_exception();
+                return;
+            }
+
+            decoded.generation = generation;
+            decoded.index = index;
+            queue_.push(std::move(decoded));
+
+            lock.lock();
+            if (generation == generation_)
+                next_ = advance(index, direction);
+        }
+    }
+
+private:
+    trajectory_reader               reader_;
+    bounded_queue<decoded_frame>    queue_;
+    const uint32_t                  read_ahead_;
+    const double                    frames_per_second_;
+
+    // control state, shared with the decoder thread
+    mutable std::mutex              mutex_;
+    std::condition_variable         changed_;
+    double                          playhead_ = 0.0;
+    double                          speed_ = 1.0;
+    bool                            playing_ = true;
+    bool                            loop_ = true;
+    bool                            stopping_ = false;
+    uint64_t                        generation_ = 0;
+    int64_t                         next_ = 0;         // frame the decoder works on next
+    int64_t                         stride_ = 1;       // frames the playhead moved in the last update(), at least 1
+    std::exception_ptr              error_;
+
+    // update() side
+    particle_set                    current_;
+    int64_t                         shown_ = -1;
+    playback_stats                  stats_;
+
+    std::thread                     decoder_;
+};
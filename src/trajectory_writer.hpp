@@ -0,0 +1,222 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.hpp"
+#include "simulation.hpp"
+#include "thread_pool.hpp"
+#include "trajectory.hpp"
+
+struct trajectory_config {
+    double   tolerance         = 1e-3;  // largest position error of a decoded frame
+    uint32_t block_size        = 4096;  // particles per independently coded block
+    uint32_t keyframe_interval = 64;    // frames between keyframes
+    uint32_t queue_depth       = 4;     // frames waiting for the encoder before push() blocks
+    unsigned thread_count      = 0;     // encoder threads, 0 - one per hardware thread
+};
+
+struct trajectory_stats {
+    uint64_t frames = 0;
+    uint64_t raw_bytes = 0;         // the same frames as particle_t
+    uint64_t bytes = 0;             // written, headers included
+    double   push_seconds = 0.0;    // spent in push(), waiting for a queue slot included
+    double   encode_seconds = 0.0;  // spent by the background thread per frame, encoding and writing
+};
+
+// Streams frames to a trajectory file (see trajectory.hpp). push() copies the
+// positions into a bounded queue in id order and returns; a background thread
+// encodes the blocks of each frame on a thread pool and appends the frame.
+class trajectory_writer {
+public:
+    trajectory_writer(const std::string& path, uint32_t particle_count, const trajectory_config& config = {}) :
+        config_(config),
+        particle_count_(particle_count),
+        queue_(config.queue_depth),
+        pool_(config.thread_count)
+    {
+        if (config_.tolerance <= 0.0 || config_.block_size == 0)
+            throw std::invalid_argument("trajectory: tolerance and block size must be positive");
+
+        file_ = std::fopen(path.c_str(), "wb");
+        if (!file_)
+            throw std::runtime_error("cannot write " + path);
+
+        trajectory_header header = {};
+        std::memcpy(header.magic, trajectory_magic, sizeof(header.magic));
+        header.version = trajectory_version;
+        header.header_size = sizeof(header);
+        header.particle_count = particle_count;
+        header.tolerance = config_.tolerance;
+        header.block_size = config_.block_size;
+        header.keyframe_interval = (std::max)(config_.keyframe_interval, 1u);
+        write(&header, sizeof(header));
+
+        state_.resize(particle_count);
+        encoder_ = std::thread([this] { encoder_thread_proc(); });
+    }
+
+    trajectory_writer(const trajectory_writer&) = delete;
+    trajectory_writer& operator=(const trajectory_writer&) = delete;
+
+    ~trajectory_writer() {
+        try {
+            close();
+        }
+        catch (...) {
+            // nowhere to report it from a destructor
+        }
+    }
+
+    // queues the positions of particles; blocks while the queue is full.
+    // Rethrows the error of a failed write. The ids of particles must be a
+    // permutation of [0, particle_count).
+    void push(const particle_set& particles, uint64_t step, double time) {
+        const auto start = std::chrono::steady_clock::now();
+        rethrow_error();
+
+        if (particles.size() != particle_count_)
+            throw std::invalid_argument("trajectory: particle count changed");
+
+        trajectory_frame frame;
+        frame.step = step;
+        frame.time = time;
+        frame.px.resize(particle_count_);
+        frame.py.resize(particle_count_);
+        frame.pz.resize(particle_count_);
+
+        if (particles.id.size() != particle_count_)
+            throw std::invalid_argument("trajectory: the particles have no ids");
+        seen_.assign(particle_count_, 0);
+        for (uint32_t i = 0; i < particle_count_; ++i) {
+            const uint32_t id = particles.id[i];
+            if (id >= particle_count_ || seen_[id])
+                throw std::invalid_argument("trajectory: the particle ids are not a permutation of 0.." + std::to_string(particle_count_ - 1));
+            seen_[id] = 1;
+            frame.px[id] = particles.px[i];
+            frame.py[id] = particles.py[i];
+            frame.pz[id] = particles.pz[i];
+        }
+
+        if (!queue_.push(std::move(frame))) {
+            rethrow_error();
+            throw std::logic_error("trajectory: push() after close()");
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.push_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // drains the queue and closes the file
+    void close() {
+        if (!file_)
+            return;
+
+        queue_.close();
+        encoder_.join();
+
+        const bool ok = std::fclose(file_) == 0;
+        file_ = nullptr;
+
+        rethrow_error();
+        if (!ok)
+            throw std::runtime_error("trajectory: cannot write");
+    }
+
+    trajectory_stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    void rethrow_error() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (error_) {
+            std::exception_ptr error = error_;
+            error_ = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+    void write(const void* data, size_t size) {
+        if (std::fwrite(data, 1, size, file_) != size)
+            throw std::runtime_error("trajectory: cannot write");
+        bytes_ += size;
+    }
+
+    void encoder_thread_proc() {
+        const uint32_t block_count = (particle_count_ + config_.block_size - 1) / config_.block_size;
+        const double quantum = 2.0 * config_.tolerance;
+        std::vector<std::vector<uint8_t>> blocks(block_count);
+        std::vector<uint32_t> sizes(block_count);
+
+        trajectory_frame frame;
+        while (queue_.pop(frame)) {
+            const auto start = std::chrono::steady_clock::now();
+            const bool keyframe = frames_ % (std::max)(config_.keyframe_interval, 1u) == 0;
+
+            try {
+                pool_.run(block_count, [&](uint32_t block) {
+                    const uint32_t begin = block * config_.block_size;
+                    const uint32_t end = (std::min)(begin + config_.block_size, particle_count_);
+                    encode_trajectory_block(frame, quantum, keyframe, begin, end, state_, blocks[block]);
+                });
+
+                trajectory_frame_header header = {};
+                header.step = frame.step;
+                header.time = frame.time;
+                header.block_count = block_count;
+                header.keyframe = keyframe ? 1 : 0;
+                header.size = block_count * sizeof(uint32_t);
+                for (uint32_t b = 0; b < block_count; ++b) {
+                    sizes[b] = static_cast<uint32_t>(blocks[b].size());
+                    header.size += sizes[b];
+                }
+
+                write(&header, sizeof(header));
+                write(sizes.data(), sizes.size() * sizeof(uint32_t));
+                for (const auto& block : blocks)
+                    write(block.data(), block.size());
+            }
+            catch (...) {
+                // stop taking frames, push() and close() report the error
+                std::lock_guard<std::mutex> lock(mutex_);
+                error_ = std::current_exception();
+                queue_.close();
+                queue_.clear();
+                return;
+            }
+
+            ++frames_;
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            stats_.frames = frames_;
+            stats_.raw_bytes += uint64_t(particle_count_) * 32;
+            stats_.bytes = bytes_;
+            stats_.encode_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+private:
+    trajectory_config                   config_;
+    uint32_t                            particle_count_;
+    FILE*                               file_ = nullptr;
+    bounded_queue<trajectory_frame>     queue_;
+    thread_pool                         pool_;
+    trajectory_state                    state_;     // encoder thread only
+    std::vector<uint8_t>                seen_;      // push() only
+    uint64_t                            frames_ = 0;
+    uint64_t                            bytes_ = 0;
+    trajectory_stats                    stats_;
+    std::exception_ptr                  error_;
+    mutable std::mutex                  mutex_;
+    std::thread                         encoder_;
+};
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cost_zones.hpp"
+#include "cpu_engine.hpp"
+#include "number_parser.hpp"
+#include "simulation.hpp"
+#include "thread_pool.hpp"
+
+// Accuracy validation of the engines
+//
+// The reference is a direct sum in double over all particles for a sample of
+// them, the same softened force law as the engines and the shader. An
+// engine's accelerations are compared with it per sampled particle as the
+// relative error |a - a_ref| / |a_ref|; the errors are summarized as RMS,
+// percentiles and maximum and checked against a tolerance per engine and
+// precision, built in or from a CSV file of the same columns. The precision
+// of a case is the engine's, or compact-float and compact-fixed16 for the
+// positions of the GPU's compact storage (compact_storage.hpp) evaluated by
+// the direct engine in float. Their compact velocities play no part in the
+// accelerations, so they are not validated here.
+
+// count particles evenly spread over [0, size)
+inline std::vector<uint32_t> sample_particles(uint32_t size, uint32_t count) {
+    count = (std::min)(count, size);
+    std::vector<uint32_t> sample(count);
+    for (uint32_t s = 0; s < count; ++s)
+        sample[s] = static_cast<uint32_t>(uint64_t(s) * size / count);
+    return sample;
+}
+
+// x, y, z per sampled particle
+inline std::vector<double> reference_accelerations(const particle_set& particles, const std::vector<uint32_t>& sample, thread_pool& pool) {
+    const uint32_t count = static_cast<uint32_t>(particles.size());
+    const std::vector<uint32_t> zones = even_zones(static_cast<uint32_t>(sample.size()), pool.size());
+    std::vector<double> reference(sample.size() * 3);
+
+    pool.run(pool.size(), [&](uint32_t zone) {
+        for (uint32_t s = zones[zone]; s < zones[zone + 1]; ++s) {
+            const uint32_t i = sample[s];
+            const double pix = particles.px[i], piy = particles.py[i], piz = particles.pz[i];
+            double ax = 0.0, ay = 0.0, az = 0.0;
+            for (uint32_t j = 0; j < count; ++j) {
+                const double rx = particles.px[j] - pix, ry = particles.py[j] - piy, rz = particles.pz[j] - piz;
+                const double dist = std::sqrt(rx * rx + ry * ry + rz * rz + double(gravity::softening_squared));
+                const double F = double(gravity::G) * particles.mass[j] / (dist * dist * dist);
+                ax += rx * F; ay += ry * F; az += rz * F;
+            }
+            reference[s * 3 + 0] = ax;
+            reference[s * 3 + 1] = ay;
+            reference[s * 3 + 2] = az;
+        }
+    });
+    return reference;
+}
+
+struct error_summary {
+    uint32_t samples = 0;
+    double   rms = 0.0;
+    double   p50 = 0.0;
+    double   p90 = 0.0;
+    double   p99 = 0.0;
+    double   max = 0.0;
+};
+
+// the errors of the engine's last accelerations; position[s] is where the
+// s-th sampled particle is stored after the engine ran
+inline error_summary acceleration_errors(const cpu_engine& engine, const std::vector<uint32_t>& position, const std::vector<double>& reference) {
+    std::vector<double> errors(position.size());
+    for (size_t s = 0; s < position.size(); ++s) {
+        const uint32_t i = position[s];
+        const double* a = &reference[s * 3];
+        const double ex = engine.ax()[i] - a[0], ey = engine.ay()[i] - a[1], ez = engine.az()[i] - a[2];
+        const double norm = a[0] * a[0] + a[1] * a[1] + a[2] * a[2];
+        errors[s] = norm > 0.0 ? std::sqrt((ex * ex + ey * ey + ez * ez) / norm) : 0.0;
+    }
+
+    error_summary summary;
+    summary.samples = static_cast<uint32_t>(errors.size());
+    if (errors.empty())
+        return summary;
+
+    double sum_squared = 0.0;
+    for (double error : errors)
+        sum_squared += error * error;
+    summary.rms = std::sqrt(sum_squared / errors.size());
+
+    // nearest rank
+    std::sort(errors.begin(), errors.end());
+    auto percentile = [&](double fraction) {
+        const size_t rank = static_cast<size_t>(std::ceil(fraction * errors.size()));
+        return errors[(std::max)(rank, size_t(1)) - 1];
+    };
+    summary.p50 = percentile(0.50);
+    summary.p90 = percentile(0.90);
+    summary.p99 = percentile(0.99);
+    summary.max = errors.back();
+    return summary;
+}
+
+struct accuracy_tolerance {
+    std::string engine;         // "*" matches any
+    std::string precision;
+    double      rms;
+    double      p99;
+    double      max;
+
+    bool matches(const std::string& e, const std::string& p) const {
+        return (engine == "*" || engine == e) && (precision == "*" || precision == p);
+    }
+
+    bool accepts(const error_summary& errors) const {
+        return errors.rms <= rms && errors.p99 <= p99 && errors.max <= max;
+    }
+};
+
+// The direct engine only rounds: float sums lose about sqrt(n) ulps, the
+// compensated and double ones next to nothing, and fixed point has a fixed
+// quantum, which the small accelerations in the center of a cusp feel. The
+// tree engine's error is the monopole approximation at its default opening
+// angle, worst for a thin disk, and dwarfs rounding whatever the precision.
+// Compact storage rounds the positions themselves: a float offset from the
+// block origin loses little, 16-bit fixed point over an unsorted block's
+// extent is the coarsest of all, worst where particles crowd in a cusp: its
+// step there is a few hundred softening lengths, and a particle with a
+// neighbour closer than a step can take any error at all. Its largest error
+// is not gated, as it grows with the sample count rather than with a flaw
+// (0.2 with 256 samples, up to 0.8 with 2000); RMS and p99 hold from 1000 to
+// 20000 particles and 2000 samples, at most 6e-2 and 2e-1 measured.
+// The first match wins; a case without one fails.
+inline std::vector<accuracy_tolerance> default_tolerances() {
+    return {
+        { "direct", "float", 1e-5, 5e-5, 1e-3 },
+        { "direct", "fixed", 5e-4, 5e-3, 1e-2 },
+        { "direct", "compact-float",   1e-4, 5e-4, 2e-3 },
+        { "direct", "compact-fixed16", 1e-1, 3e-1, std::numeric_limits<double>::infinity() },
+        { "direct", "*",     1e-6, 5e-6, 1e-4 },
+        { "tree",   "*",     2e-2, 5e-2, 1e-1 },
+    };
+}
+
+// engine,precision,rms,p99,max per line after a header line
+inline std::vector<accuracy_tolerance> read_tolerances(const std::string& path) {
+    FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file)
+        throw std::runtime_error("cannot open " + path);
+
+    std::vector<accuracy_tolerance> tolerances;
+    char line[512];
+    bool header = true;
+    while (std::fgets(line, sizeof(line), file)) {
+        std::string text(line);
+        while (!text.empty() && (text.back() == '\n' || text.back() == '\r'))
+            text.pop_back();
+        if (header || text.empty()) {
+            header = false;
+            continue;
+        }
+
+        std::vector<std::string> fields;
+        size_t begin = 0;
+        for (size_t comma; (comma = text.find(',', begin)) != std::string::npos; begin = comma + 1)
+            fields.push_back(text.substr(begin, comma - begin));
+        fields.push_back(text.substr(begin));
+
+        double values[3];
+        bool ok = fields.size() == 5;
+        for (int v = 0; ok && v < 3; ++v)
+            ok = parse_number(fields[2 + v].data(), fields[2 + v].data() + fields[2 + v].size(), values[v]) == fields[2 + v].data() + fields[2 + v].size();
+        if (!ok) {
+            std::fclose(file);
+            throw std::runtime_error("tolerances: cannot parse '" + text + "' in " + path);
+        }
+        tolerances.push_back({ fields[0], fields[1], values[0], values[1], values[2] });
+    }
+    std::fclose(file);
+    return tolerances;
+}
+
+inline const accuracy_tolerance* find_tolerance(const std::vector<accuracy_tolerance>& tolerances, const std::string& engine, const std::string& precision) {
+    for (const accuracy_tolerance& tolerance : tolerances)
+        if (tolerance.matches(engine, precision))
+            return &tolerance;
+    return nullptr;
+}